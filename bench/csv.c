@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "breeze.h"
+
+/***
+  Measures the CSV natives: `csv_bench [file.csv]`. The file is streamed
+  through `csv_each` with a function that does nothing, then read whole
+  into columns by `csv_columns`, each timed on the wall clock as the best of
+  a few runs. The peak resident set size after each step shows what
+  streaming costs next to keeping every column. Without a file, one of
+  mixed numeric and text columns, some quoted, is generated in a temporary
+  file first.
+  ***/
+
+#define RUNS 3
+#define SYNTHETIC_RECORDS 2000000
+
+static double now_ms() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec * 1e3 + (double)time.tv_nsec / 1e6;
+}
+
+static double best_ms(BreezeVM *vm, const char *source) {
+  double best = 0;
+  for (int32_t run = 0; run < RUNS; run += 1) {
+    double start = now_ms();
+    if (interpret(vm, source) != InterpretOk) {
+      fprintf(stderr, "Benchmark script failed: %s\n", source);
+      exit(1);
+    }
+    double elapsed = now_ms() - start;
+    best = run == 0 || elapsed < best ? elapsed : best;
+  }
+  return best;
+}
+
+static double peak_rss_mb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (double)usage.ru_maxrss / 1024;
+}
+
+static void write_synthetic_file(FILE *file) {
+  static const char *cities[] = {"Algiers", "Oran", "Lyon", "Zurich",
+                                 "Kyoto"};
+  fputs("id,name,price,quantity,city,comment\n", file);
+  for (int32_t i = 0; i < SYNTHETIC_RECORDS; i += 1) {
+    fprintf(file, "%d,item_%d,%.2f,%d,%s,", i, i % 50000,
+            (double)(i % 99991) * 0.37, i % 1000, cities[i % 5]);
+    if (i % 4 == 0) {
+      fprintf(file, "\"sold \"\"as is\"\", %d left\"\n", i % 17);
+    } else {
+      fputs("in stock\n", file);
+    }
+  }
+}
+
+int32_t main(int32_t argc, const char *argv[]) {
+  char path[64] = "/tmp/breeze_csv_bench_XXXXXX";
+  const char *csv = argc > 1 ? argv[1] : path;
+  if (argc == 1) {
+    int32_t fd = mkstemp(path);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (file == NULL) {
+      fprintf(stderr, "Could not write a synthetic file.\n");
+      return 1;
+    }
+    write_synthetic_file(file);
+    fclose(file);
+  }
+  struct stat status;
+  if (stat(csv, &status) != 0) {
+    fprintf(stderr, "Could not read %s.\n", csv);
+    return 1;
+  }
+  double size = (double)status.st_size;
+
+  BreezeVM *vm = new_vm();
+  char setup[4200];
+  snprintf(setup, sizeof(setup),
+           "let path = \"%s\"; fn skip(fields) {}", csv);
+  if (vm == NULL || interpret(vm, setup) != InterpretOk) {
+    fprintf(stderr, "Could not set up the benchmark.\n");
+    return 1;
+  }
+
+  printf("%s: %.0f bytes, best of %d runs\n", csv, size, RUNS);
+  double start_rss = peak_rss_mb();
+  double each = best_ms(vm, "csv_each(path, skip);");
+  printf("%-12s %10.2f ms %8.3f GB/s, peak RSS %.1f MB (%.1f MB before)\n",
+         "csv_each", each, size / each / 1e6, peak_rss_mb(), start_rss);
+  double columns = best_ms(vm, "csv_columns(path);");
+  printf("%-12s %10.2f ms %8.3f GB/s, peak RSS %.1f MB\n", "csv_columns",
+         columns, size / columns / 1e6, peak_rss_mb());
+
+  delete_vm(vm);
+  if (argc == 1) {
+    remove(path);
+  }
+  shutdown_isolates();
+  free_shared_strings();
+  return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "breeze.h"
+
+/***
+  Measures json_parse and json_stringify: `json_bench [corpus.json]`. The
+  corpus is read once into a string, then parsed and serialized back, each
+  timed on the wall clock as the best of a few runs. Without a corpus, a
+  synthetic one of records mixing numbers, strings, nested objects and
+  arrays is written to a temporary file first.
+  ***/
+
+#define RUNS 5
+#define SYNTHETIC_RECORDS 100000
+
+static double now_ms() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec * 1e3 + (double)time.tv_nsec / 1e6;
+}
+
+static double best_ms(BreezeVM *vm, const char *source) {
+  double best = 0;
+  for (int32_t run = 0; run < RUNS; run += 1) {
+    double start = now_ms();
+    if (interpret(vm, source) != InterpretOk) {
+      fprintf(stderr, "Benchmark script failed: %s\n", source);
+      exit(1);
+    }
+    double elapsed = now_ms() - start;
+    best = run == 0 || elapsed < best ? elapsed : best;
+  }
+  return best;
+}
+
+static void write_synthetic_corpus(FILE *file) {
+  static const char *cities[] = {"Algiers", "Oran", "Lyon", "Z\\u00fcrich",
+                                 "Kyoto"};
+  fputc('[', file);
+  for (int32_t i = 0; i < SYNTHETIC_RECORDS; i += 1) {
+    fprintf(file,
+            "%s\n  {\"id\": %d, \"name\": \"user_%d\", \"score\": %.3f, "
+            "\"active\": %s, \"tags\": [\"t%d\", \"t%d\", \"t%d\"], "
+            "\"address\": {\"city\": \"%s\", \"zip\": \"%05d\"}, "
+            "\"bio\": \"line one\\nline \\\"two\\\"\", \"parent\": null}",
+            i == 0 ? "" : ",", i, i, (double)(i % 9973) * 1.618,
+            i % 3 == 0 ? "true" : "false", i % 7, i % 11, i % 13,
+            cities[i % 5], i % 100000);
+  }
+  fputs("\n]\n", file);
+}
+
+// Runs a script that prints one number, and returns it.
+static double eval_number(BreezeVM *vm, const char *source) {
+  char *output = NULL;
+  size_t output_len = 0;
+  FILE *out = open_memstream(&output, &output_len);
+  set_vm_output(vm, out, stderr);
+  InterpretResult result = interpret(vm, source);
+  fclose(out);
+  set_vm_output(vm, stdout, stderr);
+  double number = result == InterpretOk ? strtod(output, NULL) : -1;
+  free(output);
+  return number;
+}
+
+int32_t main(int32_t argc, const char *argv[]) {
+  char path[64] = "/tmp/breeze_json_bench_XXXXXX";
+  const char *corpus = argc > 1 ? argv[1] : path;
+  if (argc == 1) {
+    int32_t fd = mkstemp(path);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (file == NULL) {
+      fprintf(stderr, "Could not write a synthetic corpus.\n");
+      return 1;
+    }
+    write_synthetic_corpus(file);
+    fclose(file);
+  }
+
+  BreezeVM *vm = new_vm();
+  char setup[4200];
+  snprintf(setup, sizeof(setup), "let text = read_file_async(\"%s\");",
+           corpus);
+  if (vm == NULL || interpret(vm, setup) != InterpretOk) {
+    fprintf(stderr, "Could not read %s.\n", corpus);
+    return 1;
+  }
+  double text_len = eval_number(vm, "print len(text);");
+  double json_len =
+      eval_number(vm, "let value = json_parse(text); "
+                      "print len(json_stringify(value));");
+  if (text_len < 0 || json_len < 0) {
+    fprintf(stderr, "Could not parse %s.\n", corpus);
+    return 1;
+  }
+
+  double parse = best_ms(vm, "json_parse(text);");
+  double stringify = best_ms(vm, "json_stringify(value);");
+  printf("%s: %.0f bytes, best of %d runs\n", corpus, text_len, RUNS);
+  printf("%-16s %10.2f ms %8.3f GB/s\n", "json_parse", parse,
+         text_len / parse / 1e6);
+  printf("%-16s %10.2f ms %8.3f GB/s (%.0f bytes out)\n", "json_stringify",
+         stringify, json_len / stringify / 1e6, json_len);
+
+  delete_vm(vm);
+  if (argc == 1) {
+    remove(path);
+  }
+  shutdown_isolates();
+  free_shared_strings();
+  return 0;
+}
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "breeze.h"
+
+/***
+  Measures how parallel_map and parallel_reduce scale with the number of
+  threads: `parallel_bench [max_threads] [elements]`. Each loop is timed on
+  the wall clock, as the best of a few runs, for 1, 2, 4... threads up to
+  the number of cores.
+  ***/
+
+#define RUNS 5
+
+static double now_ms() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec * 1e3 + (double)time.tv_nsec / 1e6;
+}
+
+static double best_ms(BreezeVM *vm, const char *source) {
+  double best = 0;
+  for (int32_t run = 0; run < RUNS; run += 1) {
+    double start = now_ms();
+    if (interpret(vm, source) != InterpretOk) {
+      fprintf(stderr, "Benchmark script failed: %s\n", source);
+      exit(1);
+    }
+    double elapsed = now_ms() - start;
+    best = run == 0 || elapsed < best ? elapsed : best;
+  }
+  return best;
+}
+
+int32_t main(int32_t argc, const char *argv[]) {
+  long max_threads = argc > 1 ? atol(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  long len = argc > 2 ? atol(argv[2]) : 1 << 24;
+  if (max_threads < 1 || len < 1) {
+    fprintf(stderr, "Usage: parallel_bench [max_threads] [elements]\n");
+    return 64;
+  }
+
+  BreezeVM *vm = new_vm();
+  char setup[128];
+  snprintf(setup, sizeof(setup),
+           "let a = parallel_map(f64_array(%ld), \"1.5\");", len);
+  if (vm == NULL || interpret(vm, setup) != InterpretOk) {
+    fprintf(stderr, "Could not set up the benchmark.\n");
+    return 1;
+  }
+
+  printf("%ld elements, best of %d runs\n", len, RUNS);
+  printf("%8s %12s %8s %12s %8s\n", "threads", "map ms", "speedup",
+         "reduce ms", "speedup");
+  double map_base = 0;
+  double reduce_base = 0;
+  for (long threads = 1; threads <= max_threads; threads *= 2) {
+    char source[64];
+    snprintf(source, sizeof(source), "parallel_threads(%ld);", threads);
+    interpret(vm, source);
+    double map = best_ms(vm, "parallel_map(a, \"sqrt(x) * 2 + 1\");");
+    double reduce = best_ms(vm, "parallel_reduce(a, \"sum\", \"x * x\");");
+    if (threads == 1) {
+      map_base = map;
+      reduce_base = reduce;
+    }
+    printf("%8ld %12.2f %7.2fx %12.2f %7.2fx\n", threads, map,
+           map_base / map, reduce, reduce_base / reduce);
+  }
+
+  delete_vm(vm);
+  shutdown_isolates();
+  free_shared_strings();
+  return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef breeze_h
+#define breeze_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+/***
+  Embedding API of libbreeze. Every interpreter state lives in a `BreezeVM`,
+  so a host can run independent VMs side by side, one per thread. A single
+  VM must not be used by two threads at once.
+  ***/
+
+typedef struct VirtualMachine BreezeVM;
+
+typedef enum {
+  InterpretOk,
+  InterpretCompileErr,
+  InterpretRuntimeErr,
+} InterpretResult;
+
+/* Creates a new VM with its own heap, globals and natives
+ * @return: Handle to the VM, or NULL when out of memory
+ */
+BreezeVM *new_vm();
+
+/* Frees a VM and every object in its heap
+ * @param vm: The VM to free
+ */
+void delete_vm(BreezeVM *vm);
+
+/* Resets a VM between programs: clears the stack and drops every global but
+ * the natives. The heap is kept, so the next program reuses its memory.
+ * @param vm: The VM to reset
+ */
+void reset_vm(BreezeVM *vm);
+
+/* Redirects the output of a VM. Both default to the standard streams.
+ * @param vm: The VM to redirect
+ * @param out: Stream written by `print`
+ * @param err: Stream written with compile and runtime errors
+ */
+void set_vm_output(BreezeVM *vm, FILE *out, FILE *err);
+
+/* Caps the call depth of a VM and of each of its coroutines. Stacks start
+ * small and grow on demand up to that depth; a deeper call is a runtime
+ * error.
+ * @param vm: The VM to configure
+ * @param frames_max: Maximum number of nested calls, `FRAMES_MAX` by default
+ */
+void set_vm_stack_limit(BreezeVM *vm, uint32_t frames_max);
+
+/* Compiles and runs a program
+ * @param vm: The VM to run the program in
+ * @param source: Null-terminated source code of the program
+ * @return: Whether the program compiled and ran successfully
+ */
+InterpretResult interpret(BreezeVM *vm, const char *source);
+
+/* Waits for every running isolate to finish, then stops the isolate pool
+ * and the threads of parallel loops. Call it before `free_shared_strings`.
+ */
+void shutdown_isolates();
+
+/* Frees the strings and frozen objects shared by every VM. Call it once
+ * every VM is deleted.
+ */
+void free_shared_strings();
+
+#endif // !breeze_h
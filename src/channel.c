@@ -0,0 +1,122 @@
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "channel.h"
+
+/***
+  The queue is Vyukov's intrusive MPSC queue. `head` is where producers
+  append, `tail` is where the consumer reads, and `stub` keeps the list
+  non-empty so that a push is a single exchange on `head` followed by a
+  store into the previous node. Between those two steps the list is briefly
+  disconnected; the consumer sees that as an empty queue and retries.
+  ***/
+
+struct Channel {
+  _Atomic(Message *) head;
+  Message *tail;
+  Message *stub;
+  atomic_uint refs;
+  pthread_mutex_t recv_lock;
+  // Counts messages pushed but not yet received.
+  sem_t available;
+};
+
+Channel *open_channel() {
+  Channel *channel = (Channel *)malloc(sizeof(Channel));
+  Message *stub = (Message *)calloc(1, sizeof(Message));
+  if (channel == NULL || stub == NULL) {
+    fprintf(stderr, "Not enough memory for a channel.");
+    exit(1);
+  }
+  atomic_init(&stub->next, NULL);
+  channel->stub = stub;
+  atomic_init(&channel->head, stub);
+  channel->tail = stub;
+  atomic_init(&channel->refs, 1);
+  pthread_mutex_init(&channel->recv_lock, NULL);
+  sem_init(&channel->available, 0, 0);
+  return channel;
+}
+
+void retain_channel(Channel *channel) {
+  atomic_fetch_add_explicit(&channel->refs, 1, memory_order_relaxed);
+}
+
+static void push(Channel *channel, Message *message) {
+  atomic_store_explicit(&message->next, NULL, memory_order_relaxed);
+  Message *previous =
+      atomic_exchange_explicit(&channel->head, message, memory_order_acq_rel);
+  atomic_store_explicit(&previous->next, message, memory_order_release);
+}
+
+// Must be called by the single consumer. Returns NULL if the queue looks
+// empty, including while a push is halfway through.
+static Message *pop(Channel *channel) {
+  Message *tail = channel->tail;
+  Message *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  if (tail == channel->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    channel->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+  if (next != NULL) {
+    channel->tail = next;
+    return tail;
+  }
+
+  if (tail != atomic_load_explicit(&channel->head, memory_order_acquire)) {
+    return NULL;
+  }
+  push(channel, channel->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next != NULL) {
+    channel->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+void release_channel(Channel *channel) {
+  if (atomic_fetch_sub_explicit(&channel->refs, 1, memory_order_acq_rel) !=
+      1) {
+    return;
+  }
+
+  // Last reference: nobody can push anymore, so draining cannot race.
+  Message *message;
+  while ((message = pop(channel)) != NULL) {
+    free_message(message);
+  }
+  sem_destroy(&channel->available);
+  pthread_mutex_destroy(&channel->recv_lock);
+  free(channel->stub);
+  free(channel);
+}
+
+void channel_send(Channel *channel, Message *message) {
+  push(channel, message);
+  sem_post(&channel->available);
+}
+
+Message *channel_recv(Channel *channel) {
+  while (sem_wait(&channel->available) != 0) {
+  }
+
+  pthread_mutex_lock(&channel->recv_lock);
+  Message *message;
+  // The semaphore guarantees a message is coming; spin past a producer that
+  // has swapped `head` but not linked its node yet.
+  while ((message = pop(channel)) == NULL) {
+    sched_yield();
+  }
+  pthread_mutex_unlock(&channel->recv_lock);
+  return message;
+}
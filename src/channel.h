@@ -0,0 +1,44 @@
+#ifndef breeze_channel_h
+#define breeze_channel_h
+
+#include "message.h"
+
+/***
+  A channel is a reference-counted message queue shared by every VM holding
+  it. Senders push onto an intrusive multi-producer single-consumer queue
+  with a single atomic exchange and never block. Receivers serialize on a
+  mutex so the queue only ever sees one consumer, and sleep on a semaphore
+  while it is empty.
+  ***/
+
+typedef struct Channel Channel;
+
+/* Creates an empty channel with one reference
+ * @return: The new channel
+ */
+Channel *open_channel();
+
+/* Adds a reference to a channel
+ * @param channel: The channel to retain
+ */
+void retain_channel(Channel *channel);
+
+/* Drops a reference to a channel, freeing it and any pending message with
+ * the last one
+ * @param channel: The channel to release
+ */
+void release_channel(Channel *channel);
+
+/* Queues a message. Never blocks.
+ * @param channel: The channel to send on
+ * @param message: The message, now owned by the channel
+ */
+void channel_send(Channel *channel, Message *message);
+
+/* Dequeues the oldest message, waiting for one if the channel is empty
+ * @param channel: The channel to receive from
+ * @return: The message, owned by the caller
+ */
+Message *channel_recv(Channel *channel);
+
+#endif // !breeze_channel_h
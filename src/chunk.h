@@ -28,6 +28,9 @@ typedef enum {
   OpDefineProperty,
   OpSetProperty,
   OpGetProperty,
+  OpNewScalar,
+  OpSetScalar,
+  OpGetScalar,
   OpDefineGlobal,
   OpSetGlobal,
   OpGetGlobal,
@@ -40,7 +43,12 @@ typedef enum {
   OpJmp,
   OpClosure,
   OpCall,
+  OpTailCall,
   OpClass,
+  OpYield,
+  OpList,
+  OpIndexGet,
+  OpIndexSet,
 } OpCode;
 
 /***
@@ -66,10 +74,13 @@ typedef struct {
 uint32_t get_line(const LineVec *lines, uint32_t offset);
 
 void init_chunk(Chunk *chunk);
-void free_chunk(Chunk *chunk);
-void write_chunk(Chunk *chunk, uint8_t byte, uint32_t line);
-uint32_t add_constant(Chunk *chunk, Value value);
-uint32_t push_constant(Chunk *chunk, Value value, uint32_t line);
-void write_constant_chunk(Chunk *chunk, uint32_t constant, uint32_t line);
+void free_chunk(VirtualMachine *vm, Chunk *chunk);
+void write_chunk(VirtualMachine *vm, Chunk *chunk, uint8_t byte,
+                 uint32_t line);
+uint32_t add_constant(VirtualMachine *vm, Chunk *chunk, Value value);
+uint32_t push_constant(VirtualMachine *vm, Chunk *chunk, Value value,
+                       uint32_t line);
+void write_constant_chunk(VirtualMachine *vm, Chunk *chunk, uint32_t constant,
+                          uint32_t line);
 
 #endif // !breeze_chunk_h
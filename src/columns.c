@@ -0,0 +1,167 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "columns.h"
+
+#include "memory.h"
+#include "table.h"
+#include "virtual_machine.h"
+
+static bool find_column(const ObjColumns *columns, const ObjString *name,
+                        Value **column) {
+  Value field;
+  if (!table_get(&columns->klass->fields, name, &field) ||
+      AS_NUMBER(field) >= columns->fields_len) {
+    return false;
+  }
+  *column = columns->values + (uint32_t)AS_NUMBER(field) * columns->capacity;
+  return true;
+}
+
+Value *row_field(ObjRow *row, const ObjString *name) {
+  Value *column;
+  if (!find_column(row->columns, name, &column)) {
+    return NULL;
+  }
+  return &column[row->idx];
+}
+
+// Moves every column into arrays twice as long, in one allocation.
+static void grow_columns(VirtualMachine *vm, ObjColumns *columns) {
+  uint32_t capacity = GROW_CAPACITY(columns->capacity);
+  Value *values = ALLOCATE(vm, Value, columns->fields_len * capacity);
+  for (uint32_t field = 0; columns->len > 0 && field < columns->fields_len;
+       field += 1) {
+    memcpy(values + field * capacity,
+           columns->values + field * columns->capacity,
+           sizeof(Value) * columns->len);
+  }
+  FREE_ARRAY(vm, Value, columns->values,
+             columns->fields_len * columns->capacity);
+  columns->values = values;
+  columns->capacity = capacity;
+}
+
+Value table_of_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1 || !IS_CLASS(args[0])) {
+    return native_error(vm, "table_of expects a class.");
+  }
+  return OBJ_VAL(new_columns(vm, AS_CLASS(args[0])));
+}
+
+Value table_add_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len < 1 || !IS_COLUMNS(args[0])) {
+    return native_error(vm, "table_add expects a table.");
+  }
+  ObjColumns *columns = AS_COLUMNS(args[0]);
+  uint32_t values_len = (uint32_t)args_len - 1;
+  if (values_len > columns->fields_len) {
+    return native_error(vm, "Expected at most %u values but got %u.",
+                        columns->fields_len, values_len);
+  }
+  if (columns->obj.is_shared) {
+    return native_error(vm, "Cannot add to a frozen table.");
+  }
+
+  if (columns->len == columns->capacity) {
+    grow_columns(vm, columns);
+  }
+  const Value *defaults = columns->klass->template.values;
+  for (uint32_t field = 0; field < columns->fields_len; field += 1) {
+    columns->values[field * columns->capacity + columns->len] =
+        field < values_len ? args[1 + field] : defaults[field];
+  }
+  columns->len += 1;
+  return NUMBER_VAL(columns->len - 1);
+}
+
+Value table_row_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 2 || !IS_COLUMNS(args[0]) || !IS_NUMBER(args[1])) {
+    return native_error(vm, "table_row expects a table and an index.");
+  }
+  ObjColumns *columns = AS_COLUMNS(args[0]);
+  double idx = AS_NUMBER(args[1]);
+  if (idx < 0 || idx >= columns->len || idx != (uint32_t)idx) {
+    return native_error(vm, "Row index %g is out of bounds.", idx);
+  }
+  return OBJ_VAL(new_row(vm, columns, (uint32_t)idx));
+}
+
+Value table_len_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1 || !IS_COLUMNS(args[0])) {
+    return native_error(vm, "table_len expects a table.");
+  }
+  return NUMBER_VAL(AS_COLUMNS(args[0])->len);
+}
+
+// Checks the arguments of a column aggregate and finds its column.
+static bool aggregate_column(VirtualMachine *vm, const char *native,
+                             int32_t args_len, Value *args, Value **column,
+                             uint32_t *len) {
+  if (args_len != 2 || !IS_COLUMNS(args[0]) || !IS_STRING(args[1])) {
+    native_error(vm, "%s expects a table and a field name.", native);
+    return false;
+  }
+  // Field names are looked up by identity, which a view does not share.
+  ObjColumns *columns = AS_COLUMNS(args[0]);
+  ObjString *name = terminate_string(vm, args[1]);
+  if (!find_column(columns, name, column)) {
+    native_error(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+  *len = columns->len;
+  return true;
+}
+
+static Value not_a_number(VirtualMachine *vm, const char *native) {
+  return native_error(vm, "%s expects a column of numbers.", native);
+}
+
+Value column_sum_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  Value *column;
+  uint32_t len;
+  if (!aggregate_column(vm, "column_sum", args_len, args, &column, &len)) {
+    return NULL_VAL;
+  }
+  double sum = 0;
+  for (uint32_t i = 0; i < len; i += 1) {
+    if (!IS_NUMBER(column[i])) {
+      return not_a_number(vm, "column_sum");
+    }
+    sum += AS_NUMBER(column[i]);
+  }
+  return NUMBER_VAL(sum);
+}
+
+// Smallest number of a column, or largest with a `sign` of -1.
+static Value column_extreme(VirtualMachine *vm, const char *native,
+                            int32_t args_len, Value *args, double sign) {
+  Value *column;
+  uint32_t len;
+  if (!aggregate_column(vm, native, args_len, args, &column, &len)) {
+    return NULL_VAL;
+  }
+  if (len == 0) {
+    return NULL_VAL;
+  }
+  double extreme = 0;
+  for (uint32_t i = 0; i < len; i += 1) {
+    if (!IS_NUMBER(column[i])) {
+      return not_a_number(vm, native);
+    }
+    double number = AS_NUMBER(column[i]);
+    if (i == 0 || sign * number < sign * extreme) {
+      extreme = number;
+    }
+  }
+  return NUMBER_VAL(extreme);
+}
+
+Value column_min_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  return column_extreme(vm, "column_min", args_len, args, 1);
+}
+
+Value column_max_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  return column_extreme(vm, "column_max", args_len, args, -1);
+}
@@ -0,0 +1,53 @@
+#ifndef breeze_columns_h
+#define breeze_columns_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+/***
+  A columnar table holds many records of one class without an object per
+  record: each field declared by the class gets its own contiguous array,
+  and a record is an index shared by all of them. Scanning one field over
+  every record walks a single array, and a record costs only its field
+  values.
+
+  Records are reached through row handles, which have the properties of an
+  instance of the class, or summed up a column at a time by natives.
+  ***/
+
+/* Finds a field of a record
+ * @param row: Handle on the record
+ * @param name: Name of the field
+ * @return: The field's slot in its column, or NULL if the class does not
+ *          declare it
+ */
+Value *row_field(ObjRow *row, const ObjString *name);
+
+/* table_of(class): Creates an empty table for the instances of a class */
+Value table_of_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* table_add(table, values...): Appends a record, its fields taken in
+ * declaration order from the values and then from the class defaults
+ * @return: The index of the record
+ */
+Value table_add_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* table_row(table, idx): Returns a handle on a record */
+Value table_row_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* table_len(table): Returns the number of records */
+Value table_len_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* column_sum(table, field): Sums a column of numbers */
+Value column_sum_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* column_min(table, field): Smallest number of a column, null if empty */
+Value column_min_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* column_max(table, field): Largest number of a column, null if empty */
+Value column_max_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+#endif // !breeze_columns_h
@@ -3,10 +3,14 @@
 
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// #define DEBUG_PRINT_ESCAPE
 
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
+/* Every runtime function takes the VM it operates on explicitly. */
+typedef struct VirtualMachine VirtualMachine;
+
 #define UINT16_COUNT (UINT16_MAX + 1)
 #define UINT8_COUNT (UINT8_MAX + 1)
 
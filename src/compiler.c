@@ -10,19 +10,14 @@
 #include "chunk.h"
 #include "memory.h"
 #include "scanner.h"
+#include "shared_string.h"
 #include "value.h"
+#include "virtual_machine.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
-typedef struct {
-  Token current;
-  Token previous;
-  bool had_error;
-  bool panic_mode;
-} Parser;
-
 typedef enum {
   PrecNone,
   PrecAssignment, // =
@@ -37,21 +32,19 @@ typedef enum {
   PrecPrimary
 } Precedence;
 
-/// function pointer
-typedef void (*ParseFn)(bool can_assign);
-
-typedef struct {
-  ParseFn prefix;
-  ParseFn infix;
-  Precedence precedence;
-} ParseRule;
-
 typedef struct {
   Token name;
   int32_t depth;
   bool is_captured;
+  // Set on an instance replaced by stack slots: its fields follow it as
+  // hidden locals, which names never resolve to.
+  uint8_t fields_len;
+  bool is_field;
 } Local;
 
+// Most fields an instance can use and still be replaced by stack slots.
+#define SCALAR_FIELDS_MAX 16
+
 typedef struct {
   uint32_t index;
   bool is_local;
@@ -67,106 +60,134 @@ typedef struct Compiler {
   uint32_t locals_len;
   Upvalue upvalues[UINT8_COUNT];
   int32_t scope_depth;
+  // Offset of the last `OpCall`, which a `return` right after it turns into
+  // a tail call.
+  uint32_t last_call;
+  // Instances created by `let name = Class();`, and how many of those were
+  // replaced by stack slots.
+  uint32_t instances_len;
+  uint32_t scalars_len;
 } Compiler;
 
-Parser parser;
-Compiler *current_compiler = NULL;
+typedef struct Parser {
+  Scanner scanner;
+  Token current;
+  Token previous;
+  bool had_error;
+  bool panic_mode;
+  Compiler *compiler;
+  VirtualMachine *vm;
+} Parser;
+
+/// function pointer
+typedef void (*ParseFn)(Parser *parser, bool can_assign);
 
-static Chunk *current_chunk() { return &current_compiler->function->chunk; }
+typedef struct {
+  ParseFn prefix;
+  ParseFn infix;
+  Precedence precedence;
+} ParseRule;
 
-static void error_at(const Token *token, const char *message) {
-  if (parser.panic_mode == true) {
+static Chunk *current_chunk(Parser *parser) {
+  return &parser->compiler->function->chunk;
+}
+
+static void error_at(Parser *parser, const Token *token, const char *message) {
+  if (parser->panic_mode == true) {
     return;
   }
-  parser.panic_mode = true;
-  fprintf(stderr, "[line %d] Error", token->line);
+  parser->panic_mode = true;
+  fprintf(parser->vm->err, "[line %d] Error", token->line);
 
   if (token->type == TokenEof) {
-    fprintf(stderr, " at end");
+    fprintf(parser->vm->err, " at end");
   } else if (token->type == TokenError) {
 
   } else {
-    fprintf(stderr, " at '%.*s'", token->len, token->start);
+    fprintf(parser->vm->err, " at '%.*s'", token->len, token->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
-  parser.had_error = true;
+  fprintf(parser->vm->err, ": %s\n", message);
+  parser->had_error = true;
 }
 
-static void error(const char *format, ...) {
+static void error(Parser *parser, const char *format, ...) {
   char message[256]; // Adjust size as necessary
   va_list args;
   va_start(args, format);
   vsnprintf(message, sizeof(message), format, args);
   va_end(args);
-  error_at(&parser.previous, message);
+  error_at(parser, &parser->previous, message);
 }
 
-static void error_at_current(const char *format, ...) {
+static void error_at_current(Parser *parser, const char *format, ...) {
   char message[256]; // Adjust size as necessary
   va_list args;
   va_start(args, format);
   vsnprintf(message, sizeof(message), format, args);
   va_end(args);
-  error_at(&parser.current, message);
+  error_at(parser, &parser->current, message);
 }
 
-static void advance() {
-  parser.previous = parser.current;
+static void advance(Parser *parser) {
+  parser->previous = parser->current;
 
   while (true) {
-    parser.current = scan_token();
-    if (parser.current.type != TokenError) {
+    parser->current = scan_token(&parser->scanner);
+    if (parser->current.type != TokenError) {
       break;
     }
-    error(parser.current.start);
+    error(parser, parser->current.start);
   }
 }
 
-static void consume_token(TokenType type, const char *message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume_token(Parser *parser, TokenType type, const char *message) {
+  if (parser->current.type == type) {
+    advance(parser);
     return;
   }
 
-  error_at_current(message);
+  error_at_current(parser, message);
 }
 
-static bool check_token(TokenType type) { return parser.current.type == type; }
+static bool check_token(Parser *parser, TokenType type) {
+  return parser->current.type == type;
+}
 
-static bool match_token(TokenType type) {
-  if (!check_token(type)) {
+static bool match_token(Parser *parser, TokenType type) {
+  if (!check_token(parser, type)) {
     return false;
   }
-  advance();
+  advance(parser);
   return true;
 }
 
-static bool max_constants_error(const uint32_t idx) {
+static bool max_constants_error(Parser *parser, const uint32_t idx) {
   if (idx > UINT16_MAX) {
-    error("Too many constants in one chunk.");
+    error(parser, "Too many constants in one chunk.");
     return true;
   }
   return false;
 }
 
-static void emit_byte(uint8_t byte) {
-  write_chunk(current_chunk(), byte, parser.previous.line);
+static void emit_byte(Parser *parser, uint8_t byte) {
+  write_chunk(parser->vm, current_chunk(parser), byte, parser->previous.line);
 }
 
-static void emit_word(const uint8_t byte1, const uint8_t byte2) {
-  emit_byte(byte1);
-  emit_byte(byte2);
+static void emit_word(Parser *parser, const uint8_t byte1,
+                      const uint8_t byte2) {
+  emit_byte(parser, byte1);
+  emit_byte(parser, byte2);
 }
 
-static void emit_return() { emit_word(OpNull, OpRet); }
+static void emit_return(Parser *parser) { emit_word(parser, OpNull, OpRet); }
 
 /*
  * Emits a constant into constant array
  */
-static uint32_t emit_constant_array(const Value value) {
-  uint32_t idx = add_constant(current_chunk(), value);
-  if (max_constants_error(idx)) {
+static uint32_t emit_constant_array(Parser *parser, const Value value) {
+  uint32_t idx = add_constant(parser->vm, current_chunk(parser), value);
+  if (max_constants_error(parser, idx)) {
     exit(1);
   }
   return idx;
@@ -175,91 +196,100 @@ static uint32_t emit_constant_array(const Value value) {
 /*
  * Emits a constant as an index into chunk
  */
-static void emit_idx(const uint32_t idx) {
-  if (max_constants_error(idx)) {
+static void emit_idx(Parser *parser, const uint32_t idx) {
+  if (max_constants_error(parser, idx)) {
     return;
   }
-  write_constant_chunk(current_chunk(), idx, parser.previous.line);
+  write_constant_chunk(parser->vm, current_chunk(parser), idx,
+                       parser->previous.line);
 }
 
 /*
  * Emits a constant into chunk and  constants array
  */
-static void emit_constant(const Value value) {
-  uint32_t idx = emit_constant_array(value);
-  emit_idx(idx);
+static void emit_constant(Parser *parser, const Value value) {
+  uint32_t idx = emit_constant_array(parser, value);
+  emit_idx(parser, idx);
   return;
 }
 
-static void emit_byte_idx(const uint8_t op, const uint32_t idx) {
-  emit_byte(op);
-  emit_idx(idx);
+static void emit_byte_idx(Parser *parser, const uint8_t op,
+                          const uint32_t idx) {
+  emit_byte(parser, op);
+  emit_idx(parser, idx);
 }
 
-static uint32_t emit_name(const Token *name) {
-  for (uint32_t idx = 0; idx < current_chunk()->constants.len; idx += 1) {
-    Value *value = &current_chunk()->constants.values[idx];
-    if (IS_STRING(*value) && AS_STRING(*value)->len == name->len &&
+// Names are always shared strings, so that every function resolves one to
+// the same pointer. A string literal with the same characters may be a
+// VM-local string, and is not reused.
+static uint32_t emit_name(Parser *parser, const Token *name) {
+  for (uint32_t idx = 0; idx < current_chunk(parser)->constants.len; idx += 1) {
+    Value *value = &current_chunk(parser)->constants.values[idx];
+    if (IS_STRING(*value) && AS_OBJ(*value)->is_shared &&
+        AS_STRING(*value)->len == name->len &&
         memcmp(name->start, AS_STRING(*value)->chars, name->len) == 0) {
       return idx;
     }
   }
-  ObjString *string = copy_string(name->start, name->len);
-  return emit_constant_array(OBJ_VAL(string));
+  ObjString *string = copy_shared_string(name->start, name->len);
+  return emit_constant_array(parser, OBJ_VAL(string));
 }
 
-static uint32_t emit_jmp(uint8_t inst) {
-  emit_byte(inst);
-  emit_word(0xff, 0xff);
-  return current_chunk()->len - 2;
+static uint32_t emit_jmp(Parser *parser, uint8_t inst) {
+  emit_byte(parser, inst);
+  emit_word(parser, 0xff, 0xff);
+  return current_chunk(parser)->len - 2;
 }
 
-static void emit_loop(uint32_t loop_start) {
-  emit_byte(OpJmp);
-  uint32_t offset = current_chunk()->len - loop_start + 2;
+static void emit_loop(Parser *parser, uint32_t loop_start) {
+  emit_byte(parser, OpJmp);
+  uint32_t offset = current_chunk(parser)->len - loop_start + 2;
   if (offset > UINT16_MAX) {
-    error("Loop body is too large.");
+    error(parser, "Loop body is too large.");
   }
-  emit_word(loop_start & 0xff, (loop_start >> 8) & 0xff);
+  emit_word(parser, loop_start & 0xff, (loop_start >> 8) & 0xff);
 }
 
-static void patch_jmp(int32_t offset) {
-  int32_t jmp = current_chunk()->len;
+static void patch_jmp(Parser *parser, int32_t offset) {
+  int32_t jmp = current_chunk(parser)->len;
   if ((jmp - offset - 2) > UINT16_MAX) {
-    error("Too much code to jump over.");
-  }
-  current_chunk()->code[offset] = (jmp) & 0xff;
-  current_chunk()->code[offset + 1] = (jmp >> 8) & 0xff;
-}
-
-static void parse_precedence(Precedence precedence);
-static void expression();
-
-static void grouping(bool can_assign);
-static void number(bool can_assign);
-static void unary(bool can_assign);
-static void binary(bool can_assign);
-static void call(bool can_assign);
-static void literal(bool can_assign);
-static void string(bool can_assign);
-static void variable(bool can_assign);
-static void and_and_(bool can_assign);
-static void or_or_(bool can_assign);
-static void dot(bool can_assign);
-
-static void var_declaration();
-static void class_declaration();
-static void fn_declaration();
-static void declaration();
-static void block();
-
-static void print_statement();
-static void return_statement();
-static void if_statement();
-static void while_statement();
-static void for_statement();
-static void expression_statement();
-static void statement();
+    error(parser, "Too much code to jump over.");
+  }
+  current_chunk(parser)->code[offset] = (jmp) & 0xff;
+  current_chunk(parser)->code[offset + 1] = (jmp >> 8) & 0xff;
+}
+
+static void parse_precedence(Parser *parser, Precedence precedence);
+static void expression(Parser *parser);
+
+static void grouping(Parser *parser, bool can_assign);
+static void number(Parser *parser, bool can_assign);
+static void unary(Parser *parser, bool can_assign);
+static void binary(Parser *parser, bool can_assign);
+static void call(Parser *parser, bool can_assign);
+static void literal(Parser *parser, bool can_assign);
+static void string(Parser *parser, bool can_assign);
+static void variable(Parser *parser, bool can_assign);
+static void and_and_(Parser *parser, bool can_assign);
+static void or_or_(Parser *parser, bool can_assign);
+static void dot(Parser *parser, bool can_assign);
+static void list(Parser *parser, bool can_assign);
+static void index_(Parser *parser, bool can_assign);
+static void yield_(Parser *parser, bool can_assign);
+
+static void var_declaration(Parser *parser);
+static void class_declaration(Parser *parser);
+static void fn_declaration(Parser *parser);
+static void declaration(Parser *parser);
+static void block(Parser *parser);
+
+static void print_statement(Parser *parser);
+static void return_statement(Parser *parser);
+static void if_statement(Parser *parser);
+static void while_statement(Parser *parser);
+static void for_statement(Parser *parser);
+static void expression_statement(Parser *parser);
+static void statement(Parser *parser);
 
 static ParseRule *get_rule(TokenType type);
 
@@ -270,12 +300,13 @@ static bool same_name(const Token *name, const Token *other) {
   return memcmp(name->start, other->start, name->len) == 0;
 }
 
-static int32_t resolve_local(Compiler *compiler, const Token *name) {
+static int32_t resolve_local(Parser *parser, Compiler *compiler,
+                             const Token *name) {
   for (int32_t i = compiler->locals_len - 1; i >= 0; i -= 1) {
     Local *local = &compiler->locals[i];
-    if (same_name(name, &local->name)) {
+    if (!local->is_field && same_name(name, &local->name)) {
       if (local->depth == -1) {
-        error("Cannot read local variable in its own initializer.");
+        error(parser, "Cannot read local variable in its own initializer.");
       }
       return i;
     }
@@ -283,8 +314,8 @@ static int32_t resolve_local(Compiler *compiler, const Token *name) {
   return -1;
 }
 
-static int32_t add_upvalue(Compiler *compiler, const size_t index,
-                           bool is_local) {
+static int32_t add_upvalue(Parser *parser, Compiler *compiler,
+                           const size_t index, bool is_local) {
   uint32_t upvalues_len = compiler->function->upvalues_len;
 
   for (uint32_t i = 0; i < upvalues_len; i += 1) {
@@ -295,7 +326,7 @@ static int32_t add_upvalue(Compiler *compiler, const size_t index,
   }
 
   if (upvalues_len == UINT16_COUNT) {
-    error("Too many closure variables in function.");
+    error(parser, "Too many closure variables in function.");
     return 0;
   }
 
@@ -305,174 +336,215 @@ static int32_t add_upvalue(Compiler *compiler, const size_t index,
   return compiler->function->upvalues_len - 1;
 }
 
-static int32_t resolve_upvalue(Compiler *compiler, const Token *name) {
+static int32_t resolve_upvalue(Parser *parser, Compiler *compiler,
+                               const Token *name) {
 
   if (compiler->enclosing == NULL) {
     return -1;
   }
 
-  int32_t local_idx = resolve_local(compiler->enclosing, name);
+  int32_t local_idx = resolve_local(parser, compiler->enclosing, name);
   if (local_idx != -1) {
     compiler->enclosing->locals[local_idx].is_captured = false;
-    return add_upvalue(compiler, local_idx, true);
+    return add_upvalue(parser, compiler, local_idx, true);
   }
 
-  int32_t upvalue = resolve_upvalue(compiler->enclosing, name);
+  int32_t upvalue = resolve_upvalue(parser, compiler->enclosing, name);
   if (upvalue != -1) {
-    return add_upvalue(compiler, upvalue, false);
+    return add_upvalue(parser, compiler, upvalue, false);
   }
 
   return -1;
 }
 
-static void emit_variable_operation(const Token *name, bool can_assign) {
+// Compiles `name.field` or `name.field = value` on an instance replaced by
+// stack slots, the only uses `scan_fields` lets through.
+static void scalar_property(Parser *parser, uint32_t slot, bool can_assign) {
+  consume_token(parser, TokenDot, "Expect '.' after instance.");
+  consume_token(parser, TokenIdentifier, "Expect property name after '.'.");
+  Local *local = &parser->compiler->locals[slot];
+  uint8_t field = 0;
+  while (field < local->fields_len &&
+         !same_name(&parser->previous, &local[1 + field].name)) {
+    field += 1;
+  }
+  if (field == local->fields_len) {
+    error(parser, "Unexpected property of a replaced instance.");
+    return;
+  }
+  uint32_t name_idx = emit_name(parser, &parser->previous);
+
+  uint8_t op = OpGetScalar;
+  if (can_assign && match_token(parser, TokenEqual)) {
+    expression(parser);
+    op = OpSetScalar;
+  }
+  emit_byte(parser, op);
+  emit_idx(parser, slot);
+  emit_byte(parser, field);
+  emit_idx(parser, name_idx);
+}
+
+static void emit_variable_operation(Parser *parser, const Token *name,
+                                    bool can_assign) {
   uint8_t get_op, set_op;
-  int32_t arg = resolve_local(current_compiler, name);
+  int32_t arg = resolve_local(parser, parser->compiler, name);
+  if (arg != -1 && parser->compiler->locals[arg].fields_len > 0) {
+    scalar_property(parser, arg, can_assign);
+    return;
+  }
   if (arg != -1) {
     get_op = OpGetLocal;
     set_op = OpSetLocal;
-  } else if ((arg = resolve_upvalue(current_compiler, name)) != -1) {
+  } else if ((arg = resolve_upvalue(parser, parser->compiler, name)) != -1) {
     get_op = OpGetUpvalue;
     set_op = OpSetUpvalue;
   } else {
-    arg = emit_name(name);
+    arg = emit_name(parser, name);
     get_op = OpGetGlobal;
     set_op = OpSetGlobal;
   }
 
-  if (can_assign && match_token(TokenEqual)) {
-    expression();
-    emit_byte(set_op);
+  if (can_assign && match_token(parser, TokenEqual)) {
+    expression(parser);
+    emit_byte(parser, set_op);
   } else {
-    emit_byte(get_op);
+    emit_byte(parser, get_op);
   }
-  emit_idx(arg);
+  emit_idx(parser, arg);
 }
 
-static void add_local(const Token *name) {
+static void add_local(Parser *parser, const Token *name) {
   // My version is able to contain more local
   // variables, but i'm trying to do same as clox
   // for now
-  if (current_compiler->locals_len == UINT16_COUNT) {
-    error("Too many local variabls in function.");
+  if (parser->compiler->locals_len == UINT16_COUNT) {
+    error(parser, "Too many local variabls in function.");
     return;
   }
-  Local *local = &current_compiler->locals[current_compiler->locals_len];
-  current_compiler->locals_len += 1;
+  Local *local = &parser->compiler->locals[parser->compiler->locals_len];
+  parser->compiler->locals_len += 1;
   local->name = *name;
   local->depth = -1;
   local->is_captured = false;
+  local->fields_len = 0;
+  local->is_field = false;
 }
 
-static void declare_variable() {
-  if (current_compiler->scope_depth == 0) {
+static void declare_variable(Parser *parser) {
+  if (parser->compiler->scope_depth == 0) {
     return;
   }
 
-  Token *name = &parser.previous;
-  for (int32_t i = current_compiler->locals_len - 1; i >= 0; i -= 1) {
-    Local *local = &current_compiler->locals[i];
-    if (local->depth != -1 && local->depth < current_compiler->scope_depth) {
+  Token *name = &parser->previous;
+  for (int32_t i = parser->compiler->locals_len - 1; i >= 0; i -= 1) {
+    Local *local = &parser->compiler->locals[i];
+    if (local->depth != -1 && local->depth < parser->compiler->scope_depth) {
       break;
     }
-    if (same_name(name, &local->name)) {
-      error("Already a variable with this name in this scope.");
+    if (!local->is_field && same_name(name, &local->name)) {
+      error(parser, "Already a variable with this name in this scope.");
     }
   }
-  add_local(name);
+  add_local(parser, name);
 }
 
-static uint32_t parse_variable(const char *message) {
-  consume_token(TokenIdentifier, message);
+static uint32_t parse_variable(Parser *parser, const char *message) {
+  consume_token(parser, TokenIdentifier, message);
 
-  declare_variable();
-  if (current_compiler->scope_depth > 0) {
+  declare_variable(parser);
+  if (parser->compiler->scope_depth > 0) {
     return 0;
   }
-  return emit_name(&parser.previous);
+  return emit_name(parser, &parser->previous);
 }
 
-static void init_variable() {
-  if (current_compiler->scope_depth == 0) {
+static void init_variable(Parser *parser) {
+  if (parser->compiler->scope_depth == 0) {
     return;
   }
-  current_compiler->locals[current_compiler->locals_len - 1].depth =
-      current_compiler->scope_depth;
+  parser->compiler->locals[parser->compiler->locals_len - 1].depth =
+      parser->compiler->scope_depth;
 }
 
-static void define_variable(uint32_t variable) {
-  if (current_compiler->scope_depth > 0) {
-    init_variable();
+static void define_variable(Parser *parser, uint32_t variable) {
+  if (parser->compiler->scope_depth > 0) {
+    init_variable(parser);
     return;
   }
-  emit_byte(OpDefineGlobal);
-  emit_idx(variable);
+  emit_byte(parser, OpDefineGlobal);
+  emit_idx(parser, variable);
 }
 
-static uint8_t argument_list() {
+static uint8_t argument_list(Parser *parser) {
   uint8_t args_len = 0;
-  if (!check_token(TokenRightParen)) {
+  if (!check_token(parser, TokenRightParen)) {
     while (true) {
-      expression();
+      expression(parser);
       if (args_len == UINT8_MAX) {
-        error("Can't have more than %d arguments.", UINT8_MAX);
+        error(parser, "Can't have more than %d arguments.", UINT8_MAX);
       }
       args_len += 1;
-      if (!match_token(TokenComma)) {
+      if (!match_token(parser, TokenComma)) {
         break;
       }
     }
   }
-  consume_token(TokenRightParen, "Expect ')' after arguments.");
+  consume_token(parser, TokenRightParen, "Expect ')' after arguments.");
   return args_len;
 }
 
-static void begin_scope() { current_compiler->scope_depth += 1; }
+static void begin_scope(Parser *parser) { parser->compiler->scope_depth += 1; }
 
-static void end_scope() {
-  current_compiler->scope_depth -= 1;
-  while (current_compiler->locals_len > 0 &&
-         current_compiler->locals[current_compiler->locals_len - 1].depth >
-             current_compiler->scope_depth) {
-    if (current_compiler->locals[current_compiler->locals_len - 1]
+static void end_scope(Parser *parser) {
+  parser->compiler->scope_depth -= 1;
+  while (parser->compiler->locals_len > 0 &&
+         parser->compiler->locals[parser->compiler->locals_len - 1].depth >
+             parser->compiler->scope_depth) {
+    if (parser->compiler->locals[parser->compiler->locals_len - 1]
             .is_captured) {
-      emit_byte(OpCloseUpvalue);
+      emit_byte(parser, OpCloseUpvalue);
     } else {
-      emit_byte(OpPop);
+      emit_byte(parser, OpPop);
     }
-    current_compiler->locals_len -= 1;
+    parser->compiler->locals_len -= 1;
   }
 }
 
-static void scoped_block() {
-  begin_scope();
-  block();
-  end_scope();
+static void scoped_block(Parser *parser) {
+  begin_scope(parser);
+  block(parser);
+  end_scope(parser);
 }
 
-static void init_compiler(Compiler *compiler,
+static void init_compiler(Parser *parser, Compiler *compiler,
                           const FunctionType function_type) {
-  compiler->enclosing = current_compiler;
+  compiler->enclosing = parser->compiler;
 
   compiler->function_type = function_type;
 
   compiler->locals_len = 0;
   compiler->scope_depth = 0;
+  compiler->last_call = UINT32_MAX;
+  compiler->instances_len = 0;
+  compiler->scalars_len = 0;
 
-  compiler->function = new_function();
+  compiler->function = new_function(parser->vm);
 
-  current_compiler = compiler;
+  parser->compiler = compiler;
 
   if (function_type != TypeScript) {
-    current_compiler->function->name =
-        copy_string(parser.previous.start, parser.previous.len);
+    parser->compiler->function->name =
+        copy_shared_string(parser->previous.start, parser->previous.len);
   }
 
-  Local *local = &current_compiler->locals[current_compiler->locals_len];
-  current_compiler->locals_len += 1;
+  Local *local = &parser->compiler->locals[parser->compiler->locals_len];
+  parser->compiler->locals_len += 1;
   local->depth = 0;
 
   local->is_captured = false;
+  local->fields_len = 0;
+  local->is_field = false;
 
   if (function_type != TypeFunction) {
     local->name.start = "this";
@@ -483,75 +555,86 @@ static void init_compiler(Compiler *compiler,
   }
 }
 
-static ObjFunction *end_compiler() {
-  emit_return();
-  ObjFunction *function = current_compiler->function;
+static ObjFunction *end_compiler(Parser *parser) {
+  emit_return(parser);
+  ObjFunction *function = parser->compiler->function;
 
 #ifdef DEBUG_PRINT_CODE
-  if (parser.had_error == false) {
-    disassemble_chunk(current_chunk(),
+  if (parser->had_error == false) {
+    disassemble_chunk(current_chunk(parser),
                       function->name != NULL ? function->name->chars : "code");
   }
 #endif /* ifdef DEBUG_PRINT_CODE */
 
-  current_compiler = current_compiler->enclosing;
+#ifdef DEBUG_PRINT_ESCAPE
+  Compiler *compiler = parser->compiler;
+  if (parser->had_error == false && compiler->instances_len > 0) {
+    printf("== %s: %u of %u allocations eliminated ==\n",
+           function->name != NULL ? function->name->chars : "code",
+           compiler->scalars_len, compiler->instances_len);
+  }
+#endif /* ifdef DEBUG_PRINT_ESCAPE */
+
+  parser->compiler = parser->compiler->enclosing;
   return function;
 }
 
-static void function(const FunctionType function_type) {
+static void function(Parser *parser, const FunctionType function_type) {
   Compiler compiler;
-  init_compiler(&compiler, function_type);
-  begin_scope();
+  init_compiler(parser, &compiler, function_type);
+  begin_scope(parser);
 
-  consume_token(TokenLeftParen, "Expect '(' after function name.");
-  if (!check_token(TokenRightParen)) {
+  consume_token(parser, TokenLeftParen, "Expect '(' after function name.");
+  if (!check_token(parser, TokenRightParen)) {
     while (true) {
       compiler.function->arity += 1;
       if (compiler.function->arity > UINT8_MAX) {
-        error_at_current("Can't have more than %d parameters.", UINT8_MAX);
+        error_at_current(parser, "Can't have more than %d parameters.",
+                         UINT8_MAX);
       }
-      uint32_t param = parse_variable("Expect parameter name.");
-      define_variable(param);
-      if (!match_token(TokenComma)) {
+      uint32_t param = parse_variable(parser, "Expect parameter name.");
+      define_variable(parser, param);
+      if (!match_token(parser, TokenComma)) {
         break;
       }
     }
   }
 
-  consume_token(TokenRightParen, "Expect ')' after parameters.");
-  consume_token(TokenLeftBrace, "Expect '{' before function body.");
-  block();
+  consume_token(parser, TokenRightParen, "Expect ')' after parameters.");
+  consume_token(parser, TokenLeftBrace, "Expect '{' before function body.");
+  block(parser);
 
-  ObjFunction *func = end_compiler();
-  uint32_t idx = emit_constant_array(OBJ_VAL(func));
-  emit_byte(OpClosure);
-  emit_idx(idx);
+  ObjFunction *func = end_compiler(parser);
+  uint32_t idx = emit_constant_array(parser, OBJ_VAL(func));
+  emit_byte(parser, OpClosure);
+  emit_idx(parser, idx);
 
   for (uint32_t i = 0; i < func->upvalues_len; i += 1) {
-    emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-    emit_idx(compiler.upvalues[i].index);
+    emit_byte(parser, compiler.upvalues[i].is_local ? 1 : 0);
+    emit_idx(parser, compiler.upvalues[i].index);
   }
 }
 
-static void method() {
-  consume_token(TokenFn, "Expect method 'fn' declaration.");
-  consume_token(TokenIdentifier, "Expect method name.");
-  uint32_t method_name_idx = emit_name(&parser.previous);
+static void method(Parser *parser) {
+  consume_token(parser, TokenFn, "Expect method 'fn' declaration.");
+  consume_token(parser, TokenIdentifier, "Expect method name.");
+  uint32_t method_name_idx = emit_name(parser, &parser->previous);
   FunctionType function_type = TypeFunction;
-  function(function_type);
-  emit_byte_idx(OpMethod, method_name_idx);
+  function(parser, function_type);
+  emit_byte_idx(parser, OpMethod, method_name_idx);
 }
 
-static void field_declaration() {
-  consume_token(TokenIdentifier, "Expect property name.");
-  uint32_t name_idx = emit_name(&parser.previous);
-  // if (match_token(TokenEqual)) {
-  //   expression();
-  // } else {
-  //   emit_byte(OpNull);
-  // }
-  consume_token(TokenSemiColon, "Expect ';' after property definition.");
-  emit_byte_idx(OpDefineProperty, name_idx);
+static void field_declaration(Parser *parser) {
+  consume_token(parser, TokenIdentifier, "Expect property name.");
+  uint32_t name_idx = emit_name(parser, &parser->previous);
+  if (match_token(parser, TokenEqual)) {
+    expression(parser);
+  } else {
+    emit_byte(parser, OpNull);
+  }
+  consume_token(parser, TokenSemiColon,
+                "Expect ';' after property definition.");
+  emit_byte_idx(parser, OpDefineProperty, name_idx);
 }
 
 ParseRule rules[] = {
@@ -559,6 +642,8 @@ ParseRule rules[] = {
     [TokenRightParen] = {NULL, NULL, PrecNone},
     [TokenLeftBrace] = {NULL, NULL, PrecNone},
     [TokenRightBrace] = {NULL, NULL, PrecNone},
+    [TokenLeftBracket] = {list, index_, PrecCall},
+    [TokenRightBracket] = {NULL, NULL, PrecNone},
     [TokenComma] = {NULL, NULL, PrecNone},
     [TokenDot] = {NULL, dot, PrecCall},
     [TokenMinus] = {unary, binary, PrecTerm},
@@ -593,65 +678,71 @@ ParseRule rules[] = {
     [TokenSelf] = {NULL, NULL, PrecNone},
     [TokenTrue] = {literal, NULL, PrecNone},
     [TokenWhile] = {NULL, NULL, PrecNone},
+    [TokenYield] = {yield_, NULL, PrecNone},
     [TokenError] = {NULL, NULL, PrecNone},
     [TokenEof] = {NULL, NULL, PrecNone},
 };
 
 static ParseRule *get_rule(TokenType type) { return &rules[type]; }
 
-static void parse_precedence(Precedence precedence) {
-  advance();
-  ParseFn handle_prefix = get_rule(parser.previous.type)->prefix;
+static void parse_precedence(Parser *parser, Precedence precedence) {
+  advance(parser);
+  ParseFn handle_prefix = get_rule(parser->previous.type)->prefix;
   if (handle_prefix == NULL) {
-    error("Expect expression.");
+    error(parser, "Expect expression.");
     return;
   }
 
   bool can_assign = precedence <= PrecAssignment;
-  handle_prefix(can_assign);
+  handle_prefix(parser, can_assign);
 
-  while (precedence <= get_rule(parser.current.type)->precedence) {
-    advance();
-    ParseFn handle_infix = get_rule(parser.previous.type)->infix;
-    handle_infix(can_assign);
+  while (precedence <= get_rule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn handle_infix = get_rule(parser->previous.type)->infix;
+    handle_infix(parser, can_assign);
   }
 
-  if (can_assign && match_token(TokenEqual)) {
-    error("Invalid assignment target.");
+  if (can_assign && match_token(parser, TokenEqual)) {
+    error(parser, "Invalid assignment target.");
   }
 }
 
-static void grouping(bool can_assign) {
-  expression();
-  consume_token(TokenRightParen, "Expect ')' after expression.");
+static void grouping(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  expression(parser);
+  consume_token(parser, TokenRightParen, "Expect ')' after expression.");
 }
 
-static void number(bool can_assign) {
-  double value = strtod(parser.previous.start, NULL);
-  emit_constant(NUMBER_VAL(value));
+static void number(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  double value = strtod(parser->previous.start, NULL);
+  emit_constant(parser, NUMBER_VAL(value));
 }
 
-static void string(bool can_assign) {
-  emit_constant(
-      OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.len - 2)));
+static void string(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  emit_constant(parser, OBJ_VAL(copy_string(parser->vm,
+                                            parser->previous.start + 1,
+                                            parser->previous.len - 2)));
 }
 
-static void variable(bool can_assign) {
-  emit_variable_operation(&parser.previous, can_assign);
+static void variable(Parser *parser, bool can_assign) {
+  emit_variable_operation(parser, &parser->previous, can_assign);
 }
 
-static void unary(bool can_assign) {
-  TokenType operator_type = parser.previous.type;
+static void unary(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  TokenType operator_type = parser->previous.type;
 
-  parse_precedence(PrecUnary);
+  parse_precedence(parser, PrecUnary);
 
   switch (operator_type) {
   case TokenMinus: {
-    emit_byte(OpNeg);
+    emit_byte(parser, OpNeg);
     break;
   }
   case TokenBang: {
-    emit_byte(OpNot);
+    emit_byte(parser, OpNot);
     break;
   }
   default:
@@ -659,82 +750,130 @@ static void unary(bool can_assign) {
   }
 }
 
-static void and_and_(bool can_assign) {
-  int32_t end_jmp = emit_jmp(OpJmpIfFalse);
+static void yield_(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  if (parser->compiler->function_type == TypeScript) {
+    error(parser, "Can't yield from top-level code.");
+  }
+  if (check_token(parser, TokenSemiColon) ||
+      check_token(parser, TokenRightParen)) {
+    emit_byte(parser, OpNull);
+  } else {
+    parse_precedence(parser, PrecAssignment);
+  }
+  emit_byte(parser, OpYield);
+}
+
+static void and_and_(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  int32_t end_jmp = emit_jmp(parser, OpJmpIfFalse);
 
-  emit_jmp(OpPop);
-  parse_precedence(PrecAndAnd);
+  emit_jmp(parser, OpPop);
+  parse_precedence(parser, PrecAndAnd);
 
-  patch_jmp(end_jmp);
+  patch_jmp(parser, end_jmp);
 }
 
-static void or_or_(bool can_assign) {
-  int32_t else_jmp = emit_jmp(OpJmpIfFalse);
-  int32_t end_jmp = emit_jmp(OpJmp);
+static void or_or_(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  int32_t else_jmp = emit_jmp(parser, OpJmpIfFalse);
+  int32_t end_jmp = emit_jmp(parser, OpJmp);
 
-  patch_jmp(else_jmp);
-  emit_byte(OpPop);
+  patch_jmp(parser, else_jmp);
+  emit_byte(parser, OpPop);
 
-  parse_precedence(PrecOrOr);
-  patch_jmp(end_jmp);
+  parse_precedence(parser, PrecOrOr);
+  patch_jmp(parser, end_jmp);
 }
 
-static void dot(bool can_assign) {
-  consume_token(TokenIdentifier, "Expect property name after '.'.");
-  uint32_t name_idx = emit_name(&parser.previous);
+static void dot(Parser *parser, bool can_assign) {
+  consume_token(parser, TokenIdentifier, "Expect property name after '.'.");
+  uint32_t name_idx = emit_name(parser, &parser->previous);
 
-  if (can_assign && match_token(TokenEqual)) {
-    expression();
-    emit_byte_idx(OpSetProperty, name_idx);
+  if (can_assign && match_token(parser, TokenEqual)) {
+    expression(parser);
+    emit_byte_idx(parser, OpSetProperty, name_idx);
   } else {
-    emit_byte_idx(OpGetProperty, name_idx);
+    emit_byte_idx(parser, OpGetProperty, name_idx);
+  }
+}
+
+static void list(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  uint32_t len = 0;
+  while (!check_token(parser, TokenRightBracket)) {
+    expression(parser);
+    if (len == UINT16_MAX) {
+      error(parser, "Can't have more than %d elements in a list literal.",
+            UINT16_MAX);
+    }
+    len += 1;
+    if (!match_token(parser, TokenComma)) {
+      break;
+    }
   }
+  consume_token(parser, TokenRightBracket, "Expect ']' after list elements.");
+  emit_byte(parser, OpList);
+  emit_word(parser, len & 0xff, (len >> 8) & 0xff);
 }
 
-static void binary(bool can_assign) {
-  TokenType operator_type = parser.previous.type;
+static void index_(Parser *parser, bool can_assign) {
+  expression(parser);
+  consume_token(parser, TokenRightBracket, "Expect ']' after index.");
+
+  if (can_assign && match_token(parser, TokenEqual)) {
+    expression(parser);
+    emit_byte(parser, OpIndexSet);
+  } else {
+    emit_byte(parser, OpIndexGet);
+  }
+}
+
+static void binary(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  TokenType operator_type = parser->previous.type;
   ParseRule *rule = get_rule(operator_type);
-  parse_precedence((Precedence)(rule->precedence + 1));
+  parse_precedence(parser, (Precedence)(rule->precedence + 1));
 
   switch (operator_type) {
   case TokenEqualEqual: {
-    emit_byte(OpEq);
+    emit_byte(parser, OpEq);
     break;
   }
   case TokenBangEqual: {
-    emit_word(OpEq, OpNot);
+    emit_word(parser, OpEq, OpNot);
     break;
   }
   case TokenLess: {
-    emit_byte(OpLt);
+    emit_byte(parser, OpLt);
     break;
   }
   case TokenLessEqual: {
-    emit_word(OpGt, OpNot);
+    emit_word(parser, OpGt, OpNot);
     break;
   }
   case TokenGreater: {
-    emit_byte(OpGt);
+    emit_byte(parser, OpGt);
     break;
   }
   case TokenGreaterEqual: {
-    emit_word(OpLt, OpNot);
+    emit_word(parser, OpLt, OpNot);
     break;
   }
   case TokenPlus: {
-    emit_byte(OpAdd);
+    emit_byte(parser, OpAdd);
     break;
   }
   case TokenMinus: {
-    emit_byte(OpSub);
+    emit_byte(parser, OpSub);
     break;
   }
   case TokenStar: {
-    emit_byte(OpMul);
+    emit_byte(parser, OpMul);
     break;
   }
   case TokenSlash: {
-    emit_byte(OpDiv);
+    emit_byte(parser, OpDiv);
     break;
   }
   default:
@@ -742,23 +881,26 @@ static void binary(bool can_assign) {
   }
 }
 
-static void call(bool can_assign) {
-  uint8_t args_len = argument_list();
-  emit_word(OpCall, args_len);
+static void call(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  uint8_t args_len = argument_list(parser);
+  parser->compiler->last_call = current_chunk(parser)->len;
+  emit_word(parser, OpCall, args_len);
 }
 
-static void literal(bool can_assign) {
-  switch (parser.previous.type) {
+static void literal(Parser *parser, bool can_assign) {
+  (void)can_assign;
+  switch (parser->previous.type) {
   case TokenNull: {
-    emit_byte(OpNull);
+    emit_byte(parser, OpNull);
     break;
   }
   case TokenTrue: {
-    emit_byte(OpTrue);
+    emit_byte(parser, OpTrue);
     break;
   }
   case TokenFalse: {
-    emit_byte(OpFalse);
+    emit_byte(parser, OpFalse);
     break;
   }
   default:
@@ -766,14 +908,14 @@ static void literal(bool can_assign) {
   }
 }
 
-static void synchronize() {
-  parser.panic_mode = false;
+static void synchronize(Parser *parser) {
+  parser->panic_mode = false;
 
-  while (parser.current.type != TokenEof) {
-    if (parser.previous.type == TokenSemiColon) {
+  while (parser->current.type != TokenEof) {
+    if (parser->previous.type == TokenSemiColon) {
       return;
     }
-    switch (parser.current.type) {
+    switch (parser->current.type) {
     case TokenClass:
     case TokenFn:
     case TokenLet:
@@ -786,224 +928,386 @@ static void synchronize() {
 
     default:;
     }
-    advance();
+    advance(parser);
   }
 }
 
-static void expression() { parse_precedence(PrecAssignment); }
+static void expression(Parser *parser) {
+  parse_precedence(parser, PrecAssignment);
+}
 
-static void print_statement() {
-  expression();
-  consume_token(TokenSemiColon, "Expect ';' after value.");
-  emit_byte(OpPrint);
+static void print_statement(Parser *parser) {
+  expression(parser);
+  consume_token(parser, TokenSemiColon, "Expect ';' after value.");
+  emit_byte(parser, OpPrint);
 }
 
-static void return_statement() {
-  if (current_compiler->function_type == TypeScript) {
-    error("Can't return from top-level code.");
+static void return_statement(Parser *parser) {
+  if (parser->compiler->function_type == TypeScript) {
+    error(parser, "Can't return from top-level code.");
   }
-  if (match_token(TokenSemiColon)) {
-    emit_return();
+  if (match_token(parser, TokenSemiColon)) {
+    emit_return(parser);
   } else {
-    expression();
-    consume_token(TokenSemiColon, "Expect ';' after return value.");
-    emit_byte(OpRet);
+    expression(parser);
+    consume_token(parser, TokenSemiColon, "Expect ';' after return value.");
+    // The `OpRet` stays: jumps over the call land on it, and calls that do
+    // not replace the frame fall through to it.
+    Chunk *chunk = current_chunk(parser);
+    if (chunk->len >= 2 && parser->compiler->last_call == chunk->len - 2) {
+      chunk->code[parser->compiler->last_call] = OpTailCall;
+    }
+    emit_byte(parser, OpRet);
   }
 }
 
-static void if_statement() {
-  expression();
+static void if_statement(Parser *parser) {
+  expression(parser);
 
-  uint32_t then_jmp = emit_jmp(OpJmpIfFalse);
-  emit_byte(OpPop);
-  consume_token(TokenLeftBrace, "Expect '{' after 'if' statement.");
-  scoped_block();
+  uint32_t then_jmp = emit_jmp(parser, OpJmpIfFalse);
+  emit_byte(parser, OpPop);
+  consume_token(parser, TokenLeftBrace, "Expect '{' after 'if' statement.");
+  scoped_block(parser);
 
-  uint32_t else_jmp = emit_jmp(OpJmp);
+  uint32_t else_jmp = emit_jmp(parser, OpJmp);
 
-  patch_jmp(then_jmp);
-  emit_byte(OpPop);
+  patch_jmp(parser, then_jmp);
+  emit_byte(parser, OpPop);
 
-  if (match_token(TokenElse)) {
-    consume_token(TokenLeftBrace, "Expect '{' after 'else' statement.");
-    scoped_block();
+  if (match_token(parser, TokenElse)) {
+    consume_token(parser, TokenLeftBrace, "Expect '{' after 'else' statement.");
+    scoped_block(parser);
   }
 
-  patch_jmp(else_jmp);
+  patch_jmp(parser, else_jmp);
 }
 
-static void while_statement() {
-  uint32_t loop_start = current_chunk()->len;
-  expression();
+static void while_statement(Parser *parser) {
+  uint32_t loop_start = current_chunk(parser)->len;
+  expression(parser);
 
-  uint32_t exit_jmp = emit_jmp(OpJmpIfFalse);
-  emit_byte(OpPop);
-  consume_token(TokenLeftBrace, "Expect '{' after 'while' statement.");
-  scoped_block();
-  emit_loop(loop_start);
+  uint32_t exit_jmp = emit_jmp(parser, OpJmpIfFalse);
+  emit_byte(parser, OpPop);
+  consume_token(parser, TokenLeftBrace, "Expect '{' after 'while' statement.");
+  scoped_block(parser);
+  emit_loop(parser, loop_start);
 
-  patch_jmp(exit_jmp);
-  emit_byte(OpPop);
+  patch_jmp(parser, exit_jmp);
+  emit_byte(parser, OpPop);
 }
 
-static void for_statement() {
-  begin_scope();
-  consume_token(TokenLeftParen, "Expect '(' after 'for'.");
-  if (match_token(TokenSemiColon)) {
-  } else if (match_token(TokenLet)) {
-    var_declaration();
+static void for_statement(Parser *parser) {
+  begin_scope(parser);
+  consume_token(parser, TokenLeftParen, "Expect '(' after 'for'.");
+  if (match_token(parser, TokenSemiColon)) {
+  } else if (match_token(parser, TokenLet)) {
+    var_declaration(parser);
   } else {
-    expression_statement();
+    expression_statement(parser);
   }
 
-  uint32_t loop_start = current_chunk()->len;
+  uint32_t loop_start = current_chunk(parser)->len;
   int32_t exit_jmp = -1;
-  if (!match_token(TokenSemiColon)) {
-    expression();
-    consume_token(TokenSemiColon, "Expect ';' after loop condition.");
+  if (!match_token(parser, TokenSemiColon)) {
+    expression(parser);
+    consume_token(parser, TokenSemiColon, "Expect ';' after loop condition.");
 
-    exit_jmp = emit_jmp(OpJmpIfFalse);
-    emit_byte(OpPop);
+    exit_jmp = emit_jmp(parser, OpJmpIfFalse);
+    emit_byte(parser, OpPop);
   }
 
-  if (!match_token(TokenRightParen)) {
-    uint32_t body_jmp = emit_jmp(OpJmp);
-    uint32_t increment_start = current_chunk()->len;
-    expression();
-    emit_byte(OpPop);
-    consume_token(TokenRightParen, "Expect ')' after 'for' clauses.");
+  if (!match_token(parser, TokenRightParen)) {
+    uint32_t body_jmp = emit_jmp(parser, OpJmp);
+    uint32_t increment_start = current_chunk(parser)->len;
+    expression(parser);
+    emit_byte(parser, OpPop);
+    consume_token(parser, TokenRightParen, "Expect ')' after 'for' clauses.");
 
-    emit_loop(loop_start);
+    emit_loop(parser, loop_start);
     loop_start = increment_start;
-    patch_jmp(body_jmp);
+    patch_jmp(parser, body_jmp);
   }
 
-  consume_token(TokenLeftBrace, "Expect '{' after 'for' statement.");
-  block();
-  emit_loop(loop_start);
+  consume_token(parser, TokenLeftBrace, "Expect '{' after 'for' statement.");
+  scoped_block(parser);
+  emit_loop(parser, loop_start);
 
   if (exit_jmp != -1) {
-    patch_jmp(exit_jmp);
-    emit_byte(OpPop);
+    patch_jmp(parser, exit_jmp);
+    emit_byte(parser, OpPop);
   }
 
-  end_scope();
+  end_scope(parser);
 }
 
-static void expression_statement() {
-  expression();
-  consume_token(TokenSemiColon, "Expect ';' after value.");
-  emit_byte(OpPop);
+static void expression_statement(Parser *parser) {
+  expression(parser);
+  consume_token(parser, TokenSemiColon, "Expect ';' after value.");
+  emit_byte(parser, OpPop);
 }
 
-static void statement() {
-  if (match_token(TokenPrint)) {
-    print_statement();
-  } else if (match_token(TokenIf)) {
-    if_statement();
-  } else if (match_token(TokenReturn)) {
-    return_statement();
-  } else if (match_token(TokenWhile)) {
-    while_statement();
-  } else if (match_token(TokenFor)) {
-    for_statement();
-  } else if (match_token(TokenLeftBrace)) {
-    scoped_block();
+static void statement(Parser *parser) {
+  if (match_token(parser, TokenPrint)) {
+    print_statement(parser);
+  } else if (match_token(parser, TokenIf)) {
+    if_statement(parser);
+  } else if (match_token(parser, TokenReturn)) {
+    return_statement(parser);
+  } else if (match_token(parser, TokenWhile)) {
+    while_statement(parser);
+  } else if (match_token(parser, TokenFor)) {
+    for_statement(parser);
+  } else if (match_token(parser, TokenLeftBrace)) {
+    scoped_block(parser);
   } else {
-    expression_statement();
+    expression_statement(parser);
   }
 }
 
-static void block() {
-  while (!check_token(TokenRightBrace) && !check_token(TokenEof)) {
-    declaration();
+static void block(Parser *parser) {
+  while (!check_token(parser, TokenRightBrace) &&
+         !check_token(parser, TokenEof)) {
+    declaration(parser);
   }
-  consume_token(TokenRightBrace, "Expect '}' after block.");
+  consume_token(parser, TokenRightBrace, "Expect '}' after block.");
 }
 
-static void class_declaration() {
-  consume_token(TokenIdentifier, "Expect class name");
-  Token class_name = parser.previous;
-  uint32_t class_name_idx = emit_name(&parser.previous);
-  declare_variable();
+static void class_declaration(Parser *parser) {
+  consume_token(parser, TokenIdentifier, "Expect class name");
+  Token class_name = parser->previous;
+  uint32_t class_name_idx = emit_name(parser, &parser->previous);
+  declare_variable(parser);
+
+  emit_byte_idx(parser, OpClass, class_name_idx);
+  define_variable(parser, class_name_idx);
 
-  emit_byte_idx(OpClass, class_name_idx);
-  define_variable(class_name_idx);
+  emit_variable_operation(parser, &class_name, false);
+  consume_token(parser, TokenLeftBrace, "Expect '{' before class body.");
+  while (!check_token(parser, TokenRightBrace) &&
+         !check_token(parser, TokenEof) &&
+         match_token(parser, TokenLet)) {
+    field_declaration(parser);
+  }
+  while (!check_token(parser, TokenRightBrace) &&
+         !check_token(parser, TokenEof)) {
+    method(parser);
+  }
+  consume_token(parser, TokenRightBrace, "Expect '}' after class body.");
+  emit_byte(parser, OpPop);
+}
+
+static void fn_declaration(Parser *parser) {
+  uint32_t variable = parse_variable(parser, "Expect function name.");
+  init_variable(parser);
+  function(parser, TypeFunction);
+  define_variable(parser, variable);
+}
 
-  emit_variable_operation(&class_name, false);
-  consume_token(TokenLeftBrace, "Expect '{' before class body.");
-  while (!check_token(TokenRightBrace) && !check_token(TokenEof) &&
-         match_token(TokenLet)) {
-    field_declaration();
+// Checks that a declaration's initializer is `Class();`: a call without
+// arguments of a name, which the compiler hopes is a class.
+static bool scan_class_call(Scanner *scanner) {
+  static const TokenType call[] = {TokenIdentifier, TokenLeftParen,
+                                   TokenRightParen, TokenSemiColon};
+  for (uint32_t i = 0; i < sizeof(call) / sizeof(call[0]); i += 1) {
+    if (scan_token(scanner).type != call[i]) {
+      return false;
+    }
   }
-  while (!check_token(TokenRightBrace) && !check_token(TokenEof)) {
-    method();
+  return true;
+}
+
+// Scans the rest of the block declaring an instance for the fields it uses.
+// The instance cannot escape if its name only ever appears as `name.field`,
+// outside of any function declared after it: it is never stored, passed,
+// returned nor captured. Scanning past the end of its scope only makes the
+// answer more conservative.
+static bool scan_fields(Scanner *scanner, const Token *name, Token *fields,
+                        uint8_t *fields_len) {
+  TokenType previous = TokenSemiColon;
+  uint32_t depth = 0;
+  bool in_function = false;
+  while (true) {
+    Token token = scan_token(scanner);
+    switch (token.type) {
+    case TokenEof:
+      return true;
+    case TokenError:
+      return false;
+    case TokenLeftBrace: {
+      depth += 1;
+      break;
+    }
+    case TokenRightBrace: {
+      if (depth == 0) {
+        return true;
+      }
+      depth -= 1;
+      break;
+    }
+    case TokenFn: {
+      in_function = true;
+      break;
+    }
+    case TokenIdentifier: {
+      if (previous == TokenDot || !same_name(&token, name)) {
+        break;
+      }
+      if (in_function || previous == TokenLet || previous == TokenClass ||
+          scan_token(scanner).type != TokenDot) {
+        return false;
+      }
+      token = scan_token(scanner);
+      if (token.type != TokenIdentifier) {
+        return false;
+      }
+      uint8_t field = 0;
+      while (field < *fields_len && !same_name(&token, &fields[field])) {
+        field += 1;
+      }
+      if (field == *fields_len) {
+        if (*fields_len == SCALAR_FIELDS_MAX) {
+          return false;
+        }
+        fields[field] = token;
+        *fields_len += 1;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    previous = token.type;
   }
-  consume_token(TokenRightBrace, "Expect '}' after class body.");
-  emit_byte(OpPop);
 }
 
-static void fn_declaration() {
-  uint32_t variable = parse_variable("Expect function name.");
-  init_variable();
-  function(TypeFunction);
-  define_variable(variable);
+// Compiles `let name = Class();` in a local scope, when the instance never
+// escapes, into an empty slot for the instance followed by a hidden local per
+// field it uses, so creating it allocates nothing. Should the name not be a
+// class declaring those fields at run time, the call is made after all and
+// the property instructions fall back to the object it returned.
+static bool scalar_declaration(Parser *parser) {
+  Compiler *compiler = parser->compiler;
+  Scanner scanner = parser->scanner;
+  if (!scan_class_call(&scanner)) {
+    return false;
+  }
+  compiler->instances_len += 1;
+
+  Token name = parser->previous;
+  Token fields[SCALAR_FIELDS_MAX];
+  uint8_t fields_len = 0;
+  if (!scan_fields(&scanner, &name, fields, &fields_len) ||
+      compiler->locals_len + fields_len >= UINT8_COUNT) {
+#ifdef DEBUG_PRINT_ESCAPE
+    printf("[line %d] '%.*s' escapes\n", name.line, name.len, name.start);
+#endif
+    return false;
+  }
+  compiler->scalars_len += 1;
+#ifdef DEBUG_PRINT_ESCAPE
+  printf("[line %d] '%.*s' does not escape, %d fields\n", name.line, name.len,
+         name.start, fields_len);
+#endif
+
+  advance(parser);
+  advance(parser);
+  emit_variable_operation(parser, &parser->previous, false);
+  advance(parser);
+  advance(parser);
+  consume_token(parser, TokenSemiColon,
+                "Expect ';' after variable declaration.");
+
+  emit_word(parser, OpNewScalar, fields_len);
+  for (uint8_t i = 0; i < fields_len; i += 1) {
+    emit_idx(parser, emit_name(parser, &fields[i]));
+  }
+  uint32_t call_jmp = current_chunk(parser)->len;
+  emit_word(parser, 0xff, 0xff);
+  emit_word(parser, OpCall, 0);
+  for (uint8_t i = 0; i < fields_len; i += 1) {
+    emit_byte(parser, OpNull);
+  }
+  patch_jmp(parser, call_jmp);
+
+  uint32_t slot = compiler->locals_len - 1;
+  init_variable(parser);
+  for (uint8_t i = 0; i < fields_len; i += 1) {
+    add_local(parser, &fields[i]);
+    compiler->locals[compiler->locals_len - 1].is_field = true;
+    init_variable(parser);
+  }
+  compiler->locals[slot].fields_len = fields_len;
+  return true;
 }
 
-static void var_declaration() {
-  uint32_t variable = parse_variable("Expect variable name.");
+static void var_declaration(Parser *parser) {
+  uint32_t variable = parse_variable(parser, "Expect variable name.");
 
-  if (match_token(TokenEqual)) {
-    expression();
+  if (parser->compiler->scope_depth > 0 && check_token(parser, TokenEqual) &&
+      scalar_declaration(parser)) {
+    return;
+  }
+
+  if (match_token(parser, TokenEqual)) {
+    expression(parser);
   } else {
-    emit_byte(OpNull);
+    emit_byte(parser, OpNull);
   }
 
-  consume_token(TokenSemiColon, "Expect ';' after variable declaration.");
+  consume_token(parser, TokenSemiColon,
+                "Expect ';' after variable declaration.");
 
-  define_variable(variable);
+  define_variable(parser, variable);
 }
 
-static void declaration() {
-  if (match_token(TokenClass)) {
-    class_declaration();
-  } else if (match_token(TokenFn)) {
-    fn_declaration();
-  } else if (match_token(TokenLet)) {
-    var_declaration();
+static void declaration(Parser *parser) {
+  if (match_token(parser, TokenClass)) {
+    class_declaration(parser);
+  } else if (match_token(parser, TokenFn)) {
+    fn_declaration(parser);
+  } else if (match_token(parser, TokenLet)) {
+    var_declaration(parser);
   } else {
-    statement();
+    statement(parser);
   }
 
-  if (parser.panic_mode) {
-    synchronize();
+  if (parser->panic_mode) {
+    synchronize(parser);
   }
 }
 
-ObjFunction *compile(const char *source) {
-  init_scanner(source);
-  Compiler compiler;
-  init_compiler(&compiler, TypeScript);
-
+ObjFunction *compile(VirtualMachine *vm, const char *source) {
+  Parser parser;
+  parser.vm = vm;
+  parser.compiler = NULL;
   parser.had_error = false;
   parser.panic_mode = false;
+  init_scanner(&parser.scanner, source);
+
+  vm->parser = &parser;
+  Compiler compiler;
+  init_compiler(&parser, &compiler, TypeScript);
 
-  advance();
-  while (!match_token(TokenEof)) {
-    declaration();
+  advance(&parser);
+  while (!match_token(&parser, TokenEof)) {
+    declaration(&parser);
   }
+  ObjFunction *function = end_compiler(&parser);
+  vm->parser = NULL;
+
   if (parser.had_error) {
     return NULL;
   }
-  ObjFunction *function = end_compiler();
-
   return function;
 }
 
-void mark_compiler_roots() {
-  Compiler *compiler = current_compiler;
+void mark_compiler_roots(VirtualMachine *vm) {
+  if (vm->parser == NULL) {
+    return;
+  }
+  Compiler *compiler = vm->parser->compiler;
   while (compiler != NULL) {
-    mark_object((Obj *)compiler->function);
+    mark_object(vm, (Obj *)compiler->function);
     compiler = compiler->enclosing;
   }
 }
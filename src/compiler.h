@@ -4,7 +4,7 @@
 #include "common.h"
 #include "object.h"
 
-ObjFunction *compile(const char *source);
-void mark_compiler_roots();
+ObjFunction *compile(VirtualMachine *vm, const char *source);
+void mark_compiler_roots(VirtualMachine *vm);
 
 #endif // !breeze_compiler_h
@@ -0,0 +1,566 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "csv.h"
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "simd.h"
+#include "virtual_machine.h"
+
+// Bytes read from a file at a time. The buffer only grows past this to
+// hold a record longer than it.
+#define CSV_CHUNK_LEN (1 << 20)
+// Numbers with more significant digits than this are read by strtod.
+#define CSV_FAST_DIGITS_MAX 19
+// Longer fields are never numbers.
+#define CSV_NUMBER_LEN_MAX 64
+// Text columns tend to repeat a few values, so each keeps the strings it
+// added last, in slots picked by their length and outer bytes, and reuses
+// them without hashing the field again.
+#define CSV_RECENT_LEN 16
+
+/*** READING ***/
+
+typedef struct {
+  const char *chars;
+  uint32_t len;
+} CsvField;
+
+typedef enum {
+  CsvRecord,
+  CsvEnd,
+  CsvError,
+} CsvStatus;
+
+typedef struct {
+  VirtualMachine *vm;
+  const ByteKernels *kernels;
+  FILE *file;
+  const char *path;
+  uint8_t delimiter;
+  bool eof;
+  // Text read but not yet split, from the start of a record, followed by
+  // a block of padding.
+  char *chars;
+  uint32_t len;
+  uint32_t capacity;
+  // Start of the next field in `chars`.
+  uint32_t start;
+  // Delimiters and newlines outside quotes, up to the last newline, or
+  // to the end of the file once it is read.
+  uint32_t *separators;
+  uint32_t separators_len;
+  uint32_t next;
+  // Fields of the current record, decoded in place in `chars`.
+  CsvField *fields;
+  uint32_t fields_len;
+  uint32_t fields_capacity;
+  // Records read so far, blank lines aside.
+  uint32_t records;
+} CsvReader;
+
+static void *allocate_buffer(void *buffer, size_t size) {
+  buffer = realloc(buffer, size);
+  if (buffer == NULL) {
+    fprintf(stderr, "Not enough memory to read CSV.");
+    exit(1);
+  }
+  return buffer;
+}
+
+static bool open_reader(VirtualMachine *vm, CsvReader *reader,
+                        const char *path, uint8_t delimiter) {
+  *reader = (CsvReader){
+      .vm = vm,
+      .kernels = byte_kernels(),
+      .file = fopen(path, "rb"),
+      .path = path,
+      .delimiter = delimiter,
+  };
+  if (reader->file == NULL) {
+    native_error(vm, "Could not open \"%s\".", path);
+    return false;
+  }
+  reader->capacity = CSV_CHUNK_LEN;
+  reader->chars = (char *)allocate_buffer(NULL, CSV_CHUNK_LEN + 64);
+  reader->separators = (uint32_t *)allocate_buffer(
+      NULL, sizeof(uint32_t) * (CSV_CHUNK_LEN + 64));
+  return true;
+}
+
+static void close_reader(CsvReader *reader) {
+  if (reader->file != NULL) {
+    fclose(reader->file);
+  }
+  free(reader->chars);
+  free(reader->separators);
+  free(reader->fields);
+}
+
+// Finds the separators in the buffer, 64 bytes at a time.
+static bool index_chunk(CsvReader *reader) {
+  uint32_t len = reader->len;
+  uint32_t padded = (len + 63) & ~(uint32_t)63;
+  memset(reader->chars + len, 0, padded - len);
+  uint64_t in_quotes = 0;
+  uint32_t found = 0;
+  uint32_t complete = 0;
+  for (uint32_t base = 0; base < padded; base += 64) {
+    CsvClasses classes;
+    reader->kernels->classify_csv((const uint8_t *)reader->chars + base,
+                                  reader->delimiter, &classes);
+    uint64_t quoted = prefix_xor(classes.quotes) ^ in_quotes;
+    in_quotes = (uint64_t)((int64_t)quoted >> 63);
+    uint64_t separators = (classes.delimiters | classes.newlines) & ~quoted;
+    while (separators != 0) {
+      uint32_t pos = base + (uint32_t)__builtin_ctzll(separators);
+      reader->separators[found] = pos;
+      found += 1;
+      complete = reader->chars[pos] == '\n' ? found : complete;
+      separators &= separators - 1;
+    }
+  }
+  reader->separators_len = reader->eof ? found : complete;
+  reader->next = 0;
+  if (reader->eof && in_quotes != 0) {
+    native_error(reader->vm, "\"%s\" has an unterminated quoted field.",
+                 reader->path);
+    return false;
+  }
+  return true;
+}
+
+// Moves the partial record left to the front of the buffer, fills the
+// rest from the file and indexes it.
+static bool read_chunk(CsvReader *reader) {
+  uint32_t kept = reader->len - reader->start;
+  memmove(reader->chars, reader->chars + reader->start, kept);
+  reader->len = kept;
+  reader->start = 0;
+  if (kept == reader->capacity) {
+    if (reader->capacity > UINT32_MAX / 4) {
+      native_error(reader->vm, "\"%s\" has a record too long to read.",
+                   reader->path);
+      return false;
+    }
+    reader->capacity *= 2;
+    reader->chars =
+        (char *)allocate_buffer(reader->chars, (size_t)reader->capacity + 64);
+    reader->separators = (uint32_t *)allocate_buffer(
+        reader->separators,
+        sizeof(uint32_t) * ((size_t)reader->capacity + 64));
+  }
+  uint32_t wanted = reader->capacity - kept;
+  size_t read = fread(reader->chars + kept, 1, wanted, reader->file);
+  reader->len += (uint32_t)read;
+  if (read < wanted) {
+    if (ferror(reader->file)) {
+      native_error(reader->vm, "Could not read \"%s\".", reader->path);
+      return false;
+    }
+    reader->eof = true;
+  }
+  return index_chunk(reader);
+}
+
+// Adds the field spanning `chars[start..end)`, unquoting it in place.
+// Returns true if it ends a line holding nothing else.
+static bool add_field(CsvReader *reader, uint32_t start, uint32_t end,
+                      bool ends_record) {
+  char *chars = reader->chars + start;
+  uint32_t len = end - start;
+  if (ends_record && len > 0 && chars[len - 1] == '\r') {
+    len -= 1;
+  }
+  bool blank = ends_record && len == 0 && reader->fields_len == 0;
+  if (len > 0 && chars[0] == '"') {
+    // Anything between the closing quote and the separator is dropped.
+    uint32_t out = 0;
+    for (uint32_t i = 1; i < len; i += 1) {
+      if (chars[i] == '"') {
+        if (i + 1 == len || chars[i + 1] != '"') {
+          break;
+        }
+        i += 1;
+      }
+      chars[out] = chars[i];
+      out += 1;
+    }
+    len = out;
+  }
+
+  if (reader->fields_len == reader->fields_capacity) {
+    reader->fields_capacity = GROW_CAPACITY(reader->fields_capacity);
+    reader->fields = (CsvField *)allocate_buffer(
+        reader->fields, sizeof(CsvField) * reader->fields_capacity);
+  }
+  reader->fields[reader->fields_len] = (CsvField){chars, len};
+  reader->fields_len += 1;
+  return blank;
+}
+
+// Splits off the next record into `reader->fields`, which stay valid until
+// the following call.
+static CsvStatus next_record(CsvReader *reader) {
+  reader->fields_len = 0;
+  while (true) {
+    while (reader->next < reader->separators_len) {
+      uint32_t separator = reader->separators[reader->next];
+      reader->next += 1;
+      bool ends_record = reader->chars[separator] == '\n';
+      bool blank = add_field(reader, reader->start, separator, ends_record);
+      reader->start = separator + 1;
+      if (!ends_record) {
+        continue;
+      }
+      if (!blank) {
+        reader->records += 1;
+        return CsvRecord;
+      }
+      reader->fields_len = 0;
+    }
+    if (reader->eof) {
+      if (reader->start == reader->len && reader->fields_len == 0) {
+        return CsvEnd;
+      }
+      bool blank = add_field(reader, reader->start, reader->len, true);
+      reader->start = reader->len;
+      if (blank) {
+        return CsvEnd;
+      }
+      reader->records += 1;
+      return CsvRecord;
+    }
+    if (!read_chunk(reader)) {
+      return CsvError;
+    }
+  }
+}
+
+/*** NATIVES ***/
+
+static bool read_delimiter(VirtualMachine *vm, const char *native,
+                           int32_t args_len, Value *args, int32_t idx,
+                           uint8_t *delimiter) {
+  *delimiter = ',';
+  if (idx == args_len) {
+    return true;
+  }
+  if (!IS_STRING(args[idx]) || AS_STRING(args[idx])->len != 1) {
+    native_error(vm, "%s expects a delimiter of one byte.", native);
+    return false;
+  }
+  *delimiter = (uint8_t)AS_CSTRING(args[idx])[0];
+  if (*delimiter == '"' || *delimiter == '\n' || *delimiter == '\r') {
+    native_error(vm, "%s cannot split fields on quotes or line breaks.",
+                 native);
+    return false;
+  }
+  return true;
+}
+
+Value csv_each_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len < 2 || args_len > 3 || !IS_STRING(args[0]) ||
+      !(IS_CLOSURE(args[1]) || IS_NATIVE(args[1]))) {
+    return native_error(vm, "csv_each expects a path, a function and an "
+                            "optional delimiter.");
+  }
+  uint8_t delimiter;
+  if (!read_delimiter(vm, "csv_each", args_len, args, 2, &delimiter)) {
+    return NULL_VAL;
+  }
+  // Calls can move the stack, and `args` with it.
+  Value function = args[1];
+  // The reader names the file in its errors: its path stays rooted.
+  ObjString *path = terminate_string(vm, args[0]);
+  push_stack(vm, OBJ_VAL(path));
+  CsvReader reader;
+  if (!open_reader(vm, &reader, path->chars, delimiter)) {
+    return NULL_VAL;
+  }
+
+  CsvStatus status;
+  while ((status = next_record(&reader)) == CsvRecord) {
+    ObjList *row = new_list(vm);
+    push_stack(vm, OBJ_VAL(row));
+    for (uint32_t i = 0; i < reader.fields_len; i += 1) {
+      Value field = OBJ_VAL(
+          copy_string(vm, reader.fields[i].chars, reader.fields[i].len));
+      push_stack(vm, field);
+      write_value_vec(vm, &row->items, field);
+      pop_stack(vm);
+    }
+    Value fields = pop_stack(vm);
+    Value result;
+    if (!call_function(vm, function, 1, &fields, &result)) {
+      status = CsvError;
+      break;
+    }
+    if (IS_BOOL(result) && !AS_BOOL(result)) {
+      break;
+    }
+  }
+  close_reader(&reader);
+  pop_stack(vm);
+  if (status == CsvError) {
+    return NULL_VAL;
+  }
+  return NUMBER_VAL(reader.records);
+}
+
+static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Reads a field as a decimal number, with an optional sign, fraction and
+// exponent, and nothing around it.
+static bool read_number(const char *chars, uint32_t len, double *number) {
+  if (len == 0 || len > CSV_NUMBER_LEN_MAX) {
+    return false;
+  }
+  uint32_t cur = 0;
+  bool negative = chars[cur] == '-';
+  cur += chars[cur] == '-' || chars[cur] == '+' ? 1 : 0;
+  uint64_t mantissa = 0;
+  uint32_t digits = 0;
+  uint32_t read = 0;
+  int32_t exponent = 0;
+  for (; cur < len && chars[cur] >= '0' && chars[cur] <= '9'; cur += 1) {
+    mantissa = mantissa * 10 + (uint64_t)(chars[cur] - '0');
+    digits += mantissa > 0 ? 1 : 0;
+    read += 1;
+  }
+  if (cur < len && chars[cur] == '.') {
+    for (cur += 1; cur < len && chars[cur] >= '0' && chars[cur] <= '9';
+         cur += 1) {
+      mantissa = mantissa * 10 + (uint64_t)(chars[cur] - '0');
+      digits += mantissa > 0 ? 1 : 0;
+      read += 1;
+      exponent -= 1;
+    }
+  }
+  if (read == 0) {
+    return false;
+  }
+  if (cur < len && (chars[cur] == 'e' || chars[cur] == 'E')) {
+    cur += 1;
+    bool exponent_negative = cur < len && chars[cur] == '-';
+    cur += cur < len && (chars[cur] == '-' || chars[cur] == '+') ? 1 : 0;
+    if (cur == len) {
+      return false;
+    }
+    int32_t written = 0;
+    for (; cur < len && chars[cur] >= '0' && chars[cur] <= '9'; cur += 1) {
+      written = written < 100000 ? written * 10 + (chars[cur] - '0') : written;
+    }
+    exponent += exponent_negative ? -written : written;
+  }
+  if (cur != len) {
+    return false;
+  }
+
+  if (digits <= CSV_FAST_DIGITS_MAX && mantissa <= (uint64_t)1 << 53 &&
+      exponent >= -22 && exponent <= 22) {
+    double value = (double)mantissa;
+    value = exponent < 0 ? value / powers_of_ten[-exponent]
+                         : value * powers_of_ten[exponent];
+    *number = negative ? -value : value;
+    return true;
+  }
+  char token[CSV_NUMBER_LEN_MAX + 1];
+  memcpy(token, chars, len);
+  token[len] = '\0';
+  *number = strtod(token, NULL);
+  return true;
+}
+
+typedef struct {
+  ObjString *name;
+  // Numbers read so far, on the VM's heap, until the column holds text.
+  double *numbers;
+  uint32_t numbers_len;
+  uint32_t numbers_capacity;
+  ObjList *texts;
+  // Every string here is in `texts` too, so none of them is collected.
+  ObjString *recent[CSV_RECENT_LEN];
+} CsvColumn;
+
+typedef struct {
+  VirtualMachine *vm;
+  CsvColumn *columns;
+  uint32_t columns_len;
+  // Holds the header and the lists of strings, where the GC sees them.
+  ObjList *roots;
+} CsvTable;
+
+static void add_root(CsvTable *table, Value value) {
+  push_stack(table->vm, value);
+  write_value_vec(table->vm, &table->roots->items, value);
+  pop_stack(table->vm);
+}
+
+static void add_text(VirtualMachine *vm, ObjList *texts, const char *chars,
+                     uint32_t len) {
+  Value text = OBJ_VAL(copy_string(vm, chars, len));
+  push_stack(vm, text);
+  write_value_vec(vm, &texts->items, text);
+  pop_stack(vm);
+}
+
+// Turns a column of numbers into one of strings.
+static void hold_text(CsvTable *table, CsvColumn *column) {
+  VirtualMachine *vm = table->vm;
+  column->texts = new_list(vm);
+  add_root(table, OBJ_VAL(column->texts));
+  for (uint32_t i = 0; i < column->numbers_len; i += 1) {
+    double number = column->numbers[i];
+    char digits[32];
+    uint32_t len = 0;
+    for (int32_t precision = 1; !isnan(number) && precision <= 17;
+         precision += 1) {
+      len = (uint32_t)snprintf(digits, sizeof(digits), "%.*g", precision,
+                               number);
+      if (strtod(digits, NULL) == number) {
+        break;
+      }
+    }
+    add_text(vm, column->texts, digits, len);
+  }
+  FREE_ARRAY(vm, double, column->numbers, column->numbers_capacity);
+  column->numbers = NULL;
+  column->numbers_len = 0;
+  column->numbers_capacity = 0;
+}
+
+static void add_field_to_column(CsvTable *table, CsvColumn *column,
+                                const CsvField *field) {
+  VirtualMachine *vm = table->vm;
+  double number = NAN;
+  if (column->texts == NULL &&
+      (field->len == 0 || read_number(field->chars, field->len, &number))) {
+    if (column->numbers_len == column->numbers_capacity) {
+      uint32_t capacity = GROW_CAPACITY(column->numbers_capacity);
+      column->numbers = GROW_ARRAY(vm, double, column->numbers,
+                                   column->numbers_capacity, capacity);
+      column->numbers_capacity = capacity;
+    }
+    column->numbers[column->numbers_len] = number;
+    column->numbers_len += 1;
+    return;
+  }
+  if (column->texts == NULL) {
+    hold_text(table, column);
+  }
+  uint32_t slot = 0;
+  if (field->len > 0) {
+    slot = (field->len * 7 + (uint8_t)field->chars[0] * 31 +
+            (uint8_t)field->chars[field->len - 1]) &
+           (CSV_RECENT_LEN - 1);
+  }
+  ObjString *text = column->recent[slot];
+  if (text == NULL || text->len != field->len ||
+      memcmp(text->chars, field->chars, field->len) != 0) {
+    text = copy_string(vm, field->chars, field->len);
+    column->recent[slot] = text;
+  }
+  push_stack(vm, OBJ_VAL(text));
+  write_value_vec(vm, &column->texts->items, OBJ_VAL(text));
+  pop_stack(vm);
+}
+
+static void free_columns(CsvTable *table) {
+  for (uint32_t i = 0; i < table->columns_len; i += 1) {
+    CsvColumn *column = &table->columns[i];
+    FREE_ARRAY(table->vm, double, column->numbers, column->numbers_capacity);
+  }
+  free(table->columns);
+}
+
+// Builds the map of columns, handing the numbers over to float64 arrays.
+static Value finish_columns(CsvTable *table) {
+  VirtualMachine *vm = table->vm;
+  ObjMap *map = new_map(vm);
+  push_stack(vm, OBJ_VAL(map));
+  map_reserve(vm, map, table->columns_len);
+  for (uint32_t i = 0; i < table->columns_len; i += 1) {
+    CsvColumn *column = &table->columns[i];
+    if (column->texts != NULL) {
+      map_set(vm, map, OBJ_VAL(column->name), OBJ_VAL(column->texts));
+      continue;
+    }
+    ObjFloat64Array *array = new_float64_array(vm, 0);
+    push_stack(vm, OBJ_VAL(array));
+    array->values = GROW_ARRAY(vm, double, column->numbers,
+                               column->numbers_capacity, column->numbers_len);
+    array->len = column->numbers_len;
+    column->numbers = NULL;
+    column->numbers_capacity = 0;
+    map_set(vm, map, OBJ_VAL(column->name), OBJ_VAL(array));
+    pop_stack(vm);
+  }
+  return pop_stack(vm);
+}
+
+Value csv_columns_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len < 1 || args_len > 2 || !IS_STRING(args[0])) {
+    return native_error(vm, "csv_columns expects a path and an optional "
+                            "delimiter.");
+  }
+  uint8_t delimiter;
+  if (!read_delimiter(vm, "csv_columns", args_len, args, 1, &delimiter)) {
+    return NULL_VAL;
+  }
+  // The reader names the file in its errors: its path stays rooted.
+  ObjString *path = terminate_string(vm, args[0]);
+  push_stack(vm, OBJ_VAL(path));
+  CsvReader reader;
+  if (!open_reader(vm, &reader, path->chars, delimiter)) {
+    return NULL_VAL;
+  }
+
+  CsvTable table = {.vm = vm, .roots = new_list(vm)};
+  push_stack(vm, OBJ_VAL(table.roots));
+  CsvStatus status = next_record(&reader);
+  if (status == CsvRecord) {
+    table.columns_len = reader.fields_len;
+    table.columns =
+        (CsvColumn *)allocate_buffer(NULL, sizeof(CsvColumn) *
+                                               table.columns_len);
+    memset(table.columns, 0, sizeof(CsvColumn) * table.columns_len);
+    for (uint32_t i = 0; i < table.columns_len; i += 1) {
+      table.columns[i].name =
+          copy_string(vm, reader.fields[i].chars, reader.fields[i].len);
+      add_root(&table, OBJ_VAL(table.columns[i].name));
+    }
+    while ((status = next_record(&reader)) == CsvRecord) {
+      if (reader.fields_len != table.columns_len) {
+        native_error(vm, "Record %u of \"%s\" has %u fields, but the header "
+                         "has %u.",
+                     reader.records, reader.path, reader.fields_len,
+                     table.columns_len);
+        status = CsvError;
+        break;
+      }
+      for (uint32_t i = 0; i < table.columns_len; i += 1) {
+        add_field_to_column(&table, &table.columns[i], &reader.fields[i]);
+      }
+    }
+  }
+  close_reader(&reader);
+
+  Value result = NULL_VAL;
+  if (status != CsvError) {
+    result = finish_columns(&table);
+    pop_stack(vm);
+    pop_stack(vm);
+  }
+  free_columns(&table);
+  return result;
+}
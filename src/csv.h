@@ -0,0 +1,41 @@
+#ifndef breeze_csv_h
+#define breeze_csv_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/***
+  CSV files are read in chunks of a megabyte, whatever their size, so
+  reading one takes as much memory as its longest record needs, plus what
+  the script keeps. Each chunk is split with the SIMD byte kernels: quotes,
+  delimiters and newlines are classified 64 bytes at a time, a prefix XOR
+  over the quotes tells which bytes lie inside quoted fields, and the
+  delimiters and newlines left outside them are the field boundaries. A
+  record whose end is not in the chunk yet is carried over to the next.
+
+  Quoted fields may hold delimiters, newlines and doubled quotes, and a
+  carriage return ending a record is dropped. Blank lines are skipped.
+
+  `csv_each` hands records to a function one at a time, as lists of
+  strings. `csv_columns` reads the first record as a header and fills one
+  column per field: a float64 array while every field in it is a number or
+  empty, read as NaN, and a list of strings once one is not. The numbers
+  read before then are written back as the shortest strings that read the
+  same, and empty fields as empty strings.
+  ***/
+
+/* csv_each(path, fn, delimiter?): Calls `fn(fields)` with each record of a
+ * CSV file, stopping early if it returns false
+ * @return: The number of records read
+ */
+Value csv_each_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* csv_columns(path, delimiter?): Reads a CSV file with a header into
+ * columns
+ * @return: A map from each header field to its column
+ */
+Value csv_columns_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+#endif // !breeze_csv_h
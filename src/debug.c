@@ -49,7 +49,7 @@ static uint32_t constant_inst(const char *name, const Chunk *chunk,
   }
   offset = read_idx(chunk, offset, constant_idx);
   printf("%-16s %4d '", name, *constant_idx);
-  print_value(chunk->constants.values[*constant_idx]);
+  print_value(stdout, chunk->constants.values[*constant_idx]);
   printf("'\n");
   return offset;
 }
@@ -63,13 +63,14 @@ static uint32_t special_inst(const char *name, const Chunk *chunk,
   }
   offset = read_idx(chunk, offset, constant_idx);
   printf("%-16s %4d '", name, *constant_idx);
-  print_value(chunk->constants.values[*constant_idx]);
+  print_value(stdout, chunk->constants.values[*constant_idx]);
   printf("'\n");
   return offset;
 }
 
 static uint32_t jmp_inst(const char *name, int8_t sign, const Chunk *chunk,
                          uint32_t offset) {
+  (void)sign;
   uint16_t jmp = (uint16_t)chunk->code[offset + 1];
   jmp |= chunk->code[offset + 2] << 8;
   offset += 3;
@@ -77,6 +78,34 @@ static uint32_t jmp_inst(const char *name, int8_t sign, const Chunk *chunk,
   return offset;
 }
 
+static uint32_t new_scalar_inst(const Chunk *chunk, uint32_t offset) {
+  uint8_t fields_len = chunk->code[offset + 1];
+  printf("%-16s %4d '", "OpNewScalar", fields_len);
+  offset += 2;
+  for (uint8_t i = 0; i < fields_len; i += 1) {
+    uint32_t name_idx;
+    offset = read_idx(chunk, offset, &name_idx);
+    printf(i == 0 ? "" : ", ");
+    print_value(stdout, chunk->constants.values[name_idx]);
+  }
+  uint16_t jmp = (uint16_t)chunk->code[offset];
+  jmp |= chunk->code[offset + 1] << 8;
+  printf("' -> %d\n", jmp);
+  return offset + 2;
+}
+
+static uint32_t scalar_inst(const char *name, const Chunk *chunk,
+                            uint32_t offset) {
+  uint32_t slot, name_idx;
+  offset = read_idx(chunk, offset + 1, &slot);
+  uint8_t field = chunk->code[offset];
+  offset = read_idx(chunk, offset + 1, &name_idx);
+  printf("%-16s %4d %d '", name, slot, field);
+  print_value(stdout, chunk->constants.values[name_idx]);
+  printf("'\n");
+  return offset;
+}
+
 uint32_t disassemble_inst(const Chunk *chunk, uint32_t offset) {
   printf("%04d ", offset);
   uint32_t curr_line = get_line(&chunk->lines, offset);
@@ -91,6 +120,18 @@ uint32_t disassemble_inst(const Chunk *chunk, uint32_t offset) {
   switch (inst) {
   case OpRet:
     return simple_inst("OpRet", offset);
+  case OpYield:
+    return simple_inst("OpYield", offset);
+  case OpList: {
+    uint16_t len = (uint16_t)chunk->code[offset + 1];
+    len |= chunk->code[offset + 2] << 8;
+    printf("%-16s %4d\n", "OpList", len);
+    return offset + 3;
+  }
+  case OpIndexGet:
+    return simple_inst("OpIndexGet", offset);
+  case OpIndexSet:
+    return simple_inst("OpIndexSet", offset);
   case OpClass:
     return special_inst("OpClass", chunk, offset, NULL);
   case OpMethod:
@@ -111,6 +152,8 @@ uint32_t disassemble_inst(const Chunk *chunk, uint32_t offset) {
     return simple_inst("OpCloseUpvalue", offset);
   case OpCall:
     return byte_inst("OpCall", chunk, offset);
+  case OpTailCall:
+    return byte_inst("OpTailCall", chunk, offset);
   case OpJmp:
     return jmp_inst("OpJmp", 1, chunk, offset);
   case OpJmpIfFalse:
@@ -149,6 +192,12 @@ uint32_t disassemble_inst(const Chunk *chunk, uint32_t offset) {
     return special_inst("OpGetProperty", chunk, offset, NULL);
   case OpSetProperty:
     return special_inst("OpSetProperty", chunk, offset, NULL);
+  case OpNewScalar:
+    return new_scalar_inst(chunk, offset);
+  case OpGetScalar:
+    return scalar_inst("OpGetScalar", chunk, offset);
+  case OpSetScalar:
+    return scalar_inst("OpSetScalar", chunk, offset);
   case OpEq:
     return simple_inst("OpEq", offset);
   case OpGt:
@@ -0,0 +1,690 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+
+#include "memory.h"
+#include "object.h"
+#include "virtual_machine.h"
+
+#define IO_THREADS_MAX 4
+#define EVENTS_MAX 64
+#define READ_CHUNK 4096
+
+typedef enum {
+  IoSleep,
+  IoRead,
+} IoKind;
+
+typedef enum {
+  // Queued on or running in the thread pool.
+  IoPooled,
+  // Registered with epoll.
+  IoPolled,
+  // In the timer heap.
+  IoTimed,
+  // Completed; its result has not been taken yet.
+  IoDone,
+} IoState;
+
+typedef struct IoOp {
+  IoKind kind;
+  IoState state;
+  // The task parked on the operation, NULL while a native blocks on it.
+  ObjCoroutine *waiter;
+  // Set under the pool lock: taken by a worker, and dropped while it was.
+  bool running;
+  bool cancelled;
+  bool failed;
+  int fd;
+  char *path;
+  char *data;
+  size_t len;
+  size_t capacity;
+  int64_t deadline;
+  // Link in the job queue or the completed list.
+  struct IoOp *next;
+  // Links in the loop's list of live operations.
+  struct IoOp *live_prev;
+  struct IoOp *live_next;
+} IoOp;
+
+typedef struct {
+  ObjCoroutine *coroutine;
+  // The completed operation the task resumes with, NULL after a `yield`.
+  IoOp *op;
+} Ready;
+
+struct EventLoop {
+  int epoll_fd;
+  // Written by the workers when they complete a job.
+  int wake_fd;
+
+  Ready *ready;
+  uint32_t ready_head;
+  uint32_t ready_len;
+  uint32_t ready_capacity;
+
+  // Min-heap on deadline.
+  IoOp **timers;
+  uint32_t timers_len;
+  uint32_t timers_capacity;
+
+  // Every operation not yet freed, except the cancelled ones still running.
+  IoOp *live;
+  // Operations started but not completed.
+  uint32_t in_progress;
+  // The task being run, NULL outside of `run_task`.
+  ObjCoroutine *task;
+
+  pthread_mutex_t lock;
+  pthread_cond_t job_ready;
+  IoOp *jobs_head;
+  IoOp *jobs_tail;
+  IoOp *completed;
+  uint32_t pending;
+  uint32_t idle;
+  bool stopping;
+  uint32_t threads_len;
+  pthread_t threads[IO_THREADS_MAX];
+};
+
+static void out_of_memory() {
+  fprintf(stderr, "Not enough memory for the event loop.");
+  exit(1);
+}
+
+static int64_t now_ns() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static EventLoop *get_loop(VirtualMachine *vm) {
+  if (vm->loop != NULL) {
+    return vm->loop;
+  }
+  EventLoop *loop = (EventLoop *)calloc(1, sizeof(EventLoop));
+  if (loop == NULL) {
+    out_of_memory();
+  }
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (loop->epoll_fd < 0 || loop->wake_fd < 0 ||
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) != 0) {
+    fprintf(stderr, "Could not start the event loop.");
+    exit(1);
+  }
+  pthread_mutex_init(&loop->lock, NULL);
+  pthread_cond_init(&loop->job_ready, NULL);
+  vm->loop = loop;
+  return loop;
+}
+
+static IoOp *new_op(EventLoop *loop, IoKind kind) {
+  IoOp *op = (IoOp *)calloc(1, sizeof(IoOp));
+  if (op == NULL) {
+    out_of_memory();
+  }
+  op->kind = kind;
+  op->fd = -1;
+  op->live_next = loop->live;
+  if (loop->live != NULL) {
+    loop->live->live_prev = op;
+  }
+  loop->live = op;
+  loop->in_progress += 1;
+  return op;
+}
+
+static void unlink_op(EventLoop *loop, IoOp *op) {
+  if (op->live_prev != NULL) {
+    op->live_prev->live_next = op->live_next;
+  } else {
+    loop->live = op->live_next;
+  }
+  if (op->live_next != NULL) {
+    op->live_next->live_prev = op->live_prev;
+  }
+}
+
+static void destroy_op(IoOp *op) {
+  // Closing the descriptor also removes it from the epoll set.
+  if (op->fd >= 0) {
+    close(op->fd);
+  }
+  free(op->path);
+  free(op->data);
+  free(op);
+}
+
+static void push_ready(EventLoop *loop, ObjCoroutine *coroutine, IoOp *op) {
+  if (loop->ready_len == loop->ready_capacity && loop->ready_head > 0) {
+    memmove(loop->ready, loop->ready + loop->ready_head,
+            sizeof(Ready) * (loop->ready_len - loop->ready_head));
+    loop->ready_len -= loop->ready_head;
+    loop->ready_head = 0;
+  }
+  if (loop->ready_len == loop->ready_capacity) {
+    loop->ready_capacity = GROW_CAPACITY(loop->ready_capacity);
+    loop->ready =
+        (Ready *)realloc(loop->ready, sizeof(Ready) * loop->ready_capacity);
+    if (loop->ready == NULL) {
+      out_of_memory();
+    }
+  }
+  loop->ready[loop->ready_len] = (Ready){coroutine, op};
+  loop->ready_len += 1;
+}
+
+static void complete(EventLoop *loop, IoOp *op) {
+  if (op->fd >= 0) {
+    close(op->fd);
+    op->fd = -1;
+  }
+  op->state = IoDone;
+  loop->in_progress -= 1;
+  if (op->waiter != NULL) {
+    push_ready(loop, op->waiter, op);
+  }
+}
+
+static void push_timer(EventLoop *loop, IoOp *op) {
+  if (loop->timers_len == loop->timers_capacity) {
+    loop->timers_capacity = GROW_CAPACITY(loop->timers_capacity);
+    loop->timers = (IoOp **)realloc(loop->timers,
+                                    sizeof(IoOp *) * loop->timers_capacity);
+    if (loop->timers == NULL) {
+      out_of_memory();
+    }
+  }
+  uint32_t idx = loop->timers_len;
+  loop->timers_len += 1;
+  while (idx > 0) {
+    uint32_t parent = (idx - 1) / 2;
+    if (loop->timers[parent]->deadline <= op->deadline) {
+      break;
+    }
+    loop->timers[idx] = loop->timers[parent];
+    idx = parent;
+  }
+  loop->timers[idx] = op;
+}
+
+static IoOp *pop_timer(EventLoop *loop) {
+  IoOp *top = loop->timers[0];
+  loop->timers_len -= 1;
+  IoOp *last = loop->timers[loop->timers_len];
+  uint32_t idx = 0;
+  while (true) {
+    uint32_t child = 2 * idx + 1;
+    if (child >= loop->timers_len) {
+      break;
+    }
+    if (child + 1 < loop->timers_len &&
+        loop->timers[child + 1]->deadline < loop->timers[child]->deadline) {
+      child += 1;
+    }
+    if (last->deadline <= loop->timers[child]->deadline) {
+      break;
+    }
+    loop->timers[idx] = loop->timers[child];
+    idx = child;
+  }
+  if (loop->timers_len > 0) {
+    loop->timers[idx] = last;
+  }
+  return top;
+}
+
+typedef enum {
+  ReadEof,
+  ReadAgain,
+  ReadError,
+} ReadStatus;
+
+// Appends everything readable from `fd` to the operation's buffer.
+static ReadStatus read_available(IoOp *op, int fd) {
+  while (true) {
+    if (op->len == op->capacity) {
+      op->capacity = op->capacity < READ_CHUNK ? READ_CHUNK : op->capacity * 2;
+      op->data = (char *)realloc(op->data, op->capacity);
+      if (op->data == NULL) {
+        out_of_memory();
+      }
+    }
+    ssize_t got = read(fd, op->data + op->len, op->capacity - op->len);
+    if (got > 0) {
+      op->len += (size_t)got;
+    } else if (got == 0) {
+      return ReadEof;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return ReadAgain;
+    } else if (errno != EINTR) {
+      return ReadError;
+    }
+  }
+}
+
+// Runs on a worker. Sizing the buffer from `fstat` takes most files in a
+// single read, plus the one that sees the end.
+static void read_regular_file(IoOp *op) {
+  int fd = open(op->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    op->failed = true;
+    return;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    op->capacity = (size_t)info.st_size + 1;
+    op->data = (char *)malloc(op->capacity);
+    if (op->data == NULL) {
+      out_of_memory();
+    }
+  }
+  op->failed = read_available(op, fd) != ReadEof;
+  close(fd);
+}
+
+static void *io_worker(void *arg) {
+  EventLoop *loop = (EventLoop *)arg;
+  pthread_mutex_lock(&loop->lock);
+  while (true) {
+    loop->idle += 1;
+    while (loop->jobs_head == NULL && !loop->stopping) {
+      pthread_cond_wait(&loop->job_ready, &loop->lock);
+    }
+    loop->idle -= 1;
+    IoOp *op = loop->jobs_head;
+    if (op == NULL) {
+      break;
+    }
+    loop->jobs_head = op->next;
+    if (loop->jobs_head == NULL) {
+      loop->jobs_tail = NULL;
+    }
+    loop->pending -= 1;
+    op->running = true;
+    pthread_mutex_unlock(&loop->lock);
+
+    read_regular_file(op);
+
+    pthread_mutex_lock(&loop->lock);
+    op->next = loop->completed;
+    loop->completed = op;
+    eventfd_write(loop->wake_fd, 1);
+  }
+  pthread_mutex_unlock(&loop->lock);
+  return NULL;
+}
+
+static void submit_job(EventLoop *loop, IoOp *op) {
+  op->state = IoPooled;
+  op->next = NULL;
+  pthread_mutex_lock(&loop->lock);
+  if (loop->jobs_tail == NULL) {
+    loop->jobs_head = op;
+  } else {
+    loop->jobs_tail->next = op;
+  }
+  loop->jobs_tail = op;
+  loop->pending += 1;
+  if (loop->pending > loop->idle && loop->threads_len < IO_THREADS_MAX) {
+    if (pthread_create(&loop->threads[loop->threads_len], NULL, io_worker,
+                       loop) != 0) {
+      fprintf(stderr, "Could not start an I/O thread.");
+      exit(1);
+    }
+    loop->threads_len += 1;
+  }
+  pthread_cond_signal(&loop->job_ready);
+  pthread_mutex_unlock(&loop->lock);
+}
+
+static void drain_completed(EventLoop *loop) {
+  pthread_mutex_lock(&loop->lock);
+  IoOp *op = loop->completed;
+  loop->completed = NULL;
+  pthread_mutex_unlock(&loop->lock);
+
+  while (op != NULL) {
+    IoOp *next = op->next;
+    if (op->cancelled) {
+      destroy_op(op);
+    } else {
+      complete(loop, op);
+    }
+    op = next;
+  }
+}
+
+static int connect_unix(const char *path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  // Nothing is sent: the peer sees the end of the request right away.
+  shutdown(fd, SHUT_WR);
+  return fd;
+}
+
+// Pipes, sockets and devices are watched by epoll; regular files, which are
+// always "ready" yet may block on disk, go to the thread pool.
+static void start_read(EventLoop *loop, IoOp *op, const char *path) {
+  struct stat info;
+  if (stat(path, &info) != 0) {
+    op->failed = true;
+    complete(loop, op);
+    return;
+  }
+  if (!S_ISREG(info.st_mode)) {
+    int fd = S_ISSOCK(info.st_mode)
+                 ? connect_unix(path)
+                 : open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      op->failed = true;
+      complete(loop, op);
+      return;
+    }
+    op->fd = fd;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = op};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0) {
+      op->state = IoPolled;
+      return;
+    }
+    // Not pollable, like a directory: let a worker report the failure.
+    close(fd);
+    op->fd = -1;
+  }
+  op->path = strdup(path);
+  if (op->path == NULL) {
+    out_of_memory();
+  }
+  submit_job(loop, op);
+}
+
+static int poll_timeout(const EventLoop *loop) {
+  if (loop->ready_head < loop->ready_len) {
+    return 0;
+  }
+  if (loop->timers_len == 0) {
+    return -1;
+  }
+  int64_t wait = loop->timers[0]->deadline - now_ns();
+  if (wait <= 0) {
+    return 0;
+  }
+  int64_t wait_ms = (wait + 999999) / 1000000;
+  return wait_ms > INT_MAX ? INT_MAX : (int)wait_ms;
+}
+
+static void poll_events(EventLoop *loop) {
+  struct epoll_event events[EVENTS_MAX];
+  int events_len =
+      epoll_wait(loop->epoll_fd, events, EVENTS_MAX, poll_timeout(loop));
+  for (int i = 0; i < events_len; i += 1) {
+    IoOp *op = (IoOp *)events[i].data.ptr;
+    if (op == NULL) {
+      eventfd_t count;
+      eventfd_read(loop->wake_fd, &count);
+      drain_completed(loop);
+      continue;
+    }
+    ReadStatus status = read_available(op, op->fd);
+    if (status != ReadAgain) {
+      op->failed = status == ReadError;
+      complete(loop, op);
+    }
+  }
+
+  int64_t now = now_ns();
+  while (loop->timers_len > 0 && loop->timers[0]->deadline <= now) {
+    complete(loop, pop_timer(loop));
+  }
+}
+
+static Value take_result(VirtualMachine *vm, EventLoop *loop, IoOp *op) {
+  Value result = NULL_VAL;
+  if (op->kind == IoRead && !op->failed && op->len < UINT32_MAX) {
+    result = OBJ_VAL(copy_string(vm, op->data, (uint32_t)op->len));
+  }
+  unlink_op(loop, op);
+  destroy_op(op);
+  return result;
+}
+
+// Resumes a task until it finishes, yields or parks on an operation.
+static bool run_task(VirtualMachine *vm, EventLoop *loop, Ready ready) {
+  ObjCoroutine *coroutine = ready.coroutine;
+  if (coroutine->state == CoroutineRunning) {
+    // Resumed by a plain call that has not returned yet; try again later.
+    push_ready(loop, coroutine, ready.op);
+    return true;
+  }
+  if (coroutine->state == CoroutineDone) {
+    coroutine->scheduled = false;
+    if (ready.op != NULL) {
+      unlink_op(loop, ready.op);
+      destroy_op(ready.op);
+    }
+    return true;
+  }
+
+  push_stack(vm, OBJ_VAL(coroutine));
+  push_stack(vm, ready.op == NULL ? NULL_VAL : take_result(vm, loop, ready.op));
+  coroutine->state = CoroutineSuspended;
+  ObjCoroutine *outer = loop->task;
+  loop->task = coroutine;
+  InterpretResult result = invoke(vm, 1);
+  loop->task = outer;
+  if (result != InterpretOk) {
+    return false;
+  }
+  pop_stack(vm);
+
+  if (coroutine->state == CoroutineSuspended) {
+    push_ready(loop, coroutine, NULL);
+  } else if (coroutine->state == CoroutineDone) {
+    coroutine->scheduled = false;
+  }
+  return true;
+}
+
+// Runs the tasks ready so far, then waits for I/O or a timer unless a task
+// is still ready. Tasks woken meanwhile run on the next step.
+static bool step(VirtualMachine *vm, EventLoop *loop) {
+  uint32_t ready = loop->ready_len - loop->ready_head;
+  while (ready > 0 && loop->ready_head < loop->ready_len) {
+    Ready next = loop->ready[loop->ready_head];
+    loop->ready_head += 1;
+    ready -= 1;
+    if (!run_task(vm, loop, next)) {
+      return false;
+    }
+  }
+  if (loop->ready_head == loop->ready_len) {
+    loop->ready_head = 0;
+    loop->ready_len = 0;
+  }
+  if (loop->in_progress > 0 || loop->ready_len > 0) {
+    poll_events(loop);
+  }
+  return true;
+}
+
+static bool is_idle(const EventLoop *loop) {
+  return loop->in_progress == 0 && loop->ready_head == loop->ready_len;
+}
+
+// A task failed: the error is reported and the stacks are unwound, so the
+// operations its siblings wait on are dropped and the failure propagates
+// without a second message.
+static Value abandon(VirtualMachine *vm, EventLoop *loop) {
+  cancel_operations(loop);
+  vm->native_failed = true;
+  return NULL_VAL;
+}
+
+static Value await_operation(VirtualMachine *vm, EventLoop *loop, IoOp *op) {
+  if (op->state != IoDone && vm->coroutine != NULL &&
+      vm->coroutine == loop->task) {
+    op->waiter = vm->coroutine;
+    vm->native_suspended = true;
+    return NULL_VAL;
+  }
+  while (op->state != IoDone) {
+    if (!step(vm, loop)) {
+      return abandon(vm, loop);
+    }
+  }
+  return take_result(vm, loop, op);
+}
+
+void cancel_operations(EventLoop *loop) {
+  if (loop == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&loop->lock);
+  loop->jobs_head = NULL;
+  loop->jobs_tail = NULL;
+  loop->pending = 0;
+  IoOp *op = loop->live;
+  while (op != NULL) {
+    IoOp *next = op->live_next;
+    if (op->state == IoPooled && op->running) {
+      // Its worker still writes to it; `drain_completed` frees it.
+      op->cancelled = true;
+    } else {
+      destroy_op(op);
+    }
+    op = next;
+  }
+  pthread_mutex_unlock(&loop->lock);
+
+  loop->live = NULL;
+  loop->in_progress = 0;
+  loop->ready_head = 0;
+  loop->ready_len = 0;
+  loop->timers_len = 0;
+}
+
+void free_event_loop(EventLoop *loop) {
+  if (loop == NULL) {
+    return;
+  }
+  cancel_operations(loop);
+  pthread_mutex_lock(&loop->lock);
+  loop->stopping = true;
+  pthread_cond_broadcast(&loop->job_ready);
+  pthread_mutex_unlock(&loop->lock);
+  for (uint32_t i = 0; i < loop->threads_len; i += 1) {
+    pthread_join(loop->threads[i], NULL);
+  }
+  drain_completed(loop);
+
+  close(loop->epoll_fd);
+  close(loop->wake_fd);
+  pthread_cond_destroy(&loop->job_ready);
+  pthread_mutex_destroy(&loop->lock);
+  free(loop->ready);
+  free(loop->timers);
+  free(loop);
+}
+
+void mark_event_loop(VirtualMachine *vm) {
+  EventLoop *loop = vm->loop;
+  if (loop == NULL) {
+    return;
+  }
+  for (uint32_t i = loop->ready_head; i < loop->ready_len; i += 1) {
+    mark_object(vm, (Obj *)loop->ready[i].coroutine);
+  }
+  for (IoOp *op = loop->live; op != NULL; op = op->live_next) {
+    if (op->waiter != NULL) {
+      mark_object(vm, (Obj *)op->waiter);
+    }
+  }
+}
+
+Value read_file_async_native(VirtualMachine *vm, int32_t args_len,
+                             Value *args) {
+  if (args_len != 1 || !IS_STRING(args[0])) {
+    return native_error(vm, "read_file_async expects a path.");
+  }
+  EventLoop *loop = get_loop(vm);
+  IoOp *op = new_op(loop, IoRead);
+  // The read keeps a copy of the path.
+  start_read(loop, op, terminate_string(vm, args[0])->chars);
+  return await_operation(vm, loop, op);
+}
+
+Value sleep_ms_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1 || !IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) >= 0)) {
+    return native_error(vm, "sleep_ms expects a non-negative number.");
+  }
+  EventLoop *loop = get_loop(vm);
+  IoOp *op = new_op(loop, IoSleep);
+  op->state = IoTimed;
+  op->deadline = now_ns() + (int64_t)(AS_NUMBER(args[0]) * 1e6);
+  push_timer(loop, op);
+  return await_operation(vm, loop, op);
+}
+
+Value wait_all_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  for (int32_t i = 0; i < args_len; i += 1) {
+    if (!IS_COROUTINE(args[i]) ||
+        AS_COROUTINE(args[i])->state == CoroutineRunning) {
+      return native_error(vm,
+                          "wait_all expects coroutines that are not running.");
+    }
+  }
+
+  EventLoop *loop = get_loop(vm);
+  for (int32_t i = 0; i < args_len; i += 1) {
+    ObjCoroutine *coroutine = AS_COROUTINE(args[i]);
+    if (coroutine->state != CoroutineDone && !coroutine->scheduled) {
+      coroutine->scheduled = true;
+      push_ready(loop, coroutine, NULL);
+    }
+  }
+  // Tasks push onto this stack when they resume, which may move it.
+  ptrdiff_t args_offset = args - vm->stack;
+  for (int32_t i = 0; i < args_len; i += 1) {
+    ObjCoroutine *coroutine = AS_COROUTINE(vm->stack[args_offset + i]);
+    while (coroutine->state != CoroutineDone) {
+      if (is_idle(loop)) {
+        return native_error(vm, "wait_all is waiting on a coroutine that "
+                                "can never finish.");
+      }
+      if (!step(vm, loop)) {
+        return abandon(vm, loop);
+      }
+    }
+  }
+  return NULL_VAL;
+}
@@ -0,0 +1,53 @@
+#ifndef breeze_event_loop_h
+#define breeze_event_loop_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/***
+  Each VM owns an event loop, created on first use: an epoll instance for
+  pipes and sockets, a timer heap for sleeps, and a small thread pool for
+  regular files, which epoll cannot watch. Workers wake the loop through an
+  eventfd.
+
+  The loop schedules coroutines handed to `wait_all`, called tasks. An I/O
+  native called by a task parks it until the operation completes and lets
+  the other tasks run, so one VM thread overlaps any number of operations.
+  Called from anywhere else, the same native drives the loop itself until its
+  own operation completes.
+  ***/
+
+typedef struct EventLoop EventLoop;
+
+/* Frees a VM's event loop, joining its workers and dropping pending
+ * operations
+ * @param loop: The loop to free, may be NULL
+ */
+void free_event_loop(EventLoop *loop);
+
+/* Drops every pending operation, after a runtime error unwound the tasks
+ * waiting on them
+ * @param loop: The loop to clear, may be NULL
+ */
+void cancel_operations(EventLoop *loop);
+
+/* Marks the tasks the loop holds on to
+ * @param vm: The VM being collected
+ */
+void mark_event_loop(VirtualMachine *vm);
+
+/* read_file_async(path): Reads a whole file, pipe or Unix socket
+ * @return: The contents as a string, or null if they cannot be read
+ */
+Value read_file_async_native(VirtualMachine *vm, int32_t args_len,
+                             Value *args);
+
+/* sleep_ms(ms): Waits for a number of milliseconds */
+Value sleep_ms_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* wait_all(coroutines...): Runs coroutines as tasks until all are done */
+Value wait_all_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+#endif // !breeze_event_loop_h
@@ -0,0 +1,209 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "float64_array.h"
+
+#include "object.h"
+#include "simd.h"
+#include "virtual_machine.h"
+
+static bool check_array(VirtualMachine *vm, const char *native,
+                        int32_t args_len, Value *args) {
+  if (args_len != 1 || !IS_FLOAT64_ARRAY(args[0])) {
+    native_error(vm, "%s expects a float64 array.", native);
+    return false;
+  }
+  return true;
+}
+
+// Checks the arguments of a native that changes an array in place and
+// takes one more argument, of `expected` type.
+static bool check_update(VirtualMachine *vm, int32_t args_len, Value *args,
+                         bool expected, const char *usage) {
+  if (args_len != 2 || !IS_FLOAT64_ARRAY(args[0]) || !expected) {
+    native_error(vm, "%s", usage);
+    return false;
+  }
+  if (AS_OBJ(args[0])->is_shared) {
+    native_error(vm, "Cannot change a frozen float64 array.");
+    return false;
+  }
+  return true;
+}
+
+static bool check_same_len(VirtualMachine *vm, Value left, Value right) {
+  if (AS_FLOAT64_ARRAY(left)->len != AS_FLOAT64_ARRAY(right)->len) {
+    native_error(vm, "Float64 arrays of %u and %u elements do not match.",
+                 AS_FLOAT64_ARRAY(left)->len, AS_FLOAT64_ARRAY(right)->len);
+    return false;
+  }
+  return true;
+}
+
+Value f64_array_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len == 1 && IS_NUMBER(args[0])) {
+    double len = AS_NUMBER(args[0]);
+    if (!(len >= 0 && len <= UINT32_MAX) || len != (uint32_t)len) {
+      return native_error(vm, "Invalid float64 array length %g.", len);
+    }
+    return OBJ_VAL(new_float64_array(vm, (uint32_t)len));
+  }
+  if (args_len != 1 || !IS_LIST(args[0])) {
+    return native_error(vm, "f64_array expects a length or a list.");
+  }
+  ValueVec *items = &AS_LIST(args[0])->items;
+  for (uint32_t i = 0; i < items->len; i += 1) {
+    if (!IS_NUMBER(items->values[i])) {
+      return native_error(vm, "f64_array expects a list of numbers.");
+    }
+  }
+  ObjFloat64Array *array = new_float64_array(vm, items->len);
+  for (uint32_t i = 0; i < items->len; i += 1) {
+    array->values[i] = AS_NUMBER(items->values[i]);
+  }
+  return OBJ_VAL(array);
+}
+
+Value f64_mmap_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1 || !IS_STRING(args[0])) {
+    return native_error(vm, "f64_mmap expects a path.");
+  }
+  const char *path = terminate_string(vm, args[0])->chars;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return native_error(vm, "Could not open \"%s\".", path);
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 || status.st_size % sizeof(double) != 0 ||
+      status.st_size / sizeof(double) > UINT32_MAX) {
+    close(fd);
+    return native_error(vm, "\"%s\" is not a file of doubles.", path);
+  }
+  size_t mapped_len = (size_t)status.st_size;
+  void *mapping = NULL;
+  if (mapped_len > 0) {
+    // A private mapping lets the script write to the array without
+    // touching the file.
+    mapping = mmap(NULL, mapped_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                   0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return native_error(vm, "Could not map \"%s\".", path);
+  }
+
+  ObjFloat64Array *array = new_float64_array(vm, 0);
+  array->values = (double *)mapping;
+  array->len = (uint32_t)(mapped_len / sizeof(double));
+  array->mapped_len = mapped_len;
+  return OBJ_VAL(array);
+}
+
+Value f64_save_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 2 || !IS_FLOAT64_ARRAY(args[0]) || !IS_STRING(args[1])) {
+    return native_error(vm, "f64_save expects a float64 array and a path.");
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  FILE *file = fopen(terminate_string(vm, args[1])->chars, "wb");
+  if (file == NULL) {
+    return BOOL_VAL(false);
+  }
+  bool written = fwrite(array->values, sizeof(double), array->len, file) ==
+                 array->len;
+  return BOOL_VAL(fclose(file) == 0 && written);
+}
+
+Value f64_sum_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_array(vm, "f64_sum", args_len, args)) {
+    return NULL_VAL;
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  return NUMBER_VAL(float64_kernels()->sum(array->values, array->len));
+}
+
+Value f64_min_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_array(vm, "f64_min", args_len, args)) {
+    return NULL_VAL;
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  if (array->len == 0) {
+    return NULL_VAL;
+  }
+  return NUMBER_VAL(float64_kernels()->min(array->values, array->len));
+}
+
+Value f64_max_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_array(vm, "f64_max", args_len, args)) {
+    return NULL_VAL;
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  if (array->len == 0) {
+    return NULL_VAL;
+  }
+  return NUMBER_VAL(float64_kernels()->max(array->values, array->len));
+}
+
+Value f64_dot_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 2 || !IS_FLOAT64_ARRAY(args[0]) ||
+      !IS_FLOAT64_ARRAY(args[1])) {
+    return native_error(vm, "f64_dot expects two float64 arrays.");
+  }
+  if (!check_same_len(vm, args[0], args[1])) {
+    return NULL_VAL;
+  }
+  ObjFloat64Array *left = AS_FLOAT64_ARRAY(args[0]);
+  ObjFloat64Array *right = AS_FLOAT64_ARRAY(args[1]);
+  return NUMBER_VAL(
+      float64_kernels()->dot(left->values, right->values, left->len));
+}
+
+Value f64_scale_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_update(vm, args_len, args, args_len == 2 && IS_NUMBER(args[1]),
+                    "f64_scale expects a float64 array and a number.")) {
+    return NULL_VAL;
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  float64_kernels()->scale(array->values, array->len, AS_NUMBER(args[1]));
+  return args[0];
+}
+
+Value f64_add_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_update(vm, args_len, args,
+                    args_len == 2 && IS_FLOAT64_ARRAY(args[1]),
+                    "f64_add expects two float64 arrays.") ||
+      !check_same_len(vm, args[0], args[1])) {
+    return NULL_VAL;
+  }
+  ObjFloat64Array *into = AS_FLOAT64_ARRAY(args[0]);
+  float64_kernels()->add(into->values, AS_FLOAT64_ARRAY(args[1])->values,
+                         into->len);
+  return args[0];
+}
+
+Value f64_fill_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_update(vm, args_len, args, args_len == 2 && IS_NUMBER(args[1]),
+                    "f64_fill expects a float64 array and a number.")) {
+    return NULL_VAL;
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  float64_kernels()->fill(array->values, array->len, AS_NUMBER(args[1]));
+  return args[0];
+}
+
+Value f64_prefix_sum_native(VirtualMachine *vm, int32_t args_len,
+                            Value *args) {
+  if (!check_array(vm, "f64_prefix_sum", args_len, args)) {
+    return NULL_VAL;
+  }
+  if (AS_OBJ(args[0])->is_shared) {
+    return native_error(vm, "Cannot change a frozen float64 array.");
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  float64_kernels()->prefix_sum(array->values, array->len);
+  return args[0];
+}
@@ -0,0 +1,69 @@
+#ifndef breeze_float64_array_h
+#define breeze_float64_array_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/***
+  Float64 arrays store raw doubles, half the size of a list of numbers, and
+  are indexed like lists. The natives below run over a whole array at once
+  with the SIMD kernels of `simd.h`, instead of one instruction dispatch per
+  element.
+
+  An array can also be a private mapping of a binary file of native-endian
+  doubles: pages are read in on first touch, and writes stay in memory.
+  ***/
+
+/* f64_array(len | list): Creates an array of `len` zeros, or a copy of a
+ * list of numbers
+ */
+Value f64_array_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_mmap(path): Maps a binary file of doubles as an array, without
+ * copying it
+ */
+Value f64_mmap_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_save(array, path): Writes an array to a binary file of doubles
+ * @return: true on success, false if the file could not be written
+ */
+Value f64_save_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_sum(array): Sums the elements */
+Value f64_sum_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_min(array): Smallest element, null if empty */
+Value f64_min_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_max(array): Largest element, null if empty */
+Value f64_max_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_dot(left, right): Dot product of two arrays of the same length */
+Value f64_dot_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_scale(array, factor): Multiplies every element in place
+ * @return: The array
+ */
+Value f64_scale_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_add(into, array): Adds an array of the same length into another, in
+ * place
+ * @return: The array added into
+ */
+Value f64_add_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_fill(array, value): Sets every element
+ * @return: The array
+ */
+Value f64_fill_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* f64_prefix_sum(array): Replaces each element with the sum of itself and
+ * those before it
+ * @return: The array
+ */
+Value f64_prefix_sum_native(VirtualMachine *vm, int32_t args_len,
+                            Value *args);
+
+#endif // !breeze_float64_array_h
@@ -0,0 +1,312 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "freeze.h"
+
+#include "memory.h"
+#include "object.h"
+#include "shared_string.h"
+#include "table.h"
+#include "virtual_machine.h"
+
+typedef struct {
+  Obj **objects;
+  uint32_t len;
+  uint32_t capacity;
+} ObjVec;
+
+// Frozen objects, linked through `Obj.next` once they leave their heap.
+static Obj *frozen_objects = NULL;
+static pthread_mutex_t frozen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Stands in for the owning VM when frozen objects are finally freed.
+static VirtualMachine frozen_heap;
+
+static void push_obj(ObjVec *vec, Obj *object) {
+  if (vec->len == vec->capacity) {
+    vec->capacity = GROW_CAPACITY(vec->capacity);
+    vec->objects =
+        (Obj **)realloc(vec->objects, sizeof(Obj *) * vec->capacity);
+    if (vec->objects == NULL) {
+      fprintf(stderr, "Not enough memory to freeze a value.");
+      exit(1);
+    }
+  }
+  vec->objects[vec->len] = object;
+  vec->len += 1;
+}
+
+// Queues an object for the walk. Strings are not queued: they are replaced,
+// not frozen in place.
+static void visit(ObjVec *pending, Value value) {
+  if (!IS_OBJ(value)) {
+    return;
+  }
+  Obj *object = AS_OBJ(value);
+  if (object->is_shared || object->is_marked ||
+      object->type == ObjStringType) {
+    return;
+  }
+  object->is_marked = true;
+  push_obj(pending, object);
+}
+
+static void visit_table(ObjVec *pending, const Table *table) {
+  uint32_t i = 0;
+  TableEntry *entry;
+  while (table_next(table, &i, &entry)) {
+    visit(pending, entry->value);
+  }
+}
+
+// Collects the heap objects reachable from `value` into `graph`, leaving
+// them marked. Returns the first object that cannot be frozen, if any.
+static Obj *collect_graph(Value value, ObjVec *graph) {
+  visit(graph, value);
+  for (uint32_t i = 0; i < graph->len; i += 1) {
+    Obj *object = graph->objects[i];
+    switch (object->type) {
+    case ObjInstanceType: {
+      ObjInstance *instance = (ObjInstance *)object;
+      visit(graph, OBJ_VAL(instance->klass));
+      for (uint32_t i = 0; i < instance->fields_len; i += 1) {
+        visit(graph, instance->fields[i]);
+      }
+      break;
+    }
+    case ObjClassType: {
+      ObjClass *klass = (ObjClass *)object;
+      visit_table(graph, &klass->methods);
+      for (uint32_t i = 0; i < klass->template.len; i += 1) {
+        visit(graph, klass->template.values[i]);
+      }
+      break;
+    }
+    case ObjClosureType: {
+      ObjClosure *closure = (ObjClosure *)object;
+      if (closure->upvalues_len > 0) {
+        return object;
+      }
+      visit(graph, OBJ_VAL(closure->function));
+      break;
+    }
+    case ObjFunctionType: {
+      ObjFunction *function = (ObjFunction *)object;
+      if (function->closure != NULL) {
+        visit(graph, OBJ_VAL(function->closure));
+      }
+      ValueVec *constants = &function->chunk.constants;
+      for (uint32_t idx = 0; idx < constants->len; idx += 1) {
+        visit(graph, constants->values[idx]);
+      }
+      break;
+    }
+    case ObjColumnsType: {
+      ObjColumns *columns = (ObjColumns *)object;
+      visit(graph, OBJ_VAL(columns->klass));
+      for (uint32_t field = 0; field < columns->fields_len; field += 1) {
+        Value *column = columns->values + field * columns->capacity;
+        for (uint32_t i = 0; i < columns->len; i += 1) {
+          visit(graph, column[i]);
+        }
+      }
+      break;
+    }
+    case ObjRowType: {
+      visit(graph, OBJ_VAL(((ObjRow *)object)->columns));
+      break;
+    }
+    case ObjListType: {
+      ValueVec *items = &((ObjList *)object)->items;
+      for (uint32_t i = 0; i < items->len; i += 1) {
+        visit(graph, items->values[i]);
+      }
+      break;
+    }
+    case ObjMapType: {
+      ObjMap *map = (ObjMap *)object;
+      for (uint32_t i = 0; i < map->entries_len; i += 1) {
+        visit(graph, map->entries[i].key);
+        visit(graph, map->entries[i].value);
+      }
+      break;
+    }
+    case ObjIterType: {
+      ObjIter *iter = (ObjIter *)object;
+      visit(graph, iter->source);
+      for (uint32_t i = 0; i < iter->stages_len; i += 1) {
+        visit(graph, iter->stages[i].arg);
+      }
+      break;
+    }
+    case ObjNativeType:
+    case ObjFloat64ArrayType:
+      break;
+    case ObjStringType:
+    case ObjUpvalueType:
+    case ObjChannelType:
+    case ObjCoroutineType:
+    case ObjMappedFileType:
+      return object;
+    }
+  }
+  return NULL;
+}
+
+static ObjString *share_string(ObjString *string) {
+  if (string == NULL || string->obj.is_shared) {
+    return string;
+  }
+  return copy_shared_string(string->chars, string->len);
+}
+
+static Value share_value(Value value) {
+  if (IS_STRING(value)) {
+    return OBJ_VAL(share_string(AS_STRING(value)));
+  }
+  return value;
+}
+
+// Swapping a key for its shared copy keeps its slot: the hash is the same.
+static void share_table(Table *table) {
+  uint32_t i = 0;
+  TableEntry *entry;
+  while (table_next(table, &i, &entry)) {
+    entry->key = share_string(entry->key);
+    entry->value = share_value(entry->value);
+  }
+}
+
+static void freeze_object(Obj *object) {
+  switch (object->type) {
+  case ObjInstanceType: {
+    ObjInstance *instance = (ObjInstance *)object;
+    for (uint32_t i = 0; i < instance->fields_len; i += 1) {
+      instance->fields[i] = share_value(instance->fields[i]);
+    }
+    break;
+  }
+  case ObjClassType: {
+    ObjClass *klass = (ObjClass *)object;
+    klass->name = share_string(klass->name);
+    share_table(&klass->methods);
+    share_table(&klass->fields);
+    for (uint32_t i = 0; i < klass->template.len; i += 1) {
+      klass->template.values[i] = share_value(klass->template.values[i]);
+    }
+    break;
+  }
+  case ObjColumnsType: {
+    ObjColumns *columns = (ObjColumns *)object;
+    for (uint32_t field = 0; field < columns->fields_len; field += 1) {
+      Value *column = columns->values + field * columns->capacity;
+      for (uint32_t i = 0; i < columns->len; i += 1) {
+        column[i] = share_value(column[i]);
+      }
+    }
+    break;
+  }
+  case ObjListType: {
+    ValueVec *items = &((ObjList *)object)->items;
+    for (uint32_t i = 0; i < items->len; i += 1) {
+      items->values[i] = share_value(items->values[i]);
+    }
+    break;
+  }
+  // String keys hash by content, so their shared copies keep their slots.
+  case ObjMapType: {
+    ObjMap *map = (ObjMap *)object;
+    for (uint32_t i = 0; i < map->entries_len; i += 1) {
+      map->entries[i].key = share_value(map->entries[i].key);
+      map->entries[i].value = share_value(map->entries[i].value);
+    }
+    break;
+  }
+  case ObjFunctionType: {
+    ObjFunction *function = (ObjFunction *)object;
+    function->name = share_string(function->name);
+    ValueVec *constants = &function->chunk.constants;
+    for (uint32_t idx = 0; idx < constants->len; idx += 1) {
+      constants->values[idx] = share_value(constants->values[idx]);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+  object->is_marked = false;
+  object->is_shared = true;
+}
+
+// Moves every shared object out of the VM's object list.
+static void unlink_frozen(VirtualMachine *vm) {
+  Obj **link = &vm->objects;
+  Obj *frozen = NULL;
+  while (*link != NULL) {
+    Obj *object = *link;
+    if (object->is_shared) {
+      *link = object->next;
+      object->next = frozen;
+      frozen = object;
+    } else {
+      link = &object->next;
+    }
+  }
+  if (frozen == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&frozen_lock);
+  Obj *last = frozen;
+  while (last->next != NULL) {
+    last = last->next;
+  }
+  last->next = frozen_objects;
+  frozen_objects = frozen;
+  pthread_mutex_unlock(&frozen_lock);
+}
+
+bool freeze_value(VirtualMachine *vm, Value value, Value *frozen) {
+  ObjVec graph = {0};
+  Obj *invalid = collect_graph(value, &graph);
+  if (invalid != NULL) {
+    for (uint32_t i = 0; i < graph.len; i += 1) {
+      graph.objects[i]->is_marked = false;
+    }
+    free(graph.objects);
+    return false;
+  }
+
+  for (uint32_t i = 0; i < graph.len; i += 1) {
+    freeze_object(graph.objects[i]);
+  }
+  if (graph.len > 0) {
+    unlink_frozen(vm);
+  }
+  free(graph.objects);
+  *frozen = share_value(value);
+  return true;
+}
+
+Value freeze_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1) {
+    return native_error(vm, "freeze expects one value.");
+  }
+  Value frozen;
+  if (!freeze_value(vm, args[0], &frozen)) {
+    return native_error(vm, "Closures with upvalues, channels, coroutines "
+                            "and mapped files cannot be frozen.");
+  }
+  return frozen;
+}
+
+void free_frozen_objects() {
+  pthread_mutex_lock(&frozen_lock);
+  Obj *object = frozen_objects;
+  frozen_objects = NULL;
+  pthread_mutex_unlock(&frozen_lock);
+  free_objects(&frozen_heap, object);
+}
@@ -0,0 +1,35 @@
+#ifndef breeze_freeze_h
+#define breeze_freeze_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/***
+  Freezing moves an object graph out of a VM's heap into the shared region:
+  objects are flagged `is_shared` in place and unlinked from the heap, and
+  strings are swapped for their shared interned copies. Shared objects are
+  read-only, never traced nor freed by a collector, and can be referenced by
+  every VM, so isolates receive them by pointer instead of by copy. They
+  live until `free_shared_strings`.
+  ***/
+
+/* Freezes everything reachable from a value
+ * @param vm: The VM whose heap owns the graph
+ * @param value: The root of the graph
+ * @param frozen: Output, the frozen equivalent of `value`
+ * @return: false, leaving the graph untouched, if it reaches an object that
+ *          cannot be frozen: closures with upvalues, channels, coroutines,
+ *          mapped files
+ */
+bool freeze_value(VirtualMachine *vm, Value value, Value *frozen);
+
+/* freeze(value): Freezes a value and returns its frozen equivalent */
+Value freeze_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* Frees every frozen object. Called by `free_shared_strings`. */
+void free_frozen_objects();
+
+#endif // !breeze_freeze_h
@@ -0,0 +1,471 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "isolate.h"
+
+#include "channel.h"
+#include "memory.h"
+#include "message.h"
+#include "object.h"
+#include "parallel.h"
+#include "table.h"
+#include "virtual_machine.h"
+
+// Most workers `isolate_threads` can allow.
+#define ISOLATES_MAX 256
+
+typedef struct Task {
+  struct Task *next;
+  // Globals as (count, name, value...) followed by the callee and arguments.
+  Message *message;
+  uint8_t args_len;
+  Channel *result;
+} Task;
+
+typedef struct Isolate {
+  pthread_t thread;
+  VirtualMachine *vm;
+  struct Isolate *next;
+} Isolate;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t task_ready;
+  Task *head;
+  Task *tail;
+  uint32_t pending;
+  uint32_t idle;
+  bool stopping;
+  Isolate *isolates;
+  uint32_t isolates_len;
+  // Most workers the pool starts; 0 until first needed, then the core count
+  // unless `isolate_threads` set it.
+  uint32_t isolates_max;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .task_ready = PTHREAD_COND_INITIALIZER,
+};
+
+static void run_task(VirtualMachine *vm, Task *task) {
+  Message *message = task->message;
+  Value *values = (Value *)malloc(sizeof(Value) * message->values_len);
+  if (values == NULL) {
+    fprintf(stderr, "Not enough memory to spawn an isolate.");
+    exit(1);
+  }
+
+  reset_vm(vm);
+  pause_gc(vm);
+  decode_message(vm, message, values);
+  uint32_t globals_len = (uint32_t)AS_NUMBER(values[0]);
+  for (uint32_t i = 0; i < globals_len; i += 1) {
+    table_insert(vm, &vm->globals, AS_STRING(values[1 + 2 * i]),
+                 values[2 + 2 * i]);
+  }
+  for (uint32_t i = 1 + 2 * globals_len; i < message->values_len; i += 1) {
+    push_stack(vm, values[i]);
+  }
+  resume_gc(vm);
+  free(values);
+  free_message(message);
+
+  Value result = NULL_VAL;
+  if (invoke(vm, task->args_len) == InterpretOk) {
+    result = pop_stack(vm);
+  }
+  channel_send(task->result, encode_message(&result, 1));
+  release_channel(task->result);
+  free(task);
+}
+
+// Workers count as idle from their start until they take a task, and again
+// once it is done.
+static void *isolate_main(void *arg) {
+  Isolate *isolate = (Isolate *)arg;
+  pthread_mutex_lock(&pool.lock);
+  while (true) {
+    while (pool.head == NULL && !pool.stopping) {
+      pthread_cond_wait(&pool.task_ready, &pool.lock);
+    }
+    Task *task = pool.head;
+    if (task == NULL) {
+      break;
+    }
+    pool.head = task->next;
+    if (pool.head == NULL) {
+      pool.tail = NULL;
+    }
+    pool.pending -= 1;
+    pool.idle -= 1;
+    pthread_mutex_unlock(&pool.lock);
+
+    run_task(isolate->vm, task);
+    pthread_mutex_lock(&pool.lock);
+    pool.idle += 1;
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+// Must be called with the pool locked.
+static void start_isolate() {
+  Isolate *isolate = (Isolate *)malloc(sizeof(Isolate));
+  if (isolate == NULL || (isolate->vm = new_vm()) == NULL) {
+    fprintf(stderr, "Not enough memory to start an isolate.");
+    exit(1);
+  }
+  if (pthread_create(&isolate->thread, NULL, isolate_main, isolate) != 0) {
+    fprintf(stderr, "Could not start an isolate.");
+    exit(1);
+  }
+  isolate->next = pool.isolates;
+  pool.isolates = isolate;
+  pool.isolates_len += 1;
+  pool.idle += 1;
+}
+
+// Must be called with the pool locked.
+static uint32_t isolates_max() {
+  if (pool.isolates_max == 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.isolates_max = cores < 1               ? 1
+                        : cores > ISOLATES_MAX ? ISOLATES_MAX
+                                               : (uint32_t)cores;
+  }
+  return pool.isolates_max;
+}
+
+// Starts workers for the tasks no idle worker will take, up to the cap; the
+// rest wait in the queue. Must be called with the pool locked.
+static void grow_pool() {
+  while (pool.pending > pool.idle && pool.isolates_len < isolates_max()) {
+    start_isolate();
+  }
+}
+
+static void submit(Task *task) {
+  pthread_mutex_lock(&pool.lock);
+  task->next = NULL;
+  if (pool.tail == NULL) {
+    pool.head = task;
+  } else {
+    pool.tail->next = task;
+  }
+  pool.tail = task;
+  pool.pending += 1;
+  grow_pool();
+  pthread_cond_signal(&pool.task_ready);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+void shutdown_isolates() {
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = true;
+  pthread_cond_broadcast(&pool.task_ready);
+  Isolate *isolate = pool.isolates;
+  pool.isolates = NULL;
+  pool.isolates_len = 0;
+  pool.idle = 0;
+  pthread_mutex_unlock(&pool.lock);
+
+  while (isolate != NULL) {
+    Isolate *next = isolate->next;
+    pthread_join(isolate->thread, NULL);
+    delete_vm(isolate->vm);
+    free(isolate);
+    isolate = next;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = false;
+  pthread_mutex_unlock(&pool.lock);
+  shutdown_kernel_threads();
+}
+
+// Walk over what a spawned call can reach, to find the globals it uses.
+typedef struct {
+  VirtualMachine *vm;
+  // Objects already queued, as an open-addressed set of pointers. Frozen
+  // objects are shared by threads, so the walk never marks objects instead.
+  Obj **seen;
+  uint32_t seen_len;
+  uint32_t seen_capacity;
+  Obj **pending;
+  uint32_t pending_len;
+  uint32_t pending_capacity;
+  // Globals to copy, as name and value pairs.
+  Value *globals;
+  uint32_t globals_len;
+  uint32_t globals_capacity;
+} GlobalScan;
+
+static void *grow_scan_array(void *array, uint32_t *capacity, size_t size) {
+  *capacity = GROW_CAPACITY(*capacity);
+  array = realloc(array, size * *capacity);
+  if (array == NULL) {
+    fprintf(stderr, "Not enough memory to spawn an isolate.");
+    exit(1);
+  }
+  return array;
+}
+
+static inline uint32_t hash_ptr(const Obj *object, uint32_t mask) {
+  return (uint32_t)(((uintptr_t)object >> 4) * 2654435761u) & mask;
+}
+
+// Adds an object to the seen set, and tells whether it was new.
+static bool see(GlobalScan *scan, Obj *object) {
+  if ((scan->seen_len + 1) * 4 > scan->seen_capacity * 3) {
+    uint32_t capacity = GROW_CAPACITY(scan->seen_capacity);
+    Obj **seen = (Obj **)calloc(capacity, sizeof(Obj *));
+    if (seen == NULL) {
+      fprintf(stderr, "Not enough memory to spawn an isolate.");
+      exit(1);
+    }
+    for (uint32_t i = 0; i < scan->seen_capacity; i += 1) {
+      if (scan->seen[i] != NULL) {
+        uint32_t slot = hash_ptr(scan->seen[i], capacity - 1);
+        while (seen[slot] != NULL) {
+          slot = (slot + 1) & (capacity - 1);
+        }
+        seen[slot] = scan->seen[i];
+      }
+    }
+    free(scan->seen);
+    scan->seen = seen;
+    scan->seen_capacity = capacity;
+  }
+  uint32_t mask = scan->seen_capacity - 1;
+  uint32_t slot = hash_ptr(object, mask);
+  while (scan->seen[slot] != NULL) {
+    if (scan->seen[slot] == object) {
+      return false;
+    }
+    slot = (slot + 1) & mask;
+  }
+  scan->seen[slot] = object;
+  scan->seen_len += 1;
+  return true;
+}
+
+// Queues an object for the walk. Strings hold nothing to walk.
+static void scan_value(GlobalScan *scan, Value value) {
+  if (!IS_OBJ(value) || IS_STRING(value) || !see(scan, AS_OBJ(value))) {
+    return;
+  }
+  if (scan->pending_len == scan->pending_capacity) {
+    scan->pending = (Obj **)grow_scan_array(
+        scan->pending, &scan->pending_capacity, sizeof(Obj *));
+  }
+  scan->pending[scan->pending_len] = AS_OBJ(value);
+  scan->pending_len += 1;
+}
+
+// A function names the globals it uses among its constants. A literal with
+// the same characters as a global copies it too, which is harmless.
+static void scan_name(GlobalScan *scan, ObjString *name) {
+  Value value;
+  if (!table_get(&scan->vm->globals, name, &value) || IS_NATIVE(value) ||
+      !see(scan, &name->obj)) {
+    return;
+  }
+  if (scan->globals_len + 2 > scan->globals_capacity) {
+    scan->globals = (Value *)grow_scan_array(
+        scan->globals, &scan->globals_capacity, sizeof(Value));
+  }
+  scan->globals[scan->globals_len] = OBJ_VAL(name);
+  scan->globals[scan->globals_len + 1] = value;
+  scan->globals_len += 2;
+  scan_value(scan, value);
+}
+
+static void scan_object(GlobalScan *scan, Obj *object) {
+  switch (object->type) {
+  case ObjInstanceType: {
+    ObjInstance *instance = (ObjInstance *)object;
+    scan_value(scan, OBJ_VAL(instance->klass));
+    for (uint32_t i = 0; i < instance->fields_len; i += 1) {
+      scan_value(scan, instance->fields[i]);
+    }
+    break;
+  }
+  case ObjClassType: {
+    ObjClass *klass = (ObjClass *)object;
+    uint32_t slot = 0;
+    TableEntry *entry;
+    while (table_next(&klass->methods, &slot, &entry)) {
+      scan_value(scan, entry->value);
+    }
+    for (uint32_t i = 0; i < klass->template.len; i += 1) {
+      scan_value(scan, klass->template.values[i]);
+    }
+    break;
+  }
+  case ObjClosureType: {
+    ObjClosure *closure = (ObjClosure *)object;
+    scan_value(scan, OBJ_VAL(closure->function));
+    for (uint32_t i = 0; i < closure->upvalues_len; i += 1) {
+      if (closure->upvalues[i] != NULL) {
+        scan_value(scan, *closure->upvalues[i]->location);
+      }
+    }
+    break;
+  }
+  case ObjFunctionType: {
+    ValueVec *constants = &((ObjFunction *)object)->chunk.constants;
+    for (uint32_t i = 0; i < constants->len; i += 1) {
+      if (IS_STRING(constants->values[i])) {
+        scan_name(scan, AS_STRING(constants->values[i]));
+      } else {
+        scan_value(scan, constants->values[i]);
+      }
+    }
+    break;
+  }
+  case ObjColumnsType: {
+    ObjColumns *columns = (ObjColumns *)object;
+    scan_value(scan, OBJ_VAL(columns->klass));
+    for (uint32_t field = 0; field < columns->fields_len; field += 1) {
+      Value *column = columns->values + field * columns->capacity;
+      for (uint32_t i = 0; i < columns->len; i += 1) {
+        scan_value(scan, column[i]);
+      }
+    }
+    break;
+  }
+  case ObjRowType:
+    scan_value(scan, OBJ_VAL(((ObjRow *)object)->columns));
+    break;
+  case ObjListType: {
+    ValueVec *items = &((ObjList *)object)->items;
+    for (uint32_t i = 0; i < items->len; i += 1) {
+      scan_value(scan, items->values[i]);
+    }
+    break;
+  }
+  case ObjMapType: {
+    ObjMap *map = (ObjMap *)object;
+    for (uint32_t i = 0; i < map->entries_len; i += 1) {
+      scan_value(scan, map->entries[i].key);
+      scan_value(scan, map->entries[i].value);
+    }
+    break;
+  }
+  case ObjIterType: {
+    ObjIter *iter = (ObjIter *)object;
+    scan_value(scan, iter->source);
+    for (uint32_t i = 0; i < iter->stages_len; i += 1) {
+      scan_value(scan, iter->stages[i].arg);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+Value spawn_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len < 1 || !(IS_CLOSURE(args[0]) || IS_NATIVE(args[0]))) {
+    return native_error(vm, "spawn expects a function.");
+  }
+
+  // Only the globals the callee and arguments can reach are copied, so a
+  // spawn costs what it uses rather than the size of the spawner's heap.
+  GlobalScan scan = {.vm = vm};
+  for (int32_t i = 0; i < args_len; i += 1) {
+    scan_value(&scan, args[i]);
+  }
+  while (scan.pending_len > 0) {
+    scan.pending_len -= 1;
+    scan_object(&scan, scan.pending[scan.pending_len]);
+  }
+  uint32_t globals_len = scan.globals_len / 2;
+
+  uint32_t values_len = 1 + 2 * globals_len + args_len;
+  Value *values = (Value *)malloc(sizeof(Value) * values_len);
+  Task *task = (Task *)malloc(sizeof(Task));
+  if (values == NULL || task == NULL) {
+    fprintf(stderr, "Not enough memory to spawn an isolate.");
+    exit(1);
+  }
+  values[0] = NUMBER_VAL(globals_len);
+  for (uint32_t i = 0; i < scan.globals_len; i += 1) {
+    values[1 + i] = scan.globals[i];
+  }
+  for (int32_t i = 0; i < args_len; i += 1) {
+    values[1 + scan.globals_len + i] = args[i];
+  }
+  free(scan.seen);
+  free(scan.pending);
+  free(scan.globals);
+
+  task->message = encode_message(values, values_len);
+  task->args_len = (uint8_t)(args_len - 1);
+  task->result = open_channel();
+  free(values);
+
+  // The handle takes its own reference; the task keeps the creation one.
+  ObjChannel *result = new_channel(vm, task->result);
+  submit(task);
+  return OBJ_VAL(result);
+}
+
+Value channel_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  (void)args;
+  if (args_len != 0) {
+    return native_error(vm, "channel expects no arguments.");
+  }
+  Channel *channel = open_channel();
+  ObjChannel *object = new_channel(vm, channel);
+  release_channel(channel);
+  return OBJ_VAL(object);
+}
+
+Value send_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 2 || !IS_CHANNEL(args[0])) {
+    return native_error(vm, "send expects a channel and a value.");
+  }
+  channel_send(AS_CHANNEL(args[0]), encode_message(&args[1], 1));
+  return NULL_VAL;
+}
+
+Value recv_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1 || !IS_CHANNEL(args[0])) {
+    return native_error(vm, "recv expects a channel.");
+  }
+  Message *message = channel_recv(AS_CHANNEL(args[0]));
+  Value value;
+  // Nothing roots the value until the native returns, and returning does
+  // not allocate, so only the decoding needs the collector paused.
+  pause_gc(vm);
+  decode_message(vm, message, &value);
+  resume_gc(vm);
+  free_message(message);
+  return value;
+}
+
+Value isolate_threads_native(VirtualMachine *vm, int32_t args_len,
+                             Value *args) {
+  if (args_len > 1 ||
+      (args_len == 1 &&
+       (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1 ||
+        AS_NUMBER(args[0]) > ISOLATES_MAX ||
+        AS_NUMBER(args[0]) != (uint32_t)AS_NUMBER(args[0])))) {
+    return native_error(vm, "isolate_threads expects a count from 1 to %d.",
+                        ISOLATES_MAX);
+  }
+  pthread_mutex_lock(&pool.lock);
+  uint32_t previous = isolates_max();
+  if (args_len == 1) {
+    // Workers above a lowered cap are kept; a raised one takes queued tasks
+    // at once.
+    pool.isolates_max = (uint32_t)AS_NUMBER(args[0]);
+    grow_pool();
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NUMBER_VAL(previous);
+}
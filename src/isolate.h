@@ -0,0 +1,44 @@
+#ifndef breeze_isolate_h
+#define breeze_isolate_h
+
+#include <stdint.h>
+
+#include "breeze.h"
+#include "common.h"
+#include "value.h"
+
+/***
+  Isolates run a function on a worker thread, in a VM of their own. Workers
+  are pooled: each keeps its VM across tasks and only resets its globals, so
+  a spawn costs a message copy and a queue push. The pool starts a worker
+  whenever every worker is busy, up to a cap, the number of cores by
+  default; further tasks wait in the queue. Isolates that block on each
+  other need a cap at least as large as their number, or they deadlock.
+
+  A spawned function sees a copy of the globals it refers to, directly or
+  through the functions and data it reaches, and receives deep copies of its
+  arguments. Its return value is sent on the channel `spawn` returns.
+  ***/
+
+/* spawn(fn, args...): Runs `fn(args...)` in an isolate
+ * @return: A channel that receives the function's result
+ */
+Value spawn_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* channel(): Creates an empty channel */
+Value channel_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* send(channel, value): Queues a copy of `value` on the channel */
+Value send_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* recv(channel): Waits for and returns the channel's oldest message */
+Value recv_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* isolate_threads(count?): Sets how many workers isolates run on at most,
+ * the number of cores by default
+ * @return: The previous count
+ */
+Value isolate_threads_native(VirtualMachine *vm, int32_t args_len,
+                             Value *args);
+
+#endif // !breeze_isolate_h
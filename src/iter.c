@@ -0,0 +1,206 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "iter.h"
+
+#include "virtual_machine.h"
+
+// Stages of one pipeline, terminal stage excluded.
+#define ITER_STAGES_MAX 32
+
+static const struct {
+  const char *name;
+  IterStageKind kind;
+} stage_names[] = {
+    {"map", IterMap},         {"filter", IterFilter},
+    {"take", IterTake},       {"reduce", IterReduce},
+    {"to_list", IterToList},  {"count", IterCount},
+};
+
+static bool is_function(Value value) {
+  return IS_CLOSURE(value) || IS_NATIVE(value);
+}
+
+Value iter_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1 || !(IS_LIST(args[0]) || IS_FLOAT64_ARRAY(args[0]))) {
+    return native_error(vm, "iter expects a list or a float64 array.");
+  }
+  return OBJ_VAL(new_iter(vm, args[0], 0));
+}
+
+// Copies a pipeline with room for `extra` more stages.
+static ObjIter *copy_iter(VirtualMachine *vm, ObjIter *iter,
+                          uint32_t extra) {
+  ObjIter *copy = new_iter(vm, iter->source, iter->stages_len + extra);
+  memcpy(copy->stages, iter->stages, sizeof(IterStage) * iter->stages_len);
+  return copy;
+}
+
+bool iter_property(VirtualMachine *vm, ObjIter *iter, const ObjString *name,
+                   Value *value) {
+  for (size_t i = 0; i < sizeof(stage_names) / sizeof(stage_names[0]);
+       i += 1) {
+    if (strcmp(stage_names[i].name, name->chars) == 0) {
+      ObjIter *waiting = copy_iter(vm, iter, 0);
+      waiting->pending = stage_names[i].kind;
+      *value = OBJ_VAL(waiting);
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool source_element(Value source, uint32_t idx, Value *element) {
+  if (IS_LIST(source)) {
+    ValueVec *items = &AS_LIST(source)->items;
+    if (idx >= items->len) {
+      return false;
+    }
+    *element = items->values[idx];
+    return true;
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(source);
+  if (idx >= array->len) {
+    return false;
+  }
+  *element = NUMBER_VAL(array->values[idx]);
+  return true;
+}
+
+// Runs a pipeline into a terminal stage in one pass. The result so far
+// stays on top of the stack, where the GC sees it.
+static Value run_iter(VirtualMachine *vm, ObjIter *iter,
+                      IterStageKind terminal, Value reducer, Value init) {
+  push_stack(vm, terminal == IterCount    ? NUMBER_VAL(0)
+                 : terminal == IterReduce ? init
+                                          : NULL_VAL);
+  if (terminal == IterToList) {
+    vm->stack_ptr[-1] = OBJ_VAL(new_list(vm));
+  }
+
+  uint32_t taken[ITER_STAGES_MAX] = {0};
+  bool done = false;
+  for (uint32_t idx = 0; !done; idx += 1) {
+    Value value;
+    if (!source_element(iter->source, idx, &value)) {
+      break;
+    }
+    bool keep = true;
+    for (uint32_t i = 0; keep && i < iter->stages_len; i += 1) {
+      IterStage *stage = &iter->stages[i];
+      switch (stage->kind) {
+      case IterMap:
+        if (!call_function(vm, stage->arg, 1, &value, &value)) {
+          return NULL_VAL;
+        }
+        break;
+      case IterFilter: {
+        Value test;
+        if (!call_function(vm, stage->arg, 1, &value, &test)) {
+          return NULL_VAL;
+        }
+        if (!IS_BOOL(test)) {
+          return native_error(vm, "filter expects a function returning a "
+                                  "boolean.");
+        }
+        keep = AS_BOOL(test);
+        break;
+      }
+      case IterTake: {
+        // Once a take is satisfied no later element can pass it, so the
+        // pass ends with this element.
+        uint32_t limit = (uint32_t)AS_NUMBER(stage->arg);
+        keep = taken[i] < limit;
+        taken[i] += keep ? 1 : 0;
+        done |= taken[i] == limit;
+        break;
+      }
+      default:
+        break;
+      }
+    }
+    if (!keep) {
+      continue;
+    }
+
+    switch (terminal) {
+    case IterReduce: {
+      Value pair[2] = {vm->stack_ptr[-1], value};
+      Value result;
+      if (!call_function(vm, reducer, 2, pair, &result)) {
+        return NULL_VAL;
+      }
+      vm->stack_ptr[-1] = result;
+      break;
+    }
+    case IterToList: {
+      ValueVec *items = &AS_LIST(vm->stack_ptr[-1])->items;
+      push_stack(vm, value);
+      write_value_vec(vm, items, value);
+      pop_stack(vm);
+      break;
+    }
+    default:
+      vm->stack_ptr[-1] = NUMBER_VAL(AS_NUMBER(vm->stack_ptr[-1]) + 1);
+      break;
+    }
+  }
+  return pop_stack(vm);
+}
+
+static bool check_stage(VirtualMachine *vm, IterStageKind kind,
+                        int32_t args_len, Value *args) {
+  if (kind == IterTake) {
+    double limit = args_len == 1 && IS_NUMBER(args[0]) ? AS_NUMBER(args[0])
+                                                       : -1;
+    if (!(limit >= 0 && limit <= UINT32_MAX) || limit != (uint32_t)limit) {
+      native_error(vm, "take expects a count.");
+      return false;
+    }
+    return true;
+  }
+  if (args_len != 1 || !is_function(args[0])) {
+    native_error(vm, "%s expects a function.",
+                 kind == IterMap ? "map" : "filter");
+    return false;
+  }
+  return true;
+}
+
+Value call_iter(VirtualMachine *vm, ObjIter *iter, int32_t args_len,
+                Value *args) {
+  switch (iter->pending) {
+  case IterMap:
+  case IterFilter:
+  case IterTake: {
+    if (!check_stage(vm, iter->pending, args_len, args)) {
+      return NULL_VAL;
+    }
+    if (iter->stages_len == ITER_STAGES_MAX) {
+      return native_error(vm, "Pipelines are limited to %d stages.",
+                          ITER_STAGES_MAX);
+    }
+    ObjIter *extended = copy_iter(vm, iter, 1);
+    extended->stages[iter->stages_len] =
+        (IterStage){.kind = iter->pending, .arg = args[0]};
+    return OBJ_VAL(extended);
+  }
+  case IterReduce:
+    if (args_len != 2 || !is_function(args[0])) {
+      return native_error(vm, "reduce expects a function and an initial "
+                              "value.");
+    }
+    return run_iter(vm, iter, IterReduce, args[0], args[1]);
+  case IterToList:
+  case IterCount:
+    if (args_len != 0) {
+      return native_error(vm, "%s expects no arguments.",
+                          iter->pending == IterToList ? "to_list" : "count");
+    }
+    return run_iter(vm, iter, iter->pending, NULL_VAL, NULL_VAL);
+  case IterStageNone:
+    break;
+  }
+  return native_error(vm, "Can only call functions and classes.");
+}
@@ -0,0 +1,52 @@
+#ifndef breeze_iter_h
+#define breeze_iter_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+/***
+  Lazy pipelines chain transformations over a list or a float64 array
+  without building a collection between steps:
+
+    iter(list).map(f).filter(g).take(n).reduce(h, init)
+
+  Reading `map`, `filter` or `take` off a pipeline yields a pipeline waiting
+  for that stage's argument; calling it returns a new pipeline with the stage
+  added, so pipelines can be shared and extended freely. Nothing runs until
+  a terminal stage, `reduce(h, init)`, `to_list()` or `count()`, is called.
+  It then makes a single pass over the source, pushing each element through
+  every stage in turn and calling script functions re-entrantly, and stops
+  as soon as a `take` is satisfied.
+
+  Filters must return booleans, like every condition.
+  ***/
+
+/* iter(source): Starts a pipeline over a list or a float64 array */
+Value iter_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* Reads a stage off a pipeline
+ * @param vm: The VM running the program
+ * @param iter: The pipeline
+ * @param name: Name of the stage
+ * @param value: Receives the pipeline waiting for the stage's arguments
+ * @return: false if no stage has this name
+ */
+bool iter_property(VirtualMachine *vm, ObjIter *iter, const ObjString *name,
+                   Value *value);
+
+/* Calls a pipeline waiting for the arguments of a stage, the way the VM
+ * calls a native
+ * @param vm: The VM running the program
+ * @param iter: The pipeline
+ * @param args_len: Number of arguments
+ * @param args: The arguments, on the stack above the pipeline
+ * @return: The extended pipeline, or the result of a terminal stage
+ */
+Value call_iter(VirtualMachine *vm, ObjIter *iter, int32_t args_len,
+                Value *args);
+
+#endif // !breeze_iter_h
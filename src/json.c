@@ -0,0 +1,1069 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "simd.h"
+#include "virtual_machine.h"
+
+// Containers nested deeper than this are rejected, which bounds the
+// recursion of both natives and catches cycles when serializing.
+#define JSON_DEPTH_MAX 1024
+// Numbers with more significant digits than this are read by strtod.
+#define JSON_FAST_DIGITS_MAX 19
+// Object keys repeat from one object to the next, so the parser keeps the
+// last few it interned, in slots picked by their length and outer bytes.
+#define JSON_KEY_CACHE_LEN 256
+#define JSON_KEY_CACHED_MAX 32
+// Objects side by side tend to have as many members as each other, so
+// each new map is sized like the last one parsed at the same depth.
+#define JSON_SIZE_HINTS_LEN 16
+
+/*** STRUCTURAL INDEX ***/
+
+// State carried from one block to the next.
+typedef struct {
+  // 1 if the first byte of the next block is escaped by a backslash.
+  uint64_t escaped;
+  // All ones if the block ended inside a string.
+  uint64_t in_string;
+  // 1 if the block ended inside a number or a literal.
+  uint64_t scalar;
+} ScanCarry;
+
+// Finds the bytes escaped by a backslash: those following a run of
+// backslashes of odd length. Adding the runs that start on odd bits to all
+// the backslashes carries them past their end, which tells runs starting
+// on odd and even bits apart without a loop.
+static uint64_t find_escaped(uint64_t backslashes, uint64_t *carry) {
+  const uint64_t even_bits = 0x5555555555555555;
+  backslashes &= ~*carry;
+  uint64_t follows_escape = backslashes << 1 | *carry;
+  uint64_t odd_starts = backslashes & ~even_bits & ~follows_escape;
+  uint64_t even_runs;
+  *carry = __builtin_add_overflow(odd_starts, backslashes, &even_runs);
+  return (even_bits ^ (even_runs << 1)) & follows_escape;
+}
+
+// Records the start of every token in a block: operators, opening quotes,
+// and the first byte of numbers and literals, all outside strings.
+static void scan_block(const ByteKernels *kernels, const uint8_t *block,
+                       uint32_t base, ScanCarry *carry, uint32_t *positions,
+                       uint32_t *positions_len) {
+  JsonClasses classes;
+  kernels->classify_json(block, &classes);
+  uint64_t escaped = find_escaped(classes.backslashes, &carry->escaped);
+  uint64_t quotes = classes.quotes & ~escaped;
+  uint64_t in_string = prefix_xor(quotes) ^ carry->in_string;
+  carry->in_string = (uint64_t)((int64_t)in_string >> 63);
+  // The bytes of strings after their opening quote, closing quote included.
+  uint64_t string_tail = in_string ^ quotes;
+
+  uint64_t scalar = ~(classes.operators | classes.whitespace);
+  uint64_t unquoted = scalar & ~quotes;
+  uint64_t follows_unquoted = unquoted << 1 | carry->scalar;
+  carry->scalar = unquoted >> 63;
+  uint64_t starts =
+      (classes.operators | (scalar & ~follows_unquoted)) & ~string_tail;
+
+  uint32_t len = *positions_len;
+  while (starts != 0) {
+    positions[len] = base + (uint32_t)__builtin_ctzll(starts);
+    len += 1;
+    starts &= starts - 1;
+  }
+  *positions_len = len;
+}
+
+// Indexes a whole text, the last partial block padded with spaces.
+// Returns false if a string is left open.
+static bool index_text(const char *chars, uint32_t len, uint32_t *positions,
+                       uint32_t *positions_len) {
+  const ByteKernels *kernels = byte_kernels();
+  ScanCarry carry = {0};
+  *positions_len = 0;
+  uint32_t base = 0;
+  for (; len - base >= 64; base += 64) {
+    scan_block(kernels, (const uint8_t *)chars + base, base, &carry,
+               positions, positions_len);
+  }
+  if (base < len) {
+    uint8_t block[64];
+    memset(block, ' ', sizeof(block));
+    memcpy(block, chars + base, len - base);
+    scan_block(kernels, block, base, &carry, positions, positions_len);
+  }
+  return carry.in_string == 0;
+}
+
+/*** PARSING ***/
+
+typedef struct {
+  VirtualMachine *vm;
+  const ByteKernels *kernels;
+  const char *chars;
+  uint32_t len;
+  const uint32_t *positions;
+  uint32_t positions_len;
+  // Index of the next token in `positions`.
+  uint32_t next;
+  // Strings with escapes are decoded here before being interned.
+  char *scratch;
+  uint32_t scratch_capacity;
+  // Every cached key is held by a map on the stack, or in one reachable
+  // from it, so none of them is collected while parsing.
+  ObjString *keys[JSON_KEY_CACHE_LEN];
+  uint32_t object_len_hints[JSON_SIZE_HINTS_LEN];
+  const char *error;
+  uint32_t error_pos;
+} JsonParser;
+
+static bool fail(JsonParser *parser, uint32_t pos, const char *error) {
+  parser->error = error;
+  parser->error_pos = pos;
+  return false;
+}
+
+static bool is_delimiter(const JsonParser *parser, uint32_t pos) {
+  if (pos == parser->len) {
+    return true;
+  }
+  switch (parser->chars[pos]) {
+  case ' ':
+  case '\t':
+  case '\n':
+  case '\r':
+  case ',':
+  case ':':
+  case '[':
+  case ']':
+  case '{':
+  case '}':
+    return true;
+  default:
+    return false;
+  }
+}
+
+// The byte starting the next token, or 0 past the last one.
+static char peek_token(const JsonParser *parser) {
+  if (parser->next == parser->positions_len) {
+    return '\0';
+  }
+  return parser->chars[parser->positions[parser->next]];
+}
+
+static uint32_t token_pos(const JsonParser *parser) {
+  if (parser->next == parser->positions_len) {
+    return parser->len;
+  }
+  return parser->positions[parser->next];
+}
+
+static bool expect_token(JsonParser *parser, char token, const char *error) {
+  if (peek_token(parser) != token) {
+    return fail(parser, token_pos(parser), error);
+  }
+  parser->next += 1;
+  return true;
+}
+
+static void reserve_scratch(JsonParser *parser, uint32_t len) {
+  if (len <= parser->scratch_capacity) {
+    return;
+  }
+  uint32_t capacity = GROW_CAPACITY(parser->scratch_capacity);
+  capacity = capacity < len ? len : capacity;
+  parser->scratch = (char *)realloc(parser->scratch, capacity);
+  if (parser->scratch == NULL) {
+    fprintf(stderr, "Not enough memory to parse JSON.");
+    exit(1);
+  }
+  parser->scratch_capacity = capacity;
+}
+
+static int32_t hex_digit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// Reads the four hex digits of a `\u` escape.
+static bool read_code_unit(JsonParser *parser, uint32_t pos, uint32_t *unit) {
+  if (parser->len - pos < 4) {
+    return fail(parser, pos, "truncated \\u escape");
+  }
+  *unit = 0;
+  for (uint32_t i = 0; i < 4; i += 1) {
+    int32_t digit = hex_digit(parser->chars[pos + i]);
+    if (digit < 0) {
+      return fail(parser, pos + i, "invalid \\u escape");
+    }
+    *unit = *unit * 16 + (uint32_t)digit;
+  }
+  return true;
+}
+
+static uint32_t encode_utf8(uint32_t code_point, char *out) {
+  if (code_point < 0x80) {
+    out[0] = (char)code_point;
+    return 1;
+  }
+  if (code_point < 0x800) {
+    out[0] = (char)(0xc0 | code_point >> 6);
+    out[1] = (char)(0x80 | (code_point & 0x3f));
+    return 2;
+  }
+  if (code_point < 0x10000) {
+    out[0] = (char)(0xe0 | code_point >> 12);
+    out[1] = (char)(0x80 | (code_point >> 6 & 0x3f));
+    out[2] = (char)(0x80 | (code_point & 0x3f));
+    return 3;
+  }
+  out[0] = (char)(0xf0 | code_point >> 18);
+  out[1] = (char)(0x80 | (code_point >> 12 & 0x3f));
+  out[2] = (char)(0x80 | (code_point >> 6 & 0x3f));
+  out[3] = (char)(0x80 | (code_point & 0x3f));
+  return 4;
+}
+
+// Decodes the escape after a backslash at `*pos` into the scratch buffer.
+static bool decode_escape(JsonParser *parser, uint32_t *pos,
+                          uint32_t *out_len) {
+  uint32_t escape = *pos + 1;
+  if (escape == parser->len) {
+    return fail(parser, *pos, "unterminated string");
+  }
+  char decoded;
+  switch (parser->chars[escape]) {
+  case '"':
+  case '\\':
+  case '/':
+    decoded = parser->chars[escape];
+    break;
+  case 'b':
+    decoded = '\b';
+    break;
+  case 'f':
+    decoded = '\f';
+    break;
+  case 'n':
+    decoded = '\n';
+    break;
+  case 'r':
+    decoded = '\r';
+    break;
+  case 't':
+    decoded = '\t';
+    break;
+  case 'u': {
+    uint32_t code_point;
+    if (!read_code_unit(parser, escape + 1, &code_point)) {
+      return false;
+    }
+    *pos = escape + 5;
+    if (code_point >= 0xdc00 && code_point <= 0xdfff) {
+      return fail(parser, escape - 1, "unpaired surrogate");
+    }
+    // A high surrogate must be followed by the escape of a low one.
+    if (code_point >= 0xd800 && code_point <= 0xdbff) {
+      uint32_t low;
+      if (parser->len - *pos < 2 || parser->chars[*pos] != '\\' ||
+          parser->chars[*pos + 1] != 'u' ||
+          !read_code_unit(parser, *pos + 2, &low) || low < 0xdc00 ||
+          low > 0xdfff) {
+        return fail(parser, escape - 1, "unpaired surrogate");
+      }
+      code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+      *pos += 6;
+    }
+    *out_len += encode_utf8(code_point, parser->scratch + *out_len);
+    return true;
+  }
+  default:
+    return fail(parser, *pos, "invalid escape");
+  }
+  parser->scratch[*out_len] = decoded;
+  *out_len += 1;
+  *pos = escape + 1;
+  return true;
+}
+
+// Reads the string whose opening quote is at `pos`. Strings without
+// escapes are interned straight from the text.
+static bool parse_string(JsonParser *parser, uint32_t pos,
+                         ObjString **string) {
+  uint32_t start = pos + 1;
+  uint32_t run = parser->kernels->plain_len(parser->chars + start,
+                                            parser->len - start);
+  if (start + run < parser->len && parser->chars[start + run] == '"') {
+    *string = copy_string(parser->vm, parser->chars + start, run);
+    return true;
+  }
+
+  uint32_t out_len = 0;
+  uint32_t cur = start;
+  while (true) {
+    run = parser->kernels->plain_len(parser->chars + cur, parser->len - cur);
+    // Room for the run and the longest decoded escape.
+    reserve_scratch(parser, out_len + run + 4);
+    memcpy(parser->scratch + out_len, parser->chars + cur, run);
+    out_len += run;
+    cur += run;
+    if (cur == parser->len) {
+      return fail(parser, pos, "unterminated string");
+    }
+    char c = parser->chars[cur];
+    if (c == '"') {
+      break;
+    }
+    if (c != '\\') {
+      return fail(parser, cur, "control character in string");
+    }
+    if (!decode_escape(parser, &cur, &out_len)) {
+      return false;
+    }
+  }
+  *string = copy_string(parser->vm, parser->scratch, out_len);
+  return true;
+}
+
+// Reads an object key, looking it up in the key cache first.
+static bool parse_key(JsonParser *parser, uint32_t pos, ObjString **key) {
+  uint32_t start = pos + 1;
+  const char *chars = parser->chars + start;
+  uint32_t run = parser->kernels->plain_len(chars, parser->len - start);
+  if (run == 0 || run > JSON_KEY_CACHED_MAX || start + run == parser->len ||
+      chars[run] != '"') {
+    return parse_string(parser, pos, key);
+  }
+  uint32_t slot = (run * 7 + (uint8_t)chars[0] * 31 + (uint8_t)chars[run - 1]) &
+                  (JSON_KEY_CACHE_LEN - 1);
+  ObjString *cached = parser->keys[slot];
+  if (cached != NULL && cached->len == run &&
+      memcmp(cached->chars, chars, run) == 0) {
+    *key = cached;
+    return true;
+  }
+  *key = copy_string(parser->vm, chars, run);
+  parser->keys[slot] = *key;
+  return true;
+}
+
+static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Reads a number, exactly: when its digits fit in a double's mantissa and
+// its power of ten is itself exact, a single multiplication or division
+// rounds correctly; strtod handles the rest.
+static bool parse_number(JsonParser *parser, uint32_t pos, double *number) {
+  const char *chars = parser->chars;
+  uint32_t cur = pos;
+  bool negative = chars[cur] == '-';
+  cur += negative ? 1 : 0;
+
+  uint64_t mantissa = 0;
+  uint32_t digits = 0;
+  int32_t exponent = 0;
+  if (cur == parser->len || chars[cur] < '0' || chars[cur] > '9') {
+    return fail(parser, pos, "invalid number");
+  }
+  if (chars[cur] == '0') {
+    cur += 1;
+  } else {
+    for (; cur < parser->len && chars[cur] >= '0' && chars[cur] <= '9';
+         cur += 1) {
+      mantissa = mantissa * 10 + (uint64_t)(chars[cur] - '0');
+      digits += 1;
+    }
+  }
+  if (cur < parser->len && chars[cur] == '.') {
+    cur += 1;
+    if (cur == parser->len || chars[cur] < '0' || chars[cur] > '9') {
+      return fail(parser, pos, "invalid number");
+    }
+    for (; cur < parser->len && chars[cur] >= '0' && chars[cur] <= '9';
+         cur += 1) {
+      mantissa = mantissa * 10 + (uint64_t)(chars[cur] - '0');
+      digits += mantissa > 0 ? 1 : 0;
+      exponent -= 1;
+    }
+  }
+  if (cur < parser->len && (chars[cur] == 'e' || chars[cur] == 'E')) {
+    cur += 1;
+    bool exponent_negative = cur < parser->len && chars[cur] == '-';
+    cur += cur < parser->len && (chars[cur] == '-' || chars[cur] == '+');
+    if (cur == parser->len || chars[cur] < '0' || chars[cur] > '9') {
+      return fail(parser, pos, "invalid number");
+    }
+    int32_t written = 0;
+    for (; cur < parser->len && chars[cur] >= '0' && chars[cur] <= '9';
+         cur += 1) {
+      written = written < 100000 ? written * 10 + (chars[cur] - '0') : written;
+    }
+    exponent += exponent_negative ? -written : written;
+  }
+  if (!is_delimiter(parser, cur)) {
+    return fail(parser, pos, "invalid number");
+  }
+
+  if (digits <= JSON_FAST_DIGITS_MAX && mantissa <= (uint64_t)1 << 53 &&
+      exponent >= -22 && exponent <= 22) {
+    double value = (double)mantissa;
+    value = exponent < 0 ? value / powers_of_ten[-exponent]
+                         : value * powers_of_ten[exponent];
+    *number = negative ? -value : value;
+    return true;
+  }
+
+  // strtod needs the token on its own, or it could read past it.
+  uint32_t len = cur - pos;
+  reserve_scratch(parser, len + 1);
+  memcpy(parser->scratch, chars + pos, len);
+  parser->scratch[len] = '\0';
+  *number = strtod(parser->scratch, NULL);
+  return true;
+}
+
+static bool parse_literal(JsonParser *parser, uint32_t pos,
+                          const char *literal, uint32_t len) {
+  if (parser->len - pos < len ||
+      memcmp(parser->chars + pos, literal, len) != 0 ||
+      !is_delimiter(parser, pos + len)) {
+    return fail(parser, pos, "invalid literal");
+  }
+  return true;
+}
+
+static bool parse_value(JsonParser *parser, uint32_t depth, Value *value);
+
+// Fills a list pushed on the stack, where the GC sees it.
+static bool parse_array(JsonParser *parser, uint32_t depth, Value *value) {
+  VirtualMachine *vm = parser->vm;
+  ObjList *list = new_list(vm);
+  push_stack(vm, OBJ_VAL(list));
+  if (peek_token(parser) == ']') {
+    parser->next += 1;
+  } else {
+    while (true) {
+      Value element;
+      if (!parse_value(parser, depth, &element)) {
+        return false;
+      }
+      push_stack(vm, element);
+      write_value_vec(vm, &list->items, element);
+      pop_stack(vm);
+      if (peek_token(parser) != ',') {
+        break;
+      }
+      parser->next += 1;
+    }
+    if (!expect_token(parser, ']', "expected ',' or ']'")) {
+      return false;
+    }
+  }
+  *value = pop_stack(vm);
+  return true;
+}
+
+static bool parse_object(JsonParser *parser, uint32_t depth, Value *value) {
+  VirtualMachine *vm = parser->vm;
+  ObjMap *map = new_map(vm);
+  push_stack(vm, OBJ_VAL(map));
+  uint32_t *len_hint =
+      &parser->object_len_hints[depth & (JSON_SIZE_HINTS_LEN - 1)];
+  map_reserve(vm, map, *len_hint);
+  if (peek_token(parser) == '}') {
+    parser->next += 1;
+  } else {
+    while (true) {
+      uint32_t pos = token_pos(parser);
+      ObjString *key;
+      if (peek_token(parser) != '"') {
+        return fail(parser, pos, "expected a string key");
+      }
+      parser->next += 1;
+      if (!parse_key(parser, pos, &key)) {
+        return false;
+      }
+      push_stack(vm, OBJ_VAL(key));
+      Value member;
+      if (!expect_token(parser, ':', "expected ':'") ||
+          !parse_value(parser, depth, &member)) {
+        return false;
+      }
+      push_stack(vm, member);
+      map_set(vm, map, OBJ_VAL(key), member);
+      pop_stack(vm);
+      pop_stack(vm);
+      if (peek_token(parser) != ',') {
+        break;
+      }
+      parser->next += 1;
+    }
+    if (!expect_token(parser, '}', "expected ',' or '}'")) {
+      return false;
+    }
+  }
+  *len_hint = map->len;
+  *value = pop_stack(vm);
+  return true;
+}
+
+static bool parse_value(JsonParser *parser, uint32_t depth, Value *value) {
+  uint32_t pos = token_pos(parser);
+  if (parser->next == parser->positions_len) {
+    return fail(parser, pos, "expected a value");
+  }
+  parser->next += 1;
+  switch (parser->chars[pos]) {
+  case '[':
+  case '{':
+    if (depth == JSON_DEPTH_MAX) {
+      return fail(parser, pos, "too deeply nested");
+    }
+    return parser->chars[pos] == '['
+               ? parse_array(parser, depth + 1, value)
+               : parse_object(parser, depth + 1, value);
+  case '"': {
+    ObjString *string;
+    if (!parse_string(parser, pos, &string)) {
+      return false;
+    }
+    *value = OBJ_VAL(string);
+    return true;
+  }
+  case 't':
+    *value = BOOL_VAL(true);
+    return parse_literal(parser, pos, "true", 4);
+  case 'f':
+    *value = BOOL_VAL(false);
+    return parse_literal(parser, pos, "false", 5);
+  case 'n':
+    *value = NULL_VAL;
+    return parse_literal(parser, pos, "null", 4);
+  case '-':
+  case '0':
+  case '1':
+  case '2':
+  case '3':
+  case '4':
+  case '5':
+  case '6':
+  case '7':
+  case '8':
+  case '9': {
+    double number;
+    if (!parse_number(parser, pos, &number)) {
+      return false;
+    }
+    *value = NUMBER_VAL(number);
+    return true;
+  }
+  default:
+    return fail(parser, pos, "expected a value");
+  }
+}
+
+Value json_parse_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1 || !IS_STRING(args[0])) {
+    return native_error(vm, "json_parse expects a string.");
+  }
+  ObjString *text = AS_STRING(args[0]);
+  uint32_t *positions =
+      (uint32_t *)malloc(sizeof(uint32_t) * ((size_t)text->len + 1));
+  if (positions == NULL) {
+    fprintf(stderr, "Not enough memory to parse JSON.");
+    exit(1);
+  }
+  JsonParser parser = {
+      .vm = vm,
+      .kernels = byte_kernels(),
+      .chars = text->chars,
+      .len = text->len,
+      .positions = positions,
+  };
+
+  Value value = NULL_VAL;
+  bool parsed = false;
+  if (!index_text(text->chars, text->len, positions,
+                  &parser.positions_len)) {
+    fail(&parser, text->len, "unterminated string");
+  } else if (parse_value(&parser, 0, &value)) {
+    parsed = parser.next == parser.positions_len ||
+             fail(&parser, token_pos(&parser), "unexpected data after JSON");
+  }
+  free(positions);
+  free(parser.scratch);
+  if (!parsed) {
+    return native_error(vm, "Invalid JSON at byte %u: %s.",
+                        parser.error_pos, parser.error);
+  }
+  return value;
+}
+
+/*** SERIALIZING ***/
+
+typedef struct {
+  VirtualMachine *vm;
+  const ByteKernels *kernels;
+  // Grown on the VM's heap, then handed over to the resulting string.
+  char *chars;
+  uint32_t len;
+  uint32_t capacity;
+} JsonWriter;
+
+static void reserve_output(JsonWriter *writer, uint32_t len) {
+  // One more byte for the string's terminator.
+  uint32_t needed = writer->len + len + 1;
+  if (needed <= writer->capacity) {
+    return;
+  }
+  uint32_t capacity = GROW_CAPACITY(writer->capacity);
+  capacity = capacity < needed ? needed : capacity;
+  writer->chars = GROW_ARRAY(writer->vm, char, writer->chars,
+                             writer->capacity, capacity);
+  writer->capacity = capacity;
+}
+
+static void write_bytes(JsonWriter *writer, const char *bytes, uint32_t len) {
+  reserve_output(writer, len);
+  memcpy(writer->chars + writer->len, bytes, len);
+  writer->len += len;
+}
+
+static void write_byte(JsonWriter *writer, char byte) {
+  reserve_output(writer, 1);
+  writer->chars[writer->len] = byte;
+  writer->len += 1;
+}
+
+static void write_string(JsonWriter *writer, const ObjString *string) {
+  static const char hex[] = "0123456789abcdef";
+  write_byte(writer, '"');
+  uint32_t cur = 0;
+  while (true) {
+    uint32_t run =
+        writer->kernels->plain_len(string->chars + cur, string->len - cur);
+    write_bytes(writer, string->chars + cur, run);
+    cur += run;
+    if (cur == string->len) {
+      break;
+    }
+    uint8_t c = (uint8_t)string->chars[cur];
+    cur += 1;
+    char escape[6] = {'\\', (char)c};
+    uint32_t escape_len = 2;
+    switch (c) {
+    case '"':
+    case '\\':
+      break;
+    case '\b':
+      escape[1] = 'b';
+      break;
+    case '\f':
+      escape[1] = 'f';
+      break;
+    case '\n':
+      escape[1] = 'n';
+      break;
+    case '\r':
+      escape[1] = 'r';
+      break;
+    case '\t':
+      escape[1] = 't';
+      break;
+    default:
+      memcpy(escape + 1, "u00", 3);
+      escape[4] = hex[c >> 4];
+      escape[5] = hex[c & 0xf];
+      escape_len = 6;
+      break;
+    }
+    write_bytes(writer, escape, escape_len);
+  }
+  write_byte(writer, '"');
+}
+
+// Integers are printed digit by digit; other numbers with the fewest
+// significant digits that read back as the same double.
+// Shortest digits are found with Grisu2: the double and the bounds of the
+// interval that rounds to it are scaled by a cached power of ten into a
+// 64-bit fixed point, and digits are generated until they fall within the
+// interval. The result always reads back the same, and is the shortest for
+// nearly all doubles.
+typedef struct {
+  uint64_t f;
+  int32_t e;
+} DiyFp;
+
+// Normalized 10^k for k = -348, -340, ..., 340.
+static const struct {
+  uint64_t f;
+  int16_t e;
+} cached_powers[] = {
+    {0xfa8fd5a0081c0288ull, -1220}, {0xbaaee17fa23ebf76ull, -1193},
+    {0x8b16fb203055ac76ull, -1166}, {0xcf42894a5dce35eaull, -1140},
+    {0x9a6bb0aa55653b2dull, -1113}, {0xe61acf033d1a45dfull, -1087},
+    {0xab70fe17c79ac6caull, -1060}, {0xff77b1fcbebcdc4full, -1034},
+    {0xbe5691ef416bd60cull, -1007}, {0x8dd01fad907ffc3cull, -980},
+    {0xd3515c2831559a83ull, -954}, {0x9d71ac8fada6c9b5ull, -927},
+    {0xea9c227723ee8bcbull, -901}, {0xaecc49914078536dull, -874},
+    {0x823c12795db6ce57ull, -847}, {0xc21094364dfb5637ull, -821},
+    {0x9096ea6f3848984full, -794}, {0xd77485cb25823ac7ull, -768},
+    {0xa086cfcd97bf97f4ull, -741}, {0xef340a98172aace5ull, -715},
+    {0xb23867fb2a35b28eull, -688}, {0x84c8d4dfd2c63f3bull, -661},
+    {0xc5dd44271ad3cdbaull, -635}, {0x936b9fcebb25c996ull, -608},
+    {0xdbac6c247d62a584ull, -582}, {0xa3ab66580d5fdaf6ull, -555},
+    {0xf3e2f893dec3f126ull, -529}, {0xb5b5ada8aaff80b8ull, -502},
+    {0x87625f056c7c4a8bull, -475}, {0xc9bcff6034c13053ull, -449},
+    {0x964e858c91ba2655ull, -422}, {0xdff9772470297ebdull, -396},
+    {0xa6dfbd9fb8e5b88full, -369}, {0xf8a95fcf88747d94ull, -343},
+    {0xb94470938fa89bcfull, -316}, {0x8a08f0f8bf0f156bull, -289},
+    {0xcdb02555653131b6ull, -263}, {0x993fe2c6d07b7facull, -236},
+    {0xe45c10c42a2b3b06ull, -210}, {0xaa242499697392d3ull, -183},
+    {0xfd87b5f28300ca0eull, -157}, {0xbce5086492111aebull, -130},
+    {0x8cbccc096f5088ccull, -103}, {0xd1b71758e219652cull, -77},
+    {0x9c40000000000000ull, -50}, {0xe8d4a51000000000ull, -24},
+    {0xad78ebc5ac620000ull, 3}, {0x813f3978f8940984ull, 30},
+    {0xc097ce7bc90715b3ull, 56}, {0x8f7e32ce7bea5c70ull, 83},
+    {0xd5d238a4abe98068ull, 109}, {0x9f4f2726179a2245ull, 136},
+    {0xed63a231d4c4fb27ull, 162}, {0xb0de65388cc8ada8ull, 189},
+    {0x83c7088e1aab65dbull, 216}, {0xc45d1df942711d9aull, 242},
+    {0x924d692ca61be758ull, 269}, {0xda01ee641a708deaull, 295},
+    {0xa26da3999aef774aull, 322}, {0xf209787bb47d6b85ull, 348},
+    {0xb454e4a179dd1877ull, 375}, {0x865b86925b9bc5c2ull, 402},
+    {0xc83553c5c8965d3dull, 428}, {0x952ab45cfa97a0b3ull, 455},
+    {0xde469fbd99a05fe3ull, 481}, {0xa59bc234db398c25ull, 508},
+    {0xf6c69a72a3989f5cull, 534}, {0xb7dcbf5354e9beceull, 561},
+    {0x88fcf317f22241e2ull, 588}, {0xcc20ce9bd35c78a5ull, 614},
+    {0x98165af37b2153dfull, 641}, {0xe2a0b5dc971f303aull, 667},
+    {0xa8d9d1535ce3b396ull, 694}, {0xfb9b7cd9a4a7443cull, 720},
+    {0xbb764c4ca7a44410ull, 747}, {0x8bab8eefb6409c1aull, 774},
+    {0xd01fef10a657842cull, 800}, {0x9b10a4e5e9913129ull, 827},
+    {0xe7109bfba19c0c9dull, 853}, {0xac2820d9623bf429ull, 880},
+    {0x80444b5e7aa7cf85ull, 907}, {0xbf21e44003acdd2dull, 933},
+    {0x8e679c2f5e44ff8full, 960}, {0xd433179d9c8cb841ull, 986},
+    {0x9e19db92b4e31ba9ull, 1013}, {0xeb96bf6ebadf77d9ull, 1039},
+    {0xaf87023b9bf0ee6bull, 1066},
+};
+
+static const uint32_t powers_of_ten_u32[] = {
+    1,      10,      100,      1000,      10000,
+    100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+static DiyFp diy_normalize(DiyFp x) {
+  int32_t shift = __builtin_clzll(x.f);
+  return (DiyFp){x.f << shift, x.e - shift};
+}
+
+static DiyFp diy_multiply(DiyFp x, DiyFp y) {
+  const uint64_t mask = 0xffffffff;
+  uint64_t a = x.f >> 32, b = x.f & mask, c = y.f >> 32, d = y.f & mask;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  // Middle 32 bits of the product, plus half a unit to round to nearest.
+  uint64_t middle = (bd >> 32) + (ad & mask) + (bc & mask) + (1u << 31);
+  return (DiyFp){ac + (ad >> 32) + (bc >> 32) + (middle >> 32),
+                 x.e + y.e + 64};
+}
+
+static uint32_t count_digits(uint32_t n) {
+  uint32_t digits = 1;
+  while (digits < 10 && n >= powers_of_ten_u32[digits]) {
+    digits += 1;
+  }
+  return digits;
+}
+
+// Nudges the last digit down while that brings it closer to the double.
+static void grisu_round(char *digits, uint32_t len, uint64_t delta,
+                        uint64_t rest, uint64_t ten_kappa, uint64_t distance) {
+  while (rest < distance && delta - rest >= ten_kappa &&
+         (rest + ten_kappa < distance ||
+          distance - rest > rest + ten_kappa - distance)) {
+    digits[len - 1] -= 1;
+    rest += ten_kappa;
+  }
+}
+
+// Writes the digits of a positive finite double, and returns how many; the
+// double is the digits times 10^`exponent`.
+static uint32_t grisu2(double number, char *digits, int32_t *exponent) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  const uint64_t hidden = 1ull << 52;
+  int32_t biased = (int32_t)(bits >> 52) & 0x7ff;
+  uint64_t fraction = bits & (hidden - 1);
+  DiyFp v = biased != 0 ? (DiyFp){fraction | hidden, biased - 1075}
+                        : (DiyFp){fraction, -1074};
+
+  // The bounds halfway to the neighbouring doubles, on the upper one's scale.
+  DiyFp upper = diy_normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+  DiyFp lower = v.f == hidden ? (DiyFp){(v.f << 2) - 1, v.e - 2}
+                              : (DiyFp){(v.f << 1) - 1, v.e - 1};
+  lower.f <<= lower.e - upper.e;
+  lower.e = upper.e;
+
+  // Picks 10^-k so that the scaled upper bound's exponent is in [-60, -32].
+  double dk = (-61 - upper.e) * 0.30102999566398114 + 347;
+  int32_t k = (int32_t)dk;
+  k += dk - k > 0 ? 1 : 0;
+  uint32_t index = (uint32_t)(k >> 3) + 1;
+  *exponent = 348 - (int32_t)index * 8;
+  DiyFp power = {cached_powers[index].f, cached_powers[index].e};
+
+  DiyFp w = diy_multiply(diy_normalize(v), power);
+  DiyFp w_upper = diy_multiply(upper, power);
+  DiyFp w_lower = diy_multiply(lower, power);
+  w_upper.f -= 1;
+  w_lower.f += 1;
+  uint64_t delta = w_upper.f - w_lower.f;
+  uint64_t distance = w_upper.f - w.f;
+
+  // Integral digits of the upper bound come from `integral`, the rest from
+  // `fractional`, scaled by `one`.
+  int32_t shift = -w_upper.e;
+  uint64_t one = 1ull << shift;
+  uint32_t integral = (uint32_t)(w_upper.f >> shift);
+  uint64_t fractional = w_upper.f & (one - 1);
+  uint32_t len = 0;
+  for (int32_t kappa = (int32_t)count_digits(integral); kappa > 0;) {
+    uint32_t unit = powers_of_ten_u32[kappa - 1];
+    uint32_t digit = integral / unit;
+    integral %= unit;
+    if (digit != 0 || len != 0) {
+      digits[len] = (char)('0' + digit);
+      len += 1;
+    }
+    kappa -= 1;
+    uint64_t rest = ((uint64_t)integral << shift) + fractional;
+    if (rest <= delta) {
+      *exponent += kappa;
+      grisu_round(digits, len, delta, rest,
+                  (uint64_t)powers_of_ten_u32[kappa] << shift, distance);
+      return len;
+    }
+  }
+  for (int32_t kappa = 0;;) {
+    fractional *= 10;
+    delta *= 10;
+    uint32_t digit = (uint32_t)(fractional >> shift);
+    if (digit != 0 || len != 0) {
+      digits[len] = (char)('0' + digit);
+      len += 1;
+    }
+    fractional &= one - 1;
+    kappa -= 1;
+    if (fractional < delta) {
+      *exponent += kappa;
+      uint64_t scale = -kappa < 10 ? powers_of_ten_u32[-kappa]
+                                   : (uint64_t)powers_of_ten_u32[9] *
+                                         powers_of_ten_u32[-kappa - 9];
+      grisu_round(digits, len, delta, fractional, one, distance * scale);
+      return len;
+    }
+  }
+}
+
+// Lays out the digits as JavaScript does: in plain notation when the
+// decimal point falls within 21 places left of them or 6 right, and in
+// exponent notation otherwise.
+static uint32_t format_double(double number, char *out) {
+  uint32_t len = 0;
+  if (number < 0) {
+    out[len] = '-';
+    len += 1;
+    number = -number;
+  }
+  char digits[24];
+  int32_t exponent;
+  int32_t digits_len = (int32_t)grisu2(number, digits, &exponent);
+  // Digits before the decimal point.
+  int32_t point = digits_len + exponent;
+  if (digits_len <= point && point <= 21) {
+    memcpy(out + len, digits, (size_t)digits_len);
+    memset(out + len + digits_len, '0', (size_t)(point - digits_len));
+    return len + (uint32_t)point;
+  }
+  if (0 < point && point <= 21) {
+    memcpy(out + len, digits, (size_t)point);
+    out[len + point] = '.';
+    memcpy(out + len + point + 1, digits + point,
+           (size_t)(digits_len - point));
+    return len + (uint32_t)digits_len + 1;
+  }
+  if (-6 < point && point <= 0) {
+    out[len] = '0';
+    out[len + 1] = '.';
+    memset(out + len + 2, '0', (size_t)-point);
+    memcpy(out + len + 2 - point, digits, (size_t)digits_len);
+    return len + 2 + (uint32_t)(digits_len - point);
+  }
+  out[len] = digits[0];
+  len += 1;
+  if (digits_len > 1) {
+    out[len] = '.';
+    memcpy(out + len + 1, digits + 1, (size_t)(digits_len - 1));
+    len += (uint32_t)digits_len;
+  }
+  len += (uint32_t)snprintf(out + len, 8, "e%+d", point - 1);
+  return len;
+}
+
+static bool write_number(JsonWriter *writer, double number) {
+  if (!isfinite(number)) {
+    native_error(writer->vm, "json_stringify cannot encode NaN or "
+                             "infinity.");
+    return false;
+  }
+  char digits[32];
+  uint32_t len = 0;
+  if (number > -9007199254740992.0 && number < 9007199254740992.0 &&
+      number == (double)(int64_t)number) {
+    int64_t integer = (int64_t)number;
+    uint64_t magnitude = integer < 0 ? (uint64_t)-integer : (uint64_t)integer;
+    char reversed[20];
+    uint32_t reversed_len = 0;
+    do {
+      reversed[reversed_len] = (char)('0' + magnitude % 10);
+      reversed_len += 1;
+      magnitude /= 10;
+    } while (magnitude > 0);
+    if (integer < 0) {
+      digits[len] = '-';
+      len += 1;
+    }
+    while (reversed_len > 0) {
+      reversed_len -= 1;
+      digits[len] = reversed[reversed_len];
+      len += 1;
+    }
+  } else {
+    len = format_double(number, digits);
+  }
+  write_bytes(writer, digits, len);
+  return true;
+}
+
+static bool write_value(JsonWriter *writer, Value value, uint32_t depth) {
+  if (IS_NULL(value)) {
+    write_bytes(writer, "null", 4);
+    return true;
+  }
+  if (IS_BOOL(value)) {
+    if (AS_BOOL(value)) {
+      write_bytes(writer, "true", 4);
+    } else {
+      write_bytes(writer, "false", 5);
+    }
+    return true;
+  }
+  if (IS_NUMBER(value)) {
+    return write_number(writer, AS_NUMBER(value));
+  }
+  if (IS_STRING(value)) {
+    write_string(writer, AS_STRING(value));
+    return true;
+  }
+  if (!IS_LIST(value) && !IS_MAP(value) && !IS_FLOAT64_ARRAY(value)) {
+    native_error(writer->vm, "json_stringify expects null, booleans, "
+                             "numbers, strings, lists, maps and float64 "
+                             "arrays.");
+    return false;
+  }
+  if (depth == JSON_DEPTH_MAX) {
+    native_error(writer->vm, "Cannot stringify a value nested more than %d "
+                             "levels deep, or cyclic.",
+                 JSON_DEPTH_MAX);
+    return false;
+  }
+
+  if (IS_FLOAT64_ARRAY(value)) {
+    ObjFloat64Array *array = AS_FLOAT64_ARRAY(value);
+    write_byte(writer, '[');
+    for (uint32_t i = 0; i < array->len; i += 1) {
+      if (i > 0) {
+        write_byte(writer, ',');
+      }
+      if (!write_number(writer, array->values[i])) {
+        return false;
+      }
+    }
+    write_byte(writer, ']');
+    return true;
+  }
+  if (IS_LIST(value)) {
+    ValueVec *items = &AS_LIST(value)->items;
+    write_byte(writer, '[');
+    for (uint32_t i = 0; i < items->len; i += 1) {
+      if (i > 0) {
+        write_byte(writer, ',');
+      }
+      if (!write_value(writer, items->values[i], depth + 1)) {
+        return false;
+      }
+    }
+    write_byte(writer, ']');
+    return true;
+  }
+
+  ObjMap *map = AS_MAP(value);
+  bool first = true;
+  write_byte(writer, '{');
+  for (uint32_t i = 0; i < map->entries_len; i += 1) {
+    MapEntry *entry = &map->entries[i];
+    if (IS_EMPTY(entry->key)) {
+      continue;
+    }
+    if (!IS_STRING(entry->key)) {
+      native_error(writer->vm, "json_stringify expects maps with string "
+                               "keys.");
+      return false;
+    }
+    if (!first) {
+      write_byte(writer, ',');
+    }
+    first = false;
+    write_string(writer, AS_STRING(entry->key));
+    write_byte(writer, ':');
+    if (!write_value(writer, entry->value, depth + 1)) {
+      return false;
+    }
+  }
+  write_byte(writer, '}');
+  return true;
+}
+
+Value json_stringify_native(VirtualMachine *vm, int32_t args_len,
+                            Value *args) {
+  if (args_len != 1) {
+    return native_error(vm, "json_stringify expects one value.");
+  }
+  JsonWriter writer = {.vm = vm, .kernels = byte_kernels()};
+  if (!write_value(&writer, args[0], 0)) {
+    FREE_ARRAY(vm, char, writer.chars, writer.capacity);
+    return NULL_VAL;
+  }
+  // Shrink the buffer to the string's size, which is what frees it later.
+  writer.chars = GROW_ARRAY(vm, char, writer.chars, writer.capacity,
+                            writer.len + 1);
+  writer.chars[writer.len] = '\0';
+  return OBJ_VAL(take_string(vm, writer.chars, writer.len));
+}
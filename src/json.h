@@ -0,0 +1,36 @@
+#ifndef breeze_json_h
+#define breeze_json_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/***
+  JSON text is parsed in two stages. The first classifies the input 64
+  bytes at a time with the SIMD byte kernels, works out which quotes are
+  escaped and which bytes lie inside strings with a few bit operations per
+  block, and records where every token starts. The second walks those
+  positions and builds values straight away: objects become maps, arrays
+  lists, and strings are interned, read in place unless they hold escapes.
+  Numbers take an exact fast path when they have few enough digits, and
+  strtod otherwise.
+
+  Serializing goes the other way, for null, booleans, finite numbers,
+  strings, lists, float64 arrays and maps with string keys. Strings are
+  copied in runs that need no escaping, found with the same byte kernels,
+  and numbers are printed with Grisu2, which gives digits that read back
+  the same, and the fewest such digits for nearly every double.
+
+  Bytes that are not ASCII are taken as they are, without checking that
+  they form valid UTF-8.
+  ***/
+
+/* json_parse(string): Parses a JSON text into maps, lists and scalars */
+Value json_parse_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* json_stringify(value): Serializes a value as compact JSON text */
+Value json_stringify_native(VirtualMachine *vm, int32_t args_len,
+                            Value *args);
+
+#endif // !breeze_json_h
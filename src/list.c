@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "list.h"
+
+#include "object.h"
+#include "virtual_machine.h"
+
+static bool check_list(VirtualMachine *vm, const char *native,
+                       int32_t args_len, Value *args) {
+  if (args_len < 1 || !IS_LIST(args[0])) {
+    native_error(vm, "%s expects a list.", native);
+    return false;
+  }
+  if (AS_OBJ(args[0])->is_shared) {
+    native_error(vm, "Cannot change a frozen list.");
+    return false;
+  }
+  return true;
+}
+
+Value push_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_list(vm, "push", args_len, args)) {
+    return NULL_VAL;
+  }
+  ValueVec *items = &AS_LIST(args[0])->items;
+  for (int32_t i = 1; i < args_len; i += 1) {
+    write_value_vec(vm, items, args[i]);
+  }
+  return NUMBER_VAL(items->len);
+}
+
+Value pop_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_list(vm, "pop", args_len, args)) {
+    return NULL_VAL;
+  }
+  if (args_len != 1) {
+    return native_error(vm, "pop expects one list.");
+  }
+  ValueVec *items = &AS_LIST(args[0])->items;
+  if (items->len == 0) {
+    return native_error(vm, "Cannot pop from an empty list.");
+  }
+  items->len -= 1;
+  return items->values[items->len];
+}
+
+Value len_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len == 1 && IS_LIST(args[0])) {
+    return NUMBER_VAL(AS_LIST(args[0])->items.len);
+  }
+  if (args_len == 1 && IS_STRING(args[0])) {
+    return NUMBER_VAL(AS_STRING(args[0])->len);
+  }
+  if (args_len == 1 && IS_MAP(args[0])) {
+    return NUMBER_VAL(AS_MAP(args[0])->len);
+  }
+  if (args_len == 1 && IS_FLOAT64_ARRAY(args[0])) {
+    return NUMBER_VAL(AS_FLOAT64_ARRAY(args[0])->len);
+  }
+  if (args_len == 1 && IS_MAPPED_FILE(args[0])) {
+    return NUMBER_VAL((double)AS_MAPPED_FILE(args[0])->len);
+  }
+  return native_error(vm, "len expects a list, a map, a float64 array, a "
+                          "mapped file or a string.");
+}
@@ -0,0 +1,28 @@
+#ifndef breeze_list_h
+#define breeze_list_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/***
+  Lists are contiguous arrays of values, written `[a, b, c]` and indexed
+  with `list[i]`. Indexing compiles to dedicated instructions; the natives
+  below grow and shrink a list at its end, with amortized doubling.
+  ***/
+
+/* push(list, values...): Appends values to a list
+ * @return: The new length of the list
+ */
+Value push_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* pop(list): Removes the last element of a list and returns it */
+Value pop_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* len(value): Returns the length of a list, a map, a float64 array, a
+ * string, or the size in bytes of a mapped file
+ */
+Value len_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+#endif // !breeze_list_h
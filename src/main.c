@@ -1,30 +1,76 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#include "virtual_machine.h"
+#include "breeze.h"
 
-static void repl();
-static void run_file(const char *);
-static const char *read_file(const char *);
+/***
+  Batch mode runs many scripts in one process: `breeze --batch --jobs N
+  files...`. Each of the N workers owns a VM that it resets between scripts,
+  so a script only pays for `reset_vm`, not for a process and `init_vm`.
+  Output is captured per script and replayed in argument order.
+  ***/
+
+typedef struct {
+  const char *path;
+  int32_t status;
+  char *out;
+  size_t out_len;
+  char *err;
+  size_t err_len;
+  bool done;
+} BatchResult;
+
+typedef struct {
+  BatchResult *results;
+  uint32_t results_len;
+  atomic_uint next;
+  pthread_mutex_t lock;
+  pthread_cond_t result_done;
+} Batch;
+
+static void repl(BreezeVM *vm);
+static void run_file(BreezeVM *vm, const char *);
+static int32_t run_batch(int32_t argc, const char *argv[]);
+static const char *read_file(const char *, FILE *);
 
 int32_t main(int32_t argc, const char *argv[]) {
-  init_vm();
+  if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+    int32_t status = run_batch(argc - 2, argv + 2);
+    shutdown_isolates();
+    free_shared_strings();
+    return status;
+  }
+
+  BreezeVM *vm = new_vm();
+  if (vm == NULL) {
+    fprintf(stderr, "Not enough memory to start the VM.");
+    exit(1);
+  }
 
   if (argc == 1) {
-    repl();
+    repl(vm);
   } else if (argc == 2) {
-    run_file(argv[1]);
+    run_file(vm, argv[1]);
   } else {
-    fprintf(stderr, "Usage: breeze <path>");
+    fprintf(stderr, "Usage: breeze [path]\n"
+                    "       breeze --batch [--jobs N] <path>...\n");
     exit(64);
   }
 
-  free_vm();
+  delete_vm(vm);
+  shutdown_isolates();
+  free_shared_strings();
   return 0;
 }
 
-static void repl() {
+static void repl(BreezeVM *vm) {
   char line[1024];
   while (true) {
     printf(">> ");
@@ -34,28 +80,189 @@ static void repl() {
       break;
     }
 
-    interpret(line);
+    interpret(vm, line);
+  }
+}
+
+static int32_t exit_status(InterpretResult result) {
+  switch (result) {
+  case InterpretOk:
+    return 0;
+  case InterpretCompileErr:
+    return 65;
+  case InterpretRuntimeErr:
+    return 70;
   }
+  return 70;
 }
 
-static void run_file(const char *path) {
-  const char *source = read_file(path);
-  InterpretResult result = interpret(source);
+static void run_file(BreezeVM *vm, const char *path) {
+  const char *source = read_file(path, stderr);
+  if (source == NULL) {
+    exit(74);
+  }
+  InterpretResult result = interpret(vm, source);
   free((void *)source);
 
-  if (result == InterpretCompileErr) {
-    exit(65);
+  int32_t status = exit_status(result);
+  if (status != 0) {
+    exit(status);
+  }
+}
+
+static FILE *open_capture(char **buffer, size_t *len) {
+  FILE *stream = open_memstream(buffer, len);
+  if (stream == NULL) {
+    fprintf(stderr, "Not enough memory to capture script output.");
+    exit(1);
   }
-  if (result == InterpretRuntimeErr) {
-    exit(70);
+  return stream;
+}
+
+static void run_batch_script(BreezeVM *vm, BatchResult *result) {
+  FILE *out = open_capture(&result->out, &result->out_len);
+  FILE *err = open_capture(&result->err, &result->err_len);
+
+  const char *source = read_file(result->path, err);
+  if (source == NULL) {
+    result->status = 74;
+  } else {
+    reset_vm(vm);
+    set_vm_output(vm, out, err);
+    result->status = exit_status(interpret(vm, source));
+    set_vm_output(vm, stdout, stderr);
+    free((void *)source);
   }
+
+  fclose(out);
+  fclose(err);
 }
 
-static const char *read_file(const char *path) {
+static void *batch_worker(void *arg) {
+  Batch *batch = (Batch *)arg;
+  BreezeVM *vm = new_vm();
+  if (vm == NULL) {
+    fprintf(stderr, "Not enough memory to start the VM.");
+    exit(1);
+  }
+
+  while (true) {
+    uint32_t idx = atomic_fetch_add(&batch->next, 1);
+    if (idx >= batch->results_len) {
+      break;
+    }
+    BatchResult *result = &batch->results[idx];
+    run_batch_script(vm, result);
+
+    pthread_mutex_lock(&batch->lock);
+    result->done = true;
+    pthread_cond_broadcast(&batch->result_done);
+    pthread_mutex_unlock(&batch->lock);
+  }
+
+  delete_vm(vm);
+  return NULL;
+}
+
+static double elapsed_seconds(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int32_t run_batch(int32_t argc, const char *argv[]) {
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc >= 2 && strcmp(argv[0], "--jobs") == 0) {
+    char *end = NULL;
+    jobs = strtol(argv[1], &end, 10);
+    if (*end != '\0' || jobs <= 0) {
+      fprintf(stderr, "Invalid job count \"%s\".\n", argv[1]);
+      return 64;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+  if (argc == 0) {
+    fprintf(stderr, "Usage: breeze --batch [--jobs N] <path>...\n");
+    return 64;
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+  if (jobs > argc) {
+    jobs = argc;
+  }
+
+  Batch batch;
+  batch.results = (BatchResult *)calloc(argc, sizeof(BatchResult));
+  pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * jobs);
+  if (batch.results == NULL || workers == NULL) {
+    fprintf(stderr, "Not enough memory to start the batch.");
+    exit(1);
+  }
+  batch.results_len = argc;
+  atomic_init(&batch.next, 0);
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.result_done, NULL);
+  for (int32_t i = 0; i < argc; i += 1) {
+    batch.results[i].path = argv[i];
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < jobs; i += 1) {
+    if (pthread_create(&workers[i], NULL, batch_worker, &batch) != 0) {
+      fprintf(stderr, "Could not start batch worker %ld.", i);
+      exit(1);
+    }
+  }
+
+  // Replay results in argument order as soon as each one is ready.
+  int32_t status = 0;
+  uint32_t failed = 0;
+  for (int32_t i = 0; i < argc; i += 1) {
+    BatchResult *result = &batch.results[i];
+    pthread_mutex_lock(&batch.lock);
+    while (!result->done) {
+      pthread_cond_wait(&batch.result_done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    fwrite(result->out, sizeof(char), result->out_len, stdout);
+    fwrite(result->err, sizeof(char), result->err_len, stderr);
+    if (result->status != 0) {
+      fprintf(stderr, "%s: exit %d\n", result->path, result->status);
+      failed += 1;
+      if (status == 0) {
+        status = result->status;
+      }
+    }
+    free(result->out);
+    free(result->err);
+  }
+
+  for (long i = 0; i < jobs; i += 1) {
+    pthread_join(workers[i], NULL);
+  }
+  double seconds = elapsed_seconds(&start);
+  fflush(stdout);
+  fprintf(stderr,
+          "batch: %d scripts, %u failed, %ld jobs, %.3f s, %.1f scripts/s\n",
+          argc, failed, jobs, seconds, seconds > 0 ? argc / seconds : 0.0);
+
+  pthread_cond_destroy(&batch.result_done);
+  pthread_mutex_destroy(&batch.lock);
+  free(workers);
+  free(batch.results);
+  return status;
+}
+
+static const char *read_file(const char *path, FILE *err) {
   FILE *file = fopen(path, "rb");
   if (file == NULL) {
-    fprintf(stderr, "Could not open file \"%s\".", path);
-    exit(74);
+    fprintf(err, "Could not open file \"%s\".\n", path);
+    return NULL;
   }
 
   fseek(file, 0L, SEEK_END);
@@ -64,14 +271,17 @@ static const char *read_file(const char *path) {
 
   char *buffer = (char *)malloc(file_size + 1);
   if (buffer == NULL) {
-    fprintf(stderr, "Not enough memero to read \"%s\"", path);
-    exit(74);
+    fprintf(err, "Not enough memory to read \"%s\".\n", path);
+    fclose(file);
+    return NULL;
   }
 
   size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
   if (bytes_read < file_size) {
-    fprintf(stderr, "Could not read file \"%s\"", path);
-    exit(74);
+    fprintf(err, "Could not read file \"%s\".\n", path);
+    free(buffer);
+    fclose(file);
+    return NULL;
   }
   buffer[bytes_read] = '\0';
 
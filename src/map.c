@@ -0,0 +1,270 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "map.h"
+
+#include "memory.h"
+#include "virtual_machine.h"
+
+#define MAP_SLOT_EMPTY 0
+#define MAP_SLOT_DELETED 1
+#define MAP_SLOT_ENTRY 2
+
+#define MAP_SLOTS_MIN 8
+
+// Entries a slot index of this capacity holds before it resizes.
+#define MAP_ENTRIES_MAX(slots_capacity) ((slots_capacity) / 4 * 3)
+
+// Finalizer of MurmurHash3, which spreads every input bit over the hash.
+static uint32_t mix_bits(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  bits *= 0xc4ceb9fe1a85ec53ull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static uint32_t hash_key(Value key) {
+  switch (key.type) {
+  case ValNumber: {
+    // -0 and 0 are the same key.
+    double number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return mix_bits(bits);
+  }
+  case ValBool:
+    return AS_BOOL(key) ? 1 : 2;
+  case ValObj:
+    if (IS_STRING(key)) {
+      return string_hash(AS_STRING(key));
+    }
+    return mix_bits((uint64_t)(uintptr_t)AS_OBJ(key));
+  case ValNull:
+  case ValEmpty:
+    break;
+  }
+  return 0;
+}
+
+static bool keys_equal(Value left, Value right) {
+  if (IS_STRING(left) && IS_STRING(right)) {
+    ObjString *left_string = AS_STRING(left);
+    ObjString *right_string = AS_STRING(right);
+    return left_string == right_string ||
+           (left_string->len == right_string->len &&
+            memcmp(left_string->chars, right_string->chars,
+                   left_string->len) == 0);
+  }
+  return values_equal(left, right);
+}
+
+// Finds the slot holding a key, or NULL if the map does not hold it.
+static uint32_t *find_slot(const ObjMap *map, Value key, uint32_t hash) {
+  if (map->len == 0) {
+    return NULL;
+  }
+  uint32_t mask = map->slots_capacity - 1;
+  for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+    uint32_t slot = map->slots[i];
+    if (slot == MAP_SLOT_EMPTY) {
+      return NULL;
+    }
+    if (slot != MAP_SLOT_DELETED) {
+      const MapEntry *entry = &map->entries[slot - MAP_SLOT_ENTRY];
+      if (entry->hash == hash && keys_equal(entry->key, key)) {
+        return &map->slots[i];
+      }
+    }
+  }
+}
+
+// Points a free slot at an entry. The index always has a free slot, as it
+// holds fewer entries than slots.
+static void place_entry(ObjMap *map, uint32_t hash, uint32_t entry) {
+  uint32_t mask = map->slots_capacity - 1;
+  uint32_t i = hash & mask;
+  while (map->slots[i] > MAP_SLOT_DELETED) {
+    i = (i + 1) & mask;
+  }
+  map->slots[i] = entry + MAP_SLOT_ENTRY;
+}
+
+// Rebuilds a map with room for `len` entries, dropping deleted ones.
+static void resize_map(VirtualMachine *vm, ObjMap *map, uint32_t len) {
+  uint32_t slots_capacity = MAP_SLOTS_MIN;
+  while (MAP_ENTRIES_MAX(slots_capacity) < len) {
+    slots_capacity *= 2;
+  }
+  uint32_t entries_capacity = MAP_ENTRIES_MAX(slots_capacity);
+  MapEntry *entries = ALLOCATE(vm, MapEntry, entries_capacity);
+  uint32_t *slots = ALLOCATE(vm, uint32_t, slots_capacity);
+  memset(slots, 0, sizeof(uint32_t) * slots_capacity);
+
+  uint32_t entries_len = 0;
+  for (uint32_t i = 0; i < map->entries_len; i += 1) {
+    if (!IS_EMPTY(map->entries[i].key)) {
+      entries[entries_len] = map->entries[i];
+      entries_len += 1;
+    }
+  }
+  FREE_ARRAY(vm, MapEntry, map->entries, map->entries_capacity);
+  FREE_ARRAY(vm, uint32_t, map->slots, map->slots_capacity);
+  map->entries = entries;
+  map->entries_len = entries_len;
+  map->entries_capacity = entries_capacity;
+  map->slots = slots;
+  map->slots_capacity = slots_capacity;
+  for (uint32_t i = 0; i < entries_len; i += 1) {
+    place_entry(map, entries[i].hash, i);
+  }
+}
+
+void map_reserve(VirtualMachine *vm, ObjMap *map, uint32_t len) {
+  if (len > map->entries_capacity) {
+    resize_map(vm, map, len);
+  }
+}
+
+bool map_get(const ObjMap *map, Value key, Value *value) {
+  uint32_t *slot = find_slot(map, key, hash_key(key));
+  if (slot == NULL) {
+    return false;
+  }
+  *value = map->entries[*slot - MAP_SLOT_ENTRY].value;
+  return true;
+}
+
+void map_set(VirtualMachine *vm, ObjMap *map, Value key, Value value) {
+  uint32_t hash = hash_key(key);
+  uint32_t *slot = find_slot(map, key, hash);
+  if (slot != NULL) {
+    map->entries[*slot - MAP_SLOT_ENTRY].value = value;
+    return;
+  }
+  if (map->entries_len == map->entries_capacity) {
+    // Doubles a map full of live entries, and only compacts one that has
+    // enough deleted entries.
+    resize_map(vm, map, map->len * 2 + 1);
+  }
+  map->entries[map->entries_len] =
+      (MapEntry){.key = key, .value = value, .hash = hash};
+  place_entry(map, hash, map->entries_len);
+  map->entries_len += 1;
+  map->len += 1;
+}
+
+bool map_delete(ObjMap *map, Value key) {
+  uint32_t *slot = find_slot(map, key, hash_key(key));
+  if (slot == NULL) {
+    return false;
+  }
+  MapEntry *entry = &map->entries[*slot - MAP_SLOT_ENTRY];
+  entry->key = EMPTY_VAL;
+  entry->value = NULL_VAL;
+  *slot = MAP_SLOT_DELETED;
+  map->len -= 1;
+  return true;
+}
+
+static bool check_map(VirtualMachine *vm, int32_t args_len, Value *args,
+                      int32_t expected, const char *usage) {
+  if (args_len != expected || !IS_MAP(args[0])) {
+    native_error(vm, "%s", usage);
+    return false;
+  }
+  return true;
+}
+
+static bool check_mutable(VirtualMachine *vm, Value map) {
+  if (AS_OBJ(map)->is_shared) {
+    native_error(vm, "Cannot change a frozen map.");
+    return false;
+  }
+  return true;
+}
+
+Value map_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len > 1 || (args_len == 1 && (!IS_NUMBER(args[0]) ||
+                                         AS_NUMBER(args[0]) < 0 ||
+                                         AS_NUMBER(args[0]) > UINT32_MAX))) {
+    return native_error(vm, "map expects an optional size hint.");
+  }
+  // Pushing the map can move the stack, and `args` with it.
+  uint32_t hint = args_len == 1 ? (uint32_t)AS_NUMBER(args[0]) : 0;
+  ObjMap *map = new_map(vm);
+  if (hint > 0) {
+    push_stack(vm, OBJ_VAL(map));
+    map_reserve(vm, map, hint);
+    pop_stack(vm);
+  }
+  return OBJ_VAL(map);
+}
+
+Value map_get_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len < 2 || args_len > 3 || !IS_MAP(args[0])) {
+    return native_error(vm, "map_get expects a map, a key and an optional "
+                            "default.");
+  }
+  Value value;
+  if (map_get(AS_MAP(args[0]), args[1], &value)) {
+    return value;
+  }
+  return args_len == 3 ? args[2] : NULL_VAL;
+}
+
+Value map_set_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_map(vm, args_len, args, 3,
+                 "map_set expects a map, a key and a value.") ||
+      !check_mutable(vm, args[0])) {
+    return NULL_VAL;
+  }
+  map_set(vm, AS_MAP(args[0]), args[1], args[2]);
+  return args[2];
+}
+
+Value map_has_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_map(vm, args_len, args, 2, "map_has expects a map and a key.")) {
+    return NULL_VAL;
+  }
+  Value value;
+  return BOOL_VAL(map_get(AS_MAP(args[0]), args[1], &value));
+}
+
+Value map_delete_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (!check_map(vm, args_len, args, 2,
+                 "map_delete expects a map and a key.") ||
+      !check_mutable(vm, args[0])) {
+    return NULL_VAL;
+  }
+  return BOOL_VAL(map_delete(AS_MAP(args[0]), args[1]));
+}
+
+// Lists the keys or the values of a map, in insertion order.
+static Value map_list(VirtualMachine *vm, const char *native,
+                      int32_t args_len, Value *args, bool keys) {
+  if (args_len != 1 || !IS_MAP(args[0])) {
+    return native_error(vm, "%s expects a map.", native);
+  }
+  ObjMap *map = AS_MAP(args[0]);
+  ObjList *list = new_list(vm);
+  push_stack(vm, OBJ_VAL(list));
+  for (uint32_t i = 0; i < map->entries_len; i += 1) {
+    const MapEntry *entry = &map->entries[i];
+    if (!IS_EMPTY(entry->key)) {
+      write_value_vec(vm, &list->items, keys ? entry->key : entry->value);
+    }
+  }
+  pop_stack(vm);
+  return OBJ_VAL(list);
+}
+
+Value map_keys_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  return map_list(vm, "map_keys", args_len, args, true);
+}
+
+Value map_values_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  return map_list(vm, "map_values", args_len, args, false);
+}
@@ -0,0 +1,77 @@
+#ifndef breeze_map_h
+#define breeze_map_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+/***
+  Maps associate keys of any type with values. Numbers and booleans are
+  keys by value, strings by their characters and other objects by identity.
+
+  Entries are appended to an array in insertion order, which is also the
+  order `map_keys` returns them in. A separate open-addressed index of slots,
+  probed linearly from the key's hash, holds entry positions, and every
+  entry caches its key's hash, so a resize never rehashes a key and a lookup
+  compares keys only when the hashes match. Lookups never allocate.
+  ***/
+
+/* Grows a map so it holds at least `len` entries without resizing
+ * @param vm: The VM whose heap owns the map
+ * @param map: The map to grow
+ * @param len: Number of entries to make room for
+ */
+void map_reserve(VirtualMachine *vm, ObjMap *map, uint32_t len);
+
+/* Looks up a key
+ * @param map: The map to search
+ * @param key: The key to look up
+ * @param value: Receives the value of the key, if found
+ * @return: true if the map holds the key
+ */
+bool map_get(const ObjMap *map, Value key, Value *value);
+
+/* Sets the value of a key, appending it if the map does not hold it yet
+ * @param vm: The VM whose heap owns the map
+ * @param map: The map to update
+ * @param key: The key to set
+ * @param value: Its new value
+ */
+void map_set(VirtualMachine *vm, ObjMap *map, Value key, Value value);
+
+/* Removes a key
+ * @param map: The map to update
+ * @param key: The key to remove
+ * @return: true if the map held the key
+ */
+bool map_delete(ObjMap *map, Value key);
+
+/* map(size_hint?): Creates an empty map, with room for `size_hint` keys */
+Value map_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* map_get(map, key, default?): Returns the value of a key, or the default
+ * (null if omitted) when the map does not hold it
+ */
+Value map_get_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* map_set(map, key, value): Sets the value of a key and returns it */
+Value map_set_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* map_has(map, key): Tells whether the map holds a key */
+Value map_has_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* map_delete(map, key): Removes a key
+ * @return: true if the map held the key
+ */
+Value map_delete_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* map_keys(map): Returns a list of the keys, in insertion order */
+Value map_keys_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* map_values(map): Returns a list of the values, in insertion order */
+Value map_values_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+#endif // !breeze_map_h
@@ -0,0 +1,90 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+
+#include "object.h"
+#include "virtual_machine.h"
+
+Value mmap_file_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1 || !IS_STRING(args[0])) {
+    return native_error(vm, "mmap_file expects a path.");
+  }
+  const char *path = terminate_string(vm, args[0])->chars;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return native_error(vm, "Could not open \"%s\".", path);
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode)) {
+    close(fd);
+    return native_error(vm, "\"%s\" is not a regular file.", path);
+  }
+  size_t len = (size_t)status.st_size;
+  void *mapping = NULL;
+  if (len > 0) {
+    mapping = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return native_error(vm, "Could not map \"%s\".", path);
+  }
+  if (mapping != NULL) {
+    // Lines are read front to back, so the kernel can read ahead further
+    // and drop pages behind.
+    madvise(mapping, len, MADV_SEQUENTIAL);
+  }
+  return OBJ_VAL(new_mapped_file(vm, (const char *)mapping, len));
+}
+
+Value each_line_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len < 2 || args_len > 3 || !IS_MAPPED_FILE(args[0]) ||
+      !(IS_CLOSURE(args[1]) || IS_NATIVE(args[1]))) {
+    return native_error(vm, "each_line expects a mapped file, a function "
+                            "and an optional delimiter.");
+  }
+  uint8_t delimiter = '\n';
+  if (args_len == 3) {
+    if (!IS_STRING(args[2]) || AS_STRING(args[2])->len != 1) {
+      return native_error(vm, "each_line expects a delimiter of one byte.");
+    }
+    delimiter = (uint8_t)AS_CSTRING(args[2])[0];
+  }
+  // Calls can move the stack, and `args` with it; the file stays rooted in
+  // its slot all the same.
+  ObjMappedFile *file = AS_MAPPED_FILE(args[0]);
+  Value function = args[1];
+
+  uint32_t lines = 0;
+  size_t start = 0;
+  while (start < file->len) {
+    const char *chars = file->chars + start;
+    // glibc's memchr is vectorized already.
+    const char *end = memchr(chars, delimiter, file->len - start);
+    size_t len = end == NULL ? file->len - start : (size_t)(end - chars);
+    size_t next = start + len + 1;
+    if (delimiter == '\n' && len > 0 && chars[len - 1] == '\r') {
+      len -= 1;
+    }
+    if (len > UINT32_MAX) {
+      return native_error(vm, "each_line cannot read lines of 4 GB or more.");
+    }
+
+    Value line = OBJ_VAL(new_string_view(vm, file, chars, (uint32_t)len));
+    lines += 1;
+    start = next;
+    Value result;
+    if (!call_function(vm, function, 1, &line, &result)) {
+      return NULL_VAL;
+    }
+    if (IS_BOOL(result) && !AS_BOOL(result)) {
+      break;
+    }
+  }
+  return NUMBER_VAL(lines);
+}
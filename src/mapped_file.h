@@ -0,0 +1,34 @@
+#ifndef breeze_mapped_file_h
+#define breeze_mapped_file_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/***
+  A mapped file is a read-only mapping of a whole file: pages are read in
+  as they are first touched and dropped by the kernel under memory
+  pressure, so a file can be far larger than the VM's heap.
+
+  The lines handed out by `each_line` are views: strings whose characters
+  stay in the mapping instead of being copied and interned. A view keeps
+  its file mapped while it lives and is otherwise an ordinary string, equal
+  to any other string of the same characters. Natives that need a
+  NUL-terminated string, such as those taking a path, copy a view first.
+  ***/
+
+/* mmap_file(path): Maps a file in memory, without reading it
+ * @return: The mapped file, whose `len` is its size in bytes
+ */
+Value mmap_file_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* each_line(file, fn, delimiter?): Calls `fn(line)` with each line of a
+ * mapped file, as a view, stopping early if it returns false. Lines end at
+ * newlines, whose preceding carriage return is dropped, or at a delimiter
+ * of one byte
+ * @return: The number of lines read
+ */
+Value each_line_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+#endif // !breeze_mapped_file_h
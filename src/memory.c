@@ -1,11 +1,14 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 #include "memory.h"
 
+#include "channel.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "event_loop.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -18,16 +21,19 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void *reallocate(void *ptr, size_t old_capacity, size_t new_capacity) {
-  vm.bytes_allocated += new_capacity - old_capacity;
-  if (new_capacity > old_capacity) {
+void *reallocate(VirtualMachine *vm, void *ptr, size_t old_capacity,
+                 size_t new_capacity) {
+  vm->bytes_allocated += new_capacity - old_capacity;
+  // Only growth may trigger a collection: frees happen during the sweep
+  // itself, which must not start another one.
+  if (vm->gc_paused == 0 && new_capacity > old_capacity) {
 #ifdef DEBUG_STRESS_GC
-    collect_garbage();
+    collect_garbage(vm);
 #endif /* ifdef DEBUG_STRESS_GC */
-  }
 
-  if (vm.bytes_allocated > vm.next_gc) {
-    collect_garbage();
+    if (vm->bytes_allocated > vm->next_gc) {
+      collect_garbage(vm);
+    }
   }
 
   if (new_capacity == 0) {
@@ -42,172 +48,337 @@ void *reallocate(void *ptr, size_t old_capacity, size_t new_capacity) {
   return result;
 }
 
-void mark_object(Obj *object) {
+void pause_gc(VirtualMachine *vm) { vm->gc_paused += 1; }
+
+void resume_gc(VirtualMachine *vm) { vm->gc_paused -= 1; }
+
+void mark_object(VirtualMachine *vm, Obj *object) {
   if (object == NULL) {
     return;
   }
-  if (object->is_marked == true) {
+  if (object->is_marked == true || object->is_shared) {
     return;
   }
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void *)object);
-  print_value(OBJ_VAL(object));
+  print_value(stdout, OBJ_VAL(object));
   printf("\n");
 #endif // ifdef DEBUG_LOG_GC
 
   object->is_marked = true;
 
-  if (vm.gray_stack_capacity < vm.gray_stack_len + 1) {
-    vm.gray_stack_capacity = GROW_CAPACITY(vm.gray_stack_capacity);
-    vm.gray_stack =
-        (Obj **)realloc(vm.gray_stack, sizeof(Obj *) * vm.gray_stack_capacity);
+  if (vm->gray_stack_capacity < vm->gray_stack_len + 1) {
+    vm->gray_stack_capacity = GROW_CAPACITY(vm->gray_stack_capacity);
+    vm->gray_stack = (Obj **)realloc(vm->gray_stack,
+                                     sizeof(Obj *) * vm->gray_stack_capacity);
 
-    if (vm.gray_stack == NULL) {
+    if (vm->gray_stack == NULL) {
       fprintf(stderr, "Not enough memory for `gray_stack` allocation.");
       exit(1);
     }
   }
 
-  vm.gray_stack[vm.gray_stack_len] = object;
-  vm.gray_stack_len += 1;
+  vm->gray_stack[vm->gray_stack_len] = object;
+  vm->gray_stack_len += 1;
 }
 
-void mark_value(Value value) {
+void mark_value(VirtualMachine *vm, Value value) {
   if (IS_OBJ(value)) {
-    mark_object(AS_OBJ(value));
+    mark_object(vm, AS_OBJ(value));
   }
 }
 
-void mark_vec(ValueVec *vector) {
+void mark_vec(VirtualMachine *vm, ValueVec *vector) {
   for (uint32_t i = 0; i < vector->len; i += 1) {
-    mark_value(vector->values[i]);
+    mark_value(vm, vector->values[i]);
   }
 }
 
-static void blacken_object(Obj *object) {
+static void mark_fiber(VirtualMachine *vm, const Fiber *fiber) {
+  for (Value *stack_slot = fiber->stack; stack_slot < fiber->stack_ptr;
+       stack_slot += 1) {
+    mark_value(vm, *stack_slot);
+  }
+  for (uint32_t frame_idx = 0; frame_idx < fiber->frames_len;
+       frame_idx += 1) {
+    mark_object(vm, (Obj *)fiber->frames[frame_idx].closure);
+  }
+  for (ObjUpvalue *upvalue = fiber->open_upvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    mark_object(vm, (Obj *)upvalue);
+  }
+}
+
+static void blacken_object(VirtualMachine *vm, Obj *object) {
 
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void *)object);
-  print_value(OBJ_VAL(object));
+  print_value(stdout, OBJ_VAL(object));
   printf("\n");
 #endif /* ifdef DEBUG_LOG_GC */
 
   switch (object->type) {
   case ObjInstanceType: {
     ObjInstance *instance = (ObjInstance *)object;
-    mark_object((Obj *)instance->klass);
-    mark_table(&instance->fields);
+    mark_object(vm, (Obj *)instance->klass);
+    for (uint32_t i = 0; i < instance->fields_len; i += 1) {
+      mark_value(vm, instance->fields[i]);
+    }
     break;
   }
   case ObjClassType: {
     ObjClass *klass = (ObjClass *)object;
-    mark_object((Obj *)klass->name);
-    mark_table(&klass->methods);
-    mark_set(&klass->fields);
+    mark_object(vm, (Obj *)klass->name);
+    mark_table(vm, &klass->methods);
+    mark_table(vm, &klass->fields);
+    mark_vec(vm, &klass->template);
     break;
   }
 
   case ObjClosureType: {
     ObjClosure *closure = (ObjClosure *)object;
-    mark_object((Obj *)closure->function);
+    mark_object(vm, (Obj *)closure->function);
     for (uint32_t i = 0; i < closure->upvalues_len; i += 1) {
-      mark_object((Obj *)closure->upvalues[i]);
+      mark_object(vm, (Obj *)closure->upvalues[i]);
     }
     break;
   }
 
   case ObjFunctionType: {
     ObjFunction *function = (ObjFunction *)object;
-    mark_object((Obj *)function->name);
-    mark_vec(&function->chunk.constants);
+    mark_object(vm, (Obj *)function->name);
+    mark_object(vm, (Obj *)function->closure);
+    mark_vec(vm, &function->chunk.constants);
     break;
   }
 
   case ObjUpvalueType: {
-    mark_value(((ObjUpvalue *)object)->closed);
+    mark_value(vm, ((ObjUpvalue *)object)->closed);
+    break;
+  }
+
+  case ObjCoroutineType: {
+    ObjCoroutine *coroutine = (ObjCoroutine *)object;
+    // A running coroutine's own registers are the VM's, marked as roots.
+    if (coroutine->state == CoroutineSuspended ||
+        coroutine->state == CoroutineWaiting) {
+      mark_fiber(vm, &coroutine->fiber);
+    } else if (coroutine->state == CoroutineRunning) {
+      mark_fiber(vm, &coroutine->caller);
+      mark_object(vm, (Obj *)coroutine->caller_coroutine);
+    }
+    break;
+  }
+
+  case ObjColumnsType: {
+    ObjColumns *columns = (ObjColumns *)object;
+    mark_object(vm, (Obj *)columns->klass);
+    for (uint32_t field = 0; field < columns->fields_len; field += 1) {
+      Value *column = columns->values + field * columns->capacity;
+      for (uint32_t i = 0; i < columns->len; i += 1) {
+        mark_value(vm, column[i]);
+      }
+    }
+    break;
+  }
+
+  case ObjRowType: {
+    mark_object(vm, (Obj *)((ObjRow *)object)->columns);
+    break;
+  }
+
+  case ObjListType: {
+    mark_vec(vm, &((ObjList *)object)->items);
+    break;
+  }
+
+  case ObjMapType: {
+    ObjMap *map = (ObjMap *)object;
+    for (uint32_t i = 0; i < map->entries_len; i += 1) {
+      mark_value(vm, map->entries[i].key);
+      mark_value(vm, map->entries[i].value);
+    }
+    break;
+  }
+
+  case ObjIterType: {
+    ObjIter *iter = (ObjIter *)object;
+    mark_value(vm, iter->source);
+    for (uint32_t i = 0; i < iter->stages_len; i += 1) {
+      mark_value(vm, iter->stages[i].arg);
+    }
+    break;
+  }
+
+  case ObjStringType: {
+    if (((ObjString *)object)->is_view) {
+      mark_object(vm, (Obj *)((ObjStringView *)object)->file);
+    }
     break;
   }
 
   case ObjNativeType:
-  case ObjStringType:
+  case ObjFloat64ArrayType:
+  case ObjMappedFileType:
+  case ObjChannelType:
     break;
   }
 }
 
-static void free_object(Obj *object) {
+static void free_object(VirtualMachine *vm, Obj *object) {
   switch (object->type) {
   case ObjInstanceType: {
     ObjInstance *instance = (ObjInstance *)object;
-    free_table(&instance->fields);
-    FREE(ObjInstance, object);
+    reallocate(vm, object, INSTANCE_SIZE(instance->fields_len), 0);
     break;
   }
   case ObjClassType: {
     ObjClass *klass = (ObjClass *)object;
-    free_table(&klass->methods);
-    free_set(&klass->fields);
-    FREE(ObjClass, object);
+    free_table(vm, &klass->methods);
+    free_table(vm, &klass->fields);
+    free_value_vec(vm, &klass->template);
+    FREE(vm, ObjClass, object);
     break;
   }
   case ObjClosureType: {
     ObjClosure *closure = (ObjClosure *)object;
-    FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalues_len);
-    FREE(ObjClosure, object);
+    reallocate(vm, object, CLOSURE_SIZE(closure->upvalues_len), 0);
     break;
   }
   case ObjNativeType: {
-    FREE(ObjNative, object);
+    FREE(vm, ObjNative, object);
     break;
   }
   case ObjFunctionType: {
     ObjFunction *function = (ObjFunction *)object;
-    free_chunk(&function->chunk);
-    FREE(ObjFunction, object);
+    free_chunk(vm, &function->chunk);
+    FREE(vm, ObjFunction, object);
     break;
   }
   case ObjStringType: {
     ObjString *string = (ObjString *)object;
-    FREE_ARRAY(char, (void *)string->chars, string->len + 1);
-    FREE(ObjString, object);
+    if (string->is_view) {
+      FREE(vm, ObjStringView, object);
+      break;
+    }
+    FREE_ARRAY(vm, char, (void *)string->chars, string->len + 1);
+    FREE(vm, ObjString, object);
     break;
   }
   case ObjUpvalueType: {
-    FREE(ObjUpvalue, object);
+    FREE(vm, ObjUpvalue, object);
     break;
   }
+  case ObjChannelType: {
+    release_channel(((ObjChannel *)object)->channel);
+    FREE(vm, ObjChannel, object);
+    break;
   }
-}
-
-static void mark_roots() {
-  for (Value *stack_slot = vm.stack; stack_slot < vm.stack_ptr;
-       stack_slot += 1) {
-    mark_value(*stack_slot);
+  case ObjCoroutineType: {
+    ObjCoroutine *coroutine = (ObjCoroutine *)object;
+    FREE_ARRAY(vm, CallFrame, coroutine->fiber.frames,
+               coroutine->fiber.frames_capacity);
+    FREE_ARRAY(vm, Value, coroutine->fiber.stack,
+               coroutine->fiber.stack_capacity);
+    FREE(vm, ObjCoroutine, object);
+    break;
   }
-
-  for (uint32_t frame_idx = 0; frame_idx < vm.frames_len; frame_idx += 1) {
-    mark_object((Obj *)vm.frames[frame_idx].closure);
+  case ObjColumnsType: {
+    ObjColumns *columns = (ObjColumns *)object;
+    FREE_ARRAY(vm, Value, columns->values,
+               columns->fields_len * columns->capacity);
+    FREE(vm, ObjColumns, object);
+    break;
   }
-
-  for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL;
-       upvalue = upvalue->next) {
-    mark_object((Obj *)upvalue);
+  case ObjRowType: {
+    FREE(vm, ObjRow, object);
+    break;
+  }
+  case ObjListType: {
+    free_value_vec(vm, &((ObjList *)object)->items);
+    FREE(vm, ObjList, object);
+    break;
+  }
+  case ObjIterType: {
+    reallocate(vm, object, ITER_SIZE(((ObjIter *)object)->stages_len), 0);
+    break;
   }
+  case ObjFloat64ArrayType: {
+    ObjFloat64Array *array = (ObjFloat64Array *)object;
+    if (array->mapped_len > 0) {
+      munmap(array->values, array->mapped_len);
+    } else {
+      FREE_ARRAY(vm, double, array->values, array->len);
+    }
+    FREE(vm, ObjFloat64Array, object);
+    break;
+  }
+  case ObjMappedFileType: {
+    ObjMappedFile *file = (ObjMappedFile *)object;
+    if (file->chars != NULL) {
+      munmap((void *)file->chars, file->len);
+    }
+    FREE(vm, ObjMappedFile, object);
+    break;
+  }
+  case ObjMapType: {
+    ObjMap *map = (ObjMap *)object;
+    FREE_ARRAY(vm, MapEntry, map->entries, map->entries_capacity);
+    FREE_ARRAY(vm, uint32_t, map->slots, map->slots_capacity);
+    FREE(vm, ObjMap, object);
+    break;
+  }
+  }
+}
 
-  mark_table(&vm.globals);
-  mark_compiler_roots();
+static void mark_roots(VirtualMachine *vm) {
+  Fiber running = {
+      .frames = vm->frames,
+      .frames_len = vm->frames_len,
+      .stack = vm->stack,
+      .stack_ptr = vm->stack_ptr,
+      .open_upvalues = vm->open_upvalues,
+  };
+  mark_fiber(vm, &running);
+  mark_object(vm, (Obj *)vm->coroutine);
+
+  mark_table(vm, &vm->globals);
+  mark_compiler_roots(vm);
+  mark_event_loop(vm);
 }
 
-static void trace_references() {
-  while (vm.gray_stack_len > 0) {
-    vm.gray_stack_len -= 1;
-    Obj *object = vm.gray_stack[vm.gray_stack_len];
-    blacken_object(object);
+static void trace_references(VirtualMachine *vm) {
+  while (vm->gray_stack_len > 0) {
+    vm->gray_stack_len -= 1;
+    Obj *object = vm->gray_stack[vm->gray_stack_len];
+    blacken_object(vm, object);
   }
 }
 
-static void sweep() {
+// Dead coroutines take their stacks with them: the upvalues still open on
+// those stacks must be closed before anything is freed, since live closures
+// may hold them.
+static void sweep_coroutines(VirtualMachine *vm) {
+  ObjCoroutine **link = &vm->coroutines;
+  while (*link != NULL) {
+    ObjCoroutine *coroutine = *link;
+    if (coroutine->obj.is_marked) {
+      link = &coroutine->next_coroutine;
+      continue;
+    }
+    for (ObjUpvalue *upvalue = coroutine->fiber.open_upvalues;
+         upvalue != NULL; upvalue = upvalue->next) {
+      upvalue->closed = *upvalue->location;
+      upvalue->location = &upvalue->closed;
+    }
+    *link = coroutine->next_coroutine;
+  }
+}
+
+static void sweep(VirtualMachine *vm) {
+  sweep_coroutines(vm);
   Obj *previous = NULL;
-  Obj *object = vm.objects;
+  Obj *object = vm->objects;
   while (object != NULL) {
     if (object->is_marked) {
       object->is_marked = false;
@@ -219,40 +390,44 @@ static void sweep() {
       if (previous != NULL) {
         previous->next = object;
       } else {
-        vm.objects = object;
+        vm->objects = object;
+      }
+
+      if (unreachable->type == ObjStringType &&
+          !((ObjString *)unreachable)->is_view) {
+        set_remove(&vm->strings, (ObjString *)unreachable);
       }
 
-      free_object(unreachable);
+      free_object(vm, unreachable);
     }
   }
 }
 
-void collect_garbage() {
+void collect_garbage(VirtualMachine *vm) {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
-  size_t bytes_allocated_before = vm.bytes_allocated;
+  size_t bytes_allocated_before = vm->bytes_allocated;
 #endif /* ifdef DEBUG_LOG_GC*/
 
-  mark_roots();
-  trace_references();
-  table_remove_white(&vm.strings);
-  sweep();
+  mark_roots(vm);
+  trace_references(vm);
+  sweep(vm);
 
-  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+  vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
   printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         bytes_allocated_before - vm.bytes_allocated, bytes_allocated_before,
-         vm.bytes_allocated, vm.next_gc);
+         bytes_allocated_before - vm->bytes_allocated, bytes_allocated_before,
+         vm->bytes_allocated, vm->next_gc);
 #endif /* ifdef DEBUG_LOG_GC*/
 }
 
-void free_objects(Obj *object) {
+void free_objects(VirtualMachine *vm, Obj *object) {
   while (object != NULL) {
     Obj *next = object->next;
-    free_object(object);
+    free_object(vm, object);
     object = next;
   }
-  free(vm.gray_stack);
+  free(vm->gray_stack);
 }
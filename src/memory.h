@@ -11,12 +11,13 @@
 #define ARRAY_GROWTH_FACTOR 2
 
 /* Allocates memory for a new array
+ * @param vm: The VM owning the memory
  * @param type: Type of elements in the array
  * @param new_capacity: Number of elements to allocate
  * @return: Pointer to the newly allocated array
  */
-#define ALLOCATE(type, new_capacity)                                           \
-  (type *)reallocate(NULL, 0, sizeof(type) * new_capacity)
+#define ALLOCATE(vm, type, new_capacity)                                       \
+  (type *)reallocate(vm, NULL, 0, sizeof(type) * (new_capacity))
 
 /* Calculates the new capacity when growing an array
  * @param capacity: Current capacity
@@ -26,54 +27,76 @@
   ((capacity) < 8 ? 8 : (capacity) * ARRAY_GROWTH_FACTOR)
 
 /* Resizes an array to a new capacity
+ * @param vm: The VM owning the memory
  * @param type: Type of elements in the array
  * @param ptr: Pointer to the current array
  * @param old_capacity: Current max number of elements
  * @param new_capacity: Desired max number of elements
  * @return: Pointer to the resized array
  */
-#define GROW_ARRAY(type, ptr, old_capacity, new_capacity)                      \
-  (type *)reallocate(ptr, sizeof(type) * (old_capacity),                       \
+#define GROW_ARRAY(vm, type, ptr, old_capacity, new_capacity)                  \
+  (type *)reallocate(vm, ptr, sizeof(type) * (old_capacity),                   \
                      sizeof(type) * (new_capacity))
 
 /* Frees an array from memory
+ * @param vm: The VM owning the memory
  * @param type: Type of elements in the array
  * @param ptr: Pointer to the array
  * @param old_capacity: Current max number of elements
  */
-#define FREE_ARRAY(type, ptr, old_capacity)                                    \
-  reallocate(ptr, sizeof(type) * (old_capacity), 0)
+#define FREE_ARRAY(vm, type, ptr, old_capacity)                                \
+  reallocate(vm, ptr, sizeof(type) * (old_capacity), 0)
 
 /* Frees a single object from memory
+ * @param vm: The VM owning the memory
  * @param type: Type of the object
  * @param ptr: Pointer to the object
  */
-#define FREE(type, ptr) reallocate(ptr, sizeof(type), 0)
+#define FREE(vm, type, ptr) reallocate(vm, ptr, sizeof(type), 0)
 
-/* Reallocates memory block to a new size
+/* Reallocates memory block to a new size, collecting garbage first when the
+ * VM's heap has outgrown its threshold
+ * @param vm: The VM owning the memory
  * @param ptr: Pointer to the current memory block
  * @param old_capacity: Current size in bytes
  * @param new_capacity: Desired size in bytes
  * @return: Pointer to the reallocated memory block
  */
-void *reallocate(void *ptr, size_t old_capacity, size_t new_capacity);
+void *reallocate(VirtualMachine *vm, void *ptr, size_t old_capacity,
+                 size_t new_capacity);
 
 /* Marks an object as reachable in the garbage collector
+ * @param vm: The VM whose collector is running
  * @param object: Pointer to the object to mark
  */
-void mark_object(Obj *obj);
+/* Stops collections until the matching `resume_gc`. Used while host code
+ * builds objects that are not reachable from any root yet. Calls nest.
+ * @param vm: The VM whose collector to pause
+ */
+void pause_gc(VirtualMachine *vm);
+
+/* Undoes one `pause_gc`
+ * @param vm: The VM whose collector to resume
+ */
+void resume_gc(VirtualMachine *vm);
+
+void mark_object(VirtualMachine *vm, Obj *obj);
 
 /* Marks a value as reachable in the garbage collector
+ * @param vm: The VM whose collector is running
  * @param value: Value to mark
  */
-void mark_value(Value value);
+void mark_value(VirtualMachine *vm, Value value);
 
-/* Runs the garbage collector to free unreachable objects */
-void collect_garbage();
+/* Runs the garbage collector to free unreachable objects
+ * @param vm: The VM whose heap is collected
+ */
+void collect_garbage(VirtualMachine *vm);
 
 /* Frees all objects in a linked list
+ * @param vm: The VM owning the objects
  * @param object: Pointer to the first object in the list
  */
-void free_objects(Obj *object);
+void free_objects(VirtualMachine *vm, Obj *object);
 
 #endif // !breeze_memory_h
@@ -0,0 +1,668 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "message.h"
+
+#include "channel.h"
+#include "chunk.h"
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+
+/***
+  Objects are written depth first, each one tagged. The first time an object
+  is met it gets the next index; later occurrences are written as `TagRef`
+  to that index. The reader reserves indices in the same order, before it
+  reads an object's children, so a child can refer back to its parent.
+  ***/
+
+typedef enum {
+  TagNull,
+  TagTrue,
+  TagFalse,
+  TagNumber,
+  TagShared,
+  TagString,
+  TagRef,
+  TagFunction,
+  TagClosure,
+  TagUpvalue,
+  TagClass,
+  TagInstance,
+  TagNative,
+  TagChannel,
+  TagColumns,
+  TagRow,
+  TagList,
+  TagMap,
+  TagFloat64Array,
+  TagIter,
+} MessageTag;
+
+typedef struct {
+  uint8_t *bytes;
+  uint32_t len;
+  uint32_t capacity;
+
+  // Open-addressed map from written objects to their index.
+  Obj **seen_keys;
+  uint32_t *seen_idx;
+  uint32_t seen_len;
+  uint32_t seen_capacity;
+
+  Channel **channels;
+  uint32_t channels_len;
+  uint32_t channels_capacity;
+} MessageWriter;
+
+typedef struct {
+  const uint8_t *bytes;
+  uint32_t offset;
+
+  Obj **objects;
+  uint32_t objects_len;
+  uint32_t objects_capacity;
+} MessageReader;
+
+static void *checked_realloc(void *ptr, size_t size) {
+  void *result = realloc(ptr, size);
+  if (result == NULL) {
+    fprintf(stderr, "Not enough memory for a message.");
+    exit(1);
+  }
+  return result;
+}
+
+/*** WRITER ***/
+
+static void write_bytes(MessageWriter *writer, const void *bytes,
+                        uint32_t len) {
+  if (writer->len + len > writer->capacity) {
+    uint32_t capacity = GROW_CAPACITY(writer->capacity);
+    while (capacity < writer->len + len) {
+      capacity *= ARRAY_GROWTH_FACTOR;
+    }
+    writer->bytes = (uint8_t *)checked_realloc(writer->bytes, capacity);
+    writer->capacity = capacity;
+  }
+  memcpy(writer->bytes + writer->len, bytes, len);
+  writer->len += len;
+}
+
+static void write_u8(MessageWriter *writer, uint8_t byte) {
+  write_bytes(writer, &byte, sizeof(byte));
+}
+
+static void write_u32(MessageWriter *writer, uint32_t word) {
+  write_bytes(writer, &word, sizeof(word));
+}
+
+static void write_ptr(MessageWriter *writer, const void *ptr) {
+  write_bytes(writer, &ptr, sizeof(ptr));
+}
+
+static inline uint32_t hash_ptr(const Obj *object, uint32_t mask) {
+  return (uint32_t)(((uintptr_t)object >> 4) * 2654435761u) & mask;
+}
+
+static void grow_seen(MessageWriter *writer) {
+  uint32_t capacity = GROW_CAPACITY(writer->seen_capacity);
+  Obj **keys = (Obj **)calloc(capacity, sizeof(Obj *));
+  uint32_t *idx = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+  if (keys == NULL || idx == NULL) {
+    fprintf(stderr, "Not enough memory for a message.");
+    exit(1);
+  }
+
+  for (uint32_t i = 0; i < writer->seen_capacity; i += 1) {
+    Obj *key = writer->seen_keys[i];
+    if (key == NULL) {
+      continue;
+    }
+    uint32_t slot = hash_ptr(key, capacity - 1);
+    while (keys[slot] != NULL) {
+      slot = (slot + 1) & (capacity - 1);
+    }
+    keys[slot] = key;
+    idx[slot] = writer->seen_idx[i];
+  }
+
+  free(writer->seen_keys);
+  free(writer->seen_idx);
+  writer->seen_keys = keys;
+  writer->seen_idx = idx;
+  writer->seen_capacity = capacity;
+}
+
+// Writes a back reference and returns true if the object was already
+// written, otherwise gives it the next index.
+static bool write_seen(MessageWriter *writer, Obj *object) {
+  if ((writer->seen_len + 1) * 4 > writer->seen_capacity * 3) {
+    grow_seen(writer);
+  }
+  uint32_t mask = writer->seen_capacity - 1;
+  uint32_t slot = hash_ptr(object, mask);
+  while (writer->seen_keys[slot] != NULL) {
+    if (writer->seen_keys[slot] == object) {
+      write_u8(writer, TagRef);
+      write_u32(writer, writer->seen_idx[slot]);
+      return true;
+    }
+    slot = (slot + 1) & mask;
+  }
+  writer->seen_keys[slot] = object;
+  writer->seen_idx[slot] = writer->seen_len;
+  writer->seen_len += 1;
+  return false;
+}
+
+static void write_value(MessageWriter *writer, Value value);
+
+static void write_table(MessageWriter *writer, const Table *table) {
+  write_u32(writer, table->len);
+  uint32_t i = 0;
+  TableEntry *entry;
+  while (table_next(table, &i, &entry)) {
+    write_value(writer, OBJ_VAL(entry->key));
+    write_value(writer, entry->value);
+  }
+}
+
+static void write_values(MessageWriter *writer, const Value *values,
+                         uint32_t len) {
+  write_u32(writer, len);
+  for (uint32_t i = 0; i < len; i += 1) {
+    write_value(writer, values[i]);
+  }
+}
+
+static void write_function(MessageWriter *writer, ObjFunction *function) {
+  const Chunk *chunk = &function->chunk;
+  write_u8(writer, TagFunction);
+  write_u32(writer, (uint32_t)function->arity);
+  write_u32(writer, function->upvalues_len);
+  write_value(writer,
+              function->name == NULL ? NULL_VAL : OBJ_VAL(function->name));
+  write_u32(writer, chunk->len);
+  write_bytes(writer, chunk->code, chunk->len);
+  write_u32(writer, chunk->lines.len);
+  write_bytes(writer, chunk->lines.lines, sizeof(Line) * chunk->lines.len);
+  write_u32(writer, chunk->constants.len);
+  for (uint32_t i = 0; i < chunk->constants.len; i += 1) {
+    write_value(writer, chunk->constants.values[i]);
+  }
+}
+
+static void write_channel(MessageWriter *writer, Channel *channel) {
+  if (writer->channels_len == writer->channels_capacity) {
+    writer->channels_capacity = GROW_CAPACITY(writer->channels_capacity);
+    writer->channels = (Channel **)checked_realloc(
+        writer->channels, sizeof(Channel *) * writer->channels_capacity);
+  }
+  retain_channel(channel);
+  writer->channels[writer->channels_len] = channel;
+  writer->channels_len += 1;
+
+  write_u8(writer, TagChannel);
+  write_ptr(writer, channel);
+}
+
+static void write_object(MessageWriter *writer, Obj *object) {
+  // Shared strings and frozen objects are read-only and outlive every VM.
+  if (object->is_shared) {
+    write_u8(writer, TagShared);
+    write_ptr(writer, object);
+    return;
+  }
+
+  if (object->type == ObjStringType) {
+    ObjString *string = (ObjString *)object;
+    // Strings are immutable, so copying a repeated one is only a size cost;
+    // it saves the short messages from ever building the seen map.
+    write_u8(writer, TagString);
+    write_u32(writer, string->len);
+    write_bytes(writer, string->chars, string->len);
+    return;
+  }
+
+  // A coroutine's stack and a file mapping belong to their VM, so they
+  // arrive as null. Null takes no index on the reading side, so they must
+  // take none here either.
+  if (object->type == ObjCoroutineType ||
+      object->type == ObjMappedFileType) {
+    write_u8(writer, TagNull);
+    return;
+  }
+
+  if (write_seen(writer, object)) {
+    return;
+  }
+
+  switch (object->type) {
+  case ObjFunctionType: {
+    write_function(writer, (ObjFunction *)object);
+    break;
+  }
+  case ObjClosureType: {
+    ObjClosure *closure = (ObjClosure *)object;
+    write_u8(writer, TagClosure);
+    write_value(writer, OBJ_VAL(closure->function));
+    for (uint32_t i = 0; i < closure->upvalues_len; i += 1) {
+      write_value(writer, OBJ_VAL(closure->upvalues[i]));
+    }
+    break;
+  }
+  case ObjUpvalueType: {
+    write_u8(writer, TagUpvalue);
+    write_value(writer, *((ObjUpvalue *)object)->location);
+    break;
+  }
+  case ObjClassType: {
+    ObjClass *klass = (ObjClass *)object;
+    write_u8(writer, TagClass);
+    write_value(writer, OBJ_VAL(klass->name));
+    write_table(writer, &klass->fields);
+    write_values(writer, klass->template.values, klass->template.len);
+    write_table(writer, &klass->methods);
+    break;
+  }
+  case ObjInstanceType: {
+    ObjInstance *instance = (ObjInstance *)object;
+    write_u8(writer, TagInstance);
+    write_value(writer, OBJ_VAL(instance->klass));
+    write_values(writer, instance->fields, instance->fields_len);
+    break;
+  }
+  case ObjColumnsType: {
+    ObjColumns *columns = (ObjColumns *)object;
+    write_u8(writer, TagColumns);
+    write_value(writer, OBJ_VAL(columns->klass));
+    write_u32(writer, columns->fields_len);
+    write_u32(writer, columns->len);
+    for (uint32_t field = 0; field < columns->fields_len; field += 1) {
+      Value *column = columns->values + field * columns->capacity;
+      for (uint32_t i = 0; i < columns->len; i += 1) {
+        write_value(writer, column[i]);
+      }
+    }
+    break;
+  }
+  case ObjRowType: {
+    ObjRow *row = (ObjRow *)object;
+    write_u8(writer, TagRow);
+    write_value(writer, OBJ_VAL(row->columns));
+    write_u32(writer, row->idx);
+    break;
+  }
+  case ObjListType: {
+    ObjList *list = (ObjList *)object;
+    write_u8(writer, TagList);
+    write_values(writer, list->items.values, list->items.len);
+    break;
+  }
+  case ObjMapType: {
+    ObjMap *map = (ObjMap *)object;
+    write_u8(writer, TagMap);
+    write_u32(writer, map->len);
+    for (uint32_t i = 0; i < map->entries_len; i += 1) {
+      if (!IS_EMPTY(map->entries[i].key)) {
+        write_value(writer, map->entries[i].key);
+        write_value(writer, map->entries[i].value);
+      }
+    }
+    break;
+  }
+  case ObjIterType: {
+    ObjIter *iter = (ObjIter *)object;
+    write_u8(writer, TagIter);
+    write_u32(writer, iter->stages_len);
+    write_u32(writer, iter->pending);
+    write_value(writer, iter->source);
+    for (uint32_t i = 0; i < iter->stages_len; i += 1) {
+      write_u32(writer, iter->stages[i].kind);
+      write_value(writer, iter->stages[i].arg);
+    }
+    break;
+  }
+  case ObjFloat64ArrayType: {
+    ObjFloat64Array *array = (ObjFloat64Array *)object;
+    write_u8(writer, TagFloat64Array);
+    write_u32(writer, array->len);
+    write_bytes(writer, array->values, sizeof(double) * array->len);
+    break;
+  }
+  case ObjNativeType: {
+    NativeFn function = ((ObjNative *)object)->function;
+    write_u8(writer, TagNative);
+    write_bytes(writer, &function, sizeof(function));
+    break;
+  }
+  case ObjChannelType: {
+    write_channel(writer, ((ObjChannel *)object)->channel);
+    break;
+  }
+  case ObjStringType:
+  case ObjCoroutineType:
+  case ObjMappedFileType:
+    break;
+  }
+}
+
+static void write_value(MessageWriter *writer, Value value) {
+  switch (value.type) {
+  case ValNull:
+  case ValEmpty: {
+    write_u8(writer, TagNull);
+    break;
+  }
+  case ValBool: {
+    write_u8(writer, AS_BOOL(value) ? TagTrue : TagFalse);
+    break;
+  }
+  case ValNumber: {
+    double number = AS_NUMBER(value);
+    write_u8(writer, TagNumber);
+    write_bytes(writer, &number, sizeof(number));
+    break;
+  }
+  case ValObj: {
+    write_object(writer, AS_OBJ(value));
+    break;
+  }
+  }
+}
+
+Message *encode_message(const Value *values, uint32_t values_len) {
+  MessageWriter writer = {0};
+  for (uint32_t i = 0; i < values_len; i += 1) {
+    write_value(&writer, values[i]);
+  }
+
+  Message *message =
+      (Message *)checked_realloc(NULL, sizeof(Message) + writer.len);
+  atomic_init(&message->next, NULL);
+  message->values_len = values_len;
+  message->channels_len = writer.channels_len;
+  message->channels = writer.channels;
+  message->len = writer.len;
+  if (writer.len > 0) {
+    memcpy(message->bytes, writer.bytes, writer.len);
+  }
+
+  free(writer.bytes);
+  free(writer.seen_keys);
+  free(writer.seen_idx);
+  return message;
+}
+
+void free_message(Message *message) {
+  for (uint32_t i = 0; i < message->channels_len; i += 1) {
+    release_channel(message->channels[i]);
+  }
+  free(message->channels);
+  free(message);
+}
+
+/*** READER ***/
+
+static void read_bytes(MessageReader *reader, void *bytes, uint32_t len) {
+  memcpy(bytes, reader->bytes + reader->offset, len);
+  reader->offset += len;
+}
+
+static uint8_t read_u8(MessageReader *reader) {
+  uint8_t byte = reader->bytes[reader->offset];
+  reader->offset += 1;
+  return byte;
+}
+
+static uint32_t read_u32(MessageReader *reader) {
+  uint32_t word;
+  read_bytes(reader, &word, sizeof(word));
+  return word;
+}
+
+static void *read_ptr(MessageReader *reader) {
+  void *ptr;
+  read_bytes(reader, &ptr, sizeof(ptr));
+  return ptr;
+}
+
+static uint32_t reserve_object(MessageReader *reader) {
+  if (reader->objects_len == reader->objects_capacity) {
+    reader->objects_capacity = GROW_CAPACITY(reader->objects_capacity);
+    reader->objects = (Obj **)checked_realloc(
+        reader->objects, sizeof(Obj *) * reader->objects_capacity);
+  }
+  reader->objects[reader->objects_len] = NULL;
+  reader->objects_len += 1;
+  return reader->objects_len - 1;
+}
+
+static Value read_value(VirtualMachine *vm, MessageReader *reader);
+
+static void read_table(VirtualMachine *vm, MessageReader *reader,
+                       Table *table) {
+  uint32_t len = read_u32(reader);
+  for (uint32_t i = 0; i < len; i += 1) {
+    ObjString *key = AS_STRING(read_value(vm, reader));
+    Value value = read_value(vm, reader);
+    table_insert(vm, table, key, value);
+  }
+}
+
+static void read_value_vec(VirtualMachine *vm, MessageReader *reader,
+                           ValueVec *vec) {
+  uint32_t len = read_u32(reader);
+  for (uint32_t i = 0; i < len; i += 1) {
+    write_value_vec(vm, vec, read_value(vm, reader));
+  }
+}
+
+static ObjFunction *read_function(VirtualMachine *vm, MessageReader *reader) {
+  uint32_t idx = reserve_object(reader);
+  ObjFunction *function = new_function(vm);
+  reader->objects[idx] = (Obj *)function;
+
+  function->arity = (int32_t)read_u32(reader);
+  function->upvalues_len = read_u32(reader);
+  Value name = read_value(vm, reader);
+  function->name = IS_NULL(name) ? NULL : AS_STRING(name);
+
+  Chunk *chunk = &function->chunk;
+  uint32_t code_len = read_u32(reader);
+  chunk->code = ALLOCATE(vm, uint8_t, code_len);
+  chunk->capacity = code_len;
+  chunk->len = code_len;
+  read_bytes(reader, chunk->code, code_len);
+
+  uint32_t lines_len = read_u32(reader);
+  chunk->lines.lines = ALLOCATE(vm, Line, lines_len);
+  chunk->lines.capacity = lines_len;
+  chunk->lines.len = lines_len;
+  read_bytes(reader, chunk->lines.lines, sizeof(Line) * lines_len);
+
+  uint32_t constants_len = read_u32(reader);
+  for (uint32_t i = 0; i < constants_len; i += 1) {
+    write_value_vec(vm, &chunk->constants, read_value(vm, reader));
+  }
+  return function;
+}
+
+static Obj *read_object(VirtualMachine *vm, MessageReader *reader,
+                        MessageTag tag) {
+  switch (tag) {
+  case TagShared:
+    return (Obj *)read_ptr(reader);
+  case TagString: {
+    uint32_t len = read_u32(reader);
+    const char *chars = (const char *)reader->bytes + reader->offset;
+    reader->offset += len;
+    return (Obj *)copy_string(vm, chars, len);
+  }
+  case TagRef:
+    return reader->objects[read_u32(reader)];
+  case TagFunction:
+    return (Obj *)read_function(vm, reader);
+  case TagClosure: {
+    uint32_t idx = reserve_object(reader);
+    ObjClosure *closure = new_closure(vm, AS_FUNCTION(read_value(vm, reader)));
+    reader->objects[idx] = (Obj *)closure;
+    for (uint32_t i = 0; i < closure->upvalues_len; i += 1) {
+      closure->upvalues[i] = (ObjUpvalue *)AS_OBJ(read_value(vm, reader));
+    }
+    return (Obj *)closure;
+  }
+  case TagUpvalue: {
+    uint32_t idx = reserve_object(reader);
+    ObjUpvalue *upvalue = new_upvalue(vm, NULL);
+    upvalue->location = &upvalue->closed;
+    reader->objects[idx] = (Obj *)upvalue;
+    upvalue->closed = read_value(vm, reader);
+    return (Obj *)upvalue;
+  }
+  case TagClass: {
+    uint32_t idx = reserve_object(reader);
+    ObjClass *klass = new_class(vm, AS_STRING(read_value(vm, reader)));
+    reader->objects[idx] = (Obj *)klass;
+    read_table(vm, reader, &klass->fields);
+    read_value_vec(vm, reader, &klass->template);
+    read_table(vm, reader, &klass->methods);
+    return (Obj *)klass;
+  }
+  case TagInstance: {
+    uint32_t idx = reserve_object(reader);
+    ObjInstance *instance =
+        new_instance(vm, AS_CLASS(read_value(vm, reader)));
+    reader->objects[idx] = (Obj *)instance;
+    // A class still being decoded, when one of its defaults refers back to
+    // the instance, may not have all of its fields yet.
+    uint32_t fields_len = read_u32(reader);
+    for (uint32_t i = 0; i < fields_len; i += 1) {
+      Value field = read_value(vm, reader);
+      if (i < instance->fields_len) {
+        instance->fields[i] = field;
+      }
+    }
+    return (Obj *)instance;
+  }
+  case TagNative: {
+    uint32_t idx = reserve_object(reader);
+    NativeFn function;
+    read_bytes(reader, &function, sizeof(function));
+    reader->objects[idx] = (Obj *)new_native(vm, function);
+    return reader->objects[idx];
+  }
+  case TagChannel: {
+    uint32_t idx = reserve_object(reader);
+    Channel *channel = (Channel *)read_ptr(reader);
+    reader->objects[idx] = (Obj *)new_channel(vm, channel);
+    return reader->objects[idx];
+  }
+  case TagColumns: {
+    uint32_t idx = reserve_object(reader);
+    ObjColumns *columns =
+        new_columns(vm, AS_CLASS(read_value(vm, reader)));
+    reader->objects[idx] = (Obj *)columns;
+    uint32_t fields_len = read_u32(reader);
+    uint32_t len = read_u32(reader);
+    columns->values = ALLOCATE(vm, Value, columns->fields_len * len);
+    columns->capacity = len;
+    columns->len = len;
+    for (uint32_t i = 0; i < columns->fields_len * len; i += 1) {
+      columns->values[i] = NULL_VAL;
+    }
+    // As for instances, the class may still be missing fields.
+    for (uint32_t field = 0; field < fields_len; field += 1) {
+      for (uint32_t i = 0; i < len; i += 1) {
+        Value value = read_value(vm, reader);
+        if (field < columns->fields_len) {
+          columns->values[field * len + i] = value;
+        }
+      }
+    }
+    return (Obj *)columns;
+  }
+  case TagList: {
+    uint32_t idx = reserve_object(reader);
+    ObjList *list = new_list(vm);
+    reader->objects[idx] = (Obj *)list;
+    read_value_vec(vm, reader, &list->items);
+    return (Obj *)list;
+  }
+  case TagMap: {
+    uint32_t idx = reserve_object(reader);
+    ObjMap *map = new_map(vm);
+    reader->objects[idx] = (Obj *)map;
+    uint32_t len = read_u32(reader);
+    map_reserve(vm, map, len);
+    for (uint32_t i = 0; i < len; i += 1) {
+      Value key = read_value(vm, reader);
+      map_set(vm, map, key, read_value(vm, reader));
+    }
+    return (Obj *)map;
+  }
+  case TagIter: {
+    uint32_t idx = reserve_object(reader);
+    ObjIter *iter = new_iter(vm, NULL_VAL, read_u32(reader));
+    reader->objects[idx] = (Obj *)iter;
+    iter->pending = (IterStageKind)read_u32(reader);
+    iter->source = read_value(vm, reader);
+    for (uint32_t i = 0; i < iter->stages_len; i += 1) {
+      iter->stages[i].kind = (IterStageKind)read_u32(reader);
+      iter->stages[i].arg = read_value(vm, reader);
+    }
+    return (Obj *)iter;
+  }
+  case TagFloat64Array: {
+    uint32_t idx = reserve_object(reader);
+    ObjFloat64Array *array = new_float64_array(vm, read_u32(reader));
+    reader->objects[idx] = (Obj *)array;
+    read_bytes(reader, array->values, sizeof(double) * array->len);
+    return (Obj *)array;
+  }
+  case TagRow: {
+    // The row exists before its table, whose columns may hold it.
+    uint32_t idx = reserve_object(reader);
+    ObjRow *row = new_row(vm, NULL, 0);
+    reader->objects[idx] = (Obj *)row;
+    row->columns = AS_COLUMNS(read_value(vm, reader));
+    row->idx = read_u32(reader);
+    return (Obj *)row;
+  }
+  default:
+    return NULL;
+  }
+}
+
+static Value read_value(VirtualMachine *vm, MessageReader *reader) {
+  MessageTag tag = (MessageTag)read_u8(reader);
+  switch (tag) {
+  case TagNull:
+    return NULL_VAL;
+  case TagTrue:
+    return BOOL_VAL(true);
+  case TagFalse:
+    return BOOL_VAL(false);
+  case TagNumber: {
+    double number;
+    read_bytes(reader, &number, sizeof(number));
+    return NUMBER_VAL(number);
+  }
+  default:
+    return OBJ_VAL(read_object(vm, reader, tag));
+  }
+}
+
+void decode_message(VirtualMachine *vm, const Message *message,
+                    Value *values) {
+  MessageReader reader = {.bytes = message->bytes};
+  for (uint32_t i = 0; i < message->values_len; i += 1) {
+    values[i] = read_value(vm, &reader);
+  }
+  free(reader.objects);
+}
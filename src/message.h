@@ -0,0 +1,53 @@
+#ifndef breeze_message_h
+#define breeze_message_h
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+struct Channel;
+
+/***
+  A message is a heap-independent copy of a sequence of values, used to move
+  data between VMs. Numbers, booleans and null are stored inline, shared
+  strings and frozen objects by pointer; every other object is serialized
+  together with the graph it reaches, keeping shared and cyclic references
+  intact. Channels are the exception: they are passed by reference, and the
+  message holds a reference on each one until it is freed. Coroutines are
+  tied to their VM's stacks and arrive as null.
+  ***/
+
+typedef struct Message {
+  // Link used by the channel queue the message sits in.
+  _Atomic(struct Message *) next;
+  uint32_t values_len;
+  uint32_t channels_len;
+  struct Channel **channels;
+  uint32_t len;
+  uint8_t bytes[];
+} Message;
+
+/* Copies values out of the current VM's heap
+ * @param values: The values to copy
+ * @param values_len: Number of values
+ * @return: A new message, owned by the caller
+ */
+Message *encode_message(const Value *values, uint32_t values_len);
+
+/* Rebuilds the values of a message in a VM's heap. The collector must be
+ * paused by the caller until the values are reachable from a root.
+ * @param vm: The VM whose heap receives the objects
+ * @param message: The message to decode
+ * @param values: Output array of `message->values_len` values
+ */
+void decode_message(VirtualMachine *vm, const Message *message,
+                    Value *values);
+
+/* Frees a message and drops its channel references
+ * @param message: The message to free
+ */
+void free_message(Message *message);
+
+#endif // !breeze_message_h
@@ -4,16 +4,19 @@
 
 #include "object.h"
 
+#include "channel.h"
 #include "memory.h"
+#include "shared_string.h"
 #include "virtual_machine.h"
 
-static Obj *allocate_object(uint32_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
+static Obj *allocate_object(VirtualMachine *vm, uint32_t size, ObjType type) {
+  Obj *object = (Obj *)reallocate(vm, NULL, 0, size);
   object->type = type;
   object->is_marked = false;
+  object->is_shared = false;
 
-  object->next = vm.objects;
-  vm.objects = object;
+  object->next = vm->objects;
+  vm->objects = object;
 
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void *)object, object->type);
@@ -21,63 +24,85 @@ static Obj *allocate_object(uint32_t size, ObjType type) {
   return object;
 }
 
-ObjInstance *new_instance(ObjClass *klass) {
-  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, ObjInstanceType);
+ObjInstance *new_instance(VirtualMachine *vm, ObjClass *klass) {
+  uint32_t fields_len = klass->template.len;
+  ObjInstance *instance = (ObjInstance *)allocate_object(
+      vm, INSTANCE_SIZE(fields_len), ObjInstanceType);
   instance->klass = klass;
-  init_table(&instance->fields);
+  instance->fields_len = fields_len;
+  if (fields_len > 0) {
+    memcpy(instance->fields, klass->template.values,
+           sizeof(Value) * fields_len);
+  }
   return instance;
 }
-ObjClass *new_class(ObjString *name) {
-  ObjClass *klass = ALLOCATE_OBJ(ObjClass, ObjClassType);
+ObjClass *new_class(VirtualMachine *vm, ObjString *name) {
+  ObjClass *klass = ALLOCATE_OBJ(vm, ObjClass, ObjClassType);
   klass->name = name;
   init_table(&klass->methods);
-  init_set(&klass->fields);
+  init_table(&klass->fields);
+  init_value_vec(&klass->template);
   return klass;
 }
 
-ObjClosure *new_closure(ObjFunction *function) {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalues_len);
+ObjClosure *new_closure(VirtualMachine *vm, ObjFunction *function) {
+  ObjClosure *closure = (ObjClosure *)allocate_object(
+      vm, CLOSURE_SIZE(function->upvalues_len), ObjClosureType);
+  closure->function = function;
+  closure->upvalues_len = function->upvalues_len;
   for (uint32_t i = 0; i < function->upvalues_len; i += 1) {
-    upvalues[i] = NULL;
+    closure->upvalues[i] = NULL;
   }
+  return closure;
+}
 
-  ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, ObjClosureType);
-  closure->function = function;
-  closure->upvalues = upvalues;
-  closure->upvalues_len = function->upvalues_len;
+ObjClosure *closure_of(VirtualMachine *vm, ObjFunction *function) {
+  if (function->upvalues_len > 0) {
+    return new_closure(vm, function);
+  }
+  if (function->closure != NULL) {
+    return function->closure;
+  }
+  ObjClosure *closure = new_closure(vm, function);
+  // A frozen function is read-only, and must not point into a heap.
+  if (!function->obj.is_shared) {
+    function->closure = closure;
+  }
   return closure;
 }
 
-ObjFunction *new_function() {
-  ObjFunction *function = ALLOCATE_OBJ(ObjFunction, ObjFunctionType);
+ObjFunction *new_function(VirtualMachine *vm) {
+  ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, ObjFunctionType);
   function->arity = 0;
   function->upvalues_len = 0;
   function->name = NULL;
+  function->closure = NULL;
   init_chunk(&function->chunk);
   return function;
 }
 
-ObjNative *new_native(NativeFn function) {
-  ObjNative *native = ALLOCATE_OBJ(ObjNative, ObjNativeType);
+ObjNative *new_native(VirtualMachine *vm, NativeFn function) {
+  ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, ObjNativeType);
   native->function = function;
   return native;
 }
 
-static ObjString *allocate_string(const char *chars, uint32_t len,
-                                  uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(ObjString, ObjStringType);
+static ObjString *allocate_string(VirtualMachine *vm, const char *chars,
+                                  uint32_t len, uint32_t hash) {
+  ObjString *string = ALLOCATE_OBJ(vm, ObjString, ObjStringType);
   string->len = len;
   string->chars = chars;
   string->hash = hash;
+  string->is_view = false;
 
-  push_stack(OBJ_VAL(string));
-  table_insert(&vm.strings, string, NULL_VAL);
-  pop_stack();
+  push_stack(vm, OBJ_VAL(string));
+  set_insert(vm, &vm->strings, string);
+  pop_stack(vm);
 
   return string;
 }
 
-static uint32_t hash_string(const char *key, uint32_t len) {
+uint32_t hash_string(const char *key, uint32_t len) {
   uint32_t hash = 2166136261u;
   for (uint32_t i = 0; i < len; i += 1) {
     hash ^= (uint32_t)key[i];
@@ -86,76 +111,303 @@ static uint32_t hash_string(const char *key, uint32_t len) {
   return hash;
 }
 
-ObjString *take_string(char *chars, uint32_t len) {
-  uint32_t hash = hash_string(chars, len);
-  ObjString *interned = table_find_string(&vm.strings, chars, len, hash);
+// A shared string wins over a VM-local one with the same characters: the
+// local one can predate it, but only the shared one is what identifiers
+// resolve to, and tables compare names by pointer.
+static ObjString *find_interned(VirtualMachine *vm, const char *chars,
+                                uint32_t len, uint32_t hash) {
+  ObjString *interned = find_shared_string(chars, len, hash);
+  if (interned == NULL) {
+    interned = set_find_string(&vm->strings, chars, len, hash);
+  }
+  return interned;
+}
 
+ObjString *take_string(VirtualMachine *vm, char *chars, uint32_t len) {
+  uint32_t hash = hash_string(chars, len);
+  ObjString *interned = find_interned(vm, chars, len, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, len + 1);
+    FREE_ARRAY(vm, char, chars, len + 1);
     return interned;
   }
 
-  return allocate_string(chars, len, hash);
+  return allocate_string(vm, chars, len, hash);
 }
 
-ObjString *copy_string(const char *chars, uint32_t len) {
+ObjString *copy_string(VirtualMachine *vm, const char *chars, uint32_t len) {
   uint32_t hash = hash_string(chars, len);
-  ObjString *interned = table_find_string(&vm.strings, chars, len, hash);
-
+  ObjString *interned = find_interned(vm, chars, len, hash);
   if (interned != NULL) {
     return interned;
   }
 
-  char *heap_chars = ALLOCATE(char, len + 1);
+  char *heap_chars = ALLOCATE(vm, char, len + 1);
   memcpy(heap_chars, chars, len);
   heap_chars[len] = '\0';
-  return allocate_string(heap_chars, len, hash);
+  return allocate_string(vm, heap_chars, len, hash);
+}
+
+ObjString *new_string_view(VirtualMachine *vm, ObjMappedFile *file,
+                           const char *chars, uint32_t len) {
+  ObjStringView *view = ALLOCATE_OBJ(vm, ObjStringView, ObjStringType);
+  view->string.len = len;
+  view->string.chars = chars;
+  view->string.hash = 0;
+  view->string.is_view = true;
+  view->file = file;
+  return &view->string;
+}
+
+ObjString *terminate_string(VirtualMachine *vm, Value value) {
+  ObjString *string = AS_STRING(value);
+  if (!string->is_view) {
+    return string;
+  }
+  return copy_string(vm, string->chars, string->len);
 }
 
-ObjUpvalue *new_upvalue(Value *stack_slot) {
-  ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, ObjUpvalueType);
+ObjUpvalue *new_upvalue(VirtualMachine *vm, Value *stack_slot) {
+  ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, ObjUpvalueType);
   upvalue->location = stack_slot;
   upvalue->closed = NULL_VAL;
   upvalue->next = NULL;
   return upvalue;
 }
 
-void print_function(ObjFunction *function) {
+ObjChannel *new_channel(VirtualMachine *vm, Channel *channel) {
+  ObjChannel *object = ALLOCATE_OBJ(vm, ObjChannel, ObjChannelType);
+  retain_channel(channel);
+  object->channel = channel;
+  return object;
+}
+
+ObjCoroutine *new_coroutine(VirtualMachine *vm, ObjClosure *closure) {
+  // Room for the closure and its arguments, which the caller pushes.
+  uint32_t stack_capacity = closure->function->arity + 1;
+  if (stack_capacity < FIBER_STACK_INIT) {
+    stack_capacity = FIBER_STACK_INIT;
+  }
+  CallFrame *frames = ALLOCATE(vm, CallFrame, FIBER_FRAMES_INIT);
+  Value *stack = ALLOCATE(vm, Value, stack_capacity);
+
+  ObjCoroutine *coroutine =
+      ALLOCATE_OBJ(vm, ObjCoroutine, ObjCoroutineType);
+  coroutine->state = CoroutineSuspended;
+  coroutine->scheduled = false;
+  coroutine->started = false;
+  coroutine->fiber.frames = frames;
+  coroutine->fiber.frames_len = 0;
+  coroutine->fiber.frames_capacity = FIBER_FRAMES_INIT;
+  coroutine->fiber.stack = stack;
+  coroutine->fiber.stack_ptr = stack;
+  coroutine->fiber.stack_capacity = stack_capacity;
+  coroutine->fiber.open_upvalues = NULL;
+  coroutine->caller_coroutine = NULL;
+
+  *coroutine->fiber.stack_ptr = OBJ_VAL(closure);
+  coroutine->fiber.stack_ptr += 1;
+
+  coroutine->next_coroutine = vm->coroutines;
+  vm->coroutines = coroutine;
+  return coroutine;
+}
+
+ObjColumns *new_columns(VirtualMachine *vm, ObjClass *klass) {
+  ObjColumns *columns = ALLOCATE_OBJ(vm, ObjColumns, ObjColumnsType);
+  columns->klass = klass;
+  columns->fields_len = klass->template.len;
+  columns->len = 0;
+  columns->capacity = 0;
+  columns->values = NULL;
+  return columns;
+}
+
+ObjRow *new_row(VirtualMachine *vm, ObjColumns *columns, uint32_t idx) {
+  ObjRow *row = ALLOCATE_OBJ(vm, ObjRow, ObjRowType);
+  row->columns = columns;
+  row->idx = idx;
+  return row;
+}
+
+ObjList *new_list(VirtualMachine *vm) {
+  ObjList *list = ALLOCATE_OBJ(vm, ObjList, ObjListType);
+  init_value_vec(&list->items);
+  return list;
+}
+
+ObjMap *new_map(VirtualMachine *vm) {
+  ObjMap *map = ALLOCATE_OBJ(vm, ObjMap, ObjMapType);
+  map->len = 0;
+  map->entries = NULL;
+  map->entries_len = 0;
+  map->entries_capacity = 0;
+  map->slots = NULL;
+  map->slots_capacity = 0;
+  return map;
+}
+
+ObjFloat64Array *new_float64_array(VirtualMachine *vm, uint32_t len) {
+  ObjFloat64Array *array =
+      ALLOCATE_OBJ(vm, ObjFloat64Array, ObjFloat64ArrayType);
+  array->len = 0;
+  array->values = NULL;
+  array->mapped_len = 0;
+  if (len > 0) {
+    push_stack(vm, OBJ_VAL(array));
+    array->values = ALLOCATE(vm, double, len);
+    memset(array->values, 0, sizeof(double) * len);
+    array->len = len;
+    pop_stack(vm);
+  }
+  return array;
+}
+
+ObjMappedFile *new_mapped_file(VirtualMachine *vm, const char *chars,
+                               size_t len) {
+  ObjMappedFile *file = ALLOCATE_OBJ(vm, ObjMappedFile, ObjMappedFileType);
+  file->chars = chars;
+  file->len = len;
+  return file;
+}
+
+ObjIter *new_iter(VirtualMachine *vm, Value source, uint32_t stages_len) {
+  ObjIter *iter =
+      (ObjIter *)allocate_object(vm, ITER_SIZE(stages_len), ObjIterType);
+  iter->source = source;
+  iter->pending = IterStageNone;
+  iter->stages_len = stages_len;
+  for (uint32_t i = 0; i < stages_len; i += 1) {
+    iter->stages[i] = (IterStage){.kind = IterMap, .arg = NULL_VAL};
+  }
+  return iter;
+}
+
+static void print_function(FILE *out, ObjFunction *function) {
   if (function->name == NULL) {
-    printf("<script>");
+    fprintf(out, "<script>");
+    return;
+  }
+  fprintf(out, "<fn %s>", function->name->chars);
+}
+
+// Collections nested deeper than this print as `[...]` or `{...}`, which
+// also stops cycles.
+#define PRINT_DEPTH_MAX 16
+
+static void print_nested(FILE *out, Value value, uint32_t depth);
+
+static void print_list(FILE *out, const ObjList *list, uint32_t depth) {
+  if (depth == PRINT_DEPTH_MAX) {
+    fputs("[...]", out);
+    return;
+  }
+  fputc('[', out);
+  for (uint32_t i = 0; i < list->items.len; i += 1) {
+    if (i > 0) {
+      fputs(", ", out);
+    }
+    print_nested(out, list->items.values[i], depth + 1);
+  }
+  fputc(']', out);
+}
+
+static void print_map(FILE *out, const ObjMap *map, uint32_t depth) {
+  if (depth == PRINT_DEPTH_MAX) {
+    fputs("{...}", out);
     return;
   }
-  printf("<fn %s>", function->name->chars);
+  fputc('{', out);
+  bool first = true;
+  for (uint32_t i = 0; i < map->entries_len; i += 1) {
+    const MapEntry *entry = &map->entries[i];
+    if (IS_EMPTY(entry->key)) {
+      continue;
+    }
+    fputs(first ? "" : ", ", out);
+    first = false;
+    print_nested(out, entry->key, depth + 1);
+    fputs(": ", out);
+    print_nested(out, entry->value, depth + 1);
+  }
+  fputc('}', out);
 }
 
-void print_object(Value value) {
+static void print_nested(FILE *out, Value value, uint32_t depth) {
+  if (IS_LIST(value)) {
+    print_list(out, AS_LIST(value), depth);
+  } else if (IS_MAP(value)) {
+    print_map(out, AS_MAP(value), depth);
+  } else {
+    print_value(out, value);
+  }
+}
+
+void print_object(FILE *out, Value value) {
   switch (OBJ_TYPE(value)) {
   case ObjInstanceType: {
-    printf("instance of <class %s>", AS_INSTANCE(value)->klass->name->chars);
+    fprintf(out, "instance of <class %s>",
+            AS_INSTANCE(value)->klass->name->chars);
     break;
   }
   case ObjClassType: {
-    printf("<class %s>", AS_CLASS(value)->name->chars);
+    fprintf(out, "<class %s>", AS_CLASS(value)->name->chars);
     break;
   }
   case ObjClosureType: {
-    print_function(AS_CLOSURE(value)->function);
+    print_function(out, AS_CLOSURE(value)->function);
     break;
   }
   case ObjFunctionType: {
-    print_function(AS_FUNCTION(value));
+    print_function(out, AS_FUNCTION(value));
     break;
   }
   case ObjNativeType: {
-    printf("<native fn>");
+    fprintf(out, "<native fn>");
     break;
   }
   case ObjStringType: {
-    printf("%s", AS_CSTRING(value));
+    fprintf(out, "%.*s", (int)AS_STRING(value)->len, AS_CSTRING(value));
     break;
   }
   case ObjUpvalueType: {
-    printf("upvalue");
+    fprintf(out, "upvalue");
+    break;
+  }
+  case ObjChannelType: {
+    fprintf(out, "<channel>");
+    break;
+  }
+  case ObjCoroutineType: {
+    fprintf(out, "<coroutine>");
+    break;
+  }
+  case ObjColumnsType: {
+    fprintf(out, "<table of %s>", AS_COLUMNS(value)->klass->name->chars);
+    break;
+  }
+  case ObjRowType: {
+    fprintf(out, "row %u of <table of %s>", AS_ROW(value)->idx,
+            AS_ROW(value)->columns->klass->name->chars);
+    break;
+  }
+  case ObjListType: {
+    print_list(out, AS_LIST(value), 0);
+    break;
+  }
+  case ObjMapType: {
+    print_map(out, AS_MAP(value), 0);
+    break;
+  }
+  case ObjIterType: {
+    fprintf(out, "<iter of %u stages>", AS_ITER(value)->stages_len);
+    break;
+  }
+  case ObjFloat64ArrayType: {
+    fprintf(out, "<float64 array of %u>", AS_FLOAT64_ARRAY(value)->len);
+    break;
+  }
+  case ObjMappedFileType: {
+    fprintf(out, "<mapped file of %zu bytes>", AS_MAPPED_FILE(value)->len);
     break;
   }
   }
@@ -2,6 +2,7 @@
 #define breeze_object_h
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "chunk.h"
 #include "common.h"
@@ -9,15 +10,24 @@
 #include "value.h"
 
 /* Allocates memory for an object and sets its type
+ * @param vm: The VM whose heap owns the object
  * @param type: The struct type to allocate (used for casting)
  * @param object_type: The enum value to set in the object's type field
  * @return: A pointer to the newly allocated object, cast to the specified type
  *
  * Example:
- *     ObjString* str = ALLOCATE_OBJ(ObjString, ObjStringType);
+ *     ObjString* str = ALLOCATE_OBJ(vm, ObjString, ObjStringType);
  */
-#define ALLOCATE_OBJ(type, object_type)                                        \
-  (type *)allocate_object(sizeof(type), object_type)
+#define ALLOCATE_OBJ(vm, type, object_type)                                    \
+  (type *)allocate_object(vm, sizeof(type), object_type)
+
+// Size of a closure with its upvalue array.
+#define CLOSURE_SIZE(upvalues_len)                                             \
+  (sizeof(ObjClosure) + sizeof(ObjUpvalue *) * (upvalues_len))
+
+// Size of an instance with its field array.
+#define INSTANCE_SIZE(fields_len)                                              \
+  (sizeof(ObjInstance) + sizeof(Value) * (fields_len))
 
 /* Gets the type of an object from a value
  * @param value: Value struct instance to cast to an object
@@ -31,6 +41,15 @@
 #define IS_FUNCTION(value) is_obj_type(value, ObjFunctionType)
 #define IS_NATIVE(value) is_obj_type(value, ObjNativeType)
 #define IS_STRING(value) is_obj_type(value, ObjStringType)
+#define IS_CHANNEL(value) is_obj_type(value, ObjChannelType)
+#define IS_COROUTINE(value) is_obj_type(value, ObjCoroutineType)
+#define IS_COLUMNS(value) is_obj_type(value, ObjColumnsType)
+#define IS_ROW(value) is_obj_type(value, ObjRowType)
+#define IS_LIST(value) is_obj_type(value, ObjListType)
+#define IS_MAP(value) is_obj_type(value, ObjMapType)
+#define IS_FLOAT64_ARRAY(value) is_obj_type(value, ObjFloat64ArrayType)
+#define IS_ITER(value) is_obj_type(value, ObjIterType)
+#define IS_MAPPED_FILE(value) is_obj_type(value, ObjMappedFileType)
 
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
@@ -39,6 +58,23 @@
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_CHANNEL(value) (((ObjChannel *)AS_OBJ(value))->channel)
+#define AS_COROUTINE(value) ((ObjCoroutine *)AS_OBJ(value))
+#define AS_COLUMNS(value) ((ObjColumns *)AS_OBJ(value))
+#define AS_ROW(value) ((ObjRow *)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_FLOAT64_ARRAY(value) ((ObjFloat64Array *)AS_OBJ(value))
+#define AS_ITER(value) ((ObjIter *)AS_OBJ(value))
+#define AS_MAPPED_FILE(value) ((ObjMappedFile *)AS_OBJ(value))
+
+// Initial sizes of a fiber's arrays, which grow on demand.
+#define FIBER_FRAMES_INIT 8
+#define FIBER_STACK_INIT 64
+
+// Free stack slots a native is called with: it can root that many values
+// with `push_stack` before the stack, and its `args` with it, may move.
+#define NATIVE_STACK_SLACK 16
 
 typedef enum {
   ObjNativeType,
@@ -48,11 +84,22 @@ typedef enum {
   ObjUpvalueType,
   ObjClassType,
   ObjInstanceType,
+  ObjChannelType,
+  ObjCoroutineType,
+  ObjColumnsType,
+  ObjRowType,
+  ObjListType,
+  ObjMapType,
+  ObjFloat64ArrayType,
+  ObjIterType,
+  ObjMappedFileType,
 } ObjType;
 
 typedef struct Obj {
   ObjType type;
   bool is_marked;
+  // Shared objects live outside every VM heap and are never collected.
+  bool is_shared;
   struct Obj *next;
 } Obj;
 
@@ -62,9 +109,12 @@ typedef struct ObjFunction {
   uint32_t upvalues_len;
   Chunk chunk;
   ObjString *name;
+  // Without upvalues, every closure of the function would be the same: one
+  // is created on first use and shared.
+  struct ObjClosure *closure;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int32_t args_len, Value *args);
+typedef Value (*NativeFn)(VirtualMachine *vm, int32_t args_len, Value *args);
 
 typedef struct ObjNative {
   Obj obj;
@@ -74,8 +124,12 @@ typedef struct ObjNative {
 typedef struct ObjString {
   Obj obj;
   uint32_t len;
+  // Followed by a NUL, unless the string is a view.
   const char *chars;
   uint32_t hash;
+  // Views borrow their characters from a mapped file, are not interned,
+  // and leave `hash` at 0 until `string_hash` is called.
+  bool is_view;
 } ObjString;
 
 typedef struct ObjUpvalue {
@@ -88,71 +142,339 @@ typedef struct ObjUpvalue {
 typedef struct ObjClosure {
   Obj obj;
   ObjFunction *function;
-  ObjUpvalue **upvalues;
   uint32_t upvalues_len;
+  ObjUpvalue *upvalues[];
 } ObjClosure;
 
 typedef struct ObjClass {
   Obj obj;
   ObjString *name;
   Table methods;
-  Set fields;
+  // Declared fields, mapped to their index in an instance's field array.
+  Table fields;
+  // Field values of a new instance: the defaults, evaluated once when the
+  // class is declared.
+  ValueVec template;
 } ObjClass;
 
 typedef struct ObjInstance {
   Obj obj;
   ObjClass *klass;
-  Table fields;
+  // Fields declared once the instance existed are missing from it.
+  uint32_t fields_len;
+  Value fields[];
 } ObjInstance;
 
-/* Creates a new instance object
+// Records of one class stored column by column: each declared field has its
+// own array, and a record is only an index into them.
+typedef struct ObjColumns {
+  Obj obj;
+  ObjClass *klass;
+  // Fields declared once the table existed are missing from it.
+  uint32_t fields_len;
+  uint32_t len;
+  uint32_t capacity;
+  // `fields_len` columns of `capacity` values, one after the other.
+  Value *values;
+} ObjColumns;
+
+// Handle on a record of a columnar table, with the properties of an
+// instance.
+typedef struct ObjRow {
+  Obj obj;
+  ObjColumns *columns;
+  uint32_t idx;
+} ObjRow;
+
+typedef struct ObjList {
+  Obj obj;
+  ValueVec items;
+} ObjList;
+
+typedef struct {
+  // Empty once the entry is deleted.
+  Value key;
+  Value value;
+  uint32_t hash;
+} MapEntry;
+
+// Hash map keyed by any value. Entries are kept in insertion order, and an
+// open-addressed index of slots points into them.
+typedef struct ObjMap {
+  Obj obj;
+  // Live entries.
+  uint32_t len;
+  // Deleted entries stay until the next resize.
+  MapEntry *entries;
+  uint32_t entries_len;
+  uint32_t entries_capacity;
+  // A power of two, holding `MAP_SLOT_EMPTY`, `MAP_SLOT_DELETED` or an
+  // entry index plus `MAP_SLOT_ENTRY`.
+  uint32_t *slots;
+  uint32_t slots_capacity;
+} ObjMap;
+
+// Array of raw doubles, for numeric kernels.
+typedef struct ObjFloat64Array {
+  Obj obj;
+  uint32_t len;
+  double *values;
+  // Bytes of the file mapping `values` points into, or 0 when the array
+  // owns `values` on the heap.
+  size_t mapped_len;
+} ObjFloat64Array;
+
+// Read-only mapping of a whole file, unmapped when collected.
+typedef struct ObjMappedFile {
+  Obj obj;
+  const char *chars;
+  size_t len;
+} ObjMappedFile;
+
+// String borrowing its characters from a mapped file, which it keeps alive.
+typedef struct {
+  ObjString string;
+  ObjMappedFile *file;
+} ObjStringView;
+
+typedef enum {
+  IterStageNone,
+  IterMap,
+  IterFilter,
+  IterTake,
+  // Terminal stages run the pipeline instead of extending it.
+  IterReduce,
+  IterToList,
+  IterCount,
+} IterStageKind;
+
+typedef struct {
+  IterStageKind kind;
+  // Function of a map or a filter, or limit of a take.
+  Value arg;
+} IterStage;
+
+// Lazy pipeline over the elements of a list or a float64 array.
+typedef struct ObjIter {
+  Obj obj;
+  Value source;
+  // Stage whose arguments the next call to the pipeline provides, as after
+  // `it.map` in `it.map(f)`.
+  IterStageKind pending;
+  uint32_t stages_len;
+  IterStage stages[];
+} ObjIter;
+
+#define ITER_SIZE(stages_len)                                                  \
+  (sizeof(ObjIter) + sizeof(IterStage) * (stages_len))
+
+// Handle on a channel; the channel itself lives outside every heap.
+typedef struct ObjChannel {
+  Obj obj;
+  struct Channel *channel;
+} ObjChannel;
+
+typedef struct {
+  ObjClosure *closure;
+  uint8_t *inst_ptr;
+  Value *frame_ptr;
+} CallFrame;
+
+// A call stack: its frames, its values and the open upvalues that point
+// into those values.
+typedef struct {
+  CallFrame *frames;
+  uint32_t frames_len;
+  uint32_t frames_capacity;
+  Value *stack;
+  Value *stack_ptr;
+  uint32_t stack_capacity;
+  ObjUpvalue *open_upvalues;
+} Fiber;
+
+typedef enum {
+  CoroutineSuspended,
+  CoroutineRunning,
+  // Parked by the event loop until an operation completes.
+  CoroutineWaiting,
+  CoroutineDone,
+} CoroutineState;
+
+typedef struct ObjCoroutine {
+  Obj obj;
+  CoroutineState state;
+  // Whether the first resume happened, so a resume value has a `yield` to
+  // land on.
+  bool started;
+  // Owned by the event loop: queued to run or waiting on an operation.
+  bool scheduled;
+  // Own registers, valid while suspended.
+  Fiber fiber;
+  // Registers of the resumer, valid while running.
+  Fiber caller;
+  struct ObjCoroutine *caller_coroutine;
+  struct ObjCoroutine *next_coroutine;
+} ObjCoroutine;
+
+/* Creates a new instance object, in one allocation copied from the class'
+ * field template
+ * @param vm: The VM whose heap owns the instance
  * @param class (klass!): A pointer to a class object
  * @return: Pointer to the newly created instance
  */
-ObjInstance *new_instance(ObjClass *klass);
+ObjInstance *new_instance(VirtualMachine *vm, ObjClass *klass);
 
 /* Creates a new class object
+ * @param vm: The VM whose heap owns the class
  * @param name: A pointer to a string object
  * @return: Pointer to the newly created class
  */
-ObjClass *new_class(ObjString *name);
+ObjClass *new_class(VirtualMachine *vm, ObjString *name);
 
 /* Creates a new closure object that wraps a function
+ * @param vm: The VM whose heap owns the closure
  * @param function: The function object to wrap
  * @return: Pointer to the newly created closure
  */
-ObjClosure *new_closure(ObjFunction *function);
+ObjClosure *new_closure(VirtualMachine *vm, ObjFunction *function);
+
+/* Returns the closure to create when a function is evaluated: the shared
+ * one when it has no upvalues, a new one otherwise
+ * @param vm: The VM whose heap owns the closure
+ * @param function: The function object to wrap
+ * @return: The closure, whose upvalues the caller must fill
+ */
+ObjClosure *closure_of(VirtualMachine *vm, ObjFunction *function);
 
 /* Creates a new empty function object
+ * @param vm: The VM whose heap owns the function
  * @return: Pointer to the newly created function
  */
-ObjFunction *new_function();
+ObjFunction *new_function(VirtualMachine *vm);
 
 /* Creates a new native function object
+ * @param vm: The VM whose heap owns the native
  * @param function: Pointer to the C function to wrap
  * @return: Pointer to the newly created native function object
  */
-ObjNative *new_native(NativeFn function);
+ObjNative *new_native(VirtualMachine *vm, NativeFn function);
+
+/* Hashes a char array with FNV-1a, the hash every string object caches
+ * @param chars: Pointer to the character array
+ * @param len: Length of the string
+ * @return: The 32-bit hash of the characters
+ */
+uint32_t hash_string(const char *chars, uint32_t len);
 
 /* Creates a string object from an existing char array
+ * @param vm: The VM whose heap owns the string
  * @param chars: Pointer to the character array (takes ownership)
  * @param len: Length of the string
  * @return: Pointer to the newly created string object
  */
-ObjString *take_string(char *chars, uint32_t len);
+ObjString *take_string(VirtualMachine *vm, char *chars, uint32_t len);
 
 /* Creates a string object by copying a char array
+ * @param vm: The VM whose heap owns the string
  * @param chars: Pointer to the character array to copy
  * @param len: Length of the string
  * @return: Pointer to the newly created string object
  */
-ObjString *copy_string(const char *, uint32_t);
+ObjString *copy_string(VirtualMachine *vm, const char *, uint32_t);
+
+/* Creates a string that borrows its characters from a mapped file, without
+ * copying or interning them
+ * @param vm: The VM whose heap owns the view
+ * @param file: The mapped file, kept mapped while the view lives
+ * @param chars: Pointer to the characters, inside the mapping
+ * @param len: Length of the string
+ * @return: Pointer to the newly created view
+ */
+ObjString *new_string_view(VirtualMachine *vm, ObjMappedFile *file,
+                           const char *chars, uint32_t len);
+
+/* Returns a string as one that ends with a NUL byte, for natives that read
+ * it as a C string: a view is copied to the interned string of the same
+ * characters. The copy may be reachable from nowhere else, so a native must
+ * root it before allocating again while it still uses it.
+ * @param vm: The VM whose heap owns the string
+ * @param value: The string
+ * @return: The string itself, or its interned copy
+ */
+ObjString *terminate_string(VirtualMachine *vm, Value value);
 
 /* Creates a new upvalue object
+ * @param vm: The VM whose heap owns the upvalue
  * @param stack_slot: Pointer to the stack location of the captured value
  * @return: Pointer to the newly created upvalue
  */
-ObjUpvalue *new_upvalue(Value *stack_slot);
+ObjUpvalue *new_upvalue(VirtualMachine *vm, Value *stack_slot);
+
+/* Creates a new handle on a channel
+ * @param vm: The VM whose heap owns the handle
+ * @param channel: The channel, retained until the handle is freed
+ * @return: Pointer to the newly created channel object
+ */
+ObjChannel *new_channel(VirtualMachine *vm, struct Channel *channel);
+
+/* Creates a suspended coroutine that will call a closure. The closure is
+ * pushed on the coroutine's own stack, ready for its arguments.
+ * @param vm: The VM whose heap owns the coroutine
+ * @param closure: The body of the coroutine
+ * @return: Pointer to the newly created coroutine
+ */
+ObjCoroutine *new_coroutine(VirtualMachine *vm, ObjClosure *closure);
+
+/* Creates an empty columnar table for the instances of a class
+ * @param vm: The VM whose heap owns the table
+ * @param klass: The class whose declared fields become the columns
+ * @return: Pointer to the newly created table
+ */
+ObjColumns *new_columns(VirtualMachine *vm, ObjClass *klass);
+
+/* Creates a handle on a record of a columnar table
+ * @param vm: The VM whose heap owns the handle
+ * @param columns: The table holding the record
+ * @param idx: Index of the record
+ * @return: Pointer to the newly created row
+ */
+ObjRow *new_row(VirtualMachine *vm, ObjColumns *columns, uint32_t idx);
+
+/* Creates an empty list
+ * @param vm: The VM whose heap owns the list
+ * @return: Pointer to the newly created list
+ */
+ObjList *new_list(VirtualMachine *vm);
+
+/* Creates an empty map
+ * @param vm: The VM whose heap owns the map
+ * @return: Pointer to the newly created map
+ */
+ObjMap *new_map(VirtualMachine *vm);
+
+/* Creates a float64 array of zeros
+ * @param vm: The VM whose heap owns the array
+ * @param len: Number of elements
+ * @return: Pointer to the newly created array
+ */
+ObjFloat64Array *new_float64_array(VirtualMachine *vm, uint32_t len);
+
+/* Creates a handle on a file mapped in memory
+ * @param vm: The VM whose heap owns the handle
+ * @param chars: The mapping, unmapped when the handle is freed, or NULL
+ * @param len: Bytes of the mapping
+ * @return: Pointer to the newly created handle
+ */
+ObjMappedFile *new_mapped_file(VirtualMachine *vm, const char *chars,
+                               size_t len);
+
+/* Creates a pipeline with placeholder stages, for the caller to fill in
+ * @param vm: The VM whose heap owns the pipeline
+ * @param source: List or float64 array the pipeline iterates
+ * @param stages_len: Number of stages
+ * @return: Pointer to the newly created pipeline
+ */
+ObjIter *new_iter(VirtualMachine *vm, Value source, uint32_t stages_len);
 
 /* Checks if a value is an object of a specific type
  * @param value: The value to check
@@ -163,9 +485,21 @@ static inline bool is_obj_type(Value value, ObjType type) {
   return IS_OBJ(value) && (AS_OBJ(value)->type == type);
 }
 
+/* Returns the hash of a string's characters, which a view only computes
+ * the first time it is asked for
+ * @param string: The string to hash
+ * @return: The hash, as `hash_string` computes it
+ */
+static inline uint32_t string_hash(ObjString *string) {
+  if (string->hash == 0 && string->is_view) {
+    string->hash = hash_string(string->chars, string->len);
+  }
+  return string->hash;
+}
+
 /* Prints the string representation of an object
  * @param value: The value containing the object to print
  */
-void print_object(Value value);
+void print_object(FILE *out, Value value);
 
 #endif // !breeze_object_h
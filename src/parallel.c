@@ -0,0 +1,701 @@
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+#include "object.h"
+#include "simd.h"
+#include "virtual_machine.h"
+
+// Threads one loop can use, the caller included.
+#define PARALLEL_THREADS_MAX 64
+// Smallest chunk: below it, handing work to another thread costs more than
+// it saves.
+#define CHUNK_LEN_MIN 16384
+// Chunks per thread, so that threads done early have some left to steal.
+#define CHUNKS_PER_THREAD 4
+// Elements an expression is evaluated over at a time.
+#define BLOCK_LEN 256
+#define EXPR_LEN_MAX 64
+#define EXPR_DEPTH_MAX 8
+
+/*** EXPRESSIONS ***/
+
+typedef enum {
+  ExprX,
+  ExprConstant,
+  ExprAdd,
+  ExprSub,
+  ExprMul,
+  ExprDiv,
+  ExprNeg,
+  ExprSqrt,
+  ExprAbs,
+  ExprExp,
+  ExprLog,
+  ExprSin,
+  ExprCos,
+  ExprFloor,
+  ExprCeil,
+} ExprOp;
+
+typedef struct {
+  ExprOp op;
+  double constant;
+} ExprInst;
+
+// Postfix program computing an expression of `x`.
+typedef struct {
+  ExprInst code[EXPR_LEN_MAX];
+  uint32_t len;
+  uint32_t depth;
+  uint32_t depth_max;
+} Expr;
+
+typedef struct {
+  const char *current;
+  Expr *expr;
+  uint32_t nesting;
+  bool had_error;
+} ExprParser;
+
+static const struct {
+  const char *name;
+  ExprOp op;
+} expr_functions[] = {
+    {"sqrt", ExprSqrt}, {"abs", ExprAbs}, {"exp", ExprExp},
+    {"log", ExprLog},   {"sin", ExprSin}, {"cos", ExprCos},
+    {"floor", ExprFloor}, {"ceil", ExprCeil},
+};
+
+static void emit_expr(ExprParser *parser, ExprOp op, double constant) {
+  Expr *expr = parser->expr;
+  if (expr->len == EXPR_LEN_MAX) {
+    parser->had_error = true;
+    return;
+  }
+  expr->code[expr->len] = (ExprInst){.op = op, .constant = constant};
+  expr->len += 1;
+  if (op == ExprX || op == ExprConstant) {
+    expr->depth += 1;
+    if (expr->depth > expr->depth_max) {
+      expr->depth_max = expr->depth;
+    }
+  } else if (op >= ExprAdd && op <= ExprDiv) {
+    expr->depth -= 1;
+  }
+}
+
+static bool match_char(ExprParser *parser, char expected) {
+  while (isspace((unsigned char)*parser->current)) {
+    parser->current += 1;
+  }
+  if (*parser->current != expected) {
+    return false;
+  }
+  parser->current += 1;
+  return true;
+}
+
+static void parse_sum(ExprParser *parser);
+
+static void parse_call(ExprParser *parser, const char *name, size_t len) {
+  for (size_t i = 0; i < sizeof(expr_functions) / sizeof(expr_functions[0]);
+       i += 1) {
+    if (strlen(expr_functions[i].name) == len &&
+        memcmp(expr_functions[i].name, name, len) == 0) {
+      if (!match_char(parser, '(')) {
+        break;
+      }
+      parse_sum(parser);
+      if (!match_char(parser, ')')) {
+        break;
+      }
+      emit_expr(parser, expr_functions[i].op, 0);
+      return;
+    }
+  }
+  parser->had_error = true;
+}
+
+static void parse_unary(ExprParser *parser) {
+  if (parser->had_error) {
+    return;
+  }
+  // Bounds the recursion on input such as "((((...".
+  if (parser->nesting == EXPR_LEN_MAX) {
+    parser->had_error = true;
+    return;
+  }
+  parser->nesting += 1;
+  if (match_char(parser, '(')) {
+    parse_sum(parser);
+    parser->had_error |= !match_char(parser, ')');
+  } else if (match_char(parser, '-')) {
+    parse_unary(parser);
+    emit_expr(parser, ExprNeg, 0);
+  } else if (isdigit((unsigned char)*parser->current) ||
+             *parser->current == '.') {
+    char *end;
+    double constant = strtod(parser->current, &end);
+    parser->had_error |= end == parser->current;
+    parser->current = end;
+    emit_expr(parser, ExprConstant, constant);
+  } else if (isalpha((unsigned char)*parser->current)) {
+    const char *name = parser->current;
+    while (isalnum((unsigned char)*parser->current)) {
+      parser->current += 1;
+    }
+    size_t len = (size_t)(parser->current - name);
+    if (len == 1 && name[0] == 'x') {
+      emit_expr(parser, ExprX, 0);
+    } else {
+      parse_call(parser, name, len);
+    }
+  } else {
+    parser->had_error = true;
+  }
+  parser->nesting -= 1;
+}
+
+static void parse_product(ExprParser *parser) {
+  parse_unary(parser);
+  while (!parser->had_error) {
+    if (match_char(parser, '*')) {
+      parse_unary(parser);
+      emit_expr(parser, ExprMul, 0);
+    } else if (match_char(parser, '/')) {
+      parse_unary(parser);
+      emit_expr(parser, ExprDiv, 0);
+    } else {
+      return;
+    }
+  }
+}
+
+static void parse_sum(ExprParser *parser) {
+  parse_product(parser);
+  while (!parser->had_error) {
+    if (match_char(parser, '+')) {
+      parse_product(parser);
+      emit_expr(parser, ExprAdd, 0);
+    } else if (match_char(parser, '-')) {
+      parse_product(parser);
+      emit_expr(parser, ExprSub, 0);
+    } else {
+      return;
+    }
+  }
+}
+
+static bool compile_expr(const char *source, Expr *expr) {
+  expr->len = 0;
+  expr->depth = 0;
+  expr->depth_max = 0;
+  ExprParser parser = {
+      .current = source, .expr = expr, .nesting = 0, .had_error = false};
+  parse_sum(&parser);
+  return !parser.had_error && match_char(&parser, '\0') &&
+         expr->depth_max <= EXPR_DEPTH_MAX;
+}
+
+static bool is_identity(const Expr *expr) {
+  return expr->len == 1 && expr->code[0].op == ExprX;
+}
+
+#define APPLY(operation)                                                       \
+  for (uint32_t j = 0; j < len; j += 1) {                                      \
+    top[j] = operation;                                                        \
+  }
+
+// Evaluates an expression for `len` elements, at most `BLOCK_LEN`.
+static void eval_expr(const Expr *expr, const double *x, double *out,
+                      uint32_t len) {
+  double stack[EXPR_DEPTH_MAX][BLOCK_LEN];
+  uint32_t depth = 0;
+  for (uint32_t i = 0; i < expr->len; i += 1) {
+    const ExprInst *inst = &expr->code[i];
+    if (inst->op == ExprX || inst->op == ExprConstant) {
+      depth += 1;
+    }
+    double *top = stack[depth - 1];
+    double *below = depth >= 2 ? stack[depth - 2] : NULL;
+    switch (inst->op) {
+    case ExprX:
+      memcpy(top, x, sizeof(double) * len);
+      break;
+    case ExprConstant:
+      APPLY(inst->constant);
+      break;
+    case ExprAdd:
+    case ExprSub:
+    case ExprMul:
+    case ExprDiv: {
+      // Binary operators write into the operand below the top.
+      double *right = top;
+      top = below;
+      depth -= 1;
+      switch (inst->op) {
+      case ExprAdd:
+        APPLY(top[j] + right[j]);
+        break;
+      case ExprSub:
+        APPLY(top[j] - right[j]);
+        break;
+      case ExprMul:
+        APPLY(top[j] * right[j]);
+        break;
+      default:
+        APPLY(top[j] / right[j]);
+        break;
+      }
+      break;
+    }
+    case ExprNeg:
+      APPLY(-top[j]);
+      break;
+    case ExprSqrt:
+      APPLY(sqrt(top[j]));
+      break;
+    case ExprAbs:
+      APPLY(fabs(top[j]));
+      break;
+    case ExprExp:
+      APPLY(exp(top[j]));
+      break;
+    case ExprLog:
+      APPLY(log(top[j]));
+      break;
+    case ExprSin:
+      APPLY(sin(top[j]));
+      break;
+    case ExprCos:
+      APPLY(cos(top[j]));
+      break;
+    case ExprFloor:
+      APPLY(floor(top[j]));
+      break;
+    case ExprCeil:
+      APPLY(ceil(top[j]));
+      break;
+    }
+  }
+  memcpy(out, stack[0], sizeof(double) * len);
+}
+
+#undef APPLY
+
+/*** JOBS ***/
+
+typedef enum {
+  ReduceNone,
+  ReduceSum,
+  ReduceMin,
+  ReduceMax,
+} ReduceOp;
+
+// One parallel loop. Its chunks are `chunk_len` elements long, except the
+// last.
+typedef struct {
+  const Expr *expr;
+  ReduceOp reduce;
+  const double *values;
+  uint32_t len;
+  uint32_t chunk_len;
+  // Results of a map.
+  double *out;
+  // Result of each chunk of a reduction, combined in order by the caller so
+  // the result does not depend on which thread ran which chunk.
+  double *partials;
+  atomic_uint remaining;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} Job;
+
+static double reduce_block(ReduceOp reduce, const double *values,
+                           uint32_t len) {
+  const Float64Kernels *kernels = float64_kernels();
+  switch (reduce) {
+  case ReduceMin:
+    return kernels->min(values, len);
+  case ReduceMax:
+    return kernels->max(values, len);
+  default:
+    return kernels->sum(values, len);
+  }
+}
+
+static double combine(ReduceOp reduce, double left, double right) {
+  switch (reduce) {
+  case ReduceMin:
+    return right < left ? right : left;
+  case ReduceMax:
+    return right > left ? right : left;
+  default:
+    return left + right;
+  }
+}
+
+static void run_chunk(Job *job, uint32_t chunk) {
+  uint32_t start = chunk * job->chunk_len;
+  uint32_t end = job->len - start < job->chunk_len ? job->len
+                                                   : start + job->chunk_len;
+  if (job->reduce == ReduceNone) {
+    for (uint32_t i = start; i < end; i += BLOCK_LEN) {
+      uint32_t len = end - i < BLOCK_LEN ? end - i : BLOCK_LEN;
+      eval_expr(job->expr, job->values + i, job->out + i, len);
+    }
+  } else if (is_identity(job->expr)) {
+    job->partials[chunk] =
+        reduce_block(job->reduce, job->values + start, end - start);
+  } else {
+    double block[BLOCK_LEN];
+    double partial = 0;
+    for (uint32_t i = start; i < end; i += BLOCK_LEN) {
+      uint32_t len = end - i < BLOCK_LEN ? end - i : BLOCK_LEN;
+      eval_expr(job->expr, job->values + i, block, len);
+      double result = reduce_block(job->reduce, block, len);
+      partial = i == start ? result : combine(job->reduce, partial, result);
+    }
+    job->partials[chunk] = partial;
+  }
+
+  // The count drops under the lock: the caller only frees the job once it
+  // sees zero while holding the lock, so the signal cannot outlive it.
+  pthread_mutex_lock(&job->lock);
+  if (atomic_fetch_sub(&job->remaining, 1) == 1) {
+    pthread_cond_signal(&job->done);
+  }
+  pthread_mutex_unlock(&job->lock);
+}
+
+/*** POOL ***/
+
+typedef struct {
+  Job *job;
+  uint32_t idx;
+} ChunkRef;
+
+// Ring of chunks. Its owner pushes and pops at the back; thieves take from
+// the front, the chunks the owner would reach last.
+typedef struct {
+  pthread_mutex_t lock;
+  ChunkRef *chunks;
+  uint32_t front;
+  uint32_t len;
+  uint32_t capacity;
+} Deque;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_t threads[PARALLEL_THREADS_MAX];
+  Deque deques[PARALLEL_THREADS_MAX];
+  // Kernel threads started, each owning the deque of the same index.
+  atomic_uint workers_len;
+  // Threads a loop uses, the caller included; 0 until first used.
+  atomic_uint threads_len;
+  // Chunks in all deques, counted before they are pushed.
+  atomic_uint queued;
+  bool stopping;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_ready = PTHREAD_COND_INITIALIZER,
+};
+
+static void push_chunk(Deque *deque, ChunkRef chunk) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->len == deque->capacity) {
+    uint32_t capacity = deque->capacity < 8 ? 8 : deque->capacity * 2;
+    ChunkRef *chunks = (ChunkRef *)malloc(sizeof(ChunkRef) * capacity);
+    if (chunks == NULL) {
+      fprintf(stderr, "Not enough memory to queue a parallel loop.");
+      exit(1);
+    }
+    for (uint32_t i = 0; i < deque->len; i += 1) {
+      chunks[i] = deque->chunks[(deque->front + i) % deque->capacity];
+    }
+    free(deque->chunks);
+    deque->chunks = chunks;
+    deque->front = 0;
+    deque->capacity = capacity;
+  }
+  deque->chunks[(deque->front + deque->len) % deque->capacity] = chunk;
+  deque->len += 1;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+static bool pop_chunk(Deque *deque, ChunkRef *chunk, bool steal) {
+  pthread_mutex_lock(&deque->lock);
+  bool found = deque->len > 0;
+  if (found) {
+    deque->len -= 1;
+    if (steal) {
+      *chunk = deque->chunks[deque->front];
+      deque->front = (deque->front + 1) % deque->capacity;
+    } else {
+      *chunk = deque->chunks[(deque->front + deque->len) % deque->capacity];
+    }
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+// Takes a chunk from the deque of thread `self`, or steals one from the
+// other threads, starting after `self`. The caller of a loop owns no deque.
+static bool take_chunk(uint32_t self, ChunkRef *chunk) {
+  uint32_t workers_len = atomic_load(&pool.workers_len);
+  bool found = self < workers_len &&
+               pop_chunk(&pool.deques[self], chunk, false);
+  for (uint32_t i = 1; !found && i <= workers_len; i += 1) {
+    uint32_t victim = (self + i) % workers_len;
+    found = victim != self && pop_chunk(&pool.deques[victim], chunk, true);
+  }
+  if (found) {
+    atomic_fetch_sub(&pool.queued, 1);
+  }
+  return found;
+}
+
+static void *kernel_thread(void *arg) {
+  uint32_t self = (uint32_t)(uintptr_t)arg;
+  while (true) {
+    ChunkRef chunk;
+    // Threads beyond the configured count sit out.
+    if (self + 1 < atomic_load(&pool.threads_len) &&
+        take_chunk(self, &chunk)) {
+      run_chunk(chunk.job, chunk.idx);
+      continue;
+    }
+    pthread_mutex_lock(&pool.lock);
+    while ((atomic_load(&pool.queued) == 0 ||
+            self + 1 >= atomic_load(&pool.threads_len)) &&
+           !pool.stopping) {
+      pthread_cond_wait(&pool.work_ready, &pool.lock);
+    }
+    bool stopping = pool.stopping;
+    pthread_mutex_unlock(&pool.lock);
+    if (stopping) {
+      return NULL;
+    }
+  }
+}
+
+static uint32_t default_threads_len() {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) {
+    return 1;
+  }
+  return cores > PARALLEL_THREADS_MAX ? PARALLEL_THREADS_MAX
+                                      : (uint32_t)cores;
+}
+
+// Starts kernel threads until there are `len`, or as many as the system
+// allows. Returns how many there are.
+static uint32_t start_workers(uint32_t len) {
+  pthread_mutex_lock(&pool.lock);
+  uint32_t workers_len = atomic_load(&pool.workers_len);
+  while (workers_len < len) {
+    Deque *deque = &pool.deques[workers_len];
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->chunks = NULL;
+    deque->front = 0;
+    deque->len = 0;
+    deque->capacity = 0;
+    if (pthread_create(&pool.threads[workers_len], NULL, kernel_thread,
+                       (void *)(uintptr_t)workers_len) != 0) {
+      pthread_mutex_destroy(&deque->lock);
+      break;
+    }
+    workers_len += 1;
+    atomic_store(&pool.workers_len, workers_len);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return workers_len;
+}
+
+static uint32_t threads_len() {
+  uint32_t len = atomic_load(&pool.threads_len);
+  if (len == 0) {
+    len = default_threads_len();
+    atomic_store(&pool.threads_len, len);
+  }
+  return len;
+}
+
+static void run_job(Job *job) {
+  uint32_t chunks_len = (job->len + job->chunk_len - 1) / job->chunk_len;
+  uint32_t workers_len = chunks_len > 1 ? threads_len() - 1 : 0;
+  if (workers_len > 0 && start_workers(workers_len) < workers_len) {
+    workers_len = atomic_load(&pool.workers_len);
+  }
+  atomic_init(&job->remaining, chunks_len);
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->done, NULL);
+  if (workers_len == 0) {
+    for (uint32_t i = 0; i < chunks_len; i += 1) {
+      run_chunk(job, i);
+    }
+  } else {
+    atomic_fetch_add(&pool.queued, chunks_len);
+    for (uint32_t i = 0; i < chunks_len; i += 1) {
+      push_chunk(&pool.deques[i % workers_len],
+                 (ChunkRef){.job = job, .idx = i});
+    }
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    // The caller helps until nothing is left to take, possibly with chunks
+    // of other loops, then waits for the chunks still running.
+    ChunkRef chunk;
+    while (atomic_load(&job->remaining) > 0 &&
+           take_chunk(PARALLEL_THREADS_MAX, &chunk)) {
+      run_chunk(chunk.job, chunk.idx);
+    }
+  }
+  pthread_mutex_lock(&job->lock);
+  while (atomic_load(&job->remaining) > 0) {
+    pthread_cond_wait(&job->done, &job->lock);
+  }
+  pthread_mutex_unlock(&job->lock);
+  pthread_cond_destroy(&job->done);
+  pthread_mutex_destroy(&job->lock);
+}
+
+// Splits a loop into about `CHUNKS_PER_THREAD` chunks per thread, of whole
+// blocks.
+static void prepare_job(Job *job, const Expr *expr, ReduceOp reduce,
+                        const ObjFloat64Array *array) {
+  job->expr = expr;
+  job->reduce = reduce;
+  job->values = array->values;
+  job->len = array->len;
+  uint32_t chunk_len = array->len / (threads_len() * CHUNKS_PER_THREAD);
+  chunk_len = (chunk_len + BLOCK_LEN - 1) / BLOCK_LEN * BLOCK_LEN;
+  job->chunk_len = chunk_len < CHUNK_LEN_MIN ? CHUNK_LEN_MIN : chunk_len;
+  job->out = NULL;
+  job->partials = NULL;
+}
+
+void shutdown_kernel_threads() {
+  pthread_mutex_lock(&pool.lock);
+  pool.stopping = true;
+  pthread_cond_broadcast(&pool.work_ready);
+  uint32_t workers_len = atomic_load(&pool.workers_len);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (uint32_t i = 0; i < workers_len; i += 1) {
+    pthread_join(pool.threads[i], NULL);
+    free(pool.deques[i].chunks);
+    pthread_mutex_destroy(&pool.deques[i].lock);
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  atomic_store(&pool.workers_len, 0);
+  pool.stopping = false;
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/*** NATIVES ***/
+
+static bool parse_expr(VirtualMachine *vm, Value value, Expr *expr) {
+  const char *source = terminate_string(vm, value)->chars;
+  if (!compile_expr(source, expr)) {
+    native_error(vm, "Invalid expression \"%s\".", source);
+    return false;
+  }
+  return true;
+}
+
+Value parallel_map_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 2 || !IS_FLOAT64_ARRAY(args[0]) || !IS_STRING(args[1])) {
+    return native_error(vm, "parallel_map expects a float64 array and an "
+                            "expression.");
+  }
+  Expr expr;
+  if (!parse_expr(vm, args[1], &expr)) {
+    return NULL_VAL;
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  ObjFloat64Array *out = new_float64_array(vm, array->len);
+  if (array->len == 0) {
+    return OBJ_VAL(out);
+  }
+  Job job;
+  prepare_job(&job, &expr, ReduceNone, array);
+  job.out = out->values;
+  run_job(&job);
+  return OBJ_VAL(out);
+}
+
+Value parallel_reduce_native(VirtualMachine *vm, int32_t args_len,
+                             Value *args) {
+  if (args_len < 2 || args_len > 3 || !IS_FLOAT64_ARRAY(args[0]) ||
+      !IS_STRING(args[1]) || (args_len == 3 && !IS_STRING(args[2]))) {
+    return native_error(vm, "parallel_reduce expects a float64 array, an "
+                            "operation and an optional expression.");
+  }
+  const char *op = terminate_string(vm, args[1])->chars;
+  ReduceOp reduce = strcmp(op, "sum") == 0   ? ReduceSum
+                    : strcmp(op, "min") == 0 ? ReduceMin
+                    : strcmp(op, "max") == 0 ? ReduceMax
+                                             : ReduceNone;
+  if (reduce == ReduceNone) {
+    return native_error(vm, "Unknown reduction \"%s\", expected \"sum\", "
+                            "\"min\" or \"max\".", op);
+  }
+  Expr expr = {.code = {{.op = ExprX}}, .len = 1};
+  if (args_len == 3 && !parse_expr(vm, args[2], &expr)) {
+    return NULL_VAL;
+  }
+  ObjFloat64Array *array = AS_FLOAT64_ARRAY(args[0]);
+  if (array->len == 0) {
+    return reduce == ReduceSum ? NUMBER_VAL(0) : NULL_VAL;
+  }
+
+  Job job;
+  prepare_job(&job, &expr, reduce, array);
+  uint32_t chunks_len = (job.len + job.chunk_len - 1) / job.chunk_len;
+  job.partials = (double *)malloc(sizeof(double) * chunks_len);
+  if (job.partials == NULL) {
+    fprintf(stderr, "Not enough memory to run a parallel loop.");
+    exit(1);
+  }
+  run_job(&job);
+  double result = job.partials[0];
+  for (uint32_t i = 1; i < chunks_len; i += 1) {
+    result = combine(reduce, result, job.partials[i]);
+  }
+  free(job.partials);
+  return NUMBER_VAL(result);
+}
+
+Value parallel_threads_native(VirtualMachine *vm, int32_t args_len,
+                              Value *args) {
+  if (args_len > 1 ||
+      (args_len == 1 &&
+       (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 1 ||
+        AS_NUMBER(args[0]) > PARALLEL_THREADS_MAX ||
+        AS_NUMBER(args[0]) != (uint32_t)AS_NUMBER(args[0])))) {
+    return native_error(vm, "parallel_threads expects a count from 1 to %d.",
+                        PARALLEL_THREADS_MAX);
+  }
+  uint32_t previous = threads_len();
+  if (args_len == 1) {
+    atomic_store(&pool.threads_len, (uint32_t)AS_NUMBER(args[0]));
+    // Wakes threads that now have a part in running loops.
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return NUMBER_VAL(previous);
+}
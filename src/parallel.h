@@ -0,0 +1,51 @@
+#ifndef breeze_parallel_h
+#define breeze_parallel_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/***
+  Parallel loops split a float64 array into chunks and run them on a pool
+  of kernel threads, started on first use and kept for the life of the
+  process. Every thread owns a deque of chunks: it takes work from its own
+  end and, once that is empty, steals from the far end of the others'. The
+  calling thread steals too until its loop is done.
+
+  The work is limited to built-in reductions and numeric expressions of `x`
+  such as "sqrt(x) * 2 + 1", compiled to a small postfix program evaluated a
+  block of elements at a time. Kernel threads only read and write raw
+  doubles, never the VM heap.
+
+  Expressions support numbers, `x`, `+ - * /`, unary minus, parentheses and
+  the functions sqrt, abs, exp, log, sin, cos, floor and ceil.
+  ***/
+
+/* parallel_map(array, expr): Evaluates an expression of `x` for every
+ * element of a float64 array
+ * @return: A new float64 array of the results
+ */
+Value parallel_map_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* parallel_reduce(array, op, expr?): Reduces a float64 array with "sum",
+ * "min" or "max", applying an optional expression of `x` to each element
+ * first
+ * @return: The result, or null for the minimum or maximum of nothing
+ */
+Value parallel_reduce_native(VirtualMachine *vm, int32_t args_len,
+                             Value *args);
+
+/* parallel_threads(count?): Sets how many threads a parallel loop uses, the
+ * caller included; the number of cores by default
+ * @return: The previous count
+ */
+Value parallel_threads_native(VirtualMachine *vm, int32_t args_len,
+                              Value *args);
+
+/* Stops the kernel threads, once no parallel loop is running. They start
+ * again on the next loop.
+ */
+void shutdown_kernel_threads();
+
+#endif // !breeze_parallel_h
@@ -3,84 +3,78 @@
 
 #include "scanner.h"
 
-typedef struct {
-  const char *start;
-  const char *current;
-  uint32_t line;
-} Scanner;
-
-Scanner scanner;
-
-void init_scanner(const char *source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+void init_scanner(Scanner *scanner, const char *source) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = 1;
 }
 
-static Token make_token(TokenType type) {
+static Token make_token(const Scanner *scanner, TokenType type) {
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.len = (uint32_t)(scanner.current - scanner.start);
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.len = (uint32_t)(scanner->current - scanner->start);
+  token.line = scanner->line;
   return token;
 }
 
-static Token error_token(const char *message) {
+static Token error_token(const Scanner *scanner, const char *message) {
   Token token;
   token.type = TokenError;
   token.start = message;
   token.len = (uint32_t)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
   return token;
 }
 
-static const char advance() {
-  scanner.current += 1;
-  return *(scanner.current - 1);
+static char advance(Scanner *scanner) {
+  scanner->current += 1;
+  return *(scanner->current - 1);
 }
 
-static const char peek() { return *(scanner.current); }
+static char peek(const Scanner *scanner) { return *(scanner->current); }
 
-static bool is_at_end() { return peek() == '\0'; }
+static bool is_at_end(const Scanner *scanner) {
+  return peek(scanner) == '\0';
+}
 
-static const char peek_next() {
-  if (is_at_end()) {
+static char peek_next(const Scanner *scanner) {
+  if (is_at_end(scanner)) {
     return '\0';
   }
-  return *(scanner.current + 1);
+  return *(scanner->current + 1);
 }
 
-static bool match(const char expected) {
-  if (is_at_end()) {
+static bool match(Scanner *scanner, const char expected) {
+  if (is_at_end(scanner)) {
     return false;
   }
-  if (peek() != expected) {
+  if (peek(scanner) != expected) {
     return false;
   }
-  advance();
+  advance(scanner);
   return true;
 }
 
-static void skip_white_space() {
+static void skip_white_space(Scanner *scanner) {
   while (true) {
-    const char c = peek();
+    const char c = peek(scanner);
     switch (c) {
     case ' ':
     case '\r':
     case '\t': {
-      advance();
+      advance(scanner);
       break;
     }
     case '\n': {
-      scanner.line += 1;
-      advance();
+      scanner->line += 1;
+      advance(scanner);
       break;
     }
     case '/': {
-      if (peek_next() == '/') {
-        while (peek() != '\n' && !is_at_end()) {
-          advance();
+      if (peek_next(scanner) == '/') {
+        while (peek(scanner) != '\n' && !is_at_end(scanner)) {
+          advance(scanner);
         }
       } else {
         return;
@@ -93,163 +87,173 @@ static void skip_white_space() {
   }
 }
 
-static Token string() {
-  while (peek() != '"' && !is_at_end()) {
-    if (peek() == '\n') {
-      scanner.line += 1;
+static Token string(Scanner *scanner) {
+  while (peek(scanner) != '"' && !is_at_end(scanner)) {
+    if (peek(scanner) == '\n') {
+      scanner->line += 1;
     }
-    advance();
+    advance(scanner);
   }
 
-  if (is_at_end()) {
-    return error_token("Unterminated string.");
+  if (is_at_end(scanner)) {
+    return error_token(scanner, "Unterminated string.");
   }
 
-  advance();
-  return make_token(TokenString);
+  advance(scanner);
+  return make_token(scanner, TokenString);
 }
 
 static bool is_digit(const char c) { return c >= '0' && c <= '9'; }
 
-static Token number() {
-  while (is_digit(peek())) {
-    advance();
+static Token number(Scanner *scanner) {
+  while (is_digit(peek(scanner))) {
+    advance(scanner);
   }
 
-  if (peek() == '.' && is_digit(peek_next())) {
-    advance();
-    while (is_digit(peek())) {
-      advance();
+  if (peek(scanner) == '.' && is_digit(peek_next(scanner))) {
+    advance(scanner);
+    while (is_digit(peek(scanner))) {
+      advance(scanner);
     }
   }
 
-  return make_token(TokenNumber);
+  return make_token(scanner, TokenNumber);
 }
 
 static bool is_alpha(const char c) {
   return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c == '_'));
 }
 
-static TokenType check_keyword(uint8_t start, uint8_t len, const char *rest,
-                               TokenType type) {
-  if ((scanner.current - scanner.start == start + len) &&
-      memcmp(scanner.start + start, rest, len) == 0) {
+static TokenType check_keyword(const Scanner *scanner, uint8_t start,
+                               uint8_t len, const char *rest, TokenType type) {
+  if ((scanner->current - scanner->start == start + len) &&
+      memcmp(scanner->start + start, rest, len) == 0) {
     return type;
   }
   return TokenIdentifier;
 }
 
-static TokenType identifier_type() {
-  switch (scanner.start[0]) {
+static TokenType identifier_type(const Scanner *scanner) {
+  switch (scanner->start[0]) {
   case 'c':
-    return check_keyword(1, 4, "lass", TokenClass);
+    return check_keyword(scanner, 1, 4, "lass", TokenClass);
   case 'e':
-    return check_keyword(1, 3, "lse", TokenElse);
+    return check_keyword(scanner, 1, 3, "lse", TokenElse);
   case 'f': {
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
+    if (scanner->current - scanner->start > 1) {
+      switch (scanner->start[1]) {
       case 'a':
-        return check_keyword(2, 3, "lse", TokenFalse);
+        return check_keyword(scanner, 2, 3, "lse", TokenFalse);
       case 'o':
-        return check_keyword(2, 1, "r", TokenFor);
+        return check_keyword(scanner, 2, 1, "r", TokenFor);
       case 'n':
-        return check_keyword(2, 0, "", TokenFn);
+        return check_keyword(scanner, 2, 0, "", TokenFn);
       }
     }
     break;
   }
   case 'i':
-    return check_keyword(1, 1, "f", TokenIf);
+    return check_keyword(scanner, 1, 1, "f", TokenIf);
   case 'l':
-    return check_keyword(1, 2, "et", TokenLet);
+    return check_keyword(scanner, 1, 2, "et", TokenLet);
   case 'n':
-    return check_keyword(1, 3, "ull", TokenNull);
+    return check_keyword(scanner, 1, 3, "ull", TokenNull);
   case 'p':
-    return check_keyword(1, 4, "rint", TokenPrint);
+    return check_keyword(scanner, 1, 4, "rint", TokenPrint);
   case 'r':
-    return check_keyword(1, 5, "eturn", TokenReturn);
+    return check_keyword(scanner, 1, 5, "eturn", TokenReturn);
   case 's': {
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
+    if (scanner->current - scanner->start > 1) {
+      switch (scanner->start[1]) {
       case 'u':
-        return check_keyword(2, 2, "per", TokenSuper);
+        return check_keyword(scanner, 2, 2, "per", TokenSuper);
       case 'e':
-        return check_keyword(2, 2, "lf", TokenSelf);
+        return check_keyword(scanner, 2, 2, "lf", TokenSelf);
       }
     }
     break;
   }
   case 't':
-    return check_keyword(1, 3, "rue", TokenTrue);
+    return check_keyword(scanner, 1, 3, "rue", TokenTrue);
 
   case 'w':
-    return check_keyword(1, 4, "hile", TokenWhile);
+    return check_keyword(scanner, 1, 4, "hile", TokenWhile);
+  case 'y':
+    return check_keyword(scanner, 1, 4, "ield", TokenYield);
   default:
     break;
   }
   return TokenIdentifier;
 }
 
-static Token identifier() {
-  while (is_alpha(peek()) || is_digit(peek())) {
-    advance();
+static Token identifier(Scanner *scanner) {
+  while (is_alpha(peek(scanner)) || is_digit(peek(scanner))) {
+    advance(scanner);
   }
-  return make_token(identifier_type());
+  return make_token(scanner, identifier_type(scanner));
 }
 
-Token scan_token() {
-  skip_white_space();
-  scanner.start = scanner.current;
-  if (is_at_end()) {
-    return make_token(TokenEof);
+Token scan_token(Scanner *scanner) {
+  skip_white_space(scanner);
+  scanner->start = scanner->current;
+  if (is_at_end(scanner)) {
+    return make_token(scanner, TokenEof);
   }
-  const char c = advance();
+  const char c = advance(scanner);
 
   if (is_alpha(c)) {
-    return identifier();
+    return identifier(scanner);
   }
 
   if (is_digit(c)) {
-    return number();
+    return number(scanner);
   }
 
   switch (c) {
   case '(':
-    return make_token(TokenLeftParen);
+    return make_token(scanner, TokenLeftParen);
   case ')':
-    return make_token(TokenRightParen);
+    return make_token(scanner, TokenRightParen);
   case '{':
-    return make_token(TokenLeftBrace);
+    return make_token(scanner, TokenLeftBrace);
   case '}':
-    return make_token(TokenRightBrace);
+    return make_token(scanner, TokenRightBrace);
+  case '[':
+    return make_token(scanner, TokenLeftBracket);
+  case ']':
+    return make_token(scanner, TokenRightBracket);
   case ';':
-    return make_token(TokenSemiColon);
+    return make_token(scanner, TokenSemiColon);
   case ',':
-    return make_token(TokenComma);
+    return make_token(scanner, TokenComma);
   case '.':
-    return make_token(TokenDot);
+    return make_token(scanner, TokenDot);
   case '-':
-    return make_token(TokenMinus);
+    return make_token(scanner, TokenMinus);
   case '+':
-    return make_token(TokenPlus);
+    return make_token(scanner, TokenPlus);
   case '/':
-    return make_token(TokenSlash);
+    return make_token(scanner, TokenSlash);
   case '*':
-    return make_token(TokenStar);
+    return make_token(scanner, TokenStar);
   case '!':
-    return make_token(match('=') ? TokenBangEqual : TokenBang);
+    return make_token(scanner,
+                      match(scanner, '=') ? TokenBangEqual : TokenBang);
   case '=':
-    return make_token(match('=') ? TokenEqualEqual : TokenEqual);
+    return make_token(scanner,
+                      match(scanner, '=') ? TokenEqualEqual : TokenEqual);
   case '<':
-    return make_token(match('=') ? TokenLessEqual : TokenLess);
+    return make_token(scanner,
+                      match(scanner, '=') ? TokenLessEqual : TokenLess);
   case '>':
-    return make_token(match('=') ? TokenGreaterEqual : TokenGreater);
+    return make_token(scanner,
+                      match(scanner, '=') ? TokenGreaterEqual : TokenGreater);
   case '&':
-    return make_token(match('&') ? TokenAndAnd : TokenAnd);
+    return make_token(scanner, match(scanner, '&') ? TokenAndAnd : TokenAnd);
   case '|':
-    return make_token(match('|') ? TokenOrOr : TokenOr);
+    return make_token(scanner, match(scanner, '|') ? TokenOrOr : TokenOr);
   case '"':
-    return string();
+    return string(scanner);
   }
-  return error_token("Unexpected character.");
+  return error_token(scanner, "Unexpected character.");
 }
@@ -10,6 +10,8 @@ typedef enum {
   TokenRightParen,
   TokenLeftBrace,
   TokenRightBrace,
+  TokenLeftBracket,
+  TokenRightBracket,
   TokenComma,
   TokenDot,
   TokenMinus,
@@ -50,6 +52,7 @@ typedef enum {
   TokenTrue,
   TokenLet,
   TokenWhile,
+  TokenYield,
 
   TokenError,
   TokenEof,
@@ -62,7 +65,13 @@ typedef struct {
   uint32_t line;
 } Token;
 
-void init_scanner(const char *source);
-Token scan_token();
+typedef struct {
+  const char *start;
+  const char *current;
+  uint32_t line;
+} Scanner;
+
+void init_scanner(Scanner *scanner, const char *source);
+Token scan_token(Scanner *scanner);
 
 #endif // !breeze_scanner_h
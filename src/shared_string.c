@@ -0,0 +1,212 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared_string.h"
+
+#include "freeze.h"
+#include "object.h"
+
+/***
+  Shared strings are split over `SHARED_STRIPES` independent hash sets picked
+  by the top bits of the hash. Readers never lock: slots are published with
+  release stores once the string they point to is fully built, and a grown
+  slot array replaces the old one atomically. Old arrays are only retired,
+  not freed, because a reader may still be probing them; they are released
+  together with the strings by `free_shared_strings`.
+
+  Writers take the stripe's mutex and probe again before inserting, so a
+  reader that missed because of a concurrent insert or resize still ends up
+  with the single canonical pointer.
+  ***/
+
+#define SHARED_STRIPE_BITS 6
+#define SHARED_STRIPES (1 << SHARED_STRIPE_BITS)
+#define SHARED_MIN_CAPACITY 64
+#define SHARED_CACHE_SIZE 256
+
+typedef struct SharedSlots {
+  uint32_t capacity;
+  struct SharedSlots *retired;
+  _Atomic(ObjString *) slots[];
+} SharedSlots;
+
+typedef struct {
+  pthread_mutex_t lock;
+  _Atomic(SharedSlots *) slots;
+  uint32_t len;
+} SharedStripe;
+
+static SharedStripe stripes[SHARED_STRIPES];
+static pthread_once_t stripes_once = PTHREAD_ONCE_INIT;
+
+// Direct-mapped cache of recent hits, so hot identifiers skip the probe.
+static _Thread_local ObjString *shared_cache[SHARED_CACHE_SIZE];
+
+static void init_stripes() {
+  for (uint32_t i = 0; i < SHARED_STRIPES; i += 1) {
+    pthread_mutex_init(&stripes[i].lock, NULL);
+  }
+}
+
+static inline SharedStripe *stripe_of(uint32_t hash) {
+  return &stripes[hash >> (32 - SHARED_STRIPE_BITS)];
+}
+
+static inline bool string_matches(const ObjString *string, const char *chars,
+                                  uint32_t len, uint32_t hash) {
+  return string->hash == hash && string->len == len &&
+         memcmp(string->chars, chars, len) == 0;
+}
+
+static ObjString *probe_slots(const SharedSlots *slots, const char *chars,
+                              uint32_t len, uint32_t hash) {
+  uint32_t mask = slots->capacity - 1;
+  for (uint32_t idx = hash & mask;; idx = (idx + 1) & mask) {
+    ObjString *string =
+        atomic_load_explicit(&slots->slots[idx], memory_order_acquire);
+    if (string == NULL) {
+      return NULL;
+    }
+    if (string_matches(string, chars, len, hash)) {
+      return string;
+    }
+  }
+}
+
+static SharedSlots *allocate_slots(uint32_t capacity) {
+  SharedSlots *slots = (SharedSlots *)calloc(
+      1, sizeof(SharedSlots) + sizeof(_Atomic(ObjString *)) * capacity);
+  if (slots == NULL) {
+    fprintf(stderr, "Not enough memory for shared strings.");
+    exit(1);
+  }
+  slots->capacity = capacity;
+  return slots;
+}
+
+static void insert_slot(SharedSlots *slots, ObjString *string) {
+  uint32_t mask = slots->capacity - 1;
+  uint32_t idx = string->hash & mask;
+  while (atomic_load_explicit(&slots->slots[idx], memory_order_relaxed) !=
+         NULL) {
+    idx = (idx + 1) & mask;
+  }
+  atomic_store_explicit(&slots->slots[idx], string, memory_order_release);
+}
+
+// Must be called with the stripe locked.
+static void grow_stripe(SharedStripe *stripe) {
+  SharedSlots *old =
+      atomic_load_explicit(&stripe->slots, memory_order_relaxed);
+  uint32_t capacity = old == NULL ? SHARED_MIN_CAPACITY : old->capacity * 2;
+  SharedSlots *slots = allocate_slots(capacity);
+
+  if (old != NULL) {
+    for (uint32_t i = 0; i < old->capacity; i += 1) {
+      ObjString *string =
+          atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+      if (string != NULL) {
+        insert_slot(slots, string);
+      }
+    }
+  }
+  slots->retired = old;
+  atomic_store_explicit(&stripe->slots, slots, memory_order_release);
+}
+
+static ObjString *allocate_shared_string(const char *chars, uint32_t len,
+                                         uint32_t hash) {
+  ObjString *string = (ObjString *)malloc(sizeof(ObjString) + len + 1);
+  if (string == NULL) {
+    fprintf(stderr, "Not enough memory for shared strings.");
+    exit(1);
+  }
+  char *heap_chars = (char *)(string + 1);
+  memcpy(heap_chars, chars, len);
+  heap_chars[len] = '\0';
+
+  string->obj.type = ObjStringType;
+  string->obj.is_marked = false;
+  string->obj.is_shared = true;
+  string->obj.next = NULL;
+  string->len = len;
+  string->chars = heap_chars;
+  string->hash = hash;
+  string->is_view = false;
+  return string;
+}
+
+ObjString *find_shared_string(const char *chars, uint32_t len, uint32_t hash) {
+  ObjString **cached = &shared_cache[hash & (SHARED_CACHE_SIZE - 1)];
+  if (*cached != NULL && string_matches(*cached, chars, len, hash)) {
+    return *cached;
+  }
+
+  SharedSlots *slots =
+      atomic_load_explicit(&stripe_of(hash)->slots, memory_order_acquire);
+  if (slots == NULL) {
+    return NULL;
+  }
+  ObjString *string = probe_slots(slots, chars, len, hash);
+  if (string != NULL) {
+    *cached = string;
+  }
+  return string;
+}
+
+ObjString *copy_shared_string(const char *chars, uint32_t len) {
+  uint32_t hash = hash_string(chars, len);
+  ObjString *string = find_shared_string(chars, len, hash);
+  if (string != NULL) {
+    return string;
+  }
+
+  pthread_once(&stripes_once, init_stripes);
+  SharedStripe *stripe = stripe_of(hash);
+  pthread_mutex_lock(&stripe->lock);
+
+  SharedSlots *slots =
+      atomic_load_explicit(&stripe->slots, memory_order_relaxed);
+  if (slots != NULL) {
+    string = probe_slots(slots, chars, len, hash);
+  }
+  if (string == NULL) {
+    if (slots == NULL || (stripe->len + 1) * 4 > slots->capacity * 3) {
+      grow_stripe(stripe);
+      slots = atomic_load_explicit(&stripe->slots, memory_order_relaxed);
+    }
+    string = allocate_shared_string(chars, len, hash);
+    insert_slot(slots, string);
+    stripe->len += 1;
+  }
+
+  pthread_mutex_unlock(&stripe->lock);
+  shared_cache[hash & (SHARED_CACHE_SIZE - 1)] = string;
+  return string;
+}
+
+void free_shared_strings() {
+  free_frozen_objects();
+  for (uint32_t i = 0; i < SHARED_STRIPES; i += 1) {
+    SharedStripe *stripe = &stripes[i];
+    SharedSlots *slots =
+        atomic_load_explicit(&stripe->slots, memory_order_relaxed);
+    if (slots != NULL) {
+      for (uint32_t idx = 0; idx < slots->capacity; idx += 1) {
+        free(atomic_load_explicit(&slots->slots[idx], memory_order_relaxed));
+      }
+    }
+    while (slots != NULL) {
+      SharedSlots *retired = slots->retired;
+      free(slots);
+      slots = retired;
+    }
+    atomic_store_explicit(&stripe->slots, NULL, memory_order_relaxed);
+    stripe->len = 0;
+  }
+  memset(shared_cache, 0, sizeof(shared_cache));
+}
@@ -0,0 +1,29 @@
+#ifndef breeze_shared_string_h
+#define breeze_shared_string_h
+
+#include <stdint.h>
+
+#include "breeze.h"
+#include "common.h"
+#include "object.h"
+
+/* Looks up a string in the process-wide table of shared strings without
+ * taking any lock
+ * @param chars: Pointer to the characters to look up
+ * @param len: Length of the string
+ * @param hash: Hash of the string, as computed by `hash_string`
+ * @return: The shared string, or NULL if it was never interned
+ */
+ObjString *find_shared_string(const char *chars, uint32_t len, uint32_t hash);
+
+/* Interns a string in the process-wide table of shared strings. Shared
+ * strings are immutable, live until `free_shared_strings` and are never
+ * traced nor freed by a VM's collector, so every thread resolves the same
+ * characters to the same pointer.
+ * @param chars: Pointer to the characters to copy
+ * @param len: Length of the string
+ * @return: Pointer to the shared string
+ */
+ObjString *copy_shared_string(const char *chars, uint32_t len);
+
+#endif // !breeze_shared_string_h
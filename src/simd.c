@@ -0,0 +1,563 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "simd.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+/*** SCALAR ***/
+
+static double sum_scalar(const double *values, uint32_t len) {
+  double sum = 0;
+  for (uint32_t i = 0; i < len; i += 1) {
+    sum += values[i];
+  }
+  return sum;
+}
+
+static double min_scalar(const double *values, uint32_t len) {
+  double min = values[0];
+  for (uint32_t i = 1; i < len; i += 1) {
+    min = values[i] < min ? values[i] : min;
+  }
+  return min;
+}
+
+static double max_scalar(const double *values, uint32_t len) {
+  double max = values[0];
+  for (uint32_t i = 1; i < len; i += 1) {
+    max = values[i] > max ? values[i] : max;
+  }
+  return max;
+}
+
+static double dot_scalar(const double *left, const double *right,
+                         uint32_t len) {
+  double dot = 0;
+  for (uint32_t i = 0; i < len; i += 1) {
+    dot += left[i] * right[i];
+  }
+  return dot;
+}
+
+static void scale_scalar(double *values, uint32_t len, double factor) {
+  for (uint32_t i = 0; i < len; i += 1) {
+    values[i] *= factor;
+  }
+}
+
+static void add_scalar(double *into, const double *values, uint32_t len) {
+  for (uint32_t i = 0; i < len; i += 1) {
+    into[i] += values[i];
+  }
+}
+
+static void fill_scalar(double *values, uint32_t len, double value) {
+  for (uint32_t i = 0; i < len; i += 1) {
+    values[i] = value;
+  }
+}
+
+static void prefix_sum_scalar(double *values, uint32_t len) {
+  for (uint32_t i = 1; i < len; i += 1) {
+    values[i] += values[i - 1];
+  }
+}
+
+static const Float64Kernels scalar_kernels = {
+    .name = "scalar",
+    .sum = sum_scalar,
+    .min = min_scalar,
+    .max = max_scalar,
+    .dot = dot_scalar,
+    .scale = scale_scalar,
+    .add = add_scalar,
+    .fill = fill_scalar,
+    .prefix_sum = prefix_sum_scalar,
+};
+
+static void classify_json_scalar(const uint8_t *block, JsonClasses *classes) {
+  JsonClasses found = {0};
+  for (uint32_t i = 0; i < 64; i += 1) {
+    uint64_t bit = (uint64_t)1 << i;
+    switch (block[i]) {
+    case '"':
+      found.quotes |= bit;
+      break;
+    case '\\':
+      found.backslashes |= bit;
+      break;
+    case '{':
+    case '}':
+    case '[':
+    case ']':
+    case ':':
+    case ',':
+      found.operators |= bit;
+      break;
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+      found.whitespace |= bit;
+      break;
+    default:
+      break;
+    }
+  }
+  *classes = found;
+}
+
+static void classify_csv_scalar(const uint8_t *block, uint8_t delimiter,
+                                CsvClasses *classes) {
+  CsvClasses found = {0};
+  for (uint32_t i = 0; i < 64; i += 1) {
+    uint64_t bit = (uint64_t)1 << i;
+    found.quotes |= block[i] == '"' ? bit : 0;
+    found.delimiters |= block[i] == delimiter ? bit : 0;
+    found.newlines |= block[i] == '\n' ? bit : 0;
+  }
+  *classes = found;
+}
+
+static uint32_t plain_len_scalar(const char *chars, uint32_t len) {
+  uint32_t i = 0;
+  while (i < len && chars[i] != '"' && chars[i] != '\\' &&
+         (uint8_t)chars[i] >= 0x20) {
+    i += 1;
+  }
+  return i;
+}
+
+static const ByteKernels scalar_byte_kernels = {
+    .name = "scalar",
+    .classify_json = classify_json_scalar,
+    .classify_csv = classify_csv_scalar,
+    .plain_len = plain_len_scalar,
+};
+
+#ifdef SIMD_X86
+
+/*** SSE2 ***/
+
+// Reductions keep two accumulators to hide the latency of the adds.
+static double sum_sse2(const double *values, uint32_t len) {
+  __m128d first = _mm_setzero_pd();
+  __m128d second = _mm_setzero_pd();
+  uint32_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    first = _mm_add_pd(first, _mm_loadu_pd(values + i));
+    second = _mm_add_pd(second, _mm_loadu_pd(values + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(first, second));
+  return lanes[0] + lanes[1] + sum_scalar(values + i, len - i);
+}
+
+static double min_sse2(const double *values, uint32_t len) {
+  if (len < 2) {
+    return values[0];
+  }
+  __m128d min = _mm_loadu_pd(values);
+  uint32_t i = 2;
+  for (; i + 2 <= len; i += 2) {
+    min = _mm_min_pd(min, _mm_loadu_pd(values + i));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, min);
+  double rest = i < len ? values[i] : lanes[0];
+  return min_scalar((double[]){lanes[0], lanes[1], rest}, 3);
+}
+
+static double max_sse2(const double *values, uint32_t len) {
+  if (len < 2) {
+    return values[0];
+  }
+  __m128d max = _mm_loadu_pd(values);
+  uint32_t i = 2;
+  for (; i + 2 <= len; i += 2) {
+    max = _mm_max_pd(max, _mm_loadu_pd(values + i));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, max);
+  double rest = i < len ? values[i] : lanes[0];
+  return max_scalar((double[]){lanes[0], lanes[1], rest}, 3);
+}
+
+static double dot_sse2(const double *left, const double *right,
+                       uint32_t len) {
+  __m128d first = _mm_setzero_pd();
+  __m128d second = _mm_setzero_pd();
+  uint32_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    first = _mm_add_pd(first, _mm_mul_pd(_mm_loadu_pd(left + i),
+                                         _mm_loadu_pd(right + i)));
+    second = _mm_add_pd(second, _mm_mul_pd(_mm_loadu_pd(left + i + 2),
+                                           _mm_loadu_pd(right + i + 2)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(first, second));
+  return lanes[0] + lanes[1] + dot_scalar(left + i, right + i, len - i);
+}
+
+static void scale_sse2(double *values, uint32_t len, double factor) {
+  __m128d factors = _mm_set1_pd(factor);
+  uint32_t i = 0;
+  for (; i + 2 <= len; i += 2) {
+    _mm_storeu_pd(values + i, _mm_mul_pd(_mm_loadu_pd(values + i), factors));
+  }
+  scale_scalar(values + i, len - i, factor);
+}
+
+static void add_sse2(double *into, const double *values, uint32_t len) {
+  uint32_t i = 0;
+  for (; i + 2 <= len; i += 2) {
+    _mm_storeu_pd(into + i, _mm_add_pd(_mm_loadu_pd(into + i),
+                                       _mm_loadu_pd(values + i)));
+  }
+  add_scalar(into + i, values + i, len - i);
+}
+
+static void fill_sse2(double *values, uint32_t len, double value) {
+  __m128d filler = _mm_set1_pd(value);
+  uint32_t i = 0;
+  for (; i + 2 <= len; i += 2) {
+    _mm_storeu_pd(values + i, filler);
+  }
+  fill_scalar(values + i, len - i, value);
+}
+
+// Scans each pair in its register, then adds the total carried so far.
+static void prefix_sum_sse2(double *values, uint32_t len) {
+  __m128d carry = _mm_setzero_pd();
+  uint32_t i = 0;
+  for (; i + 2 <= len; i += 2) {
+    __m128d pair = _mm_loadu_pd(values + i);
+    pair = _mm_add_pd(pair, _mm_unpacklo_pd(_mm_setzero_pd(), pair));
+    pair = _mm_add_pd(pair, carry);
+    _mm_storeu_pd(values + i, pair);
+    carry = _mm_unpackhi_pd(pair, pair);
+  }
+  if (i < len) {
+    values[i] += _mm_cvtsd_f64(carry);
+  }
+}
+
+static const Float64Kernels sse2_kernels = {
+    .name = "sse2",
+    .sum = sum_sse2,
+    .min = min_sse2,
+    .max = max_sse2,
+    .dot = dot_sse2,
+    .scale = scale_sse2,
+    .add = add_sse2,
+    .fill = fill_sse2,
+    .prefix_sum = prefix_sum_sse2,
+};
+
+// Braces and brackets differ only in bit 5, so setting it folds `[` onto
+// `{` and `]` onto `}`, and no other byte onto either.
+static void classify_json_sse2(const uint8_t *block, JsonClasses *classes) {
+  JsonClasses found = {0};
+  for (uint32_t i = 0; i < 64; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+    __m128i folded = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+    __m128i operators = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                     _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(':')),
+                     _mm_cmpeq_epi8(bytes, _mm_set1_epi8(','))));
+    __m128i whitespace = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r'))));
+    found.quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')))
+                    << i;
+    found.backslashes |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                             _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')))
+                         << i;
+    found.operators |= (uint64_t)(uint16_t)_mm_movemask_epi8(operators) << i;
+    found.whitespace |= (uint64_t)(uint16_t)_mm_movemask_epi8(whitespace)
+                        << i;
+  }
+  *classes = found;
+}
+
+static void classify_csv_sse2(const uint8_t *block, uint8_t delimiter,
+                              CsvClasses *classes) {
+  CsvClasses found = {0};
+  for (uint32_t i = 0; i < 64; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(block + i));
+    found.quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')))
+                    << i;
+    found.delimiters |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                            bytes, _mm_set1_epi8((char)delimiter)))
+                        << i;
+    found.newlines |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                          _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')))
+                      << i;
+  }
+  *classes = found;
+}
+
+// Bytes below 0x20 are the ones left unchanged by an unsigned max with 0x1f.
+static uint32_t plain_len_sse2(const char *chars, uint32_t len) {
+  uint32_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(chars + i));
+    __m128i control = _mm_set1_epi8(0x1f);
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')),
+                     _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\'))),
+        _mm_cmpeq_epi8(_mm_max_epu8(bytes, control), control));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(special);
+    if (mask != 0) {
+      return i + (uint32_t)__builtin_ctz(mask);
+    }
+  }
+  return i + plain_len_scalar(chars + i, len - i);
+}
+
+static const ByteKernels sse2_byte_kernels = {
+    .name = "sse2",
+    .classify_json = classify_json_sse2,
+    .classify_csv = classify_csv_sse2,
+    .plain_len = plain_len_sse2,
+};
+
+/*** AVX2 ***/
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static double sum_lanes(__m256d lanes) {
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(lanes),
+                            _mm256_extractf128_pd(lanes, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+AVX2 static double sum_avx2(const double *values, uint32_t len) {
+  __m256d first = _mm256_setzero_pd();
+  __m256d second = _mm256_setzero_pd();
+  uint32_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    first = _mm256_add_pd(first, _mm256_loadu_pd(values + i));
+    second = _mm256_add_pd(second, _mm256_loadu_pd(values + i + 4));
+  }
+  return sum_lanes(_mm256_add_pd(first, second)) +
+         sum_sse2(values + i, len - i);
+}
+
+AVX2 static double min_avx2(const double *values, uint32_t len) {
+  if (len < 4) {
+    return min_scalar(values, len);
+  }
+  __m256d min = _mm256_loadu_pd(values);
+  uint32_t i = 4;
+  for (; i + 4 <= len; i += 4) {
+    min = _mm256_min_pd(min, _mm256_loadu_pd(values + i));
+  }
+  // Folding in the last four values covers the tail.
+  min = _mm256_min_pd(min, _mm256_loadu_pd(values + len - 4));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, min);
+  return min_scalar(lanes, 4);
+}
+
+AVX2 static double max_avx2(const double *values, uint32_t len) {
+  if (len < 4) {
+    return max_scalar(values, len);
+  }
+  __m256d max = _mm256_loadu_pd(values);
+  uint32_t i = 4;
+  for (; i + 4 <= len; i += 4) {
+    max = _mm256_max_pd(max, _mm256_loadu_pd(values + i));
+  }
+  max = _mm256_max_pd(max, _mm256_loadu_pd(values + len - 4));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, max);
+  return max_scalar(lanes, 4);
+}
+
+AVX2 static double dot_avx2(const double *left, const double *right,
+                            uint32_t len) {
+  __m256d first = _mm256_setzero_pd();
+  __m256d second = _mm256_setzero_pd();
+  uint32_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    first = _mm256_add_pd(first, _mm256_mul_pd(_mm256_loadu_pd(left + i),
+                                               _mm256_loadu_pd(right + i)));
+    second = _mm256_add_pd(second,
+                           _mm256_mul_pd(_mm256_loadu_pd(left + i + 4),
+                                         _mm256_loadu_pd(right + i + 4)));
+  }
+  return sum_lanes(_mm256_add_pd(first, second)) +
+         dot_sse2(left + i, right + i, len - i);
+}
+
+AVX2 static void scale_avx2(double *values, uint32_t len, double factor) {
+  __m256d factors = _mm256_set1_pd(factor);
+  uint32_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    _mm256_storeu_pd(values + i,
+                     _mm256_mul_pd(_mm256_loadu_pd(values + i), factors));
+  }
+  scale_scalar(values + i, len - i, factor);
+}
+
+AVX2 static void add_avx2(double *into, const double *values, uint32_t len) {
+  uint32_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    _mm256_storeu_pd(into + i, _mm256_add_pd(_mm256_loadu_pd(into + i),
+                                             _mm256_loadu_pd(values + i)));
+  }
+  add_scalar(into + i, values + i, len - i);
+}
+
+AVX2 static void fill_avx2(double *values, uint32_t len, double value) {
+  __m256d filler = _mm256_set1_pd(value);
+  uint32_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    _mm256_storeu_pd(values + i, filler);
+  }
+  fill_scalar(values + i, len - i, value);
+}
+
+// Scans four lanes in two shift-and-add steps, then adds the carry.
+AVX2 static void prefix_sum_avx2(double *values, uint32_t len) {
+  __m256d zero = _mm256_setzero_pd();
+  __m256d carry = zero;
+  uint32_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    __m256d lanes = _mm256_loadu_pd(values + i);
+    __m256d shifted = _mm256_permute4x64_pd(lanes, _MM_SHUFFLE(2, 1, 0, 0));
+    lanes = _mm256_add_pd(lanes, _mm256_blend_pd(shifted, zero, 0x1));
+    shifted = _mm256_permute4x64_pd(lanes, _MM_SHUFFLE(1, 0, 0, 0));
+    lanes = _mm256_add_pd(lanes, _mm256_blend_pd(shifted, zero, 0x3));
+    lanes = _mm256_add_pd(lanes, carry);
+    _mm256_storeu_pd(values + i, lanes);
+    carry = _mm256_permute4x64_pd(lanes, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  double total = _mm256_cvtsd_f64(carry);
+  for (; i < len; i += 1) {
+    total += values[i];
+    values[i] = total;
+  }
+}
+
+static const Float64Kernels avx2_kernels = {
+    .name = "avx2",
+    .sum = sum_avx2,
+    .min = min_avx2,
+    .max = max_avx2,
+    .dot = dot_avx2,
+    .scale = scale_avx2,
+    .add = add_avx2,
+    .fill = fill_avx2,
+    .prefix_sum = prefix_sum_avx2,
+};
+
+AVX2 static void classify_json_avx2(const uint8_t *block,
+                                    JsonClasses *classes) {
+  JsonClasses found = {0};
+  for (uint32_t i = 0; i < 64; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)(block + i));
+    __m256i folded = _mm256_or_si256(bytes, _mm256_set1_epi8(0x20));
+    __m256i operators = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')),
+                        _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(':')),
+                        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(','))));
+    __m256i whitespace = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\r'))));
+    found.quotes |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"')))
+                    << i;
+    found.backslashes |=
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\')))
+        << i;
+    found.operators |= (uint64_t)(uint32_t)_mm256_movemask_epi8(operators)
+                       << i;
+    found.whitespace |= (uint64_t)(uint32_t)_mm256_movemask_epi8(whitespace)
+                        << i;
+  }
+  *classes = found;
+}
+
+AVX2 static void classify_csv_avx2(const uint8_t *block, uint8_t delimiter,
+                                   CsvClasses *classes) {
+  CsvClasses found = {0};
+  for (uint32_t i = 0; i < 64; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)(block + i));
+    found.quotes |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"')))
+                    << i;
+    found.delimiters |=
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8((char)delimiter)))
+        << i;
+    found.newlines |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                          _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')))
+                      << i;
+  }
+  *classes = found;
+}
+
+AVX2 static uint32_t plain_len_avx2(const char *chars, uint32_t len) {
+  uint32_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)(chars + i));
+    __m256i control = _mm256_set1_epi8(0x1f);
+    __m256i special = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('"')),
+                        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\\'))),
+        _mm256_cmpeq_epi8(_mm256_max_epu8(bytes, control), control));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(special);
+    if (mask != 0) {
+      return i + (uint32_t)__builtin_ctz(mask);
+    }
+  }
+  return i + plain_len_sse2(chars + i, len - i);
+}
+
+static const ByteKernels avx2_byte_kernels = {
+    .name = "avx2",
+    .classify_json = classify_json_avx2,
+    .classify_csv = classify_csv_avx2,
+    .plain_len = plain_len_avx2,
+};
+
+#endif // SIMD_X86
+
+static const Float64Kernels *kernels = &scalar_kernels;
+static const ByteKernels *bytes_kernels = &scalar_byte_kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void pick_kernels(void) {
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2");
+  kernels = avx2 ? &avx2_kernels : &sse2_kernels;
+  bytes_kernels = avx2 ? &avx2_byte_kernels : &sse2_byte_kernels;
+#endif
+}
+
+const Float64Kernels *float64_kernels(void) {
+  pthread_once(&kernels_once, pick_kernels);
+  return kernels;
+}
+
+const ByteKernels *byte_kernels(void) {
+  pthread_once(&kernels_once, pick_kernels);
+  return bytes_kernels;
+}
@@ -0,0 +1,81 @@
+#ifndef breeze_simd_h
+#define breeze_simd_h
+
+#include <stdint.h>
+
+/***
+  Kernels over arrays of doubles, and over the bytes of JSON and CSV text, in
+  three flavors: AVX2 and SSE2 on x86-64, and portable scalar loops
+  everywhere else. The fastest flavor the CPU supports is picked once, on
+  first use.
+
+  The vector flavors add in a different order than the scalar loops, so
+  sums can differ from them in the last bits.
+  ***/
+
+typedef struct {
+  const char *name;
+  double (*sum)(const double *values, uint32_t len);
+  // `min` and `max` expect at least one value.
+  double (*min)(const double *values, uint32_t len);
+  double (*max)(const double *values, uint32_t len);
+  double (*dot)(const double *left, const double *right, uint32_t len);
+  void (*scale)(double *values, uint32_t len, double factor);
+  // Adds `values` into `into`, element by element.
+  void (*add)(double *into, const double *values, uint32_t len);
+  void (*fill)(double *values, uint32_t len, double value);
+  // Replaces each value with the sum of itself and those before it.
+  void (*prefix_sum)(double *values, uint32_t len);
+} Float64Kernels;
+
+/* Returns the kernels for this CPU
+ * @return: The AVX2, SSE2 or scalar kernels, whichever is fastest here
+ */
+const Float64Kernels *float64_kernels(void);
+
+// The bytes of a 64-byte block in each class that matters to JSON's
+// structure, as masks with bit `i` standing for byte `i`.
+typedef struct {
+  uint64_t quotes;
+  uint64_t backslashes;
+  // Braces, brackets, colons and commas.
+  uint64_t operators;
+  uint64_t whitespace;
+} JsonClasses;
+
+// The bytes of a 64-byte block that split CSV text into fields and records.
+typedef struct {
+  uint64_t quotes;
+  uint64_t delimiters;
+  uint64_t newlines;
+} CsvClasses;
+
+typedef struct {
+  const char *name;
+  void (*classify_json)(const uint8_t *block, JsonClasses *classes);
+  void (*classify_csv)(const uint8_t *block, uint8_t delimiter,
+                       CsvClasses *classes);
+  // Length of the longest prefix free of quotes, backslashes and control
+  // characters: the part of a string that JSON copies as is.
+  uint32_t (*plain_len)(const char *chars, uint32_t len);
+} ByteKernels;
+
+// Bit `i` of the result is the parity of bits 0 to `i`: starting from
+// quotes, it is set on the bytes from an opening quote up to, but not
+// including, its closing quote.
+static inline uint64_t prefix_xor(uint64_t bits) {
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+}
+
+/* Returns the byte kernels for this CPU
+ * @return: The AVX2, SSE2 or scalar kernels, whichever is fastest here
+ */
+const ByteKernels *byte_kernels(void);
+
+#endif // !breeze_simd_h
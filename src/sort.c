@@ -0,0 +1,240 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sort.h"
+
+#include "memory.h"
+#include "object.h"
+#include "virtual_machine.h"
+
+// Ranges shorter than this are insertion sorted.
+#define SORT_INSERTION_LEN 24
+// Ranges longer than this take their pivot from three medians of three.
+#define SORT_NINTHER_LEN 128
+// Moves after which a partial insertion sort gives up.
+#define SORT_PARTIAL_MOVES_MAX 8
+// Elements compared at a time by a branchless partition, at most 256.
+#define SORT_BLOCK_LEN 64
+
+typedef struct {
+  VirtualMachine *vm;
+  // Name of the sorting native, for errors.
+  const char *native;
+  // Script comparator, and the snapshot its indices refer to.
+  Value comparator;
+  const Value *values;
+  // Set once the comparator failed: the sort then winds down without
+  // calling it again.
+  bool failed;
+} SortContext;
+
+// Orders strings by their bytes, a prefix before the longer string.
+static int compare_strings(const ObjString *left, const ObjString *right) {
+  uint32_t len = left->len < right->len ? left->len : right->len;
+  int order = memcmp(left->chars, right->chars, len);
+  if (order != 0) {
+    return order;
+  }
+  return (left->len > right->len) - (left->len < right->len);
+}
+
+// Calls the comparator on two elements of the snapshot.
+static bool call_less(SortContext *ctx, uint32_t left, uint32_t right) {
+  if (ctx->failed) {
+    return false;
+  }
+  Value pair[2] = {ctx->values[left], ctx->values[right]};
+  Value order;
+  if (!call_function(ctx->vm, ctx->comparator, 2, pair, &order)) {
+    ctx->failed = true;
+    return false;
+  }
+  if (!IS_NUMBER(order)) {
+    native_error(ctx->vm, "%s expects a comparator returning a number.",
+                 ctx->native);
+    ctx->failed = true;
+    return false;
+  }
+  return AS_NUMBER(order) < 0;
+}
+
+#define SORT_PREFIX numbers
+#define SORT_ELEM double
+#define SORT_BRANCHLESS
+#define SORT_LESS(ctx, a, b) ((void)(ctx), (a) < (b))
+#include "sort_template.h"
+
+// Interned strings are equal only if they are the same object.
+#define SORT_PREFIX strings
+#define SORT_ELEM ObjString *
+#define SORT_LESS(ctx, a, b)                                                   \
+  ((void)(ctx), (a) != (b) && compare_strings(a, b) < 0)
+#include "sort_template.h"
+
+#define SORT_PREFIX indices
+#define SORT_ELEM uint32_t
+#define SORT_LESS(ctx, a, b) call_less(ctx, a, b)
+#include "sort_template.h"
+
+static void *allocate_buffer(size_t size) {
+  void *buffer = malloc(size);
+  if (buffer == NULL) {
+    fprintf(stderr, "Not enough memory to sort a list.");
+    exit(1);
+  }
+  return buffer;
+}
+
+// NaNs are unordered, so they are set aside and go last, in their order.
+static void sort_numbers(SortContext *ctx, Value *values, uint32_t len,
+                         bool stable) {
+  double *numbers =
+      (double *)allocate_buffer(sizeof(double) * (len + len / 2 + 1));
+  uint32_t ordered_len = 0;
+  uint32_t nans_len = 0;
+  for (uint32_t i = 0; i < len; i += 1) {
+    double number = AS_NUMBER(values[i]);
+    if (isnan(number)) {
+      nans_len += 1;
+      numbers[len - nans_len] = number;
+    } else {
+      numbers[ordered_len] = number;
+      ordered_len += 1;
+    }
+  }
+
+  if (stable) {
+    numbers_merge_sort(ctx, numbers, numbers + ordered_len, numbers + len);
+  } else {
+    numbers_pdqsort(ctx, numbers, numbers + ordered_len);
+  }
+
+  for (uint32_t i = 0; i < ordered_len; i += 1) {
+    values[i] = NUMBER_VAL(numbers[i]);
+  }
+  for (uint32_t i = 0; i < nans_len; i += 1) {
+    values[ordered_len + i] = NUMBER_VAL(numbers[len - 1 - i]);
+  }
+  free(numbers);
+}
+
+static void sort_strings(SortContext *ctx, Value *values, uint32_t len,
+                         bool stable) {
+  ObjString **strings = (ObjString **)allocate_buffer(
+      sizeof(ObjString *) * (len + len / 2 + 1));
+  for (uint32_t i = 0; i < len; i += 1) {
+    strings[i] = AS_STRING(values[i]);
+  }
+  if (stable) {
+    strings_merge_sort(ctx, strings, strings + len, strings + len);
+  } else {
+    strings_pdqsort(ctx, strings, strings + len);
+  }
+  for (uint32_t i = 0; i < len; i += 1) {
+    values[i] = OBJ_VAL(strings[i]);
+  }
+  free(strings);
+}
+
+static bool sort_values(SortContext *ctx, ObjList *list, bool stable) {
+  Value *values = list->items.values;
+  uint32_t len = list->items.len;
+  bool numbers = true;
+  bool strings = true;
+  for (uint32_t i = 0; i < len && (numbers || strings); i += 1) {
+    numbers &= IS_NUMBER(values[i]);
+    strings &= IS_STRING(values[i]);
+  }
+  if (numbers) {
+    sort_numbers(ctx, values, len, stable);
+  } else if (strings) {
+    sort_strings(ctx, values, len, stable);
+  } else {
+    native_error(ctx->vm, "%s expects numbers or strings, or a comparator.",
+                 ctx->native);
+    return false;
+  }
+  return true;
+}
+
+// Sorts the indices of a snapshot of the list, which keeps every element
+// alive and in place whatever the comparator does, then writes the
+// elements back in their new order.
+static bool sort_with_comparator(SortContext *ctx, ObjList *list,
+                                 bool stable) {
+  VirtualMachine *vm = ctx->vm;
+  uint32_t len = list->items.len;
+  ObjList *snapshot = new_list(vm);
+  push_stack(vm, OBJ_VAL(snapshot));
+  snapshot->items.values = ALLOCATE(vm, Value, len);
+  snapshot->items.capacity = len;
+  snapshot->items.len = len;
+  memcpy(snapshot->items.values, list->items.values, sizeof(Value) * len);
+  ctx->values = snapshot->items.values;
+
+  uint32_t *order =
+      (uint32_t *)allocate_buffer(sizeof(uint32_t) * (len + len / 2 + 1));
+  for (uint32_t i = 0; i < len; i += 1) {
+    order[i] = i;
+  }
+  if (stable) {
+    indices_merge_sort(ctx, order, order + len, order + len);
+  } else {
+    indices_pdqsort(ctx, order, order + len);
+  }
+
+  // A failed call has already unwound the stack, snapshot included.
+  bool sorted = !ctx->failed;
+  if (sorted && list->items.len != len) {
+    native_error(vm, "The list changed length during %s.", ctx->native);
+    sorted = false;
+  }
+  if (sorted) {
+    for (uint32_t i = 0; i < len; i += 1) {
+      list->items.values[i] = ctx->values[order[i]];
+    }
+    pop_stack(vm);
+  }
+  free(order);
+  return sorted;
+}
+
+static Value sort_list(VirtualMachine *vm, const char *native,
+                       int32_t args_len, Value *args, bool stable) {
+  if (args_len < 1 || args_len > 2 || !IS_LIST(args[0]) ||
+      (args_len == 2 && !IS_CLOSURE(args[1]) && !IS_NATIVE(args[1]))) {
+    return native_error(vm, "%s expects a list and an optional comparator.",
+                        native);
+  }
+  if (AS_OBJ(args[0])->is_shared) {
+    return native_error(vm, "Cannot change a frozen list.");
+  }
+  ObjList *list = AS_LIST(args[0]);
+  if (list->items.len < 2) {
+    return OBJ_VAL(list);
+  }
+
+  SortContext ctx = {.vm = vm, .native = native, .failed = false};
+  if (args_len == 2) {
+    ctx.comparator = args[1];
+    if (!sort_with_comparator(&ctx, list, stable)) {
+      return NULL_VAL;
+    }
+  } else if (!sort_values(&ctx, list, stable)) {
+    return NULL_VAL;
+  }
+  return OBJ_VAL(list);
+}
+
+Value sort_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  return sort_list(vm, "sort", args_len, args, false);
+}
+
+Value sort_stable_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  return sort_list(vm, "sort_stable", args_len, args, true);
+}
@@ -0,0 +1,37 @@
+#ifndef breeze_sort_h
+#define breeze_sort_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "value.h"
+
+/***
+  Lists are sorted in place by natives. Without a comparator a list must
+  hold only numbers or only strings, and is sorted on raw values: numbers
+  as doubles, NaNs last, and strings by their bytes, shorter prefixes
+  first. Either way the elements are copied out of their values into a
+  dense array, sorted there, and written back.
+
+  A comparator is a script function called as `cmp(a, b)`, returning a
+  negative number when `a` goes before `b`. It is called re-entrantly on a
+  snapshot of the list, so it may even change the list; the sort then fails
+  if the list's length changed.
+
+  `sort` runs a pattern-defeating quicksort, and `sort_stable` a merge sort
+  that keeps equal elements in their order.
+  ***/
+
+/* sort(list, cmp?): Sorts a list in place, without keeping the order of
+ * equal elements
+ * @return: The list
+ */
+Value sort_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+/* sort_stable(list, cmp?): Sorts a list in place, keeping equal elements in
+ * their order
+ * @return: The list
+ */
+Value sort_stable_native(VirtualMachine *vm, int32_t args_len, Value *args);
+
+#endif // !breeze_sort_h
@@ -0,0 +1,396 @@
+// No include guard: sort.c includes this file once per element type.
+
+/***
+  Sorting algorithms written once for several element types. Before each
+  inclusion, the including file defines:
+
+    SORT_PREFIX          Prefix of the generated functions
+    SORT_ELEM            Type of the elements
+    SORT_LESS(ctx, a, b) Whether element `a` orders before element `b`
+
+  and gets `SORT_PREFIX##_pdqsort`, an unstable pattern-defeating
+  quicksort, and `SORT_PREFIX##_merge_sort`, a stable merge sort. Both take
+  a `SortContext`, handed to SORT_LESS, and return early once its `failed`
+  flag is set. Defining SORT_BRANCHLESS as well makes the quicksort
+  partition with branchless block scans, which pays off when SORT_LESS is
+  cheap and its outcome hard to predict.
+
+  Comparators may come from scripts and need not be consistent, so every
+  scan is bounded by its range instead of relying on a sentinel element.
+  ***/
+
+#define SORT_CONCAT_(prefix, name) prefix##_##name
+#define SORT_CONCAT(prefix, name) SORT_CONCAT_(prefix, name)
+#define SORT_FN(name) SORT_CONCAT(SORT_PREFIX, name)
+
+static inline void SORT_FN(swap)(SORT_ELEM *a, SORT_ELEM *b) {
+  SORT_ELEM tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static void SORT_FN(insertion_sort)(SortContext *ctx, SORT_ELEM *begin,
+                                    SORT_ELEM *end) {
+  for (SORT_ELEM *cur = begin + 1; cur < end; cur += 1) {
+    if (!SORT_LESS(ctx, *cur, cur[-1])) {
+      continue;
+    }
+    SORT_ELEM tmp = *cur;
+    SORT_ELEM *sift = cur;
+    do {
+      *sift = sift[-1];
+      sift -= 1;
+    } while (sift != begin && SORT_LESS(ctx, tmp, sift[-1]));
+    *sift = tmp;
+  }
+}
+
+// Insertion sort that gives up after moving a few elements: cheap on a
+// range that is already nearly sorted, and abandoned on any other.
+static bool SORT_FN(partial_insertion_sort)(SortContext *ctx,
+                                            SORT_ELEM *begin,
+                                            SORT_ELEM *end) {
+  uint32_t moved = 0;
+  for (SORT_ELEM *cur = begin + 1; cur < end; cur += 1) {
+    if (moved > SORT_PARTIAL_MOVES_MAX) {
+      return false;
+    }
+    if (!SORT_LESS(ctx, *cur, cur[-1])) {
+      continue;
+    }
+    SORT_ELEM tmp = *cur;
+    SORT_ELEM *sift = cur;
+    do {
+      *sift = sift[-1];
+      sift -= 1;
+    } while (sift != begin && SORT_LESS(ctx, tmp, sift[-1]));
+    *sift = tmp;
+    moved += (uint32_t)(cur - sift);
+  }
+  return true;
+}
+
+static void SORT_FN(sift_down)(SortContext *ctx, SORT_ELEM *heap, size_t len,
+                               size_t root) {
+  for (size_t child = 2 * root + 1; child < len; child = 2 * root + 1) {
+    if (child + 1 < len && SORT_LESS(ctx, heap[child], heap[child + 1])) {
+      child += 1;
+    }
+    if (!SORT_LESS(ctx, heap[root], heap[child])) {
+      return;
+    }
+    SORT_FN(swap)(&heap[root], &heap[child]);
+    root = child;
+  }
+}
+
+static void SORT_FN(heap_sort)(SortContext *ctx, SORT_ELEM *begin,
+                               SORT_ELEM *end) {
+  size_t len = (size_t)(end - begin);
+  for (size_t root = len / 2; root > 0 && !ctx->failed; root -= 1) {
+    SORT_FN(sift_down)(ctx, begin, len, root - 1);
+  }
+  for (size_t last = len - 1; last > 0 && !ctx->failed; last -= 1) {
+    SORT_FN(swap)(&begin[0], &begin[last]);
+    SORT_FN(sift_down)(ctx, begin, last, 0);
+  }
+}
+
+static inline void SORT_FN(sort2)(SortContext *ctx, SORT_ELEM *a,
+                                  SORT_ELEM *b) {
+  if (SORT_LESS(ctx, *b, *a)) {
+    SORT_FN(swap)(a, b);
+  }
+}
+
+static inline void SORT_FN(sort3)(SortContext *ctx, SORT_ELEM *a,
+                                  SORT_ELEM *b, SORT_ELEM *c) {
+  SORT_FN(sort2)(ctx, a, b);
+  SORT_FN(sort2)(ctx, b, c);
+  SORT_FN(sort2)(ctx, a, b);
+}
+
+#ifdef SORT_BRANCHLESS
+// Swaps the elements found on the wrong side of the pivot by the block
+// scans, pairing them up in order.
+static inline void SORT_FN(swap_offsets)(SORT_ELEM *first, SORT_ELEM *last,
+                                         const uint8_t *offsets_left,
+                                         const uint8_t *offsets_right,
+                                         size_t len) {
+  for (size_t i = 0; i < len; i += 1) {
+    SORT_FN(swap)(first + offsets_left[i], last - offsets_right[i]);
+  }
+}
+
+// Partitions like partition_right below, but compares a block of elements
+// from each end before moving any: the comparisons only record offsets,
+// without branching on their outcome, so they cost no mispredictions.
+static SORT_ELEM *SORT_FN(partition_right)(SortContext *ctx,
+                                           SORT_ELEM *begin, SORT_ELEM *end,
+                                           bool *partitioned) {
+  SORT_ELEM pivot = *begin;
+  SORT_ELEM *first = begin + 1;
+  SORT_ELEM *last = end;
+  while (first < last && SORT_LESS(ctx, *first, pivot)) {
+    first += 1;
+  }
+  while (first < last && !SORT_LESS(ctx, last[-1], pivot)) {
+    last -= 1;
+  }
+  *partitioned = first >= last;
+  if (!*partitioned) {
+    // `first` and `last` bound the elements still to be compared.
+    SORT_FN(swap)(first, last - 1);
+    first += 1;
+    last -= 1;
+
+    uint8_t offsets_left[SORT_BLOCK_LEN];
+    uint8_t offsets_right[SORT_BLOCK_LEN];
+    SORT_ELEM *left_base = first;
+    SORT_ELEM *right_base = last;
+    size_t left_len = 0;
+    size_t right_len = 0;
+    size_t left_start = 0;
+    size_t right_start = 0;
+    while (first < last) {
+      // Scan a block from each end that has run out of offsets, splitting
+      // what is left near the middle.
+      size_t unknown_len = (size_t)(last - first);
+      size_t left_split =
+          left_len == 0 ? (right_len == 0 ? unknown_len / 2 : unknown_len) : 0;
+      size_t right_split = right_len == 0 ? unknown_len - left_split : 0;
+      left_split = left_split < SORT_BLOCK_LEN ? left_split : SORT_BLOCK_LEN;
+      right_split =
+          right_split < SORT_BLOCK_LEN ? right_split : SORT_BLOCK_LEN;
+      for (size_t i = 0; i < left_split; i += 1) {
+        offsets_left[left_len] = (uint8_t)i;
+        left_len += !SORT_LESS(ctx, *first, pivot);
+        first += 1;
+      }
+      for (size_t i = 1; i <= right_split; i += 1) {
+        last -= 1;
+        offsets_right[right_len] = (uint8_t)i;
+        right_len += SORT_LESS(ctx, *last, pivot);
+      }
+
+      size_t swaps_len = left_len < right_len ? left_len : right_len;
+      SORT_FN(swap_offsets)(left_base, right_base,
+                            offsets_left + left_start,
+                            offsets_right + right_start, swaps_len);
+      left_len -= swaps_len;
+      right_len -= swaps_len;
+      left_start += swaps_len;
+      right_start += swaps_len;
+      if (left_len == 0) {
+        left_start = 0;
+        left_base = first;
+      }
+      if (right_len == 0) {
+        right_start = 0;
+        right_base = last;
+      }
+    }
+
+    // Misplaced elements left over from one side go to the boundary.
+    while (left_len > 0) {
+      left_len -= 1;
+      last -= 1;
+      SORT_FN(swap)(left_base + offsets_left[left_start + left_len], last);
+      first = last;
+    }
+    while (right_len > 0) {
+      right_len -= 1;
+      SORT_FN(swap)(right_base - offsets_right[right_start + right_len],
+                    first);
+      first += 1;
+    }
+  }
+  SORT_ELEM *pivot_pos = first - 1;
+  *begin = *pivot_pos;
+  *pivot_pos = pivot;
+  return pivot_pos;
+}
+#else
+// Partitions around the pivot at `begin`: smaller elements to its left,
+// the others to its right. Returns the pivot's final position, and whether
+// the range was already partitioned.
+static SORT_ELEM *SORT_FN(partition_right)(SortContext *ctx,
+                                           SORT_ELEM *begin, SORT_ELEM *end,
+                                           bool *partitioned) {
+  SORT_ELEM pivot = *begin;
+  SORT_ELEM *first = begin + 1;
+  SORT_ELEM *last = end - 1;
+  *partitioned = true;
+  while (true) {
+    while (first <= last && SORT_LESS(ctx, *first, pivot)) {
+      first += 1;
+    }
+    while (first < last && !SORT_LESS(ctx, *last, pivot)) {
+      last -= 1;
+    }
+    if (first >= last) {
+      break;
+    }
+    SORT_FN(swap)(first, last);
+    *partitioned = false;
+    first += 1;
+    last -= 1;
+  }
+  SORT_ELEM *pivot_pos = first - 1;
+  *begin = *pivot_pos;
+  *pivot_pos = pivot;
+  return pivot_pos;
+}
+#endif
+
+// Partitions around the pivot at `begin`, putting the elements equal to it
+// on its left. Used once the pivot is known to be the smallest element, so
+// the left side is a run of equal elements that is already in place.
+static SORT_ELEM *SORT_FN(partition_left)(SortContext *ctx, SORT_ELEM *begin,
+                                          SORT_ELEM *end) {
+  SORT_ELEM pivot = *begin;
+  SORT_ELEM *first = begin + 1;
+  SORT_ELEM *last = end - 1;
+  while (true) {
+    while (first <= last && !SORT_LESS(ctx, pivot, *first)) {
+      first += 1;
+    }
+    while (first < last && SORT_LESS(ctx, pivot, *last)) {
+      last -= 1;
+    }
+    if (first >= last) {
+      break;
+    }
+    SORT_FN(swap)(first, last);
+    first += 1;
+    last -= 1;
+  }
+  SORT_ELEM *pivot_pos = first - 1;
+  *begin = *pivot_pos;
+  *pivot_pos = pivot;
+  return pivot_pos;
+}
+
+// Swaps a few elements of a side left too small by the pivot, so that the
+// next pivots are drawn from different positions.
+static void SORT_FN(break_patterns)(SORT_ELEM *begin, SORT_ELEM *end) {
+  size_t len = (size_t)(end - begin);
+  if (len < SORT_INSERTION_LEN) {
+    return;
+  }
+  SORT_FN(swap)(&begin[0], &begin[len / 4]);
+  SORT_FN(swap)(&end[-1], &end[-(ptrdiff_t)(len / 4)]);
+  if (len > SORT_NINTHER_LEN) {
+    SORT_FN(swap)(&begin[1], &begin[len / 4 + 1]);
+    SORT_FN(swap)(&begin[2], &begin[len / 4 + 2]);
+    SORT_FN(swap)(&end[-2], &end[-(ptrdiff_t)(len / 4 + 1)]);
+    SORT_FN(swap)(&end[-3], &end[-(ptrdiff_t)(len / 4 + 2)]);
+  }
+}
+
+static void SORT_FN(pdqsort_loop)(SortContext *ctx, SORT_ELEM *begin,
+                                  SORT_ELEM *end, uint32_t bad_allowed,
+                                  bool leftmost) {
+  while (!ctx->failed) {
+    size_t len = (size_t)(end - begin);
+    if (len < SORT_INSERTION_LEN) {
+      SORT_FN(insertion_sort)(ctx, begin, end);
+      return;
+    }
+
+    // Median of three, or of three medians on long ranges, goes to `begin`.
+    size_t half = len / 2;
+    if (len > SORT_NINTHER_LEN) {
+      SORT_FN(sort3)(ctx, begin, begin + half, end - 1);
+      SORT_FN(sort3)(ctx, begin + 1, begin + half - 1, end - 2);
+      SORT_FN(sort3)(ctx, begin + 2, begin + half + 1, end - 3);
+      SORT_FN(sort3)(ctx, begin + half - 1, begin + half, begin + half + 1);
+      SORT_FN(swap)(begin, begin + half);
+    } else {
+      SORT_FN(sort3)(ctx, begin + half, begin, end - 1);
+    }
+
+    // The element before the range is an earlier pivot, no greater than
+    // any element of it. If it equals this pivot, so do all the elements
+    // partition_left gathers, and they need no further sorting.
+    if (!leftmost && !SORT_LESS(ctx, begin[-1], *begin)) {
+      begin = SORT_FN(partition_left)(ctx, begin, end) + 1;
+      continue;
+    }
+
+    bool partitioned;
+    SORT_ELEM *pivot_pos =
+        SORT_FN(partition_right)(ctx, begin, end, &partitioned);
+    size_t left_len = (size_t)(pivot_pos - begin);
+    size_t right_len = (size_t)(end - (pivot_pos + 1));
+    if (left_len < len / 8 || right_len < len / 8) {
+      // Too many bad pivots: fall back on heap sort's worst case.
+      bad_allowed -= 1;
+      if (bad_allowed == 0) {
+        SORT_FN(heap_sort)(ctx, begin, end);
+        return;
+      }
+      SORT_FN(break_patterns)(begin, pivot_pos);
+      SORT_FN(break_patterns)(pivot_pos + 1, end);
+    } else if (partitioned &&
+               SORT_FN(partial_insertion_sort)(ctx, begin, pivot_pos) &&
+               SORT_FN(partial_insertion_sort)(ctx, pivot_pos + 1, end)) {
+      return;
+    }
+
+    // Recurse into the left side and loop on the right one.
+    SORT_FN(pdqsort_loop)(ctx, begin, pivot_pos, bad_allowed, leftmost);
+    begin = pivot_pos + 1;
+    leftmost = false;
+  }
+}
+
+static void SORT_FN(pdqsort)(SortContext *ctx, SORT_ELEM *begin,
+                             SORT_ELEM *end) {
+  uint32_t bad_allowed = 1;
+  for (size_t len = (size_t)(end - begin); len > 1; len >>= 1) {
+    bad_allowed += 1;
+  }
+  SORT_FN(pdqsort_loop)(ctx, begin, end, bad_allowed, true);
+}
+
+// Sorts a range stably, with room in `buffer` for half of it.
+static void SORT_FN(merge_sort)(SortContext *ctx, SORT_ELEM *begin,
+                                SORT_ELEM *end, SORT_ELEM *buffer) {
+  size_t len = (size_t)(end - begin);
+  if (len < SORT_INSERTION_LEN) {
+    SORT_FN(insertion_sort)(ctx, begin, end);
+    return;
+  }
+  SORT_ELEM *mid = begin + len / 2;
+  SORT_FN(merge_sort)(ctx, begin, mid, buffer);
+  SORT_FN(merge_sort)(ctx, mid, end, buffer);
+  if (ctx->failed || !SORT_LESS(ctx, *mid, mid[-1])) {
+    return;
+  }
+
+  // Merge the left half, moved to the buffer, with the right one in place.
+  // Ties take the left element first, which keeps the sort stable.
+  size_t left_len = (size_t)(mid - begin);
+  memcpy(buffer, begin, sizeof(SORT_ELEM) * left_len);
+  SORT_ELEM *left = buffer;
+  SORT_ELEM *left_end = buffer + left_len;
+  SORT_ELEM *right = mid;
+  SORT_ELEM *out = begin;
+  while (left < left_end && right < end) {
+    if (SORT_LESS(ctx, *right, *left)) {
+      *out++ = *right++;
+    } else {
+      *out++ = *left++;
+    }
+  }
+  memcpy(out, left, sizeof(SORT_ELEM) * (size_t)(left_end - left));
+}
+
+#undef SORT_FN
+#undef SORT_CONCAT
+#undef SORT_CONCAT_
+#undef SORT_PREFIX
+#undef SORT_ELEM
+#undef SORT_LESS
+#undef SORT_BRANCHLESS
@@ -1,43 +1,179 @@
 #include <stdint.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* ifdef __SSE2__ */
+
 #include "table.h"
 
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+/***
+  Tables and sets are open-addressed hash maps laid out as "swiss tables":
+  every slot has a one byte control word next to it, stored in a separate
+  `ctrl` array. Probing walks groups of `TABLE_GROUP_WIDTH` control bytes and
+  compares a whole group against the 7-bit hash fragment of the key at once,
+  so most lookups touch a single cache line of metadata and compare at most
+  one key.
+  ***/
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+
+typedef uint32_t GroupMask;
+
+typedef struct {
+  uint32_t group;
+  uint32_t stride;
+  uint32_t mask;
+} Probe;
+
+#ifdef __SSE2__
+
+static inline GroupMask group_match(const uint8_t *group, uint8_t h2) {
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+}
+
+static inline GroupMask group_match_empty(const uint8_t *group) {
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (GroupMask)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)CTRL_EMPTY)));
+}
+
+// Empty and deleted slots are the only ones with the high bit set.
+static inline GroupMask group_match_free(const uint8_t *group) {
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (GroupMask)_mm_movemask_epi8(ctrl);
+}
+
+#else
+
+static inline GroupMask group_match(const uint8_t *group, uint8_t h2) {
+  GroupMask mask = 0;
+  for (uint32_t i = 0; i < TABLE_GROUP_WIDTH; i += 1) {
+    mask |= (GroupMask)(group[i] == h2) << i;
+  }
+  return mask;
+}
+
+static inline GroupMask group_match_empty(const uint8_t *group) {
+  return group_match(group, CTRL_EMPTY);
+}
+
+static inline GroupMask group_match_free(const uint8_t *group) {
+  GroupMask mask = 0;
+  for (uint32_t i = 0; i < TABLE_GROUP_WIDTH; i += 1) {
+    mask |= (GroupMask)(group[i] >> 7) << i;
+  }
+  return mask;
+}
+
+#endif /* ifdef __SSE2__ */
+
+#define FOR_EACH_BIT(bit, mask)                                                \
+  for (GroupMask _bits = (mask), bit = __builtin_ctz(_bits | 0x10000);         \
+       _bits != 0; _bits &= _bits - 1, bit = __builtin_ctz(_bits | 0x10000))
+
+// Triangular probing over groups visits every group exactly once when the
+// number of groups is a power of two.
+static inline Probe probe_init(uint32_t hash, uint32_t capacity) {
+  uint32_t mask = capacity / TABLE_GROUP_WIDTH - 1;
+  return (Probe){.group = H1(hash) & mask, .stride = 0, .mask = mask};
+}
+
+static inline void probe_next(Probe *probe) {
+  probe->stride += 1;
+  probe->group = (probe->group + probe->stride) & probe->mask;
+}
+
+static inline uint32_t probe_offset(const Probe *probe) {
+  return probe->group * TABLE_GROUP_WIDTH;
+}
+
+static inline uint32_t max_load(uint32_t capacity) {
+  return capacity - capacity / 8;
+}
+
+static uint8_t *allocate_ctrl(VirtualMachine *vm, uint32_t capacity) {
+  uint8_t *ctrl = ALLOCATE(vm, uint8_t, capacity);
+  memset(ctrl, CTRL_EMPTY, capacity);
+  return ctrl;
+}
+
+static uint32_t find_free_slot(const uint8_t *ctrl, uint32_t capacity,
+                               uint32_t hash) {
+  Probe probe = probe_init(hash, capacity);
+  while (true) {
+    uint32_t offset = probe_offset(&probe);
+    GroupMask free = group_match_free(ctrl + offset);
+    if (free != 0) {
+      return offset + __builtin_ctz(free);
+    }
+    probe_next(&probe);
+  }
+}
+
+/* Frees a slot. A group that still has an empty slot never made a probe
+ * sequence move past it, so the slot can become empty again instead of a
+ * tombstone.
+ */
+static void erase_slot(uint8_t *ctrl, uint32_t idx, uint32_t *tombstones) {
+  const uint8_t *group = ctrl + (idx & ~(uint32_t)(TABLE_GROUP_WIDTH - 1));
+  if (group_match_empty(group) != 0) {
+    ctrl[idx] = CTRL_EMPTY;
+  } else {
+    ctrl[idx] = CTRL_DELETED;
+    *tombstones += 1;
+  }
+}
+
+/* Picks the capacity for the next rehash: tables mostly filled by tombstones
+ * are rehashed in place, which drops the tombstones, instead of growing.
+ */
+static uint32_t next_capacity(uint32_t capacity, uint32_t len) {
+  if (capacity == 0) {
+    return TABLE_GROUP_WIDTH;
+  }
+  if (len + 1 > max_load(capacity) / 2) {
+    return capacity * 2;
+  }
+  return capacity;
+}
 
 void init_table(Table *table) {
   table->len = 0;
   table->capacity = 0;
+  table->tombstones = 0;
+  table->ctrl = NULL;
   table->entries = NULL;
 }
 
-void free_table(Table *table) {
-  FREE_ARRAY(TableEntry, table->entries, table->capacity);
+void free_table(VirtualMachine *vm, Table *table) {
+  FREE_ARRAY(vm, uint8_t, table->ctrl, table->capacity);
+  FREE_ARRAY(vm, TableEntry, table->entries, table->capacity);
   init_table(table);
 }
 
-static TableEntry *find_table_entry(TableEntry *entries, uint32_t capacity,
-                                    const ObjString *key) {
-  uint32_t idx = key->hash % capacity;
-  TableEntry *tombstone = NULL;
+static TableEntry *find_table_entry(const Table *table, const ObjString *key) {
+  uint8_t h2 = H2(key->hash);
+  Probe probe = probe_init(key->hash, table->capacity);
   while (true) {
-    TableEntry *entry = &entries[idx];
-    if (entry->key == NULL) {
-      if (IS_NULL(entry->value)) {
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        if (tombstone == NULL) {
-          tombstone = entry;
-        }
+    uint32_t offset = probe_offset(&probe);
+    const uint8_t *group = table->ctrl + offset;
+    FOR_EACH_BIT(bit, group_match(group, h2)) {
+      TableEntry *entry = &table->entries[offset + bit];
+      if (entry->key == key) {
+        return entry;
       }
-    } else if (entry->key == key) {
-      return entry;
     }
-
-    idx = (idx + 1) % capacity;
+    if (group_match_empty(group) != 0) {
+      return NULL;
+    }
+    probe_next(&probe);
   }
 }
 
@@ -45,19 +181,16 @@ bool table_contains(const Table *table, const ObjString *key) {
   if (table->len == 0) {
     return false;
   }
-  TableEntry *entry = find_table_entry(table->entries, table->capacity, key);
-  return entry->key != NULL;
+  return find_table_entry(table, key) != NULL;
 }
 
-
-
 bool table_get(const Table *table, const ObjString *key, Value *value) {
   if (table->len == 0) {
     return false;
   }
 
-  TableEntry *entry = find_table_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  TableEntry *entry = find_table_entry(table, key);
+  if (entry == NULL) {
     return false;
   }
 
@@ -65,46 +198,51 @@ bool table_get(const Table *table, const ObjString *key, Value *value) {
   return true;
 }
 
-static void adjust_table_capacity(Table *table, uint32_t capacity) {
-  TableEntry *entries = ALLOCATE(TableEntry, capacity);
-  for (uint32_t i = 0; i < capacity; i += 1) {
-    entries[i].key = NULL;
-    entries[i].value = NULL_VAL;
-  }
-
-  table->len = 0;
-  for (uint32_t i = 0; i < table->capacity; i += 1) {
-    TableEntry *entry = &table->entries[i];
-    if (entry->key == NULL) {
-      continue;
-    }
-    TableEntry *dst = find_table_entry(entries, capacity, entry->key);
-    dst->key = entry->key;
-    dst->value = entry->value;
-    table->len += 1;
+static void adjust_table_capacity(VirtualMachine *vm, Table *table,
+                                  uint32_t capacity) {
+  uint8_t *ctrl = allocate_ctrl(vm, capacity);
+  TableEntry *entries = ALLOCATE(vm, TableEntry, capacity);
+
+  uint32_t i = 0;
+  TableEntry *entry;
+  while (table_next(table, &i, &entry)) {
+    uint32_t idx = find_free_slot(ctrl, capacity, entry->key->hash);
+    ctrl[idx] = H2(entry->key->hash);
+    entries[idx] = *entry;
   }
 
-  FREE_ARRAY(TableEntry, table->entries, table->capacity);
+  FREE_ARRAY(vm, uint8_t, table->ctrl, table->capacity);
+  FREE_ARRAY(vm, TableEntry, table->entries, table->capacity);
+  table->ctrl = ctrl;
   table->entries = entries;
   table->capacity = capacity;
+  table->tombstones = 0;
 }
 
-bool table_insert(Table *table, ObjString *key, Value value) {
-  if (table->len + 1 > table->capacity * TABLE_MAX_LOAD) {
-    uint32_t capacity = GROW_CAPACITY(table->capacity);
-    adjust_table_capacity(table, capacity);
-  }
-  TableEntry *entry = find_table_entry(table->entries, table->capacity, key);
-  bool is_new_key = entry->key == NULL;
-  if (is_new_key) {
-    entry->key = key;
-    if (IS_NULL(entry->value)) {
-      table->len += 1;
+bool table_insert(VirtualMachine *vm, Table *table, ObjString *key,
+                  Value value) {
+  if (table->len > 0) {
+    TableEntry *entry = find_table_entry(table, key);
+    if (entry != NULL) {
+      entry->value = value;
+      return false;
     }
   }
 
-  entry->value = value;
-  return is_new_key;
+  if (table->len + table->tombstones + 1 > max_load(table->capacity)) {
+    adjust_table_capacity(vm, table,
+                          next_capacity(table->capacity, table->len));
+  }
+
+  uint32_t idx = find_free_slot(table->ctrl, table->capacity, key->hash);
+  if (table->ctrl[idx] == CTRL_DELETED) {
+    table->tombstones -= 1;
+  }
+  table->ctrl[idx] = H2(key->hash);
+  table->entries[idx].key = key;
+  table->entries[idx].value = value;
+  table->len += 1;
+  return true;
 }
 
 bool table_remove(Table *table, const ObjString *key) {
@@ -112,23 +250,24 @@ bool table_remove(Table *table, const ObjString *key) {
     return false;
   }
 
-  TableEntry *entry = find_table_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  TableEntry *entry = find_table_entry(table, key);
+  if (entry == NULL) {
     return false;
   }
 
   entry->key = NULL;
-  // setting the entry as a tombstone
-  entry->value = BOOL_VAL(true);
+  entry->value = NULL_VAL;
+  erase_slot(table->ctrl, (uint32_t)(entry - table->entries),
+             &table->tombstones);
+  table->len -= 1;
   return true;
 }
 
-void table_copy(const Table *src, Table *dst) {
-  for (uint32_t i = 0; i < src->capacity; i += 1) {
-    TableEntry *entry = &src->entries[i];
-    if (entry->key != NULL) {
-      table_insert(dst, entry->key, entry->value);
-    }
+void table_copy(VirtualMachine *vm, const Table *src, Table *dst) {
+  uint32_t i = 0;
+  TableEntry *entry;
+  while (table_next(src, &i, &entry)) {
+    table_insert(vm, dst, entry->key, entry->value);
   }
 }
 
@@ -138,68 +277,89 @@ ObjString *table_find_string(const Table *table, const char *chars,
     return NULL;
   }
 
-  uint32_t idx = hash % table->capacity;
+  uint8_t h2 = H2(hash);
+  Probe probe = probe_init(hash, table->capacity);
   while (true) {
-    TableEntry *entry = &table->entries[idx];
-    if (entry->key == NULL) {
-      if (IS_NULL(entry->value)) {
-        return NULL;
+    uint32_t offset = probe_offset(&probe);
+    const uint8_t *group = table->ctrl + offset;
+    FOR_EACH_BIT(bit, group_match(group, h2)) {
+      ObjString *key = table->entries[offset + bit].key;
+      if (key->hash == hash && key->len == len &&
+          memcmp(key->chars, chars, len) == 0) {
+        return key;
       }
-    } else if (entry->key->len == len && entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, len) == 0) {
-      return entry->key;
     }
+    if (group_match_empty(group) != 0) {
+      return NULL;
+    }
+    probe_next(&probe);
+  }
+}
 
-    idx = (idx + 1) % table->capacity;
+bool table_next(const Table *table, uint32_t *idx, TableEntry **entry) {
+  for (uint32_t i = *idx; i < table->capacity; i += 1) {
+    if (!(table->ctrl[i] & CTRL_EMPTY)) {
+      *entry = &table->entries[i];
+      *idx = i + 1;
+      return true;
+    }
   }
+  *idx = table->capacity;
+  return false;
 }
 
 void table_remove_white(Table *table) {
-  for (uint32_t idx = 0; idx < table->len; idx += 1) {
-    TableEntry *entry = &table->entries[idx];
-    if (entry->key != NULL && !entry->key->obj.is_marked) {
-      table_remove(table, entry->key);
+  uint32_t idx = 0;
+  TableEntry *entry;
+  while (table_next(table, &idx, &entry)) {
+    if (!entry->key->obj.is_marked) {
+      entry->key = NULL;
+      entry->value = NULL_VAL;
+      erase_slot(table->ctrl, idx - 1, &table->tombstones);
+      table->len -= 1;
     }
   }
 }
 
-void mark_table(Table *table) {
-  for (uint32_t i = 0; i < table->capacity; i += 1) {
-    TableEntry *entry = &table->entries[i];
-    mark_object((Obj *)entry->key);
-    mark_value(entry->value);
+void mark_table(VirtualMachine *vm, Table *table) {
+  uint32_t i = 0;
+  TableEntry *entry;
+  while (table_next(table, &i, &entry)) {
+    mark_object(vm, (Obj *)entry->key);
+    mark_value(vm, entry->value);
   }
 }
 
 void init_set(Set *set) {
   set->len = 0;
   set->capacity = 0;
-  set->entries = NULL;
+  set->tombstones = 0;
+  set->ctrl = NULL;
+  set->keys = NULL;
 }
 
-void free_set(Set *set) {
-  FREE_ARRAY(SetEntry, set->entries, set->capacity);
+void free_set(VirtualMachine *vm, Set *set) {
+  FREE_ARRAY(vm, uint8_t, set->ctrl, set->capacity);
+  FREE_ARRAY(vm, ObjString *, set->keys, set->capacity);
   init_set(set);
 }
 
-static SetEntry *find_set_entry(SetEntry *entries, uint32_t capacity,
-                                const ObjString *key) {
-  uint32_t idx = key->hash % capacity;
-  SetEntry *tombstone = NULL;
-
+static ObjString **find_set_entry(const Set *set, const ObjString *key) {
+  uint8_t h2 = H2(key->hash);
+  Probe probe = probe_init(key->hash, set->capacity);
   while (true) {
-    SetEntry *entry = &entries[idx];
-    if (entry->key == NULL) {
-      if (!entry->is_tombstone) {
-        return tombstone != NULL ? tombstone : entry;
-      } else if (tombstone == NULL) {
-        tombstone = entry;
+    uint32_t offset = probe_offset(&probe);
+    const uint8_t *group = set->ctrl + offset;
+    FOR_EACH_BIT(bit, group_match(group, h2)) {
+      ObjString **entry = &set->keys[offset + bit];
+      if (*entry == key) {
+        return entry;
       }
-    } else if (entry->key == key) {
-      return entry;
     }
-
-    idx = (idx + 1) % capacity;
+    if (group_match_empty(group) != 0) {
+      return NULL;
+    }
+    probe_next(&probe);
   }
 }
 
@@ -207,48 +367,49 @@ bool set_contains(const Set *set, const ObjString *key) {
   if (set->len == 0) {
     return false;
   }
-  SetEntry *entry = find_set_entry(set->entries, set->capacity, key);
-  return entry->key != NULL;
+  return find_set_entry(set, key) != NULL;
 }
 
-static void adjust_set_capacity(Set *set, uint32_t capacity) {
-  SetEntry *entries = ALLOCATE(SetEntry, capacity);
-  for (uint32_t i = 0; i < capacity; i += 1) {
-    entries[i].key = NULL;
-    entries[i].is_tombstone = false;
-  }
+static void adjust_set_capacity(VirtualMachine *vm, Set *set,
+                                uint32_t capacity) {
+  uint8_t *ctrl = allocate_ctrl(vm, capacity);
+  ObjString **keys = ALLOCATE(vm, ObjString *, capacity);
 
-  set->len = 0;
   for (uint32_t i = 0; i < set->capacity; i += 1) {
-    SetEntry *entry = &set->entries[i];
-    if (entry->key == NULL) {
+    if (set->ctrl[i] & CTRL_EMPTY) {
       continue;
     }
-    SetEntry *dst = find_set_entry(entries, capacity, entry->key);
-    dst->key = entry->key;
-    dst->is_tombstone = entry->is_tombstone;
-    set->len += 1;
+    ObjString *key = set->keys[i];
+    uint32_t idx = find_free_slot(ctrl, capacity, key->hash);
+    ctrl[idx] = H2(key->hash);
+    keys[idx] = key;
   }
 
-  FREE_ARRAY(SetEntry, set->entries, set->capacity);
-  set->entries = entries;
+  FREE_ARRAY(vm, uint8_t, set->ctrl, set->capacity);
+  FREE_ARRAY(vm, ObjString *, set->keys, set->capacity);
+  set->ctrl = ctrl;
+  set->keys = keys;
   set->capacity = capacity;
+  set->tombstones = 0;
 }
 
-bool set_insert(Set *set, ObjString *key) {
-  if (set->len + 1 > set->capacity * TABLE_MAX_LOAD) {
-    uint32_t capacity = GROW_CAPACITY(set->capacity);
-    adjust_set_capacity(set, capacity);
+bool set_insert(VirtualMachine *vm, Set *set, ObjString *key) {
+  if (set_contains(set, key)) {
+    return false;
   }
-  SetEntry *entry = find_set_entry(set->entries, set->capacity, key);
-  bool is_new = (entry->key == NULL);
-  if (is_new) {
-    entry->key = key;
-    if (!entry->is_tombstone) {
-      set->len += 1;
-    }
+
+  if (set->len + set->tombstones + 1 > max_load(set->capacity)) {
+    adjust_set_capacity(vm, set, next_capacity(set->capacity, set->len));
+  }
+
+  uint32_t idx = find_free_slot(set->ctrl, set->capacity, key->hash);
+  if (set->ctrl[idx] == CTRL_DELETED) {
+    set->tombstones -= 1;
   }
-  return is_new;
+  set->ctrl[idx] = H2(key->hash);
+  set->keys[idx] = key;
+  set->len += 1;
+  return true;
 }
 
 bool set_remove(Set *set, const ObjString *key) {
@@ -256,29 +417,69 @@ bool set_remove(Set *set, const ObjString *key) {
     return false;
   }
 
-  SetEntry *entry = find_set_entry(set->entries, set->capacity, key);
-
-  if (entry->key == NULL) {
+  ObjString **entry = find_set_entry(set, key);
+  if (entry == NULL) {
     return false;
   }
 
-  entry->key = NULL;
-  entry->is_tombstone = true;
+  *entry = NULL;
+  erase_slot(set->ctrl, (uint32_t)(entry - set->keys), &set->tombstones);
+  set->len -= 1;
   return true;
 }
 
+void set_copy(VirtualMachine *vm, const Set *src, Set *dst) {
+  for (uint32_t i = 0; i < src->capacity; i += 1) {
+    if (src->ctrl[i] & CTRL_EMPTY) {
+      continue;
+    }
+    set_insert(vm, dst, src->keys[i]);
+  }
+}
+
+ObjString *set_find_string(const Set *set, const char *chars, uint32_t len,
+                           uint32_t hash) {
+  if (set->len == 0) {
+    return NULL;
+  }
+
+  uint8_t h2 = H2(hash);
+  Probe probe = probe_init(hash, set->capacity);
+  while (true) {
+    uint32_t offset = probe_offset(&probe);
+    const uint8_t *group = set->ctrl + offset;
+    FOR_EACH_BIT(bit, group_match(group, h2)) {
+      ObjString *key = set->keys[offset + bit];
+      if (key->hash == hash && key->len == len &&
+          memcmp(key->chars, chars, len) == 0) {
+        return key;
+      }
+    }
+    if (group_match_empty(group) != 0) {
+      return NULL;
+    }
+    probe_next(&probe);
+  }
+}
+
 void set_remove_white(Set *set) {
-  for (uint32_t idx = 0; idx < set->len; idx += 1) {
-    SetEntry *entry = &set->entries[idx];
-    if (entry->key != NULL && !entry->key->obj.is_marked) {
-      set_remove(set, entry->key);
+  for (uint32_t idx = 0; idx < set->capacity; idx += 1) {
+    if (set->ctrl[idx] & CTRL_EMPTY) {
+      continue;
+    }
+    if (!set->keys[idx]->obj.is_marked) {
+      set->keys[idx] = NULL;
+      erase_slot(set->ctrl, idx, &set->tombstones);
+      set->len -= 1;
     }
   }
 }
 
-void mark_set(Set *set) {
+void mark_set(VirtualMachine *vm, Set *set) {
   for (uint32_t i = 0; i < set->capacity; i += 1) {
-    SetEntry *entry = &set->entries[i];
-    mark_object((Obj *)entry->key);
+    if (set->ctrl[i] & CTRL_EMPTY) {
+      continue;
+    }
+    mark_object(vm, (Obj *)set->keys[i]);
   }
 }
@@ -7,49 +7,65 @@
 #include "common.h"
 #include "value.h"
 
+/* Number of control bytes scanned at once while probing. Capacities are
+ * always a power-of-two multiple of the group width.
+ */
+#define TABLE_GROUP_WIDTH 16
+
+/* Control byte states. A full slot stores the low 7 bits of its key's hash,
+ * so its control byte never has the high bit set.
+ */
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
+
 typedef struct TableEntry {
   ObjString *key;
   Value value;
 } TableEntry;
 
-typedef struct SetEntry {
-  ObjString *key;
-  bool is_tombstone;
-} SetEntry;
-
 typedef struct Table {
   uint32_t len;
   uint32_t capacity;
+  uint32_t tombstones;
+  uint8_t *ctrl;
   TableEntry *entries;
 } Table;
 
 typedef struct Set {
   uint32_t len;
   uint32_t capacity;
-  SetEntry *entries;
+  uint32_t tombstones;
+  uint8_t *ctrl;
+  ObjString **keys;
 } Set;
 
 void init_table(Table *table);
-void free_table(Table *table);
+void free_table(VirtualMachine *vm, Table *table);
 bool table_contains(const Table *table, const ObjString *key);
 bool table_get(const Table *table, const ObjString *key, Value *value);
-bool table_insert(Table *table, ObjString *key, Value value);
+bool table_insert(VirtualMachine *vm, Table *table, ObjString *key,
+                  Value value);
 bool table_remove(Table *table, const ObjString *key);
-void table_copy(const Table *src, Table *dst);
+void table_copy(VirtualMachine *vm, const Table *src, Table *dst);
 ObjString *table_find_string(const Table *table, const char *chars,
                              uint32_t len, uint32_t hash);
+/* Walks the live entries of `table`. Start with `*idx` at 0: each call
+ * stores the next entry in `*entry` and returns false once there is none.
+ * Only the entry just returned may be removed while walking.
+ */
+bool table_next(const Table *table, uint32_t *idx, TableEntry **entry);
 void table_remove_white(Table *table);
-void mark_table(Table *table);
+void mark_table(VirtualMachine *vm, Table *table);
 
 void init_set(Set *set);
-void free_set(Set *set);
+void free_set(VirtualMachine *vm, Set *set);
 bool set_contains(const Set *set, const ObjString *key);
-bool set_insert(Set *set, ObjString *key);
+bool set_insert(VirtualMachine *vm, Set *set, ObjString *key);
 bool set_remove(Set *set, const ObjString *key);
-void set_copy(const Set *src, Set *dst);
+void set_copy(VirtualMachine *vm, const Set *src, Set *dst);
 ObjString *set_find_string(const Set *set, const char *chars, uint32_t len,
                            uint32_t hash);
 void set_remove_white(Set *set);
-void mark_set(Set *set);
+void mark_set(VirtualMachine *vm, Set *set);
 
 #endif // !breeze_table_h
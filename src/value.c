@@ -13,38 +13,43 @@ void init_value_vec(ValueVec *vec) {
   vec->len = 0;
 }
 
-void write_value_vec(ValueVec *vec, Value value) {
+void write_value_vec(VirtualMachine *vm, ValueVec *vec, Value value) {
   if (vec->capacity < vec->len + 1) {
     uint32_t old_capacity = vec->capacity;
     vec->capacity = GROW_CAPACITY(old_capacity);
-    vec->values = GROW_ARRAY(Value, vec->values, old_capacity, vec->capacity);
+    vec->values =
+        GROW_ARRAY(vm, Value, vec->values, old_capacity, vec->capacity);
   }
 
   vec->values[vec->len] = value;
   vec->len += 1;
 }
 
-void free_value_vec(ValueVec *vec) {
-  FREE_ARRAY(Value, vec->values, vec->capacity);
+void free_value_vec(VirtualMachine *vm, ValueVec *vec) {
+  FREE_ARRAY(vm, Value, vec->values, vec->capacity);
   init_value_vec(vec);
 }
 
-void print_value(Value value) {
+void print_value(FILE *out, Value value) {
   switch (value.type) {
   case ValBool: {
-    printf(AS_BOOL(value) ? "true" : "false");
+    fputs(AS_BOOL(value) ? "true" : "false", out);
     break;
   }
   case ValNull: {
-    printf("null");
+    fputs("null", out);
     break;
   }
   case ValNumber: {
-    printf("%g", AS_NUMBER(value));
+    fprintf(out, "%g", AS_NUMBER(value));
     break;
   }
   case ValObj: {
-    print_object(value);
+    print_object(out, value);
+    break;
+  }
+  case ValEmpty: {
+    fputs("<empty>", out);
     break;
   }
   }
@@ -58,11 +63,31 @@ bool values_equal(Value left, Value right) {
   case ValBool:
     return AS_BOOL(left) == AS_BOOL(right);
   case ValNull:
+  case ValEmpty:
     return true;
   case ValNumber:
     return AS_NUMBER(left) == AS_NUMBER(right);
-  case ValObj:
-    return AS_OBJ(left) == AS_OBJ(right);
+  case ValObj: {
+    if (AS_OBJ(left) == AS_OBJ(right)) {
+      return true;
+    }
+    // A VM-local string can predate the shared string with the same
+    // characters, and views are never interned, so those are the only
+    // distinct objects that compare equal.
+    if (!IS_STRING(left) || !IS_STRING(right)) {
+      return false;
+    }
+    ObjString *left_string = AS_STRING(left);
+    ObjString *right_string = AS_STRING(right);
+    if (!(left_string->obj.is_shared || right_string->obj.is_shared ||
+          left_string->is_view || right_string->is_view)) {
+      return false;
+    }
+    return left_string->len == right_string->len &&
+           string_hash(left_string) == string_hash(right_string) &&
+           memcmp(left_string->chars, right_string->chars,
+                  left_string->len) == 0;
+  }
   default:
     return false;
   }
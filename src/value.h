@@ -1,7 +1,9 @@
 #ifndef breeze_value_h
 #define breeze_value_h
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "common.h"
 
@@ -9,6 +11,7 @@
 #define IS_NULL(value) ((value).type == ValNull)
 #define IS_NUMBER(value) ((value).type == ValNumber)
 #define IS_OBJ(value) ((value).type == ValObj)
+#define IS_EMPTY(value) ((value).type == ValEmpty)
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -18,6 +21,7 @@
 #define NULL_VAL ((Value){ValNull, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){ValNumber, {.number = value}})
 #define OBJ_VAL(object) ((Value){ValObj, {.obj = (Obj *)object}})
+#define EMPTY_VAL ((Value){ValEmpty, {.number = 0}})
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
@@ -27,6 +31,8 @@ typedef enum {
   ValNull,
   ValNumber,
   ValObj,
+  // Never seen by scripts: stands in for an instance kept in stack slots.
+  ValEmpty,
 } ValueType;
 
 typedef struct {
@@ -46,8 +52,8 @@ typedef struct {
 
 bool values_equal(Value left, Value right);
 void init_value_vec(ValueVec *vec);
-void write_value_vec(ValueVec *vec, Value value);
-void free_value_vec(ValueVec *vec);
-void print_value(Value value);
+void write_value_vec(VirtualMachine *vm, ValueVec *vec, Value value);
+void free_value_vec(VirtualMachine *vm, ValueVec *vec);
+void print_value(FILE *out, Value value);
 
 #endif // !breeze_value_h
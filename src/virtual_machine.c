@@ -9,8 +9,22 @@
 #include "virtual_machine.h"
 
 #include "chunk.h"
+#include "columns.h"
+#include "csv.h"
+#include "event_loop.h"
+#include "float64_array.h"
+#include "freeze.h"
+#include "isolate.h"
+#include "iter.h"
+#include "json.h"
+#include "list.h"
+#include "map.h"
+#include "mapped_file.h"
 #include "memory.h"
 #include "object.h"
+#include "parallel.h"
+#include "shared_string.h"
+#include "sort.h"
 #include "table.h"
 #include "value.h"
 
@@ -20,90 +34,358 @@
 
 #include "compiler.h"
 
-VirtualMachine vm;
-
-static Value clock_native(int32_t args_len, Value *args) {
+static Value clock_native(VirtualMachine *vm, int32_t args_len,
+                          Value *args) {
+  (void)vm;
+  (void)args_len;
+  (void)args;
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void reset_stack() {
-  vm.stack_ptr = vm.stack;
-  vm.frames_len = 0;
+static Value coroutine_native(VirtualMachine *vm, int32_t args_len,
+                              Value *args) {
+  if (args_len < 1 || !IS_CLOSURE(args[0])) {
+    return native_error(vm, "coroutine expects a function.");
+  }
+  ObjClosure *closure = AS_CLOSURE(args[0]);
+  if (args_len - 1 != closure->function->arity) {
+    return native_error(vm, "Expected %d arguments but got %d.",
+                        closure->function->arity, args_len - 1);
+  }
+
+  ObjCoroutine *coroutine = new_coroutine(vm, closure);
+  Fiber *fiber = &coroutine->fiber;
+  for (int32_t i = 1; i < args_len; i += 1) {
+    *fiber->stack_ptr = args[i];
+    fiber->stack_ptr += 1;
+  }
+  fiber->frames[0].closure = closure;
+  fiber->frames[0].inst_ptr = closure->function->chunk.code;
+  fiber->frames[0].frame_ptr = fiber->stack;
+  fiber->frames_len = 1;
+  return OBJ_VAL(coroutine);
 }
 
-static void runtime_error(const char *format, ...) {
-  va_list args;
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
-  fputs("\n", stderr);
+static Value done_native(VirtualMachine *vm, int32_t args_len, Value *args) {
+  if (args_len != 1 || !IS_COROUTINE(args[0])) {
+    return native_error(vm, "done expects a coroutine.");
+  }
+  return BOOL_VAL(AS_COROUTINE(args[0])->state == CoroutineDone);
+}
 
-  for (int32_t i = vm.frames_len - 1; i >= 0; i -= 1) {
-    CallFrame *frame = &vm.frames[i];
+static void close_all_upvalues(ObjUpvalue *upvalue) {
+  for (; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+  }
+}
+
+static void save_fiber(const VirtualMachine *vm, Fiber *fiber) {
+  fiber->frames = vm->frames;
+  fiber->frames_len = vm->frames_len;
+  fiber->frames_capacity = vm->frames_capacity;
+  fiber->stack = vm->stack;
+  fiber->stack_ptr = vm->stack_ptr;
+  fiber->stack_capacity = vm->stack_capacity;
+  fiber->open_upvalues = vm->open_upvalues;
+}
+
+static void load_fiber(VirtualMachine *vm, const Fiber *fiber) {
+  vm->frames = fiber->frames;
+  vm->frames_len = fiber->frames_len;
+  vm->frames_capacity = fiber->frames_capacity;
+  vm->stack = fiber->stack;
+  vm->stack_ptr = fiber->stack_ptr;
+  vm->stack_capacity = fiber->stack_capacity;
+  vm->open_upvalues = fiber->open_upvalues;
+}
+
+// Unwinds every fiber back to an empty main stack. The coroutines of the
+// resume chain are abandoned, so their upvalues are closed for the closures
+// that escaped them. Their stacks may have grown since they were last
+// suspended, so each gets back the registers its resumee saved.
+static void reset_stack(VirtualMachine *vm) {
+  Fiber running;
+  save_fiber(vm, &running);
+  for (ObjCoroutine *coroutine = vm->coroutine; coroutine != NULL;
+       coroutine = coroutine->caller_coroutine) {
+    close_all_upvalues(running.open_upvalues);
+    running.open_upvalues = NULL;
+    coroutine->fiber = running;
+    coroutine->state = CoroutineDone;
+    running = coroutine->caller;
+  }
+  vm->coroutine = NULL;
+
+  close_all_upvalues(running.open_upvalues);
+  load_fiber(vm, &running);
+  vm->frames_len = 0;
+  vm->stack_ptr = vm->stack;
+  vm->open_upvalues = NULL;
+}
+
+// Frames printed at each end of a long stack trace.
+#define TRACE_ENDS_LEN 10
+
+static void vruntime_error(VirtualMachine *vm, const char *format,
+                           va_list args) {
+  vfprintf(vm->err, format, args);
+  fputs("\n", vm->err);
+
+  for (int32_t i = vm->frames_len - 1; i >= 0; i -= 1) {
+    // Deep recursion would bury the message: keep both ends of the trace.
+    if (vm->frames_len > 2 * TRACE_ENDS_LEN &&
+        i == (int32_t)vm->frames_len - 1 - TRACE_ENDS_LEN) {
+      fprintf(vm->err, "... %u more frames\n",
+              vm->frames_len - 2 * TRACE_ENDS_LEN);
+      i = TRACE_ENDS_LEN;
+      continue;
+    }
+    CallFrame *frame = &vm->frames[i];
     ObjFunction *function = frame->closure->function;
     size_t inst = frame->inst_ptr - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", get_line(&function->chunk.lines, inst));
+    fprintf(vm->err, "[line %d] in ", get_line(&function->chunk.lines, inst));
 
     if (function->name == NULL) {
-      fprintf(stderr, "script\n");
+      fprintf(vm->err, "script\n");
     } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+      fprintf(vm->err, "%s()\n", function->name->chars);
     }
   }
 
-  reset_stack();
+  reset_stack(vm);
+}
+
+static void runtime_error(VirtualMachine *vm, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vruntime_error(vm, format, args);
+  va_end(args);
+}
+
+Value native_error(VirtualMachine *vm, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vruntime_error(vm, format, args);
+  va_end(args);
+  vm->native_failed = true;
+  return NULL_VAL;
+}
+
+static void define_native(VirtualMachine *vm, const char *name,
+                          NativeFn function) {
+  push_stack(vm, OBJ_VAL(copy_shared_string(name, (int32_t)strlen(name))));
+  push_stack(vm, OBJ_VAL(new_native(vm, function)));
+  table_insert(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+  pop_stack(vm);
+  pop_stack(vm);
+}
+
+static void define_natives(VirtualMachine *vm) {
+  define_native(vm, "clock", clock_native);
+  define_native(vm, "spawn", spawn_native);
+  define_native(vm, "channel", channel_native);
+  define_native(vm, "send", send_native);
+  define_native(vm, "recv", recv_native);
+  define_native(vm, "isolate_threads", isolate_threads_native);
+  define_native(vm, "freeze", freeze_native);
+  define_native(vm, "coroutine", coroutine_native);
+  define_native(vm, "done", done_native);
+  define_native(vm, "read_file_async", read_file_async_native);
+  define_native(vm, "sleep_ms", sleep_ms_native);
+  define_native(vm, "wait_all", wait_all_native);
+  define_native(vm, "push", push_native);
+  define_native(vm, "pop", pop_native);
+  define_native(vm, "len", len_native);
+  define_native(vm, "sort", sort_native);
+  define_native(vm, "sort_stable", sort_stable_native);
+  define_native(vm, "map", map_native);
+  define_native(vm, "map_get", map_get_native);
+  define_native(vm, "map_set", map_set_native);
+  define_native(vm, "map_has", map_has_native);
+  define_native(vm, "map_delete", map_delete_native);
+  define_native(vm, "map_keys", map_keys_native);
+  define_native(vm, "map_values", map_values_native);
+  define_native(vm, "f64_array", f64_array_native);
+  define_native(vm, "f64_mmap", f64_mmap_native);
+  define_native(vm, "f64_save", f64_save_native);
+  define_native(vm, "f64_sum", f64_sum_native);
+  define_native(vm, "f64_min", f64_min_native);
+  define_native(vm, "f64_max", f64_max_native);
+  define_native(vm, "f64_dot", f64_dot_native);
+  define_native(vm, "f64_scale", f64_scale_native);
+  define_native(vm, "f64_add", f64_add_native);
+  define_native(vm, "f64_fill", f64_fill_native);
+  define_native(vm, "f64_prefix_sum", f64_prefix_sum_native);
+  define_native(vm, "parallel_map", parallel_map_native);
+  define_native(vm, "parallel_reduce", parallel_reduce_native);
+  define_native(vm, "parallel_threads", parallel_threads_native);
+  define_native(vm, "iter", iter_native);
+  define_native(vm, "json_parse", json_parse_native);
+  define_native(vm, "json_stringify", json_stringify_native);
+  define_native(vm, "csv_each", csv_each_native);
+  define_native(vm, "csv_columns", csv_columns_native);
+  define_native(vm, "mmap_file", mmap_file_native);
+  define_native(vm, "each_line", each_line_native);
+  define_native(vm, "table_of", table_of_native);
+  define_native(vm, "table_add", table_add_native);
+  define_native(vm, "table_row", table_row_native);
+  define_native(vm, "table_len", table_len_native);
+  define_native(vm, "column_sum", column_sum_native);
+  define_native(vm, "column_min", column_min_native);
+  define_native(vm, "column_max", column_max_native);
+}
+
+void init_vm(VirtualMachine *vm) {
+  vm->frames = NULL;
+  vm->frames_len = 0;
+  vm->frames_capacity = 0;
+  vm->stack = NULL;
+  vm->stack_ptr = NULL;
+  vm->stack_capacity = 0;
+  vm->open_upvalues = NULL;
+  vm->frames_max = FRAMES_MAX;
+  vm->coroutine = NULL;
+  vm->coroutines = NULL;
+  reset_stack(vm);
+
+  vm->bytes_allocated = 0;
+  vm->next_gc = 1024 * 1024;
+  vm->objects = NULL;
+
+  vm->gc_paused = 0;
+  vm->gray_stack_len = 0;
+  vm->gray_stack_capacity = 0;
+  vm->gray_stack = NULL;
+
+  vm->parser = NULL;
+  vm->out = stdout;
+  vm->err = stderr;
+  vm->loop = NULL;
+  vm->native_failed = false;
+  vm->native_suspended = false;
+
+  init_table(&vm->globals);
+  init_set(&vm->strings);
+  define_natives(vm);
+}
+
+void reset_vm(VirtualMachine *vm) {
+  reset_stack(vm);
+  cancel_operations(vm->loop);
+  free_table(vm, &vm->globals);
+  init_table(&vm->globals);
+  define_natives(vm);
+}
+
+void set_vm_output(VirtualMachine *vm, FILE *out, FILE *err) {
+  vm->out = out;
+  vm->err = err;
+}
+
+void set_vm_stack_limit(VirtualMachine *vm, uint32_t frames_max) {
+  vm->frames_max = frames_max;
+}
+
+void free_vm(VirtualMachine *vm) {
+  free_event_loop(vm->loop);
+  vm->loop = NULL;
+  reset_stack(vm);
+  FREE_ARRAY(vm, CallFrame, vm->frames, vm->frames_capacity);
+  FREE_ARRAY(vm, Value, vm->stack, vm->stack_capacity);
+  free_table(vm, &vm->globals);
+  free_set(vm, &vm->strings);
+  free_objects(vm, vm->objects);
+  vm->objects = NULL;
+  vm->gray_stack = NULL;
+  vm->gray_stack_capacity = 0;
 }
 
-static void define_native(const char *name, NativeFn function) {
-  push_stack(OBJ_VAL(copy_string(name, (int32_t)strlen(name))));
-  push_stack(OBJ_VAL(new_native(function)));
-  table_insert(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop_stack();
-  pop_stack();
+BreezeVM *new_vm() {
+  VirtualMachine *vm = (VirtualMachine *)malloc(sizeof(VirtualMachine));
+  if (vm == NULL) {
+    return NULL;
+  }
+  init_vm(vm);
+  return vm;
 }
 
-void init_vm() {
-  reset_stack();
-  vm.open_upvalues = NULL;
+void delete_vm(BreezeVM *vm) {
+  free_vm(vm);
+  free(vm);
+}
 
-  vm.bytes_allocated = 0;
-  vm.next_gc = 1024 * 1024;
-  vm.objects = NULL;
+// The running fiber's arrays grow without collecting: the value being
+// pushed is not rooted yet. Only the call depth is limited, in `call`.
+static uint32_t grown_capacity(uint32_t capacity, uint32_t initial) {
+  return capacity < initial ? initial : capacity * ARRAY_GROWTH_FACTOR;
+}
+
+// Moves the stack, then points the frames and open upvalues of the fiber at
+// the new copy.
+static void grow_stack(VirtualMachine *vm) {
+  uint32_t capacity = grown_capacity(vm->stack_capacity, FIBER_STACK_INIT);
+  Value *stack = (Value *)malloc(sizeof(Value) * capacity);
+  if (stack == NULL) {
+    fprintf(stderr, "Not enough memory to grow the stack.");
+    exit(1);
+  }
+  uint32_t stack_len = (uint32_t)(vm->stack_ptr - vm->stack);
+  if (stack_len > 0) {
+    memcpy(stack, vm->stack, sizeof(Value) * stack_len);
+  }
+  for (uint32_t i = 0; i < vm->frames_len; i += 1) {
+    CallFrame *frame = &vm->frames[i];
+    frame->frame_ptr = stack + (frame->frame_ptr - vm->stack);
+  }
+  for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm->stack);
+  }
+  free(vm->stack);
 
-  vm.gray_stack_len = 0;
-  vm.gray_stack_capacity = 0;
-  vm.gray_stack = NULL;
+  vm->bytes_allocated += sizeof(Value) * (capacity - vm->stack_capacity);
+  vm->stack = stack;
+  vm->stack_ptr = stack + stack_len;
+  vm->stack_capacity = capacity;
+}
 
-  init_table(&vm.globals);
-  init_table(&vm.strings);
-  define_native("clock", clock_native);
+// Grows the stack until `slots` more values fit without moving it.
+static void reserve_stack(VirtualMachine *vm, uint32_t slots) {
+  while (vm->stack_capacity - (uint32_t)(vm->stack_ptr - vm->stack) < slots) {
+    grow_stack(vm);
+  }
 }
 
-void free_vm() {
-  free_table(&vm.globals);
-  free_table(&vm.strings);
-  free_objects(vm.objects);
-  init_vm();
+static void grow_frames(VirtualMachine *vm) {
+  uint32_t capacity = grown_capacity(vm->frames_capacity, FIBER_FRAMES_INIT);
+  CallFrame *frames =
+      (CallFrame *)realloc(vm->frames, sizeof(CallFrame) * capacity);
+  if (frames == NULL) {
+    fprintf(stderr, "Not enough memory to grow the call stack.");
+    exit(1);
+  }
+  vm->bytes_allocated += sizeof(CallFrame) * (capacity - vm->frames_capacity);
+  vm->frames = frames;
+  vm->frames_capacity = capacity;
 }
 
-void push_stack(Value value) {
-  if ((vm.stack_ptr - vm.stack) < STACK_MAX) {
-    *vm.stack_ptr = value;
-    vm.stack_ptr += 1;
-    return;
+void push_stack(VirtualMachine *vm, Value value) {
+  if ((uint32_t)(vm->stack_ptr - vm->stack) == vm->stack_capacity) {
+    grow_stack(vm);
   }
-  runtime_error("Stack overflow.");
-  exit(1);
+  *vm->stack_ptr = value;
+  vm->stack_ptr += 1;
 }
 
-Value pop_stack() {
-  vm.stack_ptr -= 1;
-  return *vm.stack_ptr;
+Value pop_stack(VirtualMachine *vm) {
+  vm->stack_ptr -= 1;
+  return *vm->stack_ptr;
 }
 
 // Peeks at a `Value` in the VM stack.
-static Value peek_stack(uint32_t distance) {
-  return vm.stack_ptr[(int32_t)(-1 - distance)];
+static Value peek_stack(VirtualMachine *vm, uint32_t distance) {
+  return vm->stack_ptr[(int32_t)(-1 - distance)];
 }
 
 #ifdef DEBUG_TRACE_EXECUTION
@@ -111,64 +393,146 @@ void print_constants(const Chunk *chunk) {
   printf("Constants:\n");
   for (int i = 0; i < chunk->constants.len; i++) {
     printf("%d: ", i);
-    print_value(chunk->constants.values[i]);
+    print_value(stdout, chunk->constants.values[i]);
     printf("\n");
   }
 }
 #endif
 
-static bool call(ObjClosure *closure, uint8_t args_len) {
+static bool call(VirtualMachine *vm, ObjClosure *closure, uint8_t args_len) {
   ObjFunction *function = closure->function;
 
 #ifdef DEBUG_TRACE_EXECUTION
   print_constants(&function->chunk);
 #endif
   if (args_len != function->arity) {
-    runtime_error("Expected %d arguments but got %d.", function->arity,
+    runtime_error(vm, "Expected %d arguments but got %d.", function->arity,
                   args_len);
     return false;
   }
 
-  if (vm.frames_len == FRAMES_MAX) {
-    runtime_error("Stack overflow.");
+  if (vm->frames_len >= vm->frames_max) {
+    runtime_error(vm, "Stack overflow.");
     return false;
   }
-  CallFrame *frame = &vm.frames[vm.frames_len];
-  vm.frames_len += 1;
+  if (vm->frames_len == vm->frames_capacity) {
+    grow_frames(vm);
+  }
+  CallFrame *frame = &vm->frames[vm->frames_len];
+  vm->frames_len += 1;
   frame->closure = closure;
   frame->inst_ptr = function->chunk.code;
-  frame->frame_ptr = vm.stack_ptr - args_len - 1;
+  frame->frame_ptr = vm->stack_ptr - args_len - 1;
   return true;
 }
 
-static bool call_value(Value callee, uint8_t args_len) {
+// Switches to a coroutine's fiber. The optional argument becomes the value
+// of the `yield` the coroutine is suspended on.
+static bool resume(VirtualMachine *vm, ObjCoroutine *coroutine,
+                   uint8_t args_len) {
+  if (args_len > 1) {
+    runtime_error(vm, "Expected at most 1 resume value but got %d.",
+                  args_len);
+    return false;
+  }
+  if (coroutine->state == CoroutineDone) {
+    runtime_error(vm, "Cannot resume a finished coroutine.");
+    return false;
+  }
+  if (coroutine->state == CoroutineRunning) {
+    runtime_error(vm, "Cannot resume a running coroutine.");
+    return false;
+  }
+  if (coroutine->state == CoroutineWaiting) {
+    runtime_error(vm, "Cannot resume a coroutine waiting on the event loop.");
+    return false;
+  }
+
+  Value value = args_len == 1 ? peek_stack(vm, 0) : NULL_VAL;
+  vm->stack_ptr -= args_len + 1;
+  save_fiber(vm, &coroutine->caller);
+  coroutine->caller_coroutine = vm->coroutine;
+  load_fiber(vm, &coroutine->fiber);
+  vm->coroutine = coroutine;
+  coroutine->state = CoroutineRunning;
+
+  if (coroutine->started) {
+    push_stack(vm, value);
+  }
+  coroutine->started = true;
+  return true;
+}
+
+// Suspends or finishes the running coroutine and hands a value back to its
+// resumer, as the result of the resuming call.
+static void leave_coroutine(VirtualMachine *vm, CoroutineState state,
+                            Value value) {
+  ObjCoroutine *coroutine = vm->coroutine;
+  save_fiber(vm, &coroutine->fiber);
+  coroutine->state = state;
+  load_fiber(vm, &coroutine->caller);
+  vm->coroutine = coroutine->caller_coroutine;
+  coroutine->caller_coroutine = NULL;
+  push_stack(vm, value);
+}
+
+static bool call_value(VirtualMachine *vm, Value callee, uint8_t args_len) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
     case ObjClassType: {
       ObjClass *klass = (ObjClass *)AS_OBJ(callee);
-      vm.stack_ptr[-(args_len + 1)] = OBJ_VAL(new_instance(klass));
+      vm->stack_ptr[-(args_len + 1)] = OBJ_VAL(new_instance(vm, klass));
       return true;
     }
     case ObjClosureType: {
-      return call(AS_CLOSURE(callee), args_len);
+      return call(vm, AS_CLOSURE(callee), args_len);
+    }
+    case ObjCoroutineType: {
+      return resume(vm, AS_COROUTINE(callee), args_len);
+    }
+    case ObjIterType: {
+      reserve_stack(vm, NATIVE_STACK_SLACK);
+      Value result =
+          call_iter(vm, AS_ITER(callee), args_len, vm->stack_ptr - args_len);
+      if (vm->native_failed) {
+        vm->native_failed = false;
+        return false;
+      }
+      vm->stack_ptr -= args_len + 1;
+      push_stack(vm, result);
+      return true;
     }
     case ObjNativeType: {
+      // Natives keep `args` pointing into the stack, so it must not move
+      // while they root a few allocations.
+      reserve_stack(vm, NATIVE_STACK_SLACK);
       NativeFn native = AS_NATIVE(callee);
-      Value result = native(args_len, vm.stack_ptr - args_len);
-      vm.stack_ptr -= args_len + 1;
-      push_stack(result);
+      Value result = native(vm, args_len, vm->stack_ptr - args_len);
+      if (vm->native_failed) {
+        vm->native_failed = false;
+        return false;
+      }
+      vm->stack_ptr -= args_len + 1;
+      if (vm->native_suspended) {
+        // The native's result arrives as the value the coroutine is resumed
+        // with.
+        vm->native_suspended = false;
+        leave_coroutine(vm, CoroutineWaiting, NULL_VAL);
+        return true;
+      }
+      push_stack(vm, result);
       return true;
     }
     default:
       break;
     }
   }
-  runtime_error("Can only call functions and classes.");
+  runtime_error(vm, "Can only call functions and classes.");
   return false;
 }
 
-static ObjUpvalue *capture_upvalue(Value *local) {
-  ObjUpvalue **upvalue_pptr = &vm.open_upvalues;
+static ObjUpvalue *capture_upvalue(VirtualMachine *vm, Value *local) {
+  ObjUpvalue **upvalue_pptr = &vm->open_upvalues;
   while (*upvalue_pptr != NULL && (*upvalue_pptr)->location > local) {
     upvalue_pptr = &(*upvalue_pptr)->next;
   }
@@ -177,56 +541,177 @@ static ObjUpvalue *capture_upvalue(Value *local) {
     return *upvalue_pptr;
   }
 
-  ObjUpvalue *created_upvalue = new_upvalue(local);
+  ObjUpvalue *created_upvalue = new_upvalue(vm, local);
   created_upvalue->next = *upvalue_pptr;
   *upvalue_pptr = created_upvalue;
 
   return created_upvalue;
 }
 
-static void close_upvalues(Value *local) {
-  while (vm.open_upvalues != NULL && vm.open_upvalues->location >= local) {
-    ObjUpvalue *upvalue = vm.open_upvalues;
+static void close_upvalues(VirtualMachine *vm, Value *local) {
+  while (vm->open_upvalues != NULL && vm->open_upvalues->location >= local) {
+    ObjUpvalue *upvalue = vm->open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.open_upvalues = upvalue->next;
+    vm->open_upvalues = upvalue->next;
+  }
+}
+
+static void define_method(VirtualMachine *vm, ObjString *name) {
+  Value method = peek_stack(vm, 0);
+  ObjClass *klass = AS_CLASS(peek_stack(vm, 1));
+  table_insert(vm, &klass->methods, name, method);
+  pop_stack(vm);
+}
+
+static bool get_property(VirtualMachine *vm, Value object, ObjString *name,
+                         Value *value) {
+  if (IS_ROW(object)) {
+    Value *field = row_field(AS_ROW(object), name);
+    if (field == NULL) {
+      runtime_error(vm, "Undefined property '%s'", name->chars);
+      return false;
+    }
+    *value = *field;
+    return true;
+  }
+  if (IS_ITER(object)) {
+    if (!iter_property(vm, AS_ITER(object), name, value)) {
+      runtime_error(vm, "Undefined property '%s'", name->chars);
+      return false;
+    }
+    return true;
+  }
+  if (!IS_INSTANCE(object)) {
+    runtime_error(vm, "Properties are defined for instances only.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(object);
+  Value field;
+  if (table_get(&instance->klass->fields, name, &field) &&
+      AS_NUMBER(field) < instance->fields_len) {
+    *value = instance->fields[(uint32_t)AS_NUMBER(field)];
+    return true;
+  }
+  runtime_error(vm, "Undefined property '%s'", name->chars);
+  return false;
+}
+
+static bool set_property(VirtualMachine *vm, Value object, ObjString *name,
+                         Value value) {
+  if (IS_ROW(object)) {
+    Value *field = row_field(AS_ROW(object), name);
+    if (field == NULL) {
+      runtime_error(vm, "Undefined property '%s'.", name->chars);
+      return false;
+    }
+    if (AS_ROW(object)->columns->obj.is_shared) {
+      runtime_error(vm, "Cannot set property '%s' of a frozen table.",
+                    name->chars);
+      return false;
+    }
+    *field = value;
+    return true;
   }
+  if (!IS_INSTANCE(object)) {
+    runtime_error(vm, "Properties are defined for instances only.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(object);
+  Value field;
+  if (!table_get(&instance->klass->fields, name, &field) ||
+      AS_NUMBER(field) >= instance->fields_len) {
+    runtime_error(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+  if (instance->obj.is_shared) {
+    runtime_error(vm, "Cannot set property '%s' of a frozen instance.",
+                  name->chars);
+    return false;
+  }
+  instance->fields[(uint32_t)AS_NUMBER(field)] = value;
+  return true;
 }
 
-static void define_method(ObjString *name){
-  Value method = peek_stack(0);
-  ObjClass *klass = AS_CLASS(peek_stack(1));
-  table_insert(&klass->methods, name, method);
-  pop_stack();
+// Checks that an index designates one of the `len` elements of a list or a
+// float64 array.
+static bool element_idx(VirtualMachine *vm, Value idx, uint32_t len,
+                        uint32_t *i) {
+  if (!IS_NUMBER(idx)) {
+    runtime_error(vm, "Index must be a number.");
+    return false;
+  }
+  double number = AS_NUMBER(idx);
+  *i = (uint32_t)number;
+  if (!(number >= 0 && number < len) || *i != number) {
+    runtime_error(vm, "Index %g is out of bounds.", number);
+    return false;
+  }
+  return true;
 }
 
-static InterpretResult check_bool(Value value) {
+// Finds the element of a list that an index designates.
+static bool list_slot(VirtualMachine *vm, Value object, Value idx,
+                      Value **slot) {
+  if (!IS_LIST(object)) {
+    runtime_error(vm, "Only lists and float64 arrays can be indexed.");
+    return false;
+  }
+  ValueVec *items = &AS_LIST(object)->items;
+  uint32_t i;
+  if (!element_idx(vm, idx, items->len, &i)) {
+    return false;
+  }
+  *slot = &items->values[i];
+  return true;
+}
+
+static InterpretResult check_bool(VirtualMachine *vm, Value value) {
   if (!IS_BOOL(value)) {
-    runtime_error("Operand must be a boolean.");
+    runtime_error(vm, "Operand must be a boolean.");
     return InterpretRuntimeErr;
   }
   return InterpretOk;
 }
 
-static void concat() {
-  ObjString *right = AS_STRING(peek_stack(0));
-  ObjString *left = AS_STRING(peek_stack(1));
+static void concat(VirtualMachine *vm) {
+  ObjString *right = AS_STRING(peek_stack(vm, 0));
+  ObjString *left = AS_STRING(peek_stack(vm, 1));
 
   uint32_t len = left->len + right->len;
-  char *chars = ALLOCATE(char, len + 1);
+  char *chars = ALLOCATE(vm, char, len + 1);
   memcpy(chars, left->chars, left->len);
   memcpy(chars + left->len, right->chars, right->len);
   chars[len] = '\0';
 
-  ObjString *result = take_string(chars, len);
-  pop_stack();
-  pop_stack();
-  push_stack(OBJ_VAL(result));
+  ObjString *result = take_string(vm, chars, len);
+  pop_stack(vm);
+  pop_stack(vm);
+  push_stack(vm, OBJ_VAL(result));
 }
 
-static InterpretResult run() {
+// Reads the operand index of `inst`: one byte for `OpConst`, three bytes,
+// low byte first, for the rest.
+static uint32_t read_idx(CallFrame *frame, uint8_t inst) {
+  if (inst == OpConst) {
+    return *frame->inst_ptr++;
+  }
+  uint32_t idx = frame->inst_ptr[0];
+  idx |= (uint32_t)frame->inst_ptr[1] << 8;
+  idx |= (uint32_t)frame->inst_ptr[2] << 16;
+  frame->inst_ptr += 3;
+  return idx;
+}
+
+// Runs until control is back to `base_frames` frames of the fiber that
+// `base_coroutine` runs on, where the call being run was made.
+static InterpretResult run(VirtualMachine *vm, ObjCoroutine *base_coroutine,
+                           uint32_t base_frames) {
+  if (vm->coroutine == base_coroutine && vm->frames_len == base_frames) {
+    return InterpretOk;
+  }
   /*** MACROS DEFINITION ***/
-  CallFrame *frame = &vm.frames[vm.frames_len - 1];
+  CallFrame *frame = &vm->frames[vm->frames_len - 1];
 
 #define READ_BYTE() (frame->inst_ptr += 1, *(frame->inst_ptr - 1))
 #define READ_VALUE(idx) (frame->closure->function->chunk.constants.values[idx])
@@ -235,36 +720,19 @@ static InterpretResult run() {
   (frame->inst_ptr += 2,                                                       \
    (uint16_t)(frame->inst_ptr[-2] | (frame->inst_ptr[-1] << 8)))
 
-#define READ_IDX(inst)                                                         \
-  ({                                                                           \
-    uint32_t idx;                                                              \
-    if (inst == OpConst) {                                                     \
-      idx = (uint32_t)READ_BYTE();                                             \
-    } else {                                                                   \
-      idx = (uint32_t)((READ_BYTE()) | (READ_BYTE() << 8) |                    \
-                       (READ_BYTE() << 16));                                   \
-    }                                                                          \
-    idx;                                                                       \
-  })
-
+#define READ_IDX(inst) (read_idx(frame, inst))
 #define READ_CONSTANT(inst) (READ_VALUE(READ_IDX(inst)))
-
-#define READ_STRING()                                                          \
-  ({                                                                           \
-    uint32_t idx = READ_IDX(READ_BYTE());                                      \
-    Value constant = READ_VALUE(idx);                                          \
-    AS_STRING(constant);                                                       \
-  })
+#define READ_STRING() (AS_STRING(READ_VALUE(READ_IDX(READ_BYTE()))))
 
 #define BINARY_OP(value_type, op)                                              \
   do {                                                                         \
-    if (!IS_NUMBER(peek_stack(0)) || !IS_NUMBER(peek_stack(1))) {              \
-      runtime_error("Operands must be numbers.");                              \
+    if (!IS_NUMBER(peek_stack(vm, 0)) || !IS_NUMBER(peek_stack(vm, 1))) {      \
+      runtime_error(vm, "Operands must be numbers.");                          \
       return InterpretRuntimeErr;                                              \
     }                                                                          \
-    double right = AS_NUMBER(pop_stack());                                     \
-    double left = AS_NUMBER(pop_stack());                                      \
-    push_stack(value_type(left op right));                                     \
+    double right = AS_NUMBER(pop_stack(vm));                                   \
+    double left = AS_NUMBER(pop_stack(vm));                                    \
+    push_stack(vm, value_type(left op right));                                 \
   } while (false)
 
   /*** MACROS DEFINITION ***/
@@ -273,10 +741,10 @@ static InterpretResult run() {
 
 #ifdef DEBUG_TRACE_EXECUTION
     printf("        ");
-    for (Value *stack_slot = vm.stack; stack_slot < vm.stack_ptr;
+    for (Value *stack_slot = vm->stack; stack_slot < vm->stack_ptr;
          stack_slot += 1) {
       printf("[ ");
-      print_value(*stack_slot);
+      print_value(stdout, *stack_slot);
       printf(" ]");
     }
     printf("\n");
@@ -289,32 +757,32 @@ static InterpretResult run() {
     case OpConst:
     case OpConstLong: {
       Value constant = READ_CONSTANT(inst);
-      push_stack(constant);
+      push_stack(vm, constant);
       break;
     }
     case OpNull: {
-      push_stack(NULL_VAL);
+      push_stack(vm, NULL_VAL);
       break;
     }
     case OpTrue: {
-      push_stack(BOOL_VAL(true));
+      push_stack(vm, BOOL_VAL(true));
       break;
     }
     case OpFalse: {
-      push_stack(BOOL_VAL(false));
+      push_stack(vm, BOOL_VAL(false));
       break;
     }
     case OpDefineGlobal: {
       ObjString *name = READ_STRING();
-      table_insert(&vm.globals, name, peek_stack(0));
-      pop_stack();
+      table_insert(vm, &vm->globals, name, peek_stack(vm, 0));
+      pop_stack(vm);
       break;
     }
     case OpSetGlobal: {
       ObjString *name = READ_STRING();
-      if (table_insert(&vm.globals, name, peek_stack(0))) {
-        table_remove(&vm.globals, name);
-        runtime_error("Undefined variable '%s'.", name->chars);
+      if (table_insert(vm, &vm->globals, name, peek_stack(vm, 0))) {
+        table_remove(&vm->globals, name);
+        runtime_error(vm, "Undefined variable '%s'.", name->chars);
         return InterpretRuntimeErr;
       }
       break;
@@ -322,88 +790,198 @@ static InterpretResult run() {
     case OpGetGlobal: {
       ObjString *name = READ_STRING();
       Value value;
-      if (!table_get(&vm.globals, name, &value)) {
-        runtime_error("Undefined variable '%s'.", name->chars);
+      if (!table_get(&vm->globals, name, &value)) {
+        runtime_error(vm, "Undefined variable '%s'.", name->chars);
         return InterpretRuntimeErr;
       }
-      push_stack(value);
+      push_stack(vm, value);
       break;
     }
     case OpSetLocal: {
       uint32_t local_stack_idx = READ_IDX(READ_BYTE());
-      frame->frame_ptr[local_stack_idx] = peek_stack(0);
+      frame->frame_ptr[local_stack_idx] = peek_stack(vm, 0);
       break;
     }
     case OpGetLocal: {
       uint32_t local_stack_idx = READ_IDX(READ_BYTE());
-      push_stack(frame->frame_ptr[local_stack_idx]);
+      push_stack(vm, frame->frame_ptr[local_stack_idx]);
       break;
     }
     case OpSetUpvalue: {
       uint32_t upvalue_idx = READ_IDX(READ_BYTE());
-      *frame->closure->upvalues[upvalue_idx]->location = peek_stack(0);
+      *frame->closure->upvalues[upvalue_idx]->location = peek_stack(vm, 0);
       break;
     }
     case OpGetUpvalue: {
       uint32_t upvalue_idx = READ_IDX(READ_BYTE());
-      push_stack(*frame->closure->upvalues[upvalue_idx]->location);
+      push_stack(vm, *frame->closure->upvalues[upvalue_idx]->location);
       break;
     }
     case OpDefineProperty: {
-      ObjClass *klass = AS_CLASS(peek_stack(0));
+      ObjClass *klass = AS_CLASS(peek_stack(vm, 1));
       ObjString *name = READ_STRING();
 
-      if (set_contains(&klass->fields, name)) {
-        runtime_error("Field %s is already defined.", name->chars);
+      if (klass->obj.is_shared) {
+        runtime_error(vm, "Cannot define fields on a frozen class.");
         return InterpretRuntimeErr;
       }
-      set_insert(&klass->fields, name);
 
+      if (table_contains(&klass->fields, name)) {
+        runtime_error(vm, "Field %s is already defined.", name->chars);
+        return InterpretRuntimeErr;
+      }
+      table_insert(vm, &klass->fields, name, NUMBER_VAL(klass->template.len));
+      write_value_vec(vm, &klass->template, peek_stack(vm, 0));
+      pop_stack(vm);
 
       break;
     }
     case OpSetProperty: {
-      if (!IS_INSTANCE(peek_stack(1))) {
-        runtime_error("Properties are defined for instances only.");
+      ObjString *name = READ_STRING();
+      if (!set_property(vm, peek_stack(vm, 1), name, peek_stack(vm, 0))) {
         return InterpretRuntimeErr;
       }
-
-      ObjInstance *instance = AS_INSTANCE(peek_stack(1));
+      Value value = pop_stack(vm);
+      pop_stack(vm);
+      push_stack(vm, value);
+      break;
+    }
+    case OpGetProperty: {
       ObjString *name = READ_STRING();
-
-      if (!set_contains(&instance->klass->fields, name)) {
-        runtime_error("Undefined property '%s'.", name->chars);
+      Value value;
+      if (!get_property(vm, peek_stack(vm, 0), name, &value)) {
         return InterpretRuntimeErr;
       }
-
-      table_insert(&instance->fields, name, peek_stack(0));
-      Value value = pop_stack();
-      pop_stack();
-      push_stack(value);
+      pop_stack(vm);
+      push_stack(vm, value);
       break;
     }
-    case OpGetProperty: {
-      if (!IS_INSTANCE(peek_stack(0))) {
-        runtime_error("Properties are defined for instances only.");
+    case OpNewScalar: {
+      // Stands in for `OpCall 0` on a class whose instance the compiler
+      // replaced by stack slots: an empty slot for the instance, followed by
+      // the default of each field used. Any other callee takes the call that
+      // follows, and the field slots stay unused.
+      uint8_t fields_len = READ_BYTE();
+      Value callee = peek_stack(vm, 0);
+      uint8_t defaults_len = 0;
+      for (uint8_t i = 0; i < fields_len; i += 1) {
+        ObjString *name = READ_STRING();
+        Value field;
+        if (IS_CLASS(callee) && defaults_len == i &&
+            table_get(&AS_CLASS(callee)->fields, name, &field)) {
+          ValueVec *template = &AS_CLASS(callee)->template;
+          push_stack(vm, template->values[(uint32_t)AS_NUMBER(field)]);
+          defaults_len += 1;
+        }
+      }
+      uint16_t offset = READ_WORD();
+      if (defaults_len < fields_len) {
+        vm->stack_ptr -= defaults_len;
+        break;
+      }
+      vm->stack_ptr[-(fields_len + 1)] = EMPTY_VAL;
+      frame->inst_ptr = frame->closure->function->chunk.code + offset;
+      break;
+    }
+    case OpSetScalar: {
+      uint32_t slot = READ_IDX(READ_BYTE());
+      uint8_t field = READ_BYTE();
+      ObjString *name = READ_STRING();
+      Value *object = &frame->frame_ptr[slot];
+      if (IS_EMPTY(*object)) {
+        object[1 + field] = peek_stack(vm, 0);
+      } else if (!set_property(vm, *object, name, peek_stack(vm, 0))) {
         return InterpretRuntimeErr;
       }
-
-      ObjInstance *instance = AS_INSTANCE(peek_stack(0));
+      break;
+    }
+    case OpGetScalar: {
+      uint32_t slot = READ_IDX(READ_BYTE());
+      uint8_t field = READ_BYTE();
       ObjString *name = READ_STRING();
-
+      Value *object = &frame->frame_ptr[slot];
       Value value;
-      if (table_get(&instance->fields, name, &value)) {
-        pop_stack();
-        push_stack(value);
+      if (IS_EMPTY(*object)) {
+        value = object[1 + field];
+      } else if (!get_property(vm, *object, name, &value)) {
+        return InterpretRuntimeErr;
+      }
+      push_stack(vm, value);
+      break;
+    }
+    case OpList: {
+      uint16_t len = READ_WORD();
+      ObjList *list = new_list(vm);
+      // The list stays reachable while its array is allocated.
+      push_stack(vm, OBJ_VAL(list));
+      if (len > 0) {
+        list->items.values = GROW_ARRAY(vm, Value, NULL, 0, len);
+        list->items.capacity = len;
+        list->items.len = len;
+        memcpy(list->items.values, vm->stack_ptr - len - 1,
+               sizeof(Value) * len);
+      }
+      vm->stack_ptr -= len + 1;
+      push_stack(vm, OBJ_VAL(list));
+      break;
+    }
+    case OpIndexGet: {
+      if (IS_FLOAT64_ARRAY(peek_stack(vm, 1))) {
+        ObjFloat64Array *array = AS_FLOAT64_ARRAY(peek_stack(vm, 1));
+        uint32_t i;
+        if (!element_idx(vm, peek_stack(vm, 0), array->len, &i)) {
+          return InterpretRuntimeErr;
+        }
+        vm->stack_ptr -= 1;
+        vm->stack_ptr[-1] = NUMBER_VAL(array->values[i]);
         break;
       }
-      runtime_error("Undefined property '%s'", name->chars);
-      return InterpretRuntimeErr;
+      Value *slot;
+      if (!list_slot(vm, peek_stack(vm, 1), peek_stack(vm, 0), &slot)) {
+        return InterpretRuntimeErr;
+      }
+      vm->stack_ptr -= 1;
+      vm->stack_ptr[-1] = *slot;
+      break;
+    }
+    case OpIndexSet: {
+      Value list = peek_stack(vm, 2);
+      if (IS_FLOAT64_ARRAY(list)) {
+        ObjFloat64Array *array = AS_FLOAT64_ARRAY(list);
+        uint32_t i;
+        if (!element_idx(vm, peek_stack(vm, 1), array->len, &i)) {
+          return InterpretRuntimeErr;
+        }
+        if (!IS_NUMBER(peek_stack(vm, 0))) {
+          runtime_error(vm, "Float64 array elements must be numbers.");
+          return InterpretRuntimeErr;
+        }
+        if (array->obj.is_shared) {
+          runtime_error(vm, "Cannot set an element of a frozen array.");
+          return InterpretRuntimeErr;
+        }
+        array->values[i] = AS_NUMBER(peek_stack(vm, 0));
+        vm->stack_ptr -= 2;
+        vm->stack_ptr[-1] = NUMBER_VAL(array->values[i]);
+        break;
+      }
+      Value *slot;
+      if (!list_slot(vm, list, peek_stack(vm, 1), &slot)) {
+        return InterpretRuntimeErr;
+      }
+      if (AS_OBJ(list)->is_shared) {
+        runtime_error(vm, "Cannot set an element of a frozen list.");
+        return InterpretRuntimeErr;
+      }
+      *slot = peek_stack(vm, 0);
+      vm->stack_ptr -= 2;
+      vm->stack_ptr[-1] = *slot;
+      break;
     }
     case OpEq: {
-      Value right = pop_stack();
-      Value left = pop_stack();
-      push_stack(BOOL_VAL(values_equal(left, right)));
+      Value right = pop_stack(vm);
+      Value left = pop_stack(vm);
+      push_stack(vm, BOOL_VAL(values_equal(left, right)));
       break;
     }
     case OpLt: {
@@ -415,14 +993,14 @@ static InterpretResult run() {
       break;
     }
     case OpAdd: {
-      if (IS_STRING(peek_stack(0)) && IS_STRING(peek_stack(1))) {
-        concat();
-      } else if (IS_NUMBER(peek_stack(0)) && IS_NUMBER(peek_stack(1))) {
-        double right = AS_NUMBER(pop_stack());
-        double left = AS_NUMBER(pop_stack());
-        push_stack(NUMBER_VAL(left + right));
+      if (IS_STRING(peek_stack(vm, 0)) && IS_STRING(peek_stack(vm, 1))) {
+        concat(vm);
+      } else if (IS_NUMBER(peek_stack(vm, 0)) && IS_NUMBER(peek_stack(vm, 1))) {
+        double right = AS_NUMBER(pop_stack(vm));
+        double left = AS_NUMBER(pop_stack(vm));
+        push_stack(vm, NUMBER_VAL(left + right));
       } else {
-        runtime_error("Operands must be two numbers or two strings.");
+        runtime_error(vm, "Operands must be two numbers or two strings.");
         return InterpretRuntimeErr;
       }
       break;
@@ -440,38 +1018,38 @@ static InterpretResult run() {
       break;
     }
     case OpNeg: {
-      if (!IS_NUMBER(peek_stack(0))) {
-        runtime_error("Operand must be a number.");
+      if (!IS_NUMBER(peek_stack(vm, 0))) {
+        runtime_error(vm, "Operand must be a number.");
         return InterpretRuntimeErr;
       }
-      push_stack(NUMBER_VAL(-AS_NUMBER(pop_stack())));
+      push_stack(vm, NUMBER_VAL(-AS_NUMBER(pop_stack(vm))));
       break;
     }
     case OpNot: {
-      InterpretResult check_result = check_bool(peek_stack(0));
+      InterpretResult check_result = check_bool(vm, peek_stack(vm, 0));
       if (check_result == InterpretRuntimeErr) {
         return check_result;
       }
 
-      push_stack(BOOL_VAL(!AS_BOOL(pop_stack())));
+      push_stack(vm, BOOL_VAL(!AS_BOOL(pop_stack(vm))));
       break;
     }
     case OpPrint: {
-      print_value(pop_stack());
-      printf("\n");
+      print_value(vm->out, pop_stack(vm));
+      fputc('\n', vm->out);
       break;
     }
     case OpPop: {
-      pop_stack();
+      pop_stack(vm);
       break;
     }
     case OpJmpIfFalse: {
       uint16_t offset = READ_WORD();
-      InterpretResult check_result = check_bool(peek_stack(0));
+      InterpretResult check_result = check_bool(vm, peek_stack(vm, 0));
       if (check_result == InterpretRuntimeErr) {
         return check_result;
       }
-      if (AS_BOOL(peek_stack(0)) == false) {
+      if (AS_BOOL(peek_stack(vm, 0)) == false) {
         frame->inst_ptr = frame->closure->function->chunk.code + offset;
       }
       break;
@@ -481,27 +1059,55 @@ static InterpretResult run() {
       frame->inst_ptr = frame->closure->function->chunk.code + offset;
       break;
     }
-    case OpCall: {
+    case OpTailCall: {
       uint8_t args_len = READ_BYTE();
-      if (!call_value(peek_stack(args_len), args_len)) {
+      Value callee = peek_stack(vm, args_len);
+      // Anything but a closure that accepts the arguments is a plain call:
+      // errors keep the caller's frame in their trace.
+      if (IS_CLOSURE(callee) &&
+          AS_CLOSURE(callee)->function->arity == args_len) {
+        close_upvalues(vm, frame->frame_ptr);
+        memmove(frame->frame_ptr, vm->stack_ptr - args_len - 1,
+                sizeof(Value) * (args_len + 1));
+        vm->stack_ptr = frame->frame_ptr + args_len + 1;
+        vm->frames_len -= 1;
+        call(vm, AS_CLOSURE(callee), args_len);
+        frame = &vm->frames[vm->frames_len - 1];
+        break;
+      }
+      if (!call_value(vm, callee, args_len)) {
         return InterpretRuntimeErr;
       }
-      frame = &vm.frames[vm.frames_len - 1];
+      if (vm->coroutine == base_coroutine && vm->frames_len == base_frames) {
+        return InterpretOk;
+      }
+      frame = &vm->frames[vm->frames_len - 1];
       break;
     }
-      case OpMethod: {
-        define_method(READ_STRING());
-        break;
+    case OpCall: {
+      uint8_t args_len = READ_BYTE();
+      if (!call_value(vm, peek_stack(vm, args_len), args_len)) {
+        return InterpretRuntimeErr;
+      }
+      if (vm->coroutine == base_coroutine && vm->frames_len == base_frames) {
+        return InterpretOk;
       }
+      frame = &vm->frames[vm->frames_len - 1];
+      break;
+    }
+    case OpMethod: {
+      define_method(vm, READ_STRING());
+      break;
+    }
     case OpClosure: {
       ObjFunction *function = AS_FUNCTION(READ_CONSTANT(READ_BYTE()));
-      ObjClosure *closure = new_closure(function);
-      push_stack(OBJ_VAL(closure));
+      ObjClosure *closure = closure_of(vm, function);
+      push_stack(vm, OBJ_VAL(closure));
       for (uint32_t i = 0; i < closure->upvalues_len; i += 1) {
         uint8_t is_local = READ_BYTE();
         uint32_t index = READ_IDX(READ_BYTE());
         if (is_local) {
-          closure->upvalues[i] = capture_upvalue(frame->frame_ptr + index);
+          closure->upvalues[i] = capture_upvalue(vm, frame->frame_ptr + index);
         } else {
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
@@ -509,25 +1115,40 @@ static InterpretResult run() {
       break;
     }
     case OpCloseUpvalue: {
-      close_upvalues(vm.stack_ptr - 1);
-      pop_stack();
+      close_upvalues(vm, vm->stack_ptr - 1);
+      pop_stack(vm);
+      break;
+    }
+    case OpYield: {
+      if (vm->coroutine == NULL) {
+        runtime_error(vm, "Can't yield outside a coroutine.");
+        return InterpretRuntimeErr;
+      }
+      leave_coroutine(vm, CoroutineSuspended, pop_stack(vm));
+      if (vm->coroutine == base_coroutine && vm->frames_len == base_frames) {
+        return InterpretOk;
+      }
+      frame = &vm->frames[vm->frames_len - 1];
       break;
     }
     case OpClass: {
-      push_stack(OBJ_VAL(new_class(READ_STRING())));
+      push_stack(vm, OBJ_VAL(new_class(vm, READ_STRING())));
       break;
     }
     case OpRet: {
-      Value result = pop_stack();
-      close_upvalues(frame->frame_ptr);
-      vm.frames_len -= 1;
-      if (vm.frames_len == 0) {
-        pop_stack();
+      Value result = pop_stack(vm);
+      close_upvalues(vm, frame->frame_ptr);
+      vm->frames_len -= 1;
+      vm->stack_ptr = frame->frame_ptr;
+      if (vm->frames_len == 0 && vm->coroutine != NULL) {
+        leave_coroutine(vm, CoroutineDone, result);
+      } else {
+        push_stack(vm, result);
+      }
+      if (vm->coroutine == base_coroutine && vm->frames_len == base_frames) {
         return InterpretOk;
       }
-      vm.stack_ptr = frame->frame_ptr;
-      push_stack(result);
-      frame = &vm.frames[vm.frames_len - 1];
+      frame = &vm->frames[vm->frames_len - 1];
       break;
     }
     }
@@ -541,17 +1162,45 @@ static InterpretResult run() {
 #undef BINARY_OP
 }
 
-InterpretResult interpret(const char *source) {
-  ObjFunction *function = compile(source);
+InterpretResult interpret(VirtualMachine *vm, const char *source) {
+  ObjFunction *function = compile(vm, source);
   if (function == NULL) {
     return InterpretCompileErr;
   }
 
-  push_stack(OBJ_VAL(function));
-  ObjClosure *closure = new_closure(function);
-  pop_stack();
-  push_stack(OBJ_VAL(closure));
-  call(closure, 0);
+  push_stack(vm, OBJ_VAL(function));
+  ObjClosure *closure = new_closure(vm, function);
+  pop_stack(vm);
+  push_stack(vm, OBJ_VAL(closure));
+  call(vm, closure, 0);
 
-  return run();
+  InterpretResult result = run(vm, NULL, 0);
+  if (result == InterpretOk) {
+    pop_stack(vm);
+  }
+  return result;
+}
+
+InterpretResult invoke(VirtualMachine *vm, uint8_t args_len) {
+  ObjCoroutine *coroutine = vm->coroutine;
+  uint32_t frames_len = vm->frames_len;
+  if (!call_value(vm, peek_stack(vm, args_len), args_len)) {
+    return InterpretRuntimeErr;
+  }
+  return run(vm, coroutine, frames_len);
+}
+
+bool call_function(VirtualMachine *vm, Value function, uint8_t args_len,
+                   const Value *args, Value *result) {
+  reserve_stack(vm, (uint32_t)args_len + 1);
+  push_stack(vm, function);
+  for (uint8_t i = 0; i < args_len; i += 1) {
+    push_stack(vm, args[i]);
+  }
+  if (invoke(vm, args_len) != InterpretOk) {
+    vm->native_failed = true;
+    return false;
+  }
+  *result = pop_stack(vm);
+  return true;
 }
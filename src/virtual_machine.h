@@ -1,53 +1,111 @@
 #ifndef breeze_virtual_machine_h
 #define breeze_virtual_machine_h
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "breeze.h"
 #include "common.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Default call depth limit, see `set_vm_stack_limit`.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 16384
+#endif
 
-typedef struct {
-  ObjClosure *closure;
-  uint8_t *inst_ptr;
-  Value *frame_ptr;
-} CallFrame;
-
-typedef struct {
-  CallFrame frames[FRAMES_MAX];
+typedef struct VirtualMachine {
+  // Registers of the running fiber: the main stack or a coroutine's. They
+  // are swapped with a coroutine's `Fiber` on resume and yield. The main
+  // fiber's arrays are allocated by the first call.
+  CallFrame *frames;
   uint32_t frames_len;
-  Value stack[STACK_MAX];
+  uint32_t frames_capacity;
+  Value *stack;
   Value *stack_ptr;
-  Table globals;
-  Table strings;
+  uint32_t stack_capacity;
   ObjUpvalue *open_upvalues;
+  // Call depth past which a call is a stack overflow.
+  uint32_t frames_max;
+
+  // The running coroutine, NULL on the main fiber.
+  ObjCoroutine *coroutine;
+  // Every coroutine of the heap, so the sweeper can close the upvalues
+  // still pointing into the stacks it frees.
+  ObjCoroutine *coroutines;
+
+  Table globals;
+  // Weak intern set: entries are dropped by the sweeper, never marked.
+  Set strings;
 
   size_t bytes_allocated;
   size_t next_gc;
   Obj *objects;
 
+  // Nesting depth of `pause_gc`; nothing is collected while it is non-zero.
+  uint32_t gc_paused;
+
   uint32_t gray_stack_len;
   uint32_t gray_stack_capacity;
   Obj **gray_stack;
+
+  // Parser of the compilation in progress, whose functions are GC roots.
+  struct Parser *parser;
+
+  // Streams for `print` and for compile and runtime errors.
+  FILE *out;
+  FILE *err;
+
+  // Created by the first asynchronous native.
+  struct EventLoop *loop;
+
+  // Set by `native_error`, checked once the native returns.
+  bool native_failed;
+  // Set by a native that parks the running coroutine on the event loop.
+  bool native_suspended;
 } VirtualMachine;
 
-typedef enum {
-  InterpretOk,
-  InterpretCompileErr,
-  InterpretRuntimeErr,
-} InterpretResult;
+void init_vm(VirtualMachine *vm);
+void free_vm(VirtualMachine *vm);
+void push_stack(VirtualMachine *vm, Value value);
+Value pop_stack(VirtualMachine *vm);
+
+/* Calls the value sitting below `args_len` arguments on the stack and runs it
+ * until it returns, or until it yields if it is a coroutine. Natives may call
+ * it while their own frame is active.
+ * @param vm: The VM to run the call in
+ * @param args_len: Number of arguments on top of the callee
+ * @return: The outcome; on success the result replaces callee and arguments
+ */
+InterpretResult invoke(VirtualMachine *vm, uint8_t args_len);
 
-extern VirtualMachine vm;
+/* Calls a function back from a native, re-entrantly: the call runs in a
+ * nested `run` on the VM's own stack, at the cost of an interpreted call and
+ * without allocating. The arguments stay on the stack during the call, where
+ * the GC sees them; other values the native holds on to must be rooted, and
+ * the native's own `args` may move as the stack grows.
+ *
+ * If the call fails, the error is already reported and the stacks unwound:
+ * the native must return at once, and its call fails without a second
+ * message.
+ * @param vm: The VM running the native
+ * @param function: Closure, native or any other callable value
+ * @param args_len: Number of arguments
+ * @param args: The arguments
+ * @param result: Receives the function's result
+ * @return: false if the call failed
+ */
+bool call_function(VirtualMachine *vm, Value function, uint8_t args_len,
+                   const Value *args, Value *result);
 
-void init_vm();
-void free_vm();
-InterpretResult interpret(const char *source);
-void push_stack(Value value);
-Value pop_stack();
+/* Reports a runtime error from inside a native. The native should return
+ * right away; the VM unwinds once it does.
+ * @param vm: The VM running the native
+ * @param format: printf-style message
+ * @return: A placeholder value for the native to return
+ */
+Value native_error(VirtualMachine *vm, const char *format, ...);
 
 #endif // !breeze_virtual_machine_h
@@ -0,0 +1,117 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "breeze.h"
+
+/***
+  Drives libbreeze the way a host would: several VMs run side by side on
+  their own threads, each printing into its own buffer, and a VM is reset
+  and reused between programs. Prints what went wrong and exits with 1 on
+  the first unexpected result.
+  ***/
+
+#define THREADS 4
+#define RUNS 20
+
+typedef struct {
+  int32_t id;
+  bool ok;
+} Worker;
+
+// Runs `source` in `vm`, and checks its result and what it printed.
+static bool expect_run(BreezeVM *vm, const char *source,
+                       InterpretResult expected_result,
+                       const char *expected_output) {
+  char *output = NULL;
+  size_t output_len = 0;
+  FILE *out = open_memstream(&output, &output_len);
+  FILE *err = fopen("/dev/null", "w");
+  if (out == NULL || err == NULL) {
+    fprintf(stderr, "Could not open the output streams.\n");
+    exit(1);
+  }
+  set_vm_output(vm, out, err);
+  InterpretResult result = interpret(vm, source);
+  set_vm_output(vm, stdout, stderr);
+  fclose(out);
+  fclose(err);
+
+  bool ok = result == expected_result && strcmp(output, expected_output) == 0;
+  if (!ok) {
+    fprintf(stderr, "%s\nreturned %d and printed \"%s\", expected %d and "
+                    "\"%s\".\n",
+            source, result, output, expected_result, expected_output);
+  }
+  free(output);
+  return ok;
+}
+
+static void *run_worker(void *arg) {
+  Worker *worker = (Worker *)arg;
+  BreezeVM *vm = new_vm();
+  if (vm == NULL) {
+    return NULL;
+  }
+  char source[256];
+  char expected[64];
+  worker->ok = true;
+  for (int32_t run = 0; run < RUNS && worker->ok; run += 1) {
+    // Every VM keeps its own globals, even under the same names.
+    int32_t value = worker->id * 1000 + run;
+    snprintf(source, sizeof(source),
+             "let id = %d;\n"
+             "fn twice(x) { return x * 2; }\n"
+             "let names = map();\n"
+             "map_set(names, \"id\", id);\n"
+             "print twice(map_get(names, \"id\"));\n",
+             value);
+    snprintf(expected, sizeof(expected), "%d\n", value * 2);
+    worker->ok = expect_run(vm, source, InterpretOk, expected);
+    // A reset drops the globals of the previous program.
+    reset_vm(vm);
+    worker->ok = worker->ok &&
+                 expect_run(vm, "print id;", InterpretRuntimeErr, "");
+    reset_vm(vm);
+  }
+  delete_vm(vm);
+  return NULL;
+}
+
+int main() {
+  pthread_t threads[THREADS];
+  Worker workers[THREADS];
+  for (int32_t i = 0; i < THREADS; i += 1) {
+    workers[i].id = i + 1;
+    workers[i].ok = false;
+    pthread_create(&threads[i], NULL, run_worker, &workers[i]);
+  }
+  bool ok = true;
+  for (int32_t i = 0; i < THREADS; i += 1) {
+    pthread_join(threads[i], NULL);
+    ok = ok && workers[i].ok;
+  }
+
+  // The stack limit applies to the VM it is set on only.
+  BreezeVM *shallow = new_vm();
+  BreezeVM *deep = new_vm();
+  set_vm_stack_limit(shallow, 64);
+  const char *recursion = "fn depth(n) {\n"
+                          "  if (n == 0) { return 0; }\n"
+                          "  let r = depth(n - 1);\n"
+                          "  return r + 1;\n"
+                          "}\n"
+                          "print depth(1000);\n";
+  ok = ok && expect_run(shallow, recursion, InterpretRuntimeErr, "");
+  ok = ok && expect_run(deep, recursion, InterpretOk, "1000\n");
+  ok = ok && expect_run(deep, "print 1 +;", InterpretCompileErr, "");
+  delete_vm(shallow);
+  delete_vm(deep);
+
+  shutdown_isolates();
+  free_shared_strings();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+# Runs one test script and checks its output against the `// expect: ...`
+# comments it holds, in order. A script whose last expectation is
+# `// expect error: ...` must fail with that text on stderr instead.
+# With `REPEAT` set, the script runs that many times in a row on a single
+# `--batch` worker, which must reset its VM in between, and its output is
+# expected as many times.
+#
+# Usage: cmake -DBREEZE=<interpreter> -DSCRIPT=<script.bz> [-DREPEAT=<n>]
+#              -P run_test.cmake
+
+# Unbalanced brackets and semicolons would change how CMake splits the lines
+# into a list, so they are swapped for control characters until then.
+file(READ "${SCRIPT}" source)
+string(ASCII 1 open)
+string(ASCII 2 close)
+string(ASCII 3 semicolon)
+string(REPLACE "[" "${open}" source "${source}")
+string(REPLACE "]" "${close}" source "${source}")
+string(REPLACE ";" "${semicolon}" source "${source}")
+string(REPLACE "\n" ";" lines "${source}")
+
+set(expected "")
+set(expected_error "")
+foreach(line IN LISTS lines)
+    string(REPLACE "${open}" "[" line "${line}")
+    string(REPLACE "${close}" "]" line "${line}")
+    string(REPLACE "${semicolon}" ";" line "${line}")
+    if(line MATCHES "// expect: (.*)$")
+        string(APPEND expected "${CMAKE_MATCH_1}\n")
+    elseif(line MATCHES "// expect error: (.*)$")
+        set(expected_error "${CMAKE_MATCH_1}")
+    endif()
+endforeach()
+
+set(command "${BREEZE}" "${SCRIPT}")
+if(DEFINED REPEAT)
+    set(command "${BREEZE}" --batch --jobs 1)
+    set(once "${expected}")
+    set(expected "")
+    foreach(i RANGE 1 ${REPEAT})
+        list(APPEND command "${SCRIPT}")
+        string(APPEND expected "${once}")
+    endforeach()
+endif()
+
+execute_process(
+    COMMAND ${command}
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE errors
+    RESULT_VARIABLE result
+)
+
+if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "Output differs.\n"
+        "Expected:\n${expected}\nGot:\n${output}\nStderr:\n${errors}")
+endif()
+if(expected_error STREQUAL "")
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "Exited with ${result}.\nStderr:\n${errors}")
+    endif()
+else()
+    string(FIND "${errors}" "${expected_error}" found)
+    if(result EQUAL 0 OR found EQUAL -1)
+        message(FATAL_ERROR "Expected the error \"${expected_error}\", got "
+            "exit code ${result}.\nStderr:\n${errors}")
+    endif()
+endif()